@@ -26,14 +26,14 @@ class AnalyzerCount : public Serializable
    this->count = count;
   }
 
-  inline uint_fast16_t
+  inline uint_fast32_t
   size(void) const
   {
    return sizeof(uint64_t);
   }
 
   inline bool
-  isSizeAcceptable(register const uint_fast16_t size) const
+  isSizeAcceptable(register const uint_fast32_t size) const
   {
    return size == this->size();
   }
@@ -71,7 +71,7 @@ class AnalyzerCount : public Serializable
 
   inline bool
   fromFileSystem(register const uint8_t*      source,
-                 register const uint_fast16_t size,
+                 register const uint_fast32_t size,
                  register const bool          isLittle)
   {
    count = fromFileSystemEndian((uint64_t*) source, isLittle);
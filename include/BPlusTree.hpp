@@ -4,6 +4,7 @@
 # include <assert.h>
 # include <stdint.h>
 # include <string.h>
+# include <stddef.h>
 
 # include <Globals.hpp>
 # include <Key.hpp>
@@ -12,13 +13,21 @@
 # include <BlockCache.hpp>
 # include <FileSystem.hpp>
 # include <Transaction.hpp>
+# include <LeafHint.hpp>
+# include <ValueView.hpp>
+# include <TreeStatistics.hpp>
 # include <Serializable.hpp>
+# include <Checksum.hpp>
+# include <KeySearch.hpp>
 
 # include <RawData.hpp>
 
 class BPlusTree
 {
  friend class FileSystem;
+ friend class BPlusTreeCursor;
+ friend class BPlusTreeBuilder;
+ friend class BPlusTreeBatch;
   
  public:
   enum BPlusTreeError
@@ -26,111 +35,451 @@ class BPlusTree
    noError = 0,
    keyNotFound,
    dataTooBig,
-   sizeIsNotAcceptable
+   sizeIsNotAcceptable,
+   outOfRange,
+   keyOutOfOrder,
+   /*! A node on the way failed verifyNode when it was read. */
+   checksumError
   };
 
+  /*! hint, if given, is followed when it covers key and is kept up to
+      date, see LeafHint. */
   inline bool
   lookup(register Serializable&            destination,
-         register uint_fast16_t&           size,
+         register uint_fast32_t&           size,
          register enum BPlusTreeError&     error,
          register const Key                key,
-         register class Transaction* const transaction) const
+         register class Transaction* const transaction,
+         register struct LeafHint* const   hint) const
   {
-   register BlockCacheEntry* cacheEntry;
-   register enum BlockCache::BlockCacheError cacheError;
+   ValueView view;
 
-   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, rootLBA))
-   {
+   if (!lookupView(view, error, key, transaction, hint))
+    return false;
+
+   size = view.size();
+
+   if (!accepts(destination, size, error))
+    return false;
+
+   if (!fromView(destination, view))
     assert(0);
-   }
 
-   assert(cacheEntry);
-   
-   return lookup(destination, size, error, cacheEntry, key, transaction);
+   error = noError;
+   return true;
   }
 
+  /*! Look up count keys, in strictly ascending order, in one pass. The
+      probes go down a level at a time: the nodes all of them need on
+      the next level are read with one vectored request before any is
+      searched, and keys that fall in the same node share its visit. As
+      lookup, key i gets its value in destinations[i] and its size in
+      sizes[i], and errors[i] tells how it went. */
   inline bool
-  insert(register const BPlusTree* &       newTree,
-         register enum BPlusTreeError&     error,
-         register const Serializable&      source,
-         register const Key                key,
-         register class Transaction* const transaction) const
+  multiLookup(register Serializable* const* const destinations,
+              register uint_fast32_t* const       sizes,
+              register enum BPlusTreeError* const errors,
+              register enum BPlusTreeError&       error,
+              register const Key* const           keys,
+              register const unsigned int         count,
+              register class Transaction* const   transaction) const
   {
-   register BlockCacheEntry*                 cacheEntry;
-   register enum BlockCache::BlockCacheError cacheError;
-
    assert(transaction);
+   assert(!count || (destinations && sizes && errors && keys));
 
-   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, rootLBA))
+   for(register unsigned int i = 1; i < count; i++)
    {
-    assert(0);
+    if (compareKeys(keys[i - 1], keys[i]) >= 0)
+    {
+     error = keyOutOfOrder;
+     return false;
+    }
    }
 
-   assert(cacheEntry);
+   if (!count)
+   {
+    error = noError;
+    return true;
+   }
 
-   register const bool               isLittle = (((struct header*)(cacheEntry->getDataPointer()))->version & 0x80) != bigEndian;
+   /* The keys still going down, by index, and the node each run of them
+      visits next. */
+   register unsigned int* pending     = new unsigned int[count];
+   register unsigned int* nextPending = new unsigned int[count];
+   register struct probe* probes      = new struct probe[count];
+   register struct probe* nextProbes  = new struct probe[count];
+   register unsigned int  probeCount  = 1;
 
-   register struct splitAndMergeInfo childrenInfo;
-   
-   if (!insertOrRemove(childrenInfo, error, cacheEntry, source, key, transaction, false))
+   assert(pending && nextPending && probes && nextProbes);
+
+   for(register unsigned int i = 0; i < count; i++)
+    pending[i] = i;
+
+   probes[0].theLBA = rootLBA;
+   probes[0].first  = 0;
+   probes[0].end    = count;
+
+   while (probeCount)
    {
-    assert(0);
+    register unsigned int nextCount = 0;
+    register unsigned int nextKeys  = 0;
+
+    prefetchProbes(probes, probeCount);
+
+    for(register unsigned int p = 0; p < probeCount; p++)
+    {
+     register BlockCacheEntry*                 cacheEntry;
+     register enum BlockCache::BlockCacheError cacheError;
+
+     if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, probes[p].theLBA,
+                                               verifyNode))
+     {
+      /* The keys below a corrupt node fail, the others go on. */
+      assert(cacheError == BlockCache::checksumError);
+
+      for(register unsigned int k = probes[p].first; k < probes[p].end; k++)
+       errors[pending[k]] = checksumError;
+
+      continue;
+     }
+
+     register uint8_t* data = cacheEntry->getDataPointer();
+
+     assert(data);
+
+     if (!isSupportedVersion(((struct header*)data)->version))
+     {
+      /* unsupported version. */
+      assert(0);
+     }
+
+     register const bool isLittle = (((struct header*)data)->version & 0x80) != bigEndian;
+
+     for(register unsigned int k = probes[p].first; k < probes[p].end; k++)
+     {
+      register const unsigned int index = pending[k];
+      register unsigned int       keyCount;
+      register unsigned int       keyIndex;
+      register bool               found;
+      register struct leafEntry   entry;
+      struct LBA                  child;
+      register const enum nodeStep step = isLittle ?
+                                          stepNode<true>(entry, child, keyCount, keyIndex, found, data, keys[index]) :
+                                          stepNode<false>(entry, child, keyCount, keyIndex, found, data, keys[index]);
+
+      if (step == stepLeaf)
+      {
+       if (!found)
+       {
+        errors[index] = keyNotFound;
+        continue;
+       }
+
+       if (isLittle)
+        leafEntryAt<true>(entry, data, keyIndex - 1);
+       else
+        leafEntryAt<false>(entry, data, keyIndex - 1);
+
+       deliver(*destinations[index], sizes[index], errors[index], entry, transaction, isLittle);
+       continue;
+      }
+
+      if (step == stepMessage)
+      {
+       if (entry.payload)
+        deliver(*destinations[index], sizes[index], errors[index], entry, transaction, isLittle);
+       else
+        errors[index] = keyNotFound;
+
+       continue;
+      }
+
+      /* Keys are in order, so those going to the same child are next to
+         each other. */
+      if (!nextCount || (nextProbes[nextCount - 1].theLBA.theLBA != child.theLBA))
+      {
+       nextProbes[nextCount].theLBA = child;
+       nextProbes[nextCount].first  = nextKeys;
+       nextCount++;
+      }
+
+      nextPending[nextKeys++]         = index;
+      nextProbes[nextCount - 1].end = nextKeys;
+     }
+
+     cacheEntry->unlock(data, cacheEntry, transaction);
+    }
+
+    register unsigned int* const swapPending = pending;
+    register struct probe* const swapProbes  = probes;
+
+    pending     = nextPending;
+    nextPending = swapPending;
+    probes      = nextProbes;
+    nextProbes  = swapProbes;
+    probeCount  = nextCount;
    }
 
-   assert(error == noError);
+   delete [] pending;
+   delete [] nextPending;
+   delete [] probes;
+   delete [] nextProbes;
+
+   error = noError;
+   return true;
+  }
+
+  /*! Look key up without copying the value out, see ValueView. A value
+      stored out of line is shown in its own sectors. */
+  inline bool
+  lookupView(register ValueView&               view,
+             register enum BPlusTreeError&     error,
+             register const Key                key,
+             register class Transaction* const transaction,
+             register struct LeafHint* const   hint) const
+  {
+   register BlockCacheEntry* cacheEntry;
+   register uint8_t*         data;
+   register struct leafEntry entry;
+   register bool             isLittle;
+
+   view.release();
 
-   if (!createNewRoot(newTree, error, childrenInfo, transaction, isLittle))
+   if (!findPair(cacheEntry, data, entry, isLittle, error, key, transaction, hint))
+    return false;
+
+   if (!entry.isLocation)
+    view.pin(cacheEntry, data, entry.payload, entry.size, isLittle, transaction);
+   else
    {
-    assert(0);
+    register struct valueExtents extents;
+
+    readExtents(extents, entry, isLittle);
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    viewExtent(view, extents, rootDevice, transaction, isLittle);
    }
 
-   assert(newTree);
-   assert(error == noError);
+   error = noError;
+   return true;
+  }
+
+  /*! Copy length bytes of the value of key, from offset on, to
+      destination. Only the sectors holding them are read. */
+  inline bool
+  readPart(register uint8_t* const           destination,
+           register const uint_fast32_t      offset,
+           register const uint_fast32_t      length,
+           register enum BPlusTreeError&     error,
+           register const Key                key,
+           register class Transaction* const transaction,
+           register struct LeafHint* const   hint) const
+  {
+   register BlockCacheEntry* cacheEntry;
+   register uint8_t*         data;
+   register struct leafEntry entry;
+   register bool             isLittle;
+
+   if (!findPair(cacheEntry, data, entry, isLittle, error, key, transaction, hint))
+    return false;
+
+   register const uint_fast32_t size = valueSize(entry, isLittle);
+
+   if ((((uint_fast64_t) offset) + length) > size)
+   {
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    error = outOfRange;
+    return false;
+   }
+
+   if (!entry.isLocation)
+   {
+    if (length)
+     memcpy(destination, entry.payload + offset, length);
+
+    cacheEntry->unlock(data, cacheEntry, transaction);
+   }
+   else
+   {
+    register struct valueExtents extents;
+
+    readExtents(extents, entry, isLittle);
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    if (length)
+     copyRun(destination, 0, extents, offset, length, transaction);
+   }
 
    error = noError;
    return true;
   }
 
+  /*! Overwrite length bytes of the value of key, from offset on, with
+      source. Leaves and sectors this transaction made itself are changed
+      in place, and newTree comes back as this tree. Otherwise a value in
+      a leaf is inserted again, and of one stored out of line only the
+      sectors written are copied, see copySectors. */
   inline bool
-  remove(register const BPlusTree* &       newTree,
-         register enum BPlusTreeError&     error,
-         register const Key                key,
-         register class Transaction* const transaction) const
+  writePart(register const BPlusTree* &       newTree,
+            register enum BPlusTreeError&     error,
+            register const uint8_t* const     source,
+            register const uint_fast32_t      offset,
+            register const uint_fast32_t      length,
+            register const Key                key,
+            register class Transaction* const transaction,
+            register struct LeafHint* const   hint) const
   {
    register BlockCacheEntry* cacheEntry;
-   register enum BlockCache::BlockCacheError cacheError;
+   register uint8_t*         data;
+   register struct leafEntry entry;
+   register bool             isLittle;
 
    assert(transaction);
 
-   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, rootLBA))
+   if (!findPair(cacheEntry, data, entry, isLittle, error, key, transaction, hint))
+    return false;
+
+   register const uint_fast32_t size = valueSize(entry, isLittle);
+
+   if ((((uint_fast64_t) offset) + length) > size)
    {
-    assert(0);
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    error = outOfRange;
+    return false;
    }
 
-   assert(cacheEntry);
+   if (!entry.isLocation)
+   {
+    /* The leaf is changed and sealed again where it is. */
+    if (cacheEntry->isPrivate(transaction))
+    {
+     if (length)
+     {
+      memcpy(((uint8_t*) entry.payload) + offset, source, length);
+      seal(data, isLittle);
+     }
 
-   register const bool               isLittle = (((struct header*)(cacheEntry->getDataPointer()))->version & 0x80) != bigEndian;
-   
-   register struct splitAndMergeInfo childrenInfo;
-   register class RawData            dummy;   
-   
-   if (!insertOrRemove(childrenInfo, error, cacheEntry, dummy, key, transaction, true))
+     cacheEntry->unlock(data, cacheEntry, transaction);
+
+     newTree = this;
+     error   = noError;
+     return true;
+    }
+
+    cacheEntry->unlock(data, cacheEntry, transaction);
+   }
+   else
    {
-    assert(0);
+    register struct valueExtents extents;
+
+    readExtents(extents, entry, isLittle);
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    if (!length ||
+        copyRun(0, source, extents, offset, length, transaction))
+    {
+     newTree = this;
+     error   = noError;
+     return true;
+    }
+
+    /* Shared with an older tree. */
+    return copySectors(newTree, error, source, offset, length, extents, key, transaction, hint, isLittle);
    }
 
-   assert(error == noError);
+   /* A value in a shared leaf is small, and simply inserted again. */
+   uint8_t       whole[sectorSize];
+   uint_fast32_t wholeSize;
+   RawData       value(whole, size);
 
-   if (!createNewRoot(newTree, error, childrenInfo, transaction, isLittle))
-   {
+   assert(size <= sizeof(whole));
+
+   if (!lookup(value, wholeSize, error, key, transaction, hint))
     assert(0);
-   }
 
-   assert(newTree);
-   assert(error == noError);
+   assert(wholeSize == size);
 
-   error = noError;
+   memcpy(whole + offset, source, length);
+
+   return insert(newTree, error, value, key, transaction, hint);
+  }
+
+  inline bool
+  insert(register const BPlusTree* &       newTree,
+         register enum BPlusTreeError&     error,
+         register const Serializable&      source,
+         register const Key                key,
+         register class Transaction* const transaction,
+         register struct LeafHint* const   hint) const
+  {
+   return update(newTree, error, source, key, transaction, false, hint);
+  }
+
+  inline bool
+  remove(register const BPlusTree* &       newTree,
+         register enum BPlusTreeError&     error,
+         register const Key                key,
+         register class Transaction* const transaction,
+         register struct LeafHint* const   hint) const
+  {
+   register class RawData dummy;   
+
+   return update(newTree, error, dummy, key, transaction, true, hint);
+  }
+
+  /*! Remove every key from first to last, both included, in a copy of
+      the tree. Only the paths to the two ends of the range are copied,
+      the subtrees in between are dropped whole and their sectors freed
+      once transaction commits, with those of the values removed, see
+      BPlusTreeBatch::removeRange. */
+  bool
+  removeRange(register const BPlusTree* &       newTree,
+              register enum BPlusTreeError&     error,
+              register const Key                first,
+              register const Key                last,
+              register class Transaction* const transaction) const;
+
+  /*! Walk the whole tree and give its shape. */
+  inline void
+  getStatistics(register struct TreeStatistics&   statistics,
+                register class Transaction* const transaction) const
+  {
+   statistics.height         = 0;
+   statistics.keys           = 0;
+   statistics.leaves         = 0;
+   statistics.leafBytes      = 0;
+   statistics.leafFragmented = 0;
+   statistics.internalNodes  = 0;
+   statistics.internalBytes  = 0;
+   statistics.messages       = 0;
+   statistics.messageBytes   = 0;
+
+   addToStatistics(statistics, rootLBA, 1, transaction);
+  }
+
+  /*! Check a node just read from disk. Build with -DUNCHECKED_NODES to
+      skip the check. */
+  static bool
+  verifyNode(register const uint8_t* const data)
+  {
+# ifdef UNCHECKED_NODES
    return true;
+# else
+   register const bool isLittle = (((const struct header*) data)->version & 0x80) != bigEndian;
+
+   return fromFileSystemEndian(&((const struct header*) data)->checksum, isLittle) == checksum(data);
+# endif
+  }
+
+  /*! Where the root node of the tree is. */
+  inline void
+  getRoot(register class VirtualBlockDevice* & device,
+          register struct LBA&                 theLBA) const
+  {
+   device = rootDevice;
+   theLBA = rootLBA;
   }
 
  private:
@@ -139,6 +488,8 @@ class BPlusTree
    uint8_t  version;
    uint8_t  keys;
    uint16_t spaceUsedNFlags;
+   /*! CRC32C of the sector with this field taken as zero. */
+   uint32_t checksum;
   };
 
   static const uint16_t isLeaf = 0x8000;
@@ -169,7 +520,35 @@ class BPlusTree
   struct __attribute__ ((__packed__)) leafLocation
   {
    uint64_t theLBA;
-   uint16_t size;
+   uint32_t size;
+  };
+
+  /*! A leafLocation is followed by up to maxExtents of these once
+      writePart has copied some of the sectors of its value on write. The
+      sectors from first on are at theLBA on, up to the first of the next
+      extent. Those before the first extent are at the theLBA of the
+      leafLocation on. */
+  struct __attribute__ ((__packed__)) leafExtent
+  {
+   uint32_t first;
+   uint64_t theLBA;
+  };
+
+  static const unsigned int
+  maxExtents = 16;
+
+  /*! Where the sectors of a value stored out of line are, as read from
+      its leafLocation and extents by readExtents. */
+  struct valueExtents
+  {
+   struct LBA    theLBA;
+   uint_fast32_t size;
+   unsigned int  count;
+   struct
+   {
+    uint_fast32_t first;
+    struct LBA    theLBA;
+   }             extents[maxExtents];
   };
 
   struct __attribute__ ((__packed__)) internalLocation
@@ -177,6 +556,109 @@ class BPlusTree
    uint64_t theLBA;
   };
 
+  /*! Nodes of indexedVersion carry this, 4 byte aligned, right after
+      their key array. It is followed by one 32 bit fingerprint per key:
+      the 4 bytes of the normalized key that follow the prefix all keys
+      of the node share. Fingerprints are in key order, so a search is a
+      single compare over the whole array. */
+  struct __attribute__ ((__packed__)) searchIndex
+  {
+   uint8_t prefixLength;
+   uint8_t reserved[3];
+  };
+
+  /*! Leaves of packedVersion start with this. The type and major all
+      their keys share are kept once, followed by the offsets of every
+      restartInterval-th pair and then the pairs. A pair is the minor as
+      a varint, given as the difference to the previous minor except at
+      a restart, then a varint of the value size shifted left once with
+      isLocation in bit 0, then the value. Bits 12 to 14 of
+      spaceUsedNFlags carry bits 8 to 10 of the key count, the low bits
+      the bytes used after the header. */
+  struct __attribute__ ((__packed__)) packedLeaf
+  {
+   uint64_t major;
+   uint8_t  type;
+   uint8_t  restartInterval;
+  };
+
+  /*! Internal nodes of truncatedVersion start with this. Separators are
+      cut down to the shortest key that still tells their two children
+      apart and kept as normalized key bytes with the trailing zeros left
+      out. The prefixLength bytes all separators of the node share come
+      right after, once, then every separator as the width bytes that
+      follow the prefix, then the LBAs of the children, 64 bits each.
+      The key count is extended as in packedLeaf, the low bits of
+      spaceUsedNFlags are the bytes used after the header. */
+  struct __attribute__ ((__packed__)) truncatedNode
+  {
+   uint8_t prefixLength;
+   uint8_t width;
+  };
+
+  /*! The last bytes of a node of bufferedVersion. Right above it, going
+      down, are the messages, a leafKey each in key order, then their
+      values, stacked down like those of a plain leaf. A message replaces
+      what the subtree below holds for its key, a message with offset 0
+      removes the key. bytes counts all of it, this included. */
+  struct __attribute__ ((__packed__)) messageBuffer
+  {
+   uint16_t messages;
+   uint16_t bytes;
+   /*! Nonzero if nodes below hold messages too. */
+   uint16_t below;
+  };
+
+  /*! One <key, value> pair of a leaf in either format. payload points at
+      the value, or the leafLocation if isLocation is set. */
+  struct leafEntry
+  {
+   Key            key;
+   const uint8_t* payload;
+   uint16_t       size;
+   bool           isLocation;
+  };
+
+  /*! Position in a leaf of either format. The pairs of a packed leaf can
+      only be decoded going forward from a restart. */
+  struct leafReader
+  {
+   const uint8_t* data;
+   unsigned int   keys;
+   /*! Of the pair readLeaf gives next. */
+   unsigned int   index;
+   unsigned int   offset;
+   unsigned int   interval;
+   /*! The last key decoded from a packed leaf. */
+   Key            key;
+   bool           isLittle;
+   bool           isPacked;
+  };
+
+  /*! The pairs of a leaf with pair put in at position, in place of the
+      old pair there if replace is set. A null pair only removes. */
+  struct leafEdit
+  {
+   struct leafReader       reader;
+   unsigned int            position;
+   bool                    replace;
+   bool                    done;
+   const struct leafEntry* pair;
+  };
+
+  /*! Room a run of pairs takes in a leaf of either format, header and
+      search index included. */
+  struct leafSize
+  {
+   unsigned int keys;
+   unsigned int plain;
+   unsigned int packed;
+   /*! All keys share type and major, so the run can be packed. */
+   bool         uniform;
+   Key          first;
+   Key          last;
+  };
+
   struct splitAndMergeInfo
   {
    struct
@@ -185,7 +667,7 @@ class BPlusTree
     Key      key;
     LBA      theLBA;
     uint16_t size;
-    uint8_t  keys;
+    uint16_t keys;
     bool     leaf;
    } children[3];
 
@@ -199,12 +681,97 @@ class BPlusTree
    }
   };
 
+  /*! 0x7f was the format without a checksum in the header. Such nodes
+      are no longer accepted. Nodes are built as version and given a
+      search index when they are sealed, if it fits. */
+  static const uint8_t
+  version = 0x7e;
+
+  /*! version plus a searchIndex. */
+  static const uint8_t
+  indexedVersion = 0x7d;
+
+  /*! The values of a leaf of version or indexedVersion are stacked down
+      from the end of the sector, the low bits of spaceUsedNFlags giving
+      how far down they reach, and are found through the offset of their
+      leafKey. A change to the leaf can move the key structs behind it
+      and put a new value below the others, leaving the old one unused.
+      The leaf is written anew once the unused bytes would exceed this. */
+  static const unsigned int
+  maxFragmented = sectorSize / 4;
+
+  /*! Leaf with a packedLeaf header. Leaves are written in this format
+      when their keys share type and major, as within a subtree. */
+  static const uint8_t
+  packedVersion = 0x7c;
+
+  static const unsigned int
+  restartInterval = 16;
+
+  /*! Bits 8 to 10 of the key count of a packed leaf, shifted up by 4. */
+  static const uint16_t
+  extraKeys = 0x7000;
+
+  static const unsigned int
+  maxLeafKeys = 0x7ff;
+
+  /*! Internal node with a truncatedNode header. */
+  static const uint8_t
+  truncatedVersion = 0x7b;
+
+  /*! truncatedVersion node whose sector ends in a messageBuffer. */
   static const uint8_t
-  version = 0x7f;
+  bufferedVersion = 0x7a;
+
+  /*! A buffered node keeps its children in the sector less this, so at
+      least this much is left for messages. */
+  static const unsigned int
+  bufferReserve = sectorSize / 2;
+
+  /*! Three truncated nodes take this many children plus the two a
+      split adds, however wide the separators. */
+  static const unsigned int
+  maxInternalChildren = 480;
+
+  /*! type, major and minor as big endian bytes, so that memcmp orders
+      them like compareKeys. */
+  static const unsigned int
+  normalizedKeySize = 17;
 
   static const uint8_t
   bigEndian = 0x80;
 
+  /*! A tree whose root is of bufferedVersion takes inserts and removes
+      as messages in its internal nodes, see BPlusTreeBatch, and keeps
+      doing so. Build with -DBUFFERED_NODES to have updates give trees
+      with an internal root a buffered one. */
+  static const bool
+# ifdef BUFFERED_NODES
+  newTreeIsBuffered = true;
+# else
+  newTreeIsBuffered = false;
+# endif
+
+  /*! Byte order a new tree is written in. Build with -DBIG_ENDIAN_IMAGE
+      to make big-endian images. A tree keeps the order of its root. */
+  static const bool
+# ifdef BIG_ENDIAN_IMAGE
+  newTreeIsLittle = false;
+# else
+  newTreeIsLittle = true;
+# endif
+
+  /*! Room a run of children takes in a truncated internal node. Only the
+      keys of the children after the first are separators. */
+  struct internalSize
+  {
+   unsigned int children;
+   unsigned int prefixLength;
+   /*! Of the longest separator, trailing zeros left out. */
+   unsigned int longest;
+   uint8_t      first[normalizedKeySize + sizeof(uint32_t)];
+  };
+
   class VirtualBlockDevice* rootDevice;
   LBA                       rootLBA;
 
@@ -222,71 +789,1772 @@ class BPlusTree
    rootDevice = device;
    rootLBA    = theLBA;
   }
-  
+
+  static inline uint32_t
+  checksum(register const uint8_t* const data)
+  {
+   static const uint8_t zero[sizeof(((struct header*) 0)->checksum)] = { 0 };
+
+   register uint32_t crc = Checksum::update(~0U, data, offsetof(struct header, checksum));
+
+   crc = Checksum::update(crc, zero, sizeof(zero));
+   crc = Checksum::update(crc, data + sizeof(struct header), sectorSize - sizeof(struct header));
+
+   return ~crc;
+  }
+
+  /*! Add the search index, if there is room, and store the checksum of
+      a finished node. Must be the last change to the node before it is
+      unlocked. */
+  static inline void
+  seal(register uint8_t* const data,
+       register const bool     isLittle)
+  {
+   addSearchIndex(data, isLittle);
+
+   toFileSystemEndian(&((struct header*) data)->checksum, checksum(data), isLittle);
+  }
+
   static inline bool
-  equalInternalKey(register const struct internalKey* const keyStruct,
-                   register const Key                       key,
-                   register const bool                      isLittle)
-  { 
-   return ((key.type == keyStruct->type) &&
-           (key.major == fromFileSystemEndian(&(keyStruct->major), isLittle)) &&
-           (key.minor == fromFileSystemEndian(&(keyStruct->minor), isLittle)));
+  isSupportedVersion(register const uint8_t nodeVersion)
+  {
+   return ((nodeVersion & ~bigEndian) == version) || ((nodeVersion & ~bigEndian) == indexedVersion) ||
+          ((nodeVersion & ~bigEndian) == packedVersion) || isTruncated(nodeVersion);
   }
 
+  /*! Internal node in the truncated format, buffered or not. */
   static inline bool
-  equalLeafKey(register const struct leafKey* const keyStruct,
-               register const Key                   key,
-               register const bool                  isLittle)
-  { 
-   return ((key.type == keyStruct->type) &&
-           (key.major == fromFileSystemEndian(&(keyStruct->major), isLittle)) &&
-           (key.minor == fromFileSystemEndian(&(keyStruct->minor), isLittle)));
+  isTruncated(register const uint8_t nodeVersion)
+  {
+   return ((nodeVersion & ~bigEndian) == truncatedVersion) || ((nodeVersion & ~bigEndian) == bufferedVersion);
   }
 
+  static inline bool
+  isBuffered(register const uint8_t* const data)
+  {
+   return (((const struct header*) data)->version & ~bigEndian) == bufferedVersion;
+  }
+
+  /*! The accessors the lookups go through come in a copy for each byte
+      order, without a test per field, and a variant that takes the byte
+      order and picks one. */
+  template <bool isLittle>
+  static inline unsigned int
+  nodeKeys(register const uint8_t* const data)
+  {
+   register const struct header* const header = (const struct header*) data;
+
+   return header->keys | ((fromFileSystemEndian<isLittle>(&header->spaceUsedNFlags) & extraKeys) >> 4);
+  }
+
+  static inline unsigned int
+  nodeKeys(register const uint8_t* const data,
+           register const bool           isLittle)
+  {
+   return isLittle ? nodeKeys<true>(data) : nodeKeys<false>(data);
+  }
+
+  /*! Bytes from the end of the sector down to the lowest value of a
+      plain leaf, unused ones included. */
+  static inline unsigned int
+  leafDataSpace(register const uint8_t* const data,
+                register const bool           isLittle)
+  {
+   return fromFileSystemEndian(&((const struct header*) data)->spaceUsedNFlags, isLittle) & (sectorSize - 1);
+  }
+
+  /*! Room a search index over keys keys takes, alignment included. Node
+      builders count it in so their nodes get one. */
+  static inline unsigned int
+  searchIndexSize(register const unsigned int keys)
+  {
+   return keys ? (3 + sizeof(struct searchIndex) + keys * sizeof(uint32_t)) : 0;
+  }
+
+  static inline unsigned int
+  keyArrayOffset(register const bool isLeaf)
+  {
+   return sizeof(struct header) + (isLeaf ? 0 : sizeof(struct firstLocation));
+  }
+
+  static inline unsigned int
+  searchIndexOffset(register const unsigned int keys,
+                    register const bool         isLeaf)
+  {
+   return (keyArrayOffset(isLeaf) +
+           keys * (isLeaf ? sizeof(struct leafKey) : sizeof(struct internalKey)) + 3) & ~3U;
+  }
+
+  /*! Key index of a leaf or an internal node. Both key structs start
+      with major and minor. */
+  template <bool isLittle>
+  static inline Key
+  keyAt(register const uint8_t* const data,
+        register const unsigned int   index,
+        register const bool           isLeaf)
+  {
+   register Key key;
+
+   if (isLeaf)
+   {
+    register const struct leafKey* const keyStruct =
+     ((const struct leafKey*) (data + keyArrayOffset(true))) + index;
+
+    key.type  = keyStruct->type;
+    key.major = fromFileSystemEndian<isLittle>(&keyStruct->major);
+    key.minor = fromFileSystemEndian<isLittle>(&keyStruct->minor);
+   }
+   else
+   {
+    register const struct internalKey* const keyStruct =
+     ((const struct internalKey*) (data + keyArrayOffset(false))) + index;
+
+    key.type  = keyStruct->type;
+    key.major = fromFileSystemEndian<isLittle>(&keyStruct->major);
+    key.minor = fromFileSystemEndian<isLittle>(&keyStruct->minor);
+   }
+
+   return key;
+  }
+
+  static inline Key
+  keyAt(register const uint8_t* const data,
+        register const unsigned int   index,
+        register const bool           isLeaf,
+        register const bool           isLittle)
+  {
+   return isLittle ? keyAt<true>(data, index, isLeaf) : keyAt<false>(data, index, isLeaf);
+  }
+
+  /*! normalized must have room for normalizedKeySize plus a fingerprint
+      of padding, which is cleared. */
+  static inline void
+  normalize(register uint8_t* const normalized,
+            register const Key      key)
+  {
+# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   register const uint64_t major = __builtin_bswap64(key.major);
+   register const uint64_t minor = __builtin_bswap64(key.minor);
+# else
+   register const uint64_t major = key.major;
+   register const uint64_t minor = key.minor;
+# endif
+
+   normalized[0] = key.type;
+   memcpy(normalized + 1, &major, sizeof(major));
+   memcpy(normalized + 9, &minor, sizeof(minor));
+   memset(normalized + normalizedKeySize, 0, sizeof(uint32_t));
+  }
+
+  static inline uint32_t
+  fingerprint(register const uint8_t* const normalized,
+              register const unsigned int   prefixLength)
+  {
+   register uint32_t value;
+
+   memcpy(&value, normalized + prefixLength, sizeof(value));
+
+# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   return __builtin_bswap32(value);
+# else
+   return value;
+# endif
+  }
+
+  static inline Key
+  denormalize(register const uint8_t* const normalized)
+  {
+   register uint64_t major;
+   register uint64_t minor;
+   register Key      key;
+
+   memcpy(&major, normalized + 1, sizeof(major));
+   memcpy(&minor, normalized + 9, sizeof(minor));
+
+   key.type  = normalized[0];
+# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   key.major = __builtin_bswap64(major);
+   key.minor = __builtin_bswap64(minor);
+# else
+   key.major = major;
+   key.minor = minor;
+# endif
+
+   return key;
+  }
+
+  /*! Normalized bytes up to the last one that is not zero. */
+  static inline unsigned int
+  significantLength(register const uint8_t* const normalized)
+  {
+   register unsigned int length = normalizedKeySize;
+
+   while (length && !normalized[length - 1])
+    length--;
+
+   return length;
+  }
+
+  static inline unsigned int
+  commonPrefix(register const uint8_t* const first,
+               register const uint8_t* const second)
+  {
+   register unsigned int length = 0;
+
+   while ((length < normalizedKeySize) && (first[length] == second[length]))
+    length++;
+
+   return length;
+  }
+
+  /*! The key with the fewest significant bytes that is above left and
+      not above right: the bytes of right up to the first one that
+      differs from left. */
+  static inline Key
+  shortestSeparator(register const Key left,
+                    register const Key right)
+  {
+   uint8_t low[normalizedKeySize + sizeof(uint32_t)];
+   uint8_t high[normalizedKeySize + sizeof(uint32_t)];
+
+   assert(compareKeys(left, right) < 0);
+
+   normalize(low, left);
+   normalize(high, right);
+
+   register const unsigned int length = commonPrefix(low, high) + 1;
+
+   assert(length <= normalizedKeySize);
+
+   memset(high + length, 0, normalizedKeySize - length);
+
+   return denormalize(high);
+  }
+
+  static inline void
+  addSearchIndex(register uint8_t* const data,
+                 register const bool     isLittle)
+  {
+   register struct header* const header = (struct header*) data;
+   register const unsigned int   keys   = header->keys;
+
+   if (!keys || ((header->version & ~bigEndian) != version))
+    return;
+
+   register const uint16_t     flags     = fromFileSystemEndian(&header->spaceUsedNFlags, isLittle);
+   register const bool         leaf      = (flags & isLeaf) != 0;
+   register const unsigned int dataSpace = flags & (sectorSize - 1);
+   register const unsigned int offset    = searchIndexOffset(keys, leaf);
+
+   /* A full node stays as it is, search falls back to bisection. */
+   if ((offset + sizeof(struct searchIndex) + keys * sizeof(uint32_t)) > (sectorSize - dataSpace))
+    return;
+
+   uint8_t first[normalizedKeySize + sizeof(uint32_t)];
+   uint8_t current[normalizedKeySize + sizeof(uint32_t)];
+
+   normalize(first, keyAt(data, 0, leaf, isLittle));
+   normalize(current, keyAt(data, keys - 1, leaf, isLittle));
+
+   register unsigned int prefixLength = 0;
+
+   while ((prefixLength < normalizedKeySize) && (first[prefixLength] == current[prefixLength]))
+    prefixLength++;
+
+   register struct searchIndex* const index        = (struct searchIndex*) (data + offset);
+   register uint32_t* const           fingerprints = (uint32_t*) (index + 1);
+
+   index->prefixLength = prefixLength;
+
+   for(register unsigned int i = 0; i < keys; i++)
+   {
+    normalize(current, keyAt(data, i, leaf, isLittle));
+    toFileSystemEndian(fingerprints + i, fingerprint(current, prefixLength), isLittle);
+   }
+
+   header->version = indexedVersion | (isLittle ? 0 : bigEndian);
+  }
+
+  static inline unsigned int
+  varintSize(register uint64_t value)
+  {
+   register unsigned int size = 1;
+
+   for(; value >= 0x80; value >>= 7)
+    size++;
+
+   return size;
+  }
+
+  /*! Seven bits per byte, least significant first, the top bit set on
+      all but the last byte. */
+  static inline uint8_t*
+  putVarint(register uint8_t* destination,
+            register uint64_t value)
+  {
+   for(; value >= 0x80; value >>= 7)
+    *destination++ = (uint8_t) (value | 0x80);
+
+   *destination++ = (uint8_t) value;
+
+   return destination;
+  }
+
+  static inline const uint8_t*
+  getVarint(register const uint8_t* source,
+            register uint64_t&      value)
+  {
+   register uint8_t      byte  = *source++;
+   register unsigned int shift = 7;
+
+   /* Small deltas and sizes take one byte. */
+   value = byte;
+
+   if (!(byte & 0x80))
+    return source;
+
+   value &= 0x7f;
+
+   do
+   {
+    assert(shift < 64);
+
+    byte   = *source++;
+    value |= ((uint64_t) (byte & 0x7f)) << shift;
+    shift += 7;
+   } while (byte & 0x80);
+
+   return source;
+  }
+
+  template <bool isLittle>
+  static inline unsigned int
+  restartOffset(register const uint8_t* const data,
+                register const unsigned int   restart)
+  {
+   return fromFileSystemEndian<isLittle>(((const uint16_t*) (data + sizeof(struct header) + sizeof(struct packedLeaf))) +
+                                         restart);
+  }
+
+  /*! Position reader before the first pair of the leaf at data. */
+  template <bool isLittle>
+  static inline void
+  openLeaf(register struct leafReader&   reader,
+           register const uint8_t* const data)
+  {
+   reader.data     = data;
+   reader.isLittle = isLittle;
+   reader.keys     = nodeKeys<isLittle>(data);
+   reader.index    = 0;
+   reader.offset   = 0;
+   reader.interval = 1;
+   reader.isPacked = (((const struct header*) data)->version & ~bigEndian) == packedVersion;
+
+   if (reader.isPacked && reader.keys)
+   {
+    register const struct packedLeaf* const packed = (const struct packedLeaf*) (data + sizeof(struct header));
+
+    reader.interval  = packed->restartInterval;
+    reader.key.type  = packed->type;
+    reader.key.major = fromFileSystemEndian<isLittle>(&packed->major);
+    reader.key.minor = 0;
+    reader.offset    = restartOffset<isLittle>(data, 0);
+
+    assert(reader.interval);
+   }
+  }
+
+  static inline void
+  openLeaf(register struct leafReader&   reader,
+           register const uint8_t* const data,
+           register const bool           isLittle)
+  {
+   if (isLittle)
+    openLeaf<true>(reader, data);
+   else
+    openLeaf<false>(reader, data);
+  }
+
+  /*! Decode the pair at reader and step past it. */
+  template <bool isLittle>
+  static inline void
+  readLeaf(register struct leafReader& reader,
+           register struct leafEntry&  entry)
+  {
+   assert(reader.isLittle == isLittle);
+   assert(reader.index < reader.keys);
+
+   if (!reader.isPacked)
+   {
+    register const struct leafKey* const keyStruct =
+     ((const struct leafKey*) (reader.data + sizeof(struct header))) + reader.index;
+
+    entry.key.type   = keyStruct->type;
+    entry.key.major  = fromFileSystemEndian<isLittle>(&keyStruct->major);
+    entry.key.minor  = fromFileSystemEndian<isLittle>(&keyStruct->minor);
+    entry.size       = fromFileSystemEndian<isLittle>(&keyStruct->size);
+    entry.payload    = reader.data + fromFileSystemEndian<isLittle>(&keyStruct->offset);
+    entry.isLocation = keyStruct->isLocation;
+   }
+   else
+   {
+    register const uint8_t* source = reader.data + reader.offset;
+    register uint64_t       minor;
+    register uint64_t       sizeNFlag;
+
+    source = getVarint(source, minor);
+    source = getVarint(source, sizeNFlag);
+
+    reader.key.minor = (reader.index % reader.interval) ? (reader.key.minor + minor) : minor;
+
+    entry.key        = reader.key;
+    entry.size       = sizeNFlag >> 1;
+    entry.payload    = source;
+    entry.isLocation = (sizeNFlag & 1) != 0;
+
+    reader.offset = (source + entry.size) - reader.data;
+   }
+
+   assert((entry.payload + entry.size) <= (reader.data + sectorSize));
+
+   reader.index++;
+  }
+
+  static inline void
+  readLeaf(register struct leafReader& reader,
+           register struct leafEntry&  entry)
+  {
+   if (reader.isLittle)
+    readLeaf<true>(reader, entry);
+   else
+    readLeaf<false>(reader, entry);
+  }
+
+  /*! Position reader so that readLeaf gives pair index. Going forward
+      within a restart interval decodes on from where reader is. */
+  template <bool isLittle>
+  static inline void
+  seekLeaf(register struct leafReader& reader,
+           register const unsigned int index)
+  {
+   assert(reader.isLittle == isLittle);
+   assert(index <= reader.keys);
+
+   if (!reader.isPacked || (index == reader.keys))
+   {
+    reader.index = index;
+    return;
+   }
+
+   if ((index < reader.index) || ((index / reader.interval) != (reader.index / reader.interval)))
+   {
+    register const unsigned int restart = index / reader.interval;
+
+    reader.index  = restart * reader.interval;
+    reader.offset = restartOffset<isLittle>(reader.data, restart);
+   }
+
+   register struct leafEntry skipped;
+
+   while (reader.index < index)
+    readLeaf<isLittle>(reader, skipped);
+  }
+
+  static inline void
+  seekLeaf(register struct leafReader& reader,
+           register const unsigned int index)
+  {
+   if (reader.isLittle)
+    seekLeaf<true>(reader, index);
+   else
+    seekLeaf<false>(reader, index);
+  }
+
+  /*! Pair index of the leaf at data. */
+  template <bool isLittle>
+  static inline void
+  leafEntryAt(register struct leafEntry&    entry,
+              register const uint8_t* const data,
+              register const unsigned int   index)
+  {
+   register struct leafReader reader;
+
+   openLeaf<isLittle>(reader, data);
+   seekLeaf<isLittle>(reader, index);
+   readLeaf<isLittle>(reader, entry);
+  }
+
+  static inline void
+  startEdit(register struct leafEdit&               edit,
+            register const uint8_t* const           data,
+            register const bool                     isLittle,
+            register const unsigned int             position,
+            register const bool                     replace,
+            register const struct leafEntry* const pair)
+  {
+   openLeaf(edit.reader, data, isLittle);
+
+   assert((position + (replace ? 1 : 0)) <= edit.reader.keys);
+
+   edit.position = position;
+   edit.replace  = replace;
+   edit.done     = false;
+   edit.pair     = pair;
+  }
+
+  static inline bool
+  nextEdited(register struct leafEdit&  edit,
+             register struct leafEntry& entry)
+  {
+   if (!edit.done && (edit.reader.index == edit.position))
+   {
+    edit.done = true;
+
+    if (edit.replace)
+    {
+     register struct leafEntry replaced;
+
+     readLeaf(edit.reader, replaced);
+    }
+
+    if (edit.pair)
+    {
+     entry = *edit.pair;
+     return true;
+    }
+   }
+
+   if (edit.reader.index >= edit.reader.keys)
+    return false;
+
+   readLeaf(edit.reader, entry);
+   return true;
+  }
+
+  static inline void
+  startLeafSize(register struct leafSize& size)
+  {
+   size.keys    = 0;
+   size.plain   = sizeof(struct header);
+   size.packed  = sizeof(struct header) + sizeof(struct packedLeaf);
+   size.uniform = true;
+  }
+
+  static inline void
+  addToLeafSize(register struct leafSize&   size,
+                register const Key          key,
+                register const unsigned int payloadSize)
+  {
+   if (!size.keys)
+   {
+    size.first  = key;
+    size.plain += searchIndexSize(1) - sizeof(uint32_t);
+   }
+   else if ((key.type != size.first.type) || (key.major != size.first.major))
+    size.uniform = false;
+
+   size.plain += sizeof(struct leafKey) + sizeof(uint32_t) + payloadSize;
+
+   if (size.uniform)
+   {
+    if (!(size.keys % restartInterval))
+     size.packed += sizeof(uint16_t) + varintSize(key.minor);
+    else
+     size.packed += varintSize(key.minor - size.last.minor);
+
+    size.packed += varintSize(payloadSize << 1) + payloadSize;
+   }
+
+   size.last = key;
+   size.keys++;
+  }
+
+  static inline bool
+  isPackable(register const struct leafSize& size)
+  {
+   return size.keys && size.uniform && (size.keys <= maxLeafKeys) && (size.packed < sectorSize);
+  }
+
+  static inline bool
+  leafFits(register const struct leafSize& size)
+  {
+   return isPackable(size) || ((size.keys <= UINT8_MAX) && (size.plain < sectorSize));
+  }
+
+  static inline unsigned int
+  leafBytes(register const struct leafSize& size)
+  {
+   return (size.uniform && (size.packed < size.plain)) ? size.packed : size.plain;
+  }
+
+  /*! Collects the pairs of one leaf and writes it packed if it can be,
+      plain otherwise. Values are copied in, so their source may go away
+      once they are added. */
+  class leafBuilder
+  {
+   public:
+    inline
+    leafBuilder()
+    {
+     reset();
+    }
+
+    inline void
+    reset(void)
+    {
+     startLeafSize(size);
+     used = 0;
+    }
+
+    inline unsigned int
+    count(void) const
+    {
+     return size.keys;
+    }
+
+    /*! Room the leaf takes so far. */
+    inline unsigned int
+    bytes(void) const
+    {
+     return leafBytes(size);
+    }
+
+    inline Key
+    firstKey(void) const
+    {
+     assert(size.keys);
+
+     return size.first;
+    }
+
+    inline Key
+    lastKey(void) const
+    {
+     assert(size.keys);
+
+     return size.last;
+    }
+
+    /*! Fails, leaving the leaf as it was, if entry does not fit. */
+    inline bool
+    add(register const struct leafEntry& entry)
+    {
+     register struct leafSize grown = size;
+
+     addToLeafSize(grown, entry.key, entry.size);
+
+     if (!leafFits(grown))
+      return false;
+
+     assert((used + entry.size) <= sectorSize);
+
+     register struct pair& pair = pairs[size.keys];
+
+     pair.key        = entry.key;
+     pair.offset     = used;
+     pair.size       = entry.size;
+     pair.isLocation = entry.isLocation;
+
+     if (entry.size)
+      memcpy(payloads + used, entry.payload, entry.size);
+
+     used += entry.size;
+     size  = grown;
+
+     return true;
+    }
+
+    /*! Fill the sector at data with the leaf. It still needs sealing. */
+    inline void
+    write(register uint8_t* const data,
+          register const bool     isLittle) const
+    {
+     memset(data, 0, sectorSize);
+
+     if (isPackable(size))
+      writePacked(data, isLittle);
+     else
+      writePlain(data, isLittle);
+    }
+
+   private:
+    struct pair
+    {
+     Key      key;
+     uint16_t offset;
+     uint16_t size;
+     bool     isLocation;
+    } pairs[maxLeafKeys];
+
+    struct leafSize size;
+    unsigned int    used;
+    uint8_t         payloads[sectorSize];
+
+    inline void
+    writePlain(register uint8_t* const data,
+               register const bool     isLittle) const
+    {
+     register struct header* const header    = (struct header*) data;
+     register struct leafKey*      keyStruct = (struct leafKey*) (header + 1);
+     register uint16_t             dataSpace = 0;
+
+     assert(size.keys <= UINT8_MAX);
+
+     for(register unsigned int i = 0; i < size.keys; i++, keyStruct++)
+     {
+      dataSpace += pairs[i].size;
+
+      register const uint16_t offset = sectorSize - dataSpace;
+
+      toFileSystemEndian(&keyStruct->major, pairs[i].key.major, isLittle);
+      toFileSystemEndian(&keyStruct->minor, pairs[i].key.minor, isLittle);
+      toFileSystemEndian(&keyStruct->offset, offset, isLittle);
+      toFileSystemEndian(&keyStruct->size, pairs[i].size, isLittle);
+      keyStruct->type       = pairs[i].key.type;
+      keyStruct->isLocation = pairs[i].isLocation;
+
+      memcpy(data + offset, payloads + pairs[i].offset, pairs[i].size);
+     }
+
+     assert(((uint8_t*) keyStruct) <= (data + sectorSize - dataSpace));
+
+     header->version = version | (isLittle ? 0 : bigEndian);
+     header->keys    = size.keys;
+     toFileSystemEndian(&header->spaceUsedNFlags, dataSpace | BPlusTree::isLeaf, isLittle);
+    }
+
+    inline void
+    writePacked(register uint8_t* const data,
+                register const bool     isLittle) const
+    {
+     register struct header* const     header   = (struct header*) data;
+     register struct packedLeaf* const packed   = (struct packedLeaf*) (header + 1);
+     register uint16_t* const          restarts = (uint16_t*) (packed + 1);
+     register uint8_t*                 next     = (uint8_t*) (restarts + (size.keys + restartInterval - 1) / restartInterval);
+
+     toFileSystemEndian(&packed->major, size.first.major, isLittle);
+     packed->type            = size.first.type;
+     packed->restartInterval = restartInterval;
+
+     for(register unsigned int i = 0; i < size.keys; i++)
+     {
+      if (!(i % restartInterval))
+      {
+       toFileSystemEndian(restarts + i / restartInterval, next - data, isLittle);
+       next = putVarint(next, pairs[i].key.minor);
+      }
+      else
+       next = putVarint(next, pairs[i].key.minor - pairs[i - 1].key.minor);
+
+      next = putVarint(next, (pairs[i].size << 1) | (pairs[i].isLocation ? 1 : 0));
+
+      memcpy(next, payloads + pairs[i].offset, pairs[i].size);
+      next += pairs[i].size;
+     }
+
+     assert((unsigned int) (next - data) == size.packed);
+
+     header->version = packedVersion | (isLittle ? 0 : bigEndian);
+     header->keys    = size.keys & 0xff;
+     toFileSystemEndian(&header->spaceUsedNFlags,
+                        ((size.keys >> 8) << 12) | (size.packed - sizeof(struct header)) | BPlusTree::isLeaf,
+                        isLittle);
+    }
+  };
+
+  static inline void
+  startInternalSize(register struct internalSize& size)
+  {
+   size.children     = 0;
+   size.prefixLength = 0;
+   size.longest      = 0;
+  }
+
+  static inline void
+  addToInternalSize(register struct internalSize& size,
+                    register const Key            key)
+  {
+   if (size.children == 1)
+   {
+    normalize(size.first, key);
+
+    size.prefixLength = significantLength(size.first);
+    size.longest      = size.prefixLength;
+   }
+   else if (size.children > 1)
+   {
+    uint8_t normalized[normalizedKeySize + sizeof(uint32_t)];
+
+    normalize(normalized, key);
+
+    register const unsigned int length = significantLength(normalized);
+    register const unsigned int common = commonPrefix(size.first, normalized);
+
+    if (common < size.prefixLength)
+     size.prefixLength = common;
+
+    if (length > size.longest)
+     size.longest = length;
+   }
+
+   size.children++;
+  }
+
+  static inline unsigned int
+  internalWidth(register const struct internalSize& size)
+  {
+   return (size.longest > size.prefixLength) ? (size.longest - size.prefixLength) : 0;
+  }
+
+  static inline unsigned int
+  internalBytes(register const struct internalSize& size)
+  {
+   return sizeof(struct header) + sizeof(struct truncatedNode) + size.prefixLength +
+          size.children * sizeof(struct internalLocation) +
+          (size.children ? (size.children - 1) * internalWidth(size) : 0);
+  }
+
+  /*! The children fit in room bytes of a node. */
+  static inline bool
+  internalFits(register const struct internalSize& size,
+               register const unsigned int         room = sectorSize)
+  {
+   return (size.children <= maxInternalChildren) && (internalBytes(size) <= room);
+  }
+
+  /*! Children that always fit in room bytes of a node with separators of
+      width bytes, whatever their prefix. */
+  static inline unsigned int
+  maxChildrenPerNode(register const unsigned int width,
+                     register const unsigned int room = sectorSize)
+  {
+   register const unsigned int children =
+    (room - sizeof(struct header) - sizeof(struct truncatedNode) - normalizedKeySize) /
+    (sizeof(struct internalLocation) + width);
+
+   return (children < maxInternalChildren) ? children : maxInternalChildren;
+  }
+
+  /*! Collects the children of one internal node and writes it in the
+      truncated format. The key of the first child is not stored, it is
+      only kept to be handed up. */
+  class internalBuilder
+  {
+   public:
+    inline
+    internalBuilder()
+    {
+     reset();
+    }
+
+    inline void
+    reset(void)
+    {
+     startInternalSize(size);
+    }
+
+    inline unsigned int
+    count(void) const
+    {
+     return size.children;
+    }
+
+    inline Key
+    firstKey(void) const
+    {
+     assert(size.children);
+
+     return keys[0];
+    }
+
+    inline struct LBA
+    firstChild(void) const
+    {
+     assert(size.children);
+
+     return children[0];
+    }
+
+    /*! Fails, leaving the node as it was, if the child does not fit. */
+    inline bool
+    add(register const Key        key,
+        register const struct LBA theLBA)
+    {
+     register struct internalSize grown = size;
+
+     addToInternalSize(grown, key);
+
+     if (!internalFits(grown))
+      return false;
+
+     keys[size.children]     = key;
+     children[size.children] = theLBA;
+     size                    = grown;
+
+     return true;
+    }
+
+    /*! Fill the sector at data with the node. It still needs sealing. */
+    inline void
+    write(register uint8_t* const data,
+          register const bool     isLittle) const
+    {
+     register struct header* const        header    = (struct header*) data;
+     register struct truncatedNode* const node      = (struct truncatedNode*) (header + 1);
+     register uint8_t* const              prefix    = (uint8_t*) (node + 1);
+     register const unsigned int          width     = internalWidth(size);
+     register const unsigned int          separators = size.children - 1;
+     register struct internalLocation*    location  =
+      (struct internalLocation*) (prefix + size.prefixLength + separators * width);
+     uint8_t                              normalized[normalizedKeySize + sizeof(uint32_t)];
+
+     assert(size.children);
+
+     memset(data, 0, sectorSize);
+     memcpy(prefix, size.first, size.prefixLength);
+
+     for(register unsigned int i = 0; i < size.children; i++, location++)
+     {
+      toFileSystemEndian(&location->theLBA, children[i].theLBA, isLittle);
+
+      if (i)
+      {
+       normalize(normalized, keys[i]);
+       memcpy(prefix + size.prefixLength + (i - 1) * width, normalized + size.prefixLength, width);
+      }
+     }
+
+     assert(((uint8_t*) location) == (data + internalBytes(size)));
+
+     node->prefixLength = size.prefixLength;
+     node->width        = width;
+
+     header->version = truncatedVersion | (isLittle ? 0 : bigEndian);
+     header->keys    = separators & 0xff;
+     toFileSystemEndian(&header->spaceUsedNFlags,
+                        ((separators >> 8) << 12) | (internalBytes(size) - sizeof(struct header)),
+                        isLittle);
+    }
+
+   private:
+    struct internalSize size;
+    Key                 keys[maxInternalChildren];
+    struct LBA          children[maxInternalChildren];
+  };
+
+  /*! The child at index child of an internal node of either format. */
+  template <bool isLittle>
+  static inline struct LBA
+  childAt(register const uint8_t* const data,
+          register const unsigned int   child)
+  {
+   register const struct internalLocation* location;
+
+   assert(child <= nodeKeys<isLittle>(data));
+
+   if (isTruncated(((const struct header*) data)->version))
+   {
+    register const struct truncatedNode* const node = (const struct truncatedNode*) (data + sizeof(struct header));
+
+    location = ((const struct internalLocation*)
+                (((const uint8_t*) (node + 1)) + node->prefixLength + nodeKeys<isLittle>(data) * node->width)) + child;
+   }
+   else
+   {
+    register uint16_t offset;
+
+    if (child == 0)
+     offset = fromFileSystemEndian<isLittle>(&((const struct firstLocation*) (data + sizeof(struct header)))->offset);
+    else
+     offset = fromFileSystemEndian<isLittle>(&(((const struct internalKey*) (data + keyArrayOffset(false))) + child - 1)->offset);
+
+    assert(offset > (sizeof(struct header) + sizeof(struct firstLocation)));
+    assert(offset <= (sectorSize - sizeof(struct internalLocation)));
+
+    location = (const struct internalLocation*) (data + offset);
+   }
+
+   register struct LBA theLBA;
+
+   theLBA.theLBA = fromFileSystemEndian<isLittle>(&location->theLBA);
+
+   return theLBA;
+  }
+
+  static inline struct LBA
+  childAt(register const uint8_t* const data,
+          register const unsigned int   child,
+          register const bool           isLittle)
+  {
+   return isLittle ? childAt<true>(data, child) : childAt<false>(data, child);
+  }
+
+  /*! The smallest key child of an internal node may hold, child > 0. */
+  static inline Key
+  separatorAt(register const uint8_t* const data,
+              register const unsigned int   child,
+              register const bool           isLittle)
+  {
+   assert(child > 0);
+   assert(child <= nodeKeys(data, isLittle));
+
+   if (!isTruncated(((const struct header*) data)->version))
+    return keyAt(data, child - 1, false, isLittle);
+
+   register const struct truncatedNode* const node   = (const struct truncatedNode*) (data + sizeof(struct header));
+   register const uint8_t* const              prefix = (const uint8_t*) (node + 1);
+   uint8_t                                    normalized[normalizedKeySize + sizeof(uint32_t)];
+
+   assert((node->prefixLength + node->width) <= normalizedKeySize);
+
+   memset(normalized, 0, sizeof(normalized));
+   memcpy(normalized, prefix, node->prefixLength);
+   memcpy(normalized + node->prefixLength, prefix + node->prefixLength + (child - 1) * node->width, node->width);
+
+   return denormalize(normalized);
+  }
+
+  /*! Messages in the buffer of an internal node, none unless it is of
+      bufferedVersion. */
+  template <bool isLittle>
+  static inline unsigned int
+  messageCount(register const uint8_t* const data)
+  {
+   if (!isBuffered(data))
+    return 0;
+
+   return fromFileSystemEndian<isLittle>(&((const struct messageBuffer*) (data + sectorSize -
+                                                                           sizeof(struct messageBuffer)))->messages);
+  }
+
+  static inline unsigned int
+  messageCount(register const uint8_t* const data,
+               register const bool           isLittle)
+  {
+   return isLittle ? messageCount<true>(data) : messageCount<false>(data);
+  }
+
+  static inline unsigned int
+  messageBytes(register const uint8_t* const data,
+               register const bool           isLittle)
+  {
+   if (!isBuffered(data))
+    return 0;
+
+   return fromFileSystemEndian(&((const struct messageBuffer*) (data + sectorSize - sizeof(struct messageBuffer)))->bytes,
+                               isLittle);
+  }
+
+  /*! Room the message of pair takes in a buffer. */
+  static inline unsigned int
+  messageSize(register const struct leafEntry& pair)
+  {
+   return sizeof(struct leafKey) + (pair.payload ? pair.size : 0);
+  }
+
+  static inline const struct leafKey*
+  messageKeys(register const uint8_t* const data,
+              register const unsigned int   messages)
+  {
+   return ((const struct leafKey*) (data + sectorSize - sizeof(struct messageBuffer))) - messages;
+  }
+
+  /*! Message index of the count in the buffer at data, as a pair. The
+      payload of a remove is null. */
+  template <bool isLittle>
+  static inline void
+  messageAt(register struct leafEntry&    entry,
+            register const uint8_t* const data,
+            register const unsigned int   index,
+            register const unsigned int   count)
+  {
+   register const struct leafKey* const keyStruct = messageKeys(data, count) + index;
+   register const uint16_t              offset    = fromFileSystemEndian<isLittle>(&keyStruct->offset);
+
+   assert(index < count);
+
+   entry.key.type   = keyStruct->type;
+   entry.key.major  = fromFileSystemEndian<isLittle>(&keyStruct->major);
+   entry.key.minor  = fromFileSystemEndian<isLittle>(&keyStruct->minor);
+   entry.size       = fromFileSystemEndian<isLittle>(&keyStruct->size);
+   entry.isLocation = keyStruct->isLocation;
+   entry.payload    = offset ? (data + offset) : 0;
+  }
+
+  static inline void
+  messageAt(register struct leafEntry&    entry,
+            register const uint8_t* const data,
+            register const unsigned int   index,
+            register const unsigned int   count,
+            register const bool           isLittle)
+  {
+   if (isLittle)
+    messageAt<true>(entry, data, index, count);
+   else
+    messageAt<false>(entry, data, index, count);
+  }
+
+  /*! Nodes below the internal node at data may hold messages. */
+  static inline bool
+  hasMessagesBelow(register const uint8_t* const data,
+                   register const bool           isLittle)
+  {
+   if (!isBuffered(data))
+    return false;
+
+   return fromFileSystemEndian(&((const struct messageBuffer*) (data + sectorSize - sizeof(struct messageBuffer)))->below,
+                               isLittle) != 0;
+  }
+
+  /*! Look key up in the buffer of the internal node at data. */
+  template <bool isLittle>
+  static inline bool
+  findMessage(register struct leafEntry&    entry,
+              register const uint8_t* const data,
+              register const Key            key)
+  {
+   register const unsigned int count = messageCount<isLittle>(data);
+   register unsigned int       index;
+
+   if (!count || !bisect<isLittle>(index, (const uint8_t*) messageKeys(data, count), count, true, key))
+    return false;
+
+   messageAt<isLittle>(entry, data, index - 1, count);
+   return true;
+  }
+
+  /*! What findPair and multiLookup do at a node. */
+  enum nodeStep
+  {
+   stepLeaf = 0,
+   stepMessage,
+   stepChild
+  };
+
+  /*! Search the node at data for key. A leaf ends the step there. In an
+      internal node a message for key ends it, otherwise child is where
+      to go on. */
+  template <bool isLittle>
+  static inline enum nodeStep
+  stepNode(register struct leafEntry&    entry,
+           register struct LBA&          child,
+           register unsigned int&        keys,
+           register unsigned int&        keyIndex,
+           register bool&                found,
+           register const uint8_t* const data,
+           register const Key            key)
+  {
+   keys = nodeKeys<isLittle>(data);
+
+   register const bool leaf = (fromFileSystemEndian<isLittle>(&((const struct header*) data)->spaceUsedNFlags) &
+                               isLeaf) != 0;
+
+   found = searchAs<isLittle>(keyIndex, data, keys, leaf, key);
+
+   if (leaf)
+    return stepLeaf;
+
+   /* this should not be possible! */
+   assert(found);
+   assert(keyIndex <= keys);
+
+   /* A message is newer than anything below it. */
+   if (findMessage<isLittle>(entry, data, key))
+    return stepMessage;
+
+   child = childAt<isLittle>(data, keyIndex);
+   return stepChild;
+  }
+
+  /*! Give the internal node at data, as written by internalBuilder, a
+      buffer holding the count messages, which must be in key order and
+      fit. below tells if its children hold messages. It still needs
+      sealing. */
+  static inline void
+  writeMessages(register uint8_t* const                data,
+                register const bool                    isLittle,
+                register const struct leafEntry* const messages,
+                register const unsigned int            count,
+                register const bool                    below)
+  {
+   register struct messageBuffer* const buffer    = (struct messageBuffer*) (data + sectorSize - sizeof(struct messageBuffer));
+   register struct leafKey*             keyStruct = ((struct leafKey*) buffer) - count;
+   register unsigned int                bottom    = ((uint8_t*) keyStruct) - data;
+
+   for(register unsigned int i = 0; i < count; i++, keyStruct++)
+   {
+    register uint16_t offset = 0;
+
+    if (messages[i].payload)
+    {
+     bottom -= messages[i].size;
+     offset  = bottom;
+
+     memcpy(data + bottom, messages[i].payload, messages[i].size);
+    }
+
+    toFileSystemEndian(&keyStruct->major, messages[i].key.major, isLittle);
+    toFileSystemEndian(&keyStruct->minor, messages[i].key.minor, isLittle);
+    toFileSystemEndian(&keyStruct->offset, offset, isLittle);
+    toFileSystemEndian(&keyStruct->size, messages[i].size, isLittle);
+    keyStruct->type       = messages[i].key.type;
+    keyStruct->isLocation = messages[i].isLocation;
+   }
+
+   assert(bottom >= (sizeof(struct header) +
+                     (fromFileSystemEndian(&((struct header*) data)->spaceUsedNFlags, isLittle) & (sectorSize - 1))));
+
+   toFileSystemEndian(&buffer->messages, count, isLittle);
+   toFileSystemEndian(&buffer->bytes, sectorSize - bottom, isLittle);
+   toFileSystemEndian(&buffer->below, below ? 1 : 0, isLittle);
+
+   ((struct header*) data)->version = bufferedVersion | (isLittle ? 0 : bigEndian);
+  }
+
+  /*! Sectors in the run of a value of size bytes stored out of line. */
+  static inline unsigned int
+  extentSectors(register const uint_fast32_t size)
+  {
+   return (size + sectorSize - 1) / sectorSize;
+  }
+
+  /*! Store value out of line and point location at it. The value gets a
+      run of consecutive sectors, allocated in one go so that it goes to
+      the device, and comes back, in a single request. The sectors are
+      left to the transaction or, if pinned is given, handed back locked
+      in it. */
+  static inline void
+  writeExtent(register struct leafLocation&            location,
+              register const Serializable&             value,
+              register class VirtualBlockDevice* const device,
+              register class Transaction* const        transaction,
+              register const bool                      isLittle,
+              register class BlockCacheEntry** const   pinned = 0)
+  {
+   register const uint_fast32_t              size    = value.size();
+   register const unsigned int               sectors = extentSectors(size);
+   register struct LBA                       firstLBA;
+   register enum FileSystem::FileSystemError fileSystemError;
+   class BlockCacheEntry*                    cacheEntries[ValueView::maxSectors];
+   uint8_t*                                  pages[ValueView::maxSectors];
+
+   assert(sectors && (sectors <= ValueView::maxSectors));
+
+   if (!transaction->getFileSystem()->getAvailableLBAs(firstLBA, sectors, fileSystemError))
+    assert(0);
+
+   assert(fileSystemError == FileSystem::noError);
+
+   for(register unsigned int i = 0; i < sectors; i++)
+   {
+    register enum BlockCache::BlockCacheError cacheError;
+
+    if (!BlockCache::getInstance().allocate(cacheEntries[i], cacheError, transaction))
+     assert(0);
+
+    assert(cacheError == BlockCache::noError);
+
+    pages[i] = cacheEntries[i]->getDataPointer();
+
+    assert(pages[i]);
+
+    memset(pages[i], 0, sectorSize);
+   }
+
+   /* A value spanning sectors is laid out in them directly. */
+   if (sectors == 1)
+   {
+    if (!value.toFileSystem(pages[0], isLittle))
+     assert(0);
+   }
+   else if (!value.toSectors(pages, sectors, isLittle))
+    assert(0);
+
+   for(register unsigned int i = 0; i < sectors; i++)
+   {
+    register struct LBA theLBA;
+
+    theLBA.theLBA = firstLBA.theLBA + i;
+
+    if (!cacheEntries[i]->setLBA(device, theLBA))
+     assert(0);
+
+    if (pinned)
+     pinned[i] = cacheEntries[i];
+    else
+     cacheEntries[i]->unlock(pages[i], cacheEntries[i], transaction);
+   }
+
+   toFileSystemEndian(&location.theLBA, firstLBA.theLBA, isLittle);
+   toFileSystemEndian(&location.size, size, isLittle);
+  }
+
+  /*! Read where the sectors of the value of entry, stored out of line,
+      are. */
+  static inline void
+  readExtents(register struct valueExtents&    extents,
+              register const struct leafEntry& entry,
+              register const bool              isLittle)
+  {
+   register const struct leafLocation* const location = (const struct leafLocation*) entry.payload;
+   register const struct leafExtent* const   extent   = (const struct leafExtent*) (location + 1);
+
+   assert(entry.isLocation);
+   assert(entry.size >= sizeof(struct leafLocation));
+   assert(!((entry.size - sizeof(struct leafLocation)) % sizeof(struct leafExtent)));
+
+   extents.theLBA.theLBA = fromFileSystemEndian(&location->theLBA, isLittle);
+   extents.size          = fromFileSystemEndian(&location->size, isLittle);
+   extents.count         = (entry.size - sizeof(struct leafLocation)) / sizeof(struct leafExtent);
+
+   assert(extents.count <= maxExtents);
+
+   for(register unsigned int i = 0; i < extents.count; i++)
+   {
+    extents.extents[i].first         = fromFileSystemEndian(&extent[i].first, isLittle);
+    extents.extents[i].theLBA.theLBA = fromFileSystemEndian(&extent[i].theLBA, isLittle);
+   }
+  }
+
+  /*! Store extents at payload, as a leafLocation and its extents. Returns
+      the bytes they take. */
+  static inline unsigned int
+  writeExtents(register uint8_t* const             payload,
+               register const struct valueExtents& extents,
+               register const bool                 isLittle)
+  {
+   register struct leafLocation* const location = (struct leafLocation*) payload;
+   register struct leafExtent* const   extent   = (struct leafExtent*) (location + 1);
+
+   toFileSystemEndian(&location->theLBA, extents.theLBA.theLBA, isLittle);
+   toFileSystemEndian(&location->size, extents.size, isLittle);
+
+   for(register unsigned int i = 0; i < extents.count; i++)
+   {
+    toFileSystemEndian(&extent[i].first, extents.extents[i].first, isLittle);
+    toFileSystemEndian(&extent[i].theLBA, extents.extents[i].theLBA.theLBA, isLittle);
+   }
+
+   return sizeof(struct leafLocation) + extents.count * sizeof(struct leafExtent);
+  }
+
+  /*! The LBAs of count sectors of a value from sector first on. */
+  static inline void
+  extentLBAs(register struct LBA* const          theLBAs,
+             register const struct valueExtents& extents,
+             register const unsigned int         first,
+             register const unsigned int         count)
+  {
+   register unsigned int extent = 0;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    register const unsigned int sector = first + i;
+
+    while ((extent < extents.count) && (extents.extents[extent].first <= sector))
+     extent++;
+
+    if (!extent)
+     theLBAs[i].theLBA = extents.theLBA.theLBA + sector;
+    else
+     theLBAs[i].theLBA = extents.extents[extent - 1].theLBA.theLBA + (sector - extents.extents[extent - 1].first);
+   }
+  }
+
+  /*! Make extents say sectors of a value are at theLBAs, in as few runs
+      as those make. Fails if that takes more than maxExtents. */
+  static inline bool
+  makeExtents(register struct valueExtents&   extents,
+              register const struct LBA* const theLBAs,
+              register const unsigned int      sectors,
+              register const uint_fast32_t     size)
+  {
+   extents.theLBA = theLBAs[0];
+   extents.size   = size;
+   extents.count  = 0;
+
+   for(register unsigned int i = 1; i < sectors; i++)
+   {
+    if (theLBAs[i].theLBA == theLBAs[i - 1].theLBA + 1)
+     continue;
+
+    if (extents.count == maxExtents)
+     return false;
+
+    extents.extents[extents.count].first  = i;
+    extents.extents[extents.count].theLBA = theLBAs[i];
+    extents.count++;
+   }
+
+   return true;
+  }
+
+  /*! Pin the count sectors at theLBAs. Those not cached yet are read
+      with a single vectored request. */
+  static inline void
+  pinRun(register class BlockCacheEntry** const   cacheEntries,
+         register uint8_t** const                 pages,
+         register const struct LBA* const         theLBAs,
+         register const unsigned int              count,
+         register class VirtualBlockDevice* const device,
+         register class Transaction* const        transaction)
+  {
+   register enum BlockCache::BlockCacheError cacheError;
+
+   assert(count && (count <= ValueView::maxSectors));
+
+   if ((count > 1) &&
+       !BlockCache::getInstance().prefetch(cacheError, device, theLBAs, count))
+    assert(0);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    /* Values stored out of line are raw data, not nodes. */
+    if (!BlockCache::getInstance().readLookup(cacheEntries[i], cacheError, transaction, device, theLBAs[i], 0))
+     assert(0);
+
+    pages[i] = cacheEntries[i]->getDataPointer();
+
+    assert(pages[i]);
+   }
+  }
+
+  /*! Pin the sectors of the value extents tells of in view. */
+  static inline void
+  viewExtent(register ValueView&                      view,
+             register const struct valueExtents&      extents,
+             register class VirtualBlockDevice* const device,
+             register class Transaction* const        transaction,
+             register const bool                      isLittle)
+  {
+   register const unsigned int sectors = extentSectors(extents.size);
+   struct LBA                  theLBAs[ValueView::maxSectors];
+   class BlockCacheEntry*      cacheEntries[ValueView::maxSectors];
+   uint8_t*                    pages[ValueView::maxSectors];
+
+   extentLBAs(theLBAs, extents, 0, sectors);
+   pinRun(cacheEntries, pages, theLBAs, sectors, device, transaction);
+
+   view.pin(cacheEntries[0], pages[0], pages[0], extents.size, isLittle, transaction);
+
+   for(register unsigned int i = 1; i < sectors; i++)
+    view.pinNext(cacheEntries[i], pages[i]);
+  }
+
+  /*! Hand the value view shows to destination. */
+  static inline bool
+  fromView(register Serializable&   destination,
+           register const ValueView& view)
+  {
+   if (view.sectorCount() == 1)
+    return destination.fromFileSystem(view.getData(), view.size(), view.isLittle());
+
+   return destination.fromSectors(view.pinned, view.sectorCount(), view.size(), view.isLittle());
+  }
+
+  /*! Up to 8 bytes of a separator as a number that orders like them. */
+  static inline uint64_t
+  separatorWindow(register const uint8_t* const bytes,
+                  register const unsigned int   width)
+  {
+   register uint64_t value;
+
+   memcpy(&value, bytes, sizeof(value));
+
+# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   value = __builtin_bswap64(value);
+# endif
+
+   return value >> (64 - 8 * width);
+  }
+
+  /*! search for a truncated internal node: the prefix is compared once,
+      then the separators are bisected on the bytes past it. A key past
+      the end of a separator is above it since the rest of the separator
+      is zero. */
+  static inline bool
+  searchTruncated(register unsigned int&        returnedKeyIndex,
+                  register const uint8_t* const data,
+                  register const unsigned int   keys,
+                  register const Key            key)
+  {
+   register const struct truncatedNode* const node         = (const struct truncatedNode*) (data + sizeof(struct header));
+   register const uint8_t* const              prefix       = (const uint8_t*) (node + 1);
+   register const unsigned int                prefixLength = node->prefixLength;
+   register const unsigned int                width        = node->width;
+   register const uint8_t* const              separators   = prefix + prefixLength;
+   uint8_t                                    probe[normalizedKeySize + sizeof(uint64_t)];
+
+   assert((prefixLength + width) <= normalizedKeySize);
+
+   normalize(probe, key);
+   memset(probe + normalizedKeySize, 0, sizeof(uint64_t));
+
+   register const int order = memcmp(probe, prefix, prefixLength);
+
+   if (order || !width)
+   {
+    returnedKeyIndex = (order < 0) ? 0 : keys;
+    return true;
+   }
+
+   if (!keys)
+   {
+    returnedKeyIndex = 0;
+    return true;
+   }
+
+   /* Count the separators at or below the key. The range left always
+      starts at a separator at or below it, or at the first. */
+   register unsigned int base   = 0;
+   register unsigned int length = keys;
+
+   if (width <= sizeof(uint64_t))
+   {
+    /* The separators are followed by the LBAs, so a full word can be
+       read at any of them. */
+    register const uint64_t target = separatorWindow(probe + prefixLength, width);
+
+    while (length > 1)
+    {
+     register const unsigned int half = length / 2;
+
+     base    = (separatorWindow(separators + (base + half) * width, width) <= target) ? (base + half) : base;
+     length -= half;
+    }
+
+    returnedKeyIndex = base + ((separatorWindow(separators + base * width, width) <= target) ? 1 : 0);
+   }
+   else
+   {
+    while (length > 1)
+    {
+     register const unsigned int half = length / 2;
+
+     if (memcmp(separators + (base + half) * width, probe + prefixLength, width) <= 0)
+      base += half;
+
+     length -= half;
+    }
+
+    returnedKeyIndex = base + ((memcmp(separators + base * width, probe + prefixLength, width) <= 0) ? 1 : 0);
+   }
+
+   return true;
+  }
+
+  /*! search for a packed leaf: bisect the restarts, then decode at most
+      one interval. */
+  template <bool isLittle>
+  static inline bool
+  searchPacked(register unsigned int&        returnedKeyIndex,
+               register const uint8_t* const data,
+               register const unsigned int   keys,
+               register const Key            key)
+  {
+   register const struct packedLeaf* const packed = (const struct packedLeaf*) (data + sizeof(struct header));
+   register const uint64_t                 major  = fromFileSystemEndian<isLittle>(&packed->major);
+   register const unsigned int             interval = packed->restartInterval;
+
+   if ((key.type != packed->type) || (key.major != major))
+   {
+    returnedKeyIndex = ((key.type > packed->type) || ((key.type == packed->type) && (key.major > major))) ? keys : 0;
+    return false;
+   }
+
+   /* The last restart at or below the key. */
+   register unsigned int low  = 0;
+   register unsigned int high = (keys + interval - 1) / interval;
+
+   while ((high - low) > 1)
+   {
+    register const unsigned int middle = (low + high) / 2;
+    register uint64_t           minor;
+
+    getVarint(data + restartOffset<isLittle>(data, middle), minor);
+
+    low  = (minor <= key.minor) ? middle : low;
+    high = (minor <= key.minor) ? high : middle;
+   }
+
+   register const uint8_t* source = data + restartOffset<isLittle>(data, low);
+   register unsigned int   index  = low * interval;
+   register unsigned int   end    = index + interval;
+   register uint64_t       minor  = 0;
+
+   if (end > keys)
+    end = keys;
+
+   for(; index < end; index++)
+   {
+    register uint64_t delta;
+    register uint64_t sizeNFlag;
+
+    source  = getVarint(source, delta);
+    source  = getVarint(source, sizeNFlag);
+    source += sizeNFlag >> 1;
+    minor  += delta;
+
+    if (minor >= key.minor)
+    {
+     register const bool found = minor == key.minor;
+
+     returnedKeyIndex = index + (found ? 1 : 0);
+     return found;
+    }
+   }
+
+   returnedKeyIndex = end;
+   return false;
+  }
+
+  template <bool isLittle>
+  static inline bool
+  equalInternalKey(register const struct internalKey* const keyStruct,
+                   register const Key                       key)
+  { 
+   return ((key.type == keyStruct->type) &&
+           (key.major == fromFileSystemEndian<isLittle>(&(keyStruct->major))) &&
+           (key.minor == fromFileSystemEndian<isLittle>(&(keyStruct->minor))));
+  }
+
+  template <bool isLittle>
+  static inline bool
+  equalLeafKey(register const struct leafKey* const keyStruct,
+               register const Key                   key)
+  { 
+   return ((key.type == keyStruct->type) &&
+           (key.major == fromFileSystemEndian<isLittle>(&(keyStruct->major))) &&
+           (key.minor == fromFileSystemEndian<isLittle>(&(keyStruct->minor))));
+  }
+
+
+  template <bool isLittle>
+  static inline bool
+  higherInternalKey(register const struct internalKey* const keyStruct,
+                    register const Key                       key)
+  {
+   register bool higher = key.type  > keyStruct->type;
+
+   if (!higher && (key.type == keyStruct->type))
+   {
+    higher = key.major > fromFileSystemEndian<isLittle>(&(keyStruct->major));
+
+    if (!higher && (key.major == fromFileSystemEndian<isLittle>(&(keyStruct->major))))
+      higher = key.minor > fromFileSystemEndian<isLittle>(&(keyStruct->minor));
+   }
+
+   return higher;
+  }
+
+  template <bool isLittle>
+  static inline bool
+  higherLeafKey(register const struct leafKey* const keyStruct,
+                register const Key                   key)
+  {
+   register bool higher = key.type  > keyStruct->type;
+
+   if (!higher && (key.type == keyStruct->type))
+   {
+    higher = key.major > fromFileSystemEndian<isLittle>(&(keyStruct->major));
+
+    if (!higher && (key.major == fromFileSystemEndian<isLittle>(&(keyStruct->major))))
+      higher = key.minor > fromFileSystemEndian<isLittle>(&(keyStruct->minor));
+   }
+
+   return higher;
+  }
+
+  
+  /*! Find key in the node at data. In a leaf a hit gives the one based
+      index of the key, a miss the number of smaller keys. In an internal
+      node it gives the child to descend into. */
+  static inline bool
+  search(register unsigned int&        returnedKeyIndex,
+         register const uint8_t* const data,
+         register const unsigned int   keys,
+         register const bool           isLeaf,
+         register const bool           isLittle,
+         register const Key            key)
+  {
+   /* Each byte order gets its own copy, without a test per field. */
+   if (isLittle)
+    return searchAs<true>(returnedKeyIndex, data, keys, isLeaf, key);
+
+   return searchAs<false>(returnedKeyIndex, data, keys, isLeaf, key);
+  }
 
+  template <bool isLittle>
   static inline bool
-  higherInternalKey(register const struct internalKey* const keyStruct,
-                    register const Key                       key,
-                    register const bool                      isLittle)
+  searchAs(register unsigned int&        returnedKeyIndex,
+           register const uint8_t* const data,
+           register const unsigned int   keys,
+           register const bool           isLeaf,
+           register const Key            key)
   {
-   register bool higher = key.type  > keyStruct->type;
+   if (keys && ((((const struct header*) data)->version & ~bigEndian) == packedVersion))
+    return searchPacked<isLittle>(returnedKeyIndex, data, keys, key);
 
-   if (!higher && (key.type == keyStruct->type))
-   {
-    higher = key.major > fromFileSystemEndian(&(keyStruct->major), isLittle);
+   if (isTruncated(((const struct header*) data)->version))
+    return searchTruncated(returnedKeyIndex, data, keys, key);
 
-    if (!higher && (key.major == fromFileSystemEndian(&(keyStruct->major), isLittle)))
-      higher = key.minor > fromFileSystemEndian(&(keyStruct->minor), isLittle);
-   }
+   if (!keys || ((((const struct header*) data)->version & ~bigEndian) != indexedVersion))
+    return bisect<isLittle>(returnedKeyIndex, data + keyArrayOffset(isLeaf), keys, isLeaf, key);
 
-   return higher;
-  }
+   register const struct searchIndex* const index =
+    (const struct searchIndex*) (data + searchIndexOffset(keys, isLeaf));
+   register const unsigned int              prefixLength = index->prefixLength;
+   register unsigned int                    less         = 0;
+   register unsigned int                    ties         = 0;
 
-  static inline bool
-  higherLeafKey(register const struct leafKey* const keyStruct,
-                register const Key                   key,
-                register const bool                  isLittle)
-  {
-   register bool higher = key.type  > keyStruct->type;
+   assert(prefixLength <= normalizedKeySize);
 
-   if (!higher && (key.type == keyStruct->type))
+   /* A key between the first and the last shares their prefix. */
+   if (compareKeys(key, keyAt<isLittle>(data, 0, isLeaf)) <= 0)
+    ties = 1;
+   else if (compareKeys(key, keyAt<isLittle>(data, keys - 1, isLeaf)) > 0)
+    less = keys;
+   else
    {
-    higher = key.major > fromFileSystemEndian(&(keyStruct->major), isLittle);
+    register const uint32_t* const fingerprints = (const uint32_t*) (index + 1);
+    uint8_t                        probe[normalizedKeySize + sizeof(uint32_t)];
+
+    normalize(probe, key);
+
+    register const uint32_t        target       = fingerprint(probe, prefixLength);
+
+    if (isLittle == hostIsLittle)
+     KeySearch::count(fingerprints, keys, target, less, ties);
+    else
+    {
+     for(register unsigned int i = 0; i < keys; i++)
+     {
+      register const uint32_t value = fromFileSystemEndian<isLittle>(fingerprints + i);
+
+      less += value < target;
+      ties += value == target;
+     }
+    }
 
-    if (!higher && (key.major == fromFileSystemEndian(&(keyStruct->major), isLittle)))
-      higher = key.minor > fromFileSystemEndian(&(keyStruct->minor), isLittle);
+    /* Keys that only differ past the fingerprint are told apart here. */
+    for(; ties && (compareKeys(keyAt<isLittle>(data, less, isLeaf), key) < 0); ties--)
+     less++;
    }
 
-   return higher;
+   register const bool found = ties && !compareKeys(keyAt<isLittle>(data, less, isLeaf), key);
+
+   returnedKeyIndex = less + (found ? 1 : 0);
+
+   return !isLeaf || found;
   }
 
-  
+  /*! Binary search over the key array of a node without an index. */
+  template <bool isLittle>
   static inline bool
-  search(register unsigned int&        returnedKeyIndex,
+  bisect(register unsigned int&        returnedKeyIndex,
          register const uint8_t* const keyArray,         
          register const unsigned int   keys,
          register const bool           isLeaf,
-         register const bool           isLittle,
          register const Key            key)
   {
    returnedKeyIndex = 0;
@@ -305,13 +2573,13 @@ class BPlusTree
 
     assert(middle > 0);
     
-    if ((isLeaf && equalLeafKey((struct leafKey*)(keyArray + sizeof(struct leafKey) * (middle-1)), key, isLittle)) ||
-        (!isLeaf && equalInternalKey((struct internalKey*)(keyArray + sizeof(struct internalKey) * (middle-1)), key, isLittle)))
+    if ((isLeaf && equalLeafKey<isLittle>((struct leafKey*)(keyArray + sizeof(struct leafKey) * (middle-1)), key)) ||
+        (!isLeaf && equalInternalKey<isLittle>((struct internalKey*)(keyArray + sizeof(struct internalKey) * (middle-1)), key)))
      return true;
 
     
-    if ((isLeaf && higherLeafKey((struct leafKey*)(keyArray + sizeof(struct leafKey) * (middle-1)), key, isLittle)) ||
-        (!isLeaf && higherInternalKey((struct internalKey*)(keyArray + sizeof(struct internalKey) * (middle-1)), key, isLittle)))
+    if ((isLeaf && higherLeafKey<isLittle>((struct leafKey*)(keyArray + sizeof(struct leafKey) * (middle-1)), key)) ||
+        (!isLeaf && higherInternalKey<isLittle>((struct internalKey*)(keyArray + sizeof(struct internalKey) * (middle-1)), key)))
     {
      left = middle + 1;
     }
@@ -323,12 +2591,12 @@ class BPlusTree
  
    if ((isLeaf) &&
        (returnedKeyIndex > 0) &&
-       equalLeafKey((struct leafKey*)(keyArray + sizeof(struct leafKey) * (returnedKeyIndex-1)), key, isLittle))
+       equalLeafKey<isLittle>((struct leafKey*)(keyArray + sizeof(struct leafKey) * (returnedKeyIndex-1)), key))
     return true;
 
    while ((returnedKeyIndex > 0) &&
-          ((isLeaf && !higherLeafKey((struct leafKey*)(keyArray + sizeof(struct leafKey) * (returnedKeyIndex-1)), key, isLittle)) ||
-          (!isLeaf && !higherInternalKey((struct internalKey*)(keyArray + sizeof(struct internalKey) * (returnedKeyIndex-1)), key, isLittle))))
+          ((isLeaf && !higherLeafKey<isLittle>((struct leafKey*)(keyArray + sizeof(struct leafKey) * (returnedKeyIndex-1)), key)) ||
+          (!isLeaf && !higherInternalKey<isLittle>((struct internalKey*)(keyArray + sizeof(struct internalKey) * (returnedKeyIndex-1)), key))))
    {
     returnedKeyIndex--;
    }
@@ -336,169 +2604,530 @@ class BPlusTree
    return !isLeaf;
   }
   
-  inline bool
-  lookup(register Serializable&            destination,
-         register uint_fast16_t&           size,
-         register enum BPlusTreeError&     error,
-         register BlockCacheEntry*         cacheEntry,
-         register const Key                key,
-         register class Transaction* const transaction) const
+  inline void
+  addToStatistics(register struct TreeStatistics&   statistics,
+                  register const struct LBA         theLBA,
+                  register const unsigned int       depth,
+                  register class Transaction* const transaction) const
   {
+   register BlockCacheEntry*                 cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, theLBA, verifyNode))
+    assert(0);
+
    register uint8_t* data = cacheEntry->getDataPointer();
-   register bool found = false;
-   
+
    assert(data);
 
-   if ((((struct header*)data)->version & ~0x80) != version)
+   register const bool         isLittle = (((struct header*)data)->version & 0x80) != bigEndian;
+   register const unsigned int keys     = nodeKeys(data, isLittle);
+
+   if (depth > statistics.height)
+    statistics.height = depth;
+
+   if (fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) & BPlusTree::isLeaf)
    {
-    /* unsupported version. */
-    assert(0);
+    register struct leafReader reader;
+    register struct leafEntry  entry;
+    register struct leafSize   size;
+    register unsigned int      live = 0;
+
+    startLeafSize(size);
+    openLeaf(reader, data, isLittle);
+
+    for(register unsigned int i = 0; i < keys; i++)
+    {
+     readLeaf(reader, entry);
+     addToLeafSize(size, entry.key, entry.size);
+     live += entry.size;
+    }
+
+    statistics.keys      += keys;
+    statistics.leaves    += 1;
+    statistics.leafBytes += leafBytes(size);
+
+    if (!reader.isPacked)
+     statistics.leafFragmented += leafDataSpace(data, isLittle) - live;
+
+    cacheEntry->unlock(data, cacheEntry, transaction);
+    return;
    }
 
-   register const bool    isLittle =(((struct header*)data)->version & 0x80) != bigEndian;
-   register const uint8_t keys     =((struct header*)data)->keys;
-   register const bool    isLeaf   =
-     (fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) &
-      BPlusTree::isLeaf) != 0; 
+   register struct internalSize size;
+   struct LBA                   children[maxInternalChildren];
+   register const Key           none = {.type = 0, .major = 0, .minor = 0};
 
-   register unsigned int  keyIndex;
-   found = search(keyIndex,
-                  data + sizeof(struct header) + (isLeaf ? 0 :  sizeof(struct firstLocation)),
-                  keys, isLeaf, isLittle, key);
+   assert(keys < maxInternalChildren);
 
-   register uint16_t      dataSize    = 0;
-   register LBA           indirectLBA;
-   register bool          indirect    = false;
+   startInternalSize(size);
 
-   if (!found)
+   for(register unsigned int child = 0; child <= keys; child++)
    {
-    /* this should not be possible! */
-    while(!isLeaf)
-     assert(0);
+    addToInternalSize(size, child ? separatorAt(data, child, isLittle) : none);
+    children[child] = childAt(data, child, isLittle);
+   }
 
-    error = keyNotFound;
+   statistics.internalNodes += 1;
+   statistics.internalBytes += internalBytes(size);
+   statistics.messages      += messageCount(data, isLittle);
+   statistics.messageBytes  += messageBytes(data, isLittle);
+
+   /* Not held while the children are visited. */
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   for(register unsigned int child = 0; child <= keys; child++)
+    addToStatistics(statistics, children[child], depth + 1, transaction);
+  }
+
+  /*! Where to split a leaf that no longer fits with the new pair at
+      keyIndex, if that is the last, or the first, of its type and major
+      in the leaf. Such a pair is likely the next of keys arriving in
+      order. The split goes between it and the pairs of other keys next
+      to it or, if there are none, between it and the rest. The full run
+      of pairs it joins then stays in one leaf rather than leaving two
+      half empty leaves behind. Zero to split in the middle. */
+  static inline unsigned int
+  orderedSplit(register const uint8_t* const    data,
+               register const bool              isLittle,
+               register const unsigned int      keys,
+               register const unsigned int      keyIndex,
+               register const struct leafEntry& pair)
+  {
+   register struct leafReader reader;
+   register struct leafEntry  neighbour;
+   register bool              isLast  = (keyIndex == keys);
+   register bool              isFirst = (keyIndex == 0);
+
+   if (!isLast)
+   {
+    openLeaf(reader, data, isLittle);
+    seekLeaf(reader, keyIndex);
+    readLeaf(reader, neighbour);
+
+    isLast = (neighbour.key.type != pair.key.type) || (neighbour.key.major != pair.key.major);
    }
-   else 
+
+   if (!isFirst)
    {
-    if (isLeaf)
-    {
-     assert(keyIndex > 0);
-     assert(keyIndex <= keys);
-     register const struct leafKey* const key = ((const struct leafKey*) (data + sizeof(struct header))) + keyIndex - 1;
+    openLeaf(reader, data, isLittle);
+    seekLeaf(reader, keyIndex - 1);
+    readLeaf(reader, neighbour);
 
-     dataSize = fromFileSystemEndian(&(key->size), isLittle);
-     register const uint16_t         offset = fromFileSystemEndian(&(key->offset), isLittle);
+    isFirst = (neighbour.key.type != pair.key.type) || (neighbour.key.major != pair.key.major);
+   }
 
-     if (key->isLocation)
-     {
-      assert(dataSize == sizeof(struct leafLocation));
+   register unsigned int splitAt;
 
-      assert(offset > (sizeof(struct header) + sizeof(struct leafKey)));
-      assert(offset < (sectorSize - sizeof(struct leafLocation)));  
+   if (isLast)
+    splitAt = (keyIndex < keys) ? (keyIndex + 1) : keyIndex;
+   else if (isFirst)
+    splitAt = keyIndex ? keyIndex : 1;
+   else
+    return 0;
 
-      register const struct leafLocation* const location = ((const struct leafLocation*) (data + offset));
-      
-      dataSize = fromFileSystemEndian(&(location->size), isLittle);
+   /* Both parts must fit. */
+   register struct leafEdit    edit;
+   register struct leafEntry   entry;
+   register struct leafSize    parts[2];
+   register unsigned int       index = 0;
 
-      assert(dataSize <= sectorSize);
+   startLeafSize(parts[0]);
+   startLeafSize(parts[1]);
+   startEdit(edit, data, isLittle, keyIndex, false, &pair);
 
-      indirectLBA.theLBA = fromFileSystemEndian(&(location->theLBA), isLittle);
-      indirect = true;
-     }
+   for(; nextEdited(edit, entry); index++)
+    addToLeafSize(parts[(index < splitAt) ? 0 : 1], entry.key, entry.size);
 
-     size  = dataSize;
+   return (leafFits(parts[0]) && leafFits(parts[1])) ? splitAt : 0;
+  }
 
-     if (destination.size() < dataSize)
-     {
-      error = dataTooBig;
-      found = false;
-     }
-     else if (!destination.isSizeAcceptable(dataSize))
-     {
-      error = sizeIsNotAcceptable;
-      found = false;
-     }
-     else
-     {
-      if (!key->isLocation)
-      {
-       assert(offset <= sectorSize);
-       assert((offset + dataSize) <= sectorSize);
+  /*! Find the pair of key, following hint as lookup does. On success
+      its leaf is left pinned at data, and entry holds the pair. */
+  inline bool
+  findPair(register BlockCacheEntry* &       cacheEntry,
+           register uint8_t* &               data,
+           register struct leafEntry&        entry,
+           register bool&                    isLittle,
+           register enum BPlusTreeError&     error,
+           register const Key                key,
+           register class Transaction* const transaction,
+           register struct LeafHint* const   hint) const
+  {
+   register enum BlockCache::BlockCacheError cacheError;
+   register const bool                       hinted = hint && isHinted(*hint, key);
+   register struct LeafHint*                 record = hinted ? 0 : hint;
+   register unsigned int                     level  = hinted ? (hint->depth - 1) : 0;
+   register struct LBA                       theLBA = hinted ? hint->path[level] : rootLBA;
+   register unsigned int                     keys;
+   register unsigned int                     keyIndex;
+   register bool                             found;
+
+   if (record)
+    startHint(*record);
+
+   /* A key in the range of the last leaf goes straight there. */
+   for(;;)
+   {
+    if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, theLBA, verifyNode))
+    {
+     assert(cacheError == BlockCache::checksumError);
 
-       if (!destination.fromFileSystem(data+offset, dataSize, isLittle))
-        assert(0);
-      }
-      
-      error = noError;
-     }
+     if (hint)
+      hint->invalidate();
+
+     error = checksumError;
+     return false;
     }
-    else
+
+    data = cacheEntry->getDataPointer();
+
+    assert(data);
+
+    if (!isSupportedVersion(((struct header*)data)->version))
     {
-     /* Extract a location to decend into. */
-     assert(keyIndex >= 0);
-     assert(keyIndex <= keys);
+     /* unsupported version. */
+     assert(0);
+    }
 
-     register uint16_t         offset;
+    isLittle = (((struct header*)data)->version & 0x80) != bigEndian;
 
-     if (keyIndex == 0)
-     {
-      register const struct firstLocation* const location = ((const struct firstLocation*) (data  + sizeof(struct header)));
-      offset = fromFileSystemEndian(&(location->offset), isLittle);
-     }
-     else
+    /* Once per node, not per field. */
+    register const enum nodeStep step = isLittle ?
+                                        stepNode<true>(entry, theLBA, keys, keyIndex, found, data, key) :
+                                        stepNode<false>(entry, theLBA, keys, keyIndex, found, data, key);
+
+    if (step == stepLeaf)
+     break;
+
+    /* The path of a buffered tree is not kept as a hint, the leaf is not
+       all there is. */
+    if (isBuffered(data))
+    {
+     record = 0;
+
+     if (hint)
+      hint->invalidate();
+    }
+
+    if (step == stepMessage)
+    {
+     if (entry.payload)
      {
-      register const struct internalKey* const key = ((const struct internalKey*) (data  + sizeof(struct header) + sizeof(struct firstLocation))) + keyIndex - 1;
-      offset = fromFileSystemEndian(&(key->offset), isLittle);
+      error = noError;
+      return true;
      }
 
-     assert(offset > (sizeof(struct header) + sizeof(struct firstLocation)));
-     assert(offset <= (sectorSize - sizeof(struct internalLocation)));
+     cacheEntry->unlock(data, cacheEntry, transaction);
 
-     register const struct internalLocation* const location = (const struct internalLocation*) (data  + offset);
-  
-     indirectLBA.theLBA = fromFileSystemEndian(&(location->theLBA), isLittle);
-     indirect = true;
+     error = keyNotFound;
+     return false;
     }
+
+    if (record)
+     recordStep(*record, level, data, keyIndex, keys, theLBA, isLittle);
+
+    cacheEntry->unlock(data, cacheEntry, transaction);
+    level++;
    }
-   
-   cacheEntry->unlock(data, cacheEntry, transaction);
 
-   if (indirect)
-   { 
-    /* Retrieve data from disk. */
-    register enum BlockCache::BlockCacheError cacheError;
- 
-    if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, indirectLBA))
-    {
+   if (record)
+   {
+    record->depth = level + 1;
+    record->valid = true;
+   }
+
+   if (!found)
+   {
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    error = keyNotFound;
+    return false;
+   }
+
+   assert(keyIndex > 0);
+   assert(keyIndex <= keys);
+
+   if (isLittle)
+    leafEntryAt<true>(entry, data, keyIndex - 1);
+   else
+    leafEntryAt<false>(entry, data, keyIndex - 1);
+
+   assert(!entry.isLocation || (entry.size >= sizeof(struct leafLocation)));
+
+   error = noError;
+   return true;
+  }
+
+  /*! Keys [first, end) of a multiLookup that visit the node at theLBA. */
+  struct probe
+  {
+   struct LBA   theLBA;
+   unsigned int first;
+   unsigned int end;
+  };
+
+  /*! Read the nodes of count probes into the cache, as few requests as
+      BlockCache takes. */
+  inline void
+  prefetchProbes(register const struct probe* const probes,
+                 register const unsigned int        count) const
+  {
+   register struct LBA                       theLBAs[BlockCache::maxPrefetch];
+   register enum BlockCache::BlockCacheError cacheError;
+
+   /* Only worth it if there is more than one to wait for. */
+   if (count < 2)
+    return;
+
+   for(register unsigned int done = 0; done < count; )
+   {
+    register unsigned int batched = 0;
+
+    for(; (done < count) && (batched < BlockCache::maxPrefetch); done++)
+     theLBAs[batched++] = probes[done].theLBA;
+
+    if (!BlockCache::getInstance().prefetch(cacheError, rootDevice, theLBAs, batched, verifyNode))
      assert(0);
-    }
+   }
+  }
 
-    assert(cacheEntry);
+  /*! The checks lookup makes before handing destination a value of size
+      bytes. */
+  static inline bool
+  accepts(register const Serializable&   destination,
+          register const uint_fast32_t   size,
+          register enum BPlusTreeError&  error)
+  {
+   if (destination.size() < size)
+   {
+    error = dataTooBig;
+    return false;
    }
 
-   if (isLeaf)
+   if (!destination.isSizeAcceptable(size))
+   {
+    error = sizeIsNotAcceptable;
+    return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! Hand the value of entry, found by a multiLookup in a node still
+      pinned, to destination. */
+  inline void
+  deliver(register Serializable&            destination,
+          register uint_fast32_t&           size,
+          register enum BPlusTreeError&     error,
+          register const struct leafEntry&  entry,
+          register class Transaction* const transaction,
+          register const bool               isLittle) const
+  {
+   size = valueSize(entry, isLittle);
+
+   if (!accepts(destination, size, error))
+    return;
+
+   if (!entry.isLocation)
+   {
+    if (!destination.fromFileSystem(entry.payload, size, isLittle))
+     assert(0);
+
+    return;
+   }
+
+   ValueView view;
+
+   register struct valueExtents extents;
+
+   readExtents(extents, entry, isLittle);
+   viewExtent(view, extents, rootDevice, transaction, isLittle);
+
+   if (!fromView(destination, view))
+    assert(0);
+  }
+
+  /*! The size of the value of entry, wherever it is stored. */
+  static inline uint_fast32_t
+  valueSize(register const struct leafEntry& entry,
+            register const bool              isLittle)
+  {
+   if (!entry.isLocation)
+    return entry.size;
+
+   return fromFileSystemEndian(&((const struct leafLocation*) entry.payload)->size, isLittle);
+  }
+
+  /*! Copy length bytes from offset on of the value extents tells of to
+      destination, or, if source is given instead, from source into the
+      value. Only the sectors holding those bytes are touched, the ones
+      not cached read with a single vectored request. A write is only
+      done if every one of them is private to transaction and false is
+      returned if not. */
+  inline bool
+  copyRun(register uint8_t* const             destination,
+          register const uint8_t* const       source,
+          register const struct valueExtents& extents,
+          register const uint_fast32_t        offset,
+          register const uint_fast32_t        length,
+          register class Transaction* const   transaction) const
+  {
+   register const unsigned int     first   = offset / sectorSize;
+   register const unsigned int     sectors = ((offset + length - 1) / sectorSize) - first + 1;
+   register class BlockCacheEntry* cacheEntries[ValueView::maxSectors];
+   register uint8_t*               pages[ValueView::maxSectors];
+   struct LBA                      theLBAs[ValueView::maxSectors];
+   register bool                   isPrivate = true;
+
+   assert(length);
+   assert((destination != 0) != (source != 0));
+
+   extentLBAs(theLBAs, extents, first, sectors);
+   pinRun(cacheEntries, pages, theLBAs, sectors, rootDevice, transaction);
+
+   for(register unsigned int i = 0; source && (i < sectors); i++)
+    isPrivate = isPrivate && cacheEntries[i]->isPrivate(transaction);
+
+   if (!source || isPrivate)
+   {
+    for(register unsigned int i = 0; i < sectors; i++)
+    {
+     register const unsigned int begin = i ? 0 : (offset % sectorSize);
+     register const unsigned int end   = ((i + 1) < sectors) ? sectorSize : (((offset + length - 1) % sectorSize) + 1);
+     register const unsigned int done  = i ? ((sectorSize - (offset % sectorSize)) + (i - 1) * sectorSize) : 0;
+
+     if (source)
+      memcpy(pages[i] + begin, source + done, end - begin);
+     else
+      memcpy(destination + done, pages[i] + begin, end - begin);
+    }
+   }
+
+   for(register unsigned int i = 0; i < sectors; i++)
+    cacheEntries[i]->unlock(pages[i], cacheEntries[i], transaction);
+
+   return !source || isPrivate;
+  }
+
+  /*! writePart for a value stored out of line that is shared with an
+      older tree. Only the sectors holding the bytes written are copied,
+      to new LBAs, and patched. The old ones are released and the pair of
+      key in a copy of the tree pointed at the new ones, in an extent of
+      their own. Should that make more than maxExtents, the whole value
+      is copied to a single run instead. */
+  inline bool
+  copySectors(register const BPlusTree* &         newTree,
+              register enum BPlusTreeError&       error,
+              register const uint8_t* const       source,
+              register const uint_fast32_t        offset,
+              register const uint_fast32_t        length,
+              register const struct valueExtents& extents,
+              register const Key                  key,
+              register class Transaction* const   transaction,
+              register struct LeafHint* const     hint,
+              register const bool                 isLittle) const
+  {
+   register const unsigned int               sectors = extentSectors(extents.size);
+   register unsigned int                     first   = offset / sectorSize;
+   register unsigned int                     count   = ((offset + length - 1) / sectorSize) - first + 1;
+   register enum FileSystem::FileSystemError fileSystemError;
+   register struct LBA                       newLBA;
+   struct LBA                                theLBAs[ValueView::maxSectors];
+   class BlockCacheEntry*                    cacheEntries[ValueView::maxSectors];
+   uint8_t*                                  pages[ValueView::maxSectors];
+   struct valueExtents                       newExtents;
+   uint8_t                                   payload[sizeof(struct leafLocation) + maxExtents * sizeof(struct leafExtent)];
+
+   assert(length);
+
+   extentLBAs(theLBAs, extents, 0, sectors);
+
+   /* The new sectors are taken as adjacent to nothing. */
    {
-    if (indirect)
+    struct LBA trial[ValueView::maxSectors];
+
+    memcpy(trial, theLBAs, sectors * sizeof(*trial));
+
+    for(register unsigned int i = 0; i < count; i++)
+     trial[first + i].theLBA = UINT64_MAX - sectors + i;
+
+    if (!makeExtents(newExtents, trial, sectors, extents.size))
     {
-     if (!destination.fromFileSystem(cacheEntry->getDataPointer(), dataSize, isLittle))
-      assert(0);     
+     first = 0;
+     count = sectors;
     }
+   }
+
+   if (!transaction->getFileSystem()->getAvailableLBAs(newLBA, count, fileSystemError))
+    assert(0);
+
+   assert(fileSystemError == FileSystem::noError);
+
+   pinRun(cacheEntries, pages, theLBAs + first, count, rootDevice, transaction);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    register class BlockCacheEntry*           newEntry;
+    register enum BlockCache::BlockCacheError cacheError;
+
+    if (!BlockCache::getInstance().allocate(newEntry, cacheError, transaction))
+     assert(0);
 
-    return found; 
+    register uint8_t*            newPage = newEntry->getDataPointer();
+    register const uint_fast32_t start   = (first + i) * sectorSize;
+    register const uint_fast32_t from    = (offset > start) ? offset : start;
+    register const uint_fast32_t to      = ((offset + length) < (start + sectorSize)) ? (offset + length) :
+                                           (start + sectorSize);
+
+    assert(newPage);
+
+    memcpy(newPage, pages[i], sectorSize);
+    cacheEntries[i]->unlock(pages[i], cacheEntries[i], transaction);
+
+    /* The written bytes that fall in this sector. */
+    if (from < to)
+     memcpy(newPage + (from - start), source + (from - offset), to - from);
+
+    transaction->releaseLBA(theLBAs[first + i]);
+
+    theLBAs[first + i].theLBA = newLBA.theLBA + i;
+
+    if (!newEntry->setLBA(rootDevice, theLBAs[first + i]))
+     assert(0);
+
+    newEntry->unlock(newPage, newEntry, transaction);
    }
 
-   /* Now descend. */
-   return lookup(destination, size, error, cacheEntry, key, transaction);
+   if (!makeExtents(newExtents, theLBAs, sectors, extents.size))
+    assert(0);
+
+   return relocate(newTree, error, key, payload, writeExtents(payload, newExtents, isLittle), transaction, hint);
   }
-  
+
+  /*! Point the pair of key, in a copy of the tree, at the size bytes of
+      leafLocation and extents at location. */
+  bool
+  relocate(register const BPlusTree* &       newTree,
+           register enum BPlusTreeError&     error,
+           register const Key                key,
+           register const uint8_t* const     location,
+           register const unsigned int       size,
+           register class Transaction* const transaction,
+           register struct LeafHint* const   hint) const;
+
   inline bool
   insertOrRemove(register struct splitAndMergeInfo& siblingsInfo,
                  register enum BPlusTreeError&      error,
                  register BlockCacheEntry*          cacheEntry,
+                 register const struct LBA          nodeLBA,
                  register const Serializable&       source,
                  register const Key                 key,
                  register class Transaction* const  transaction,
-                 register const bool                remove) const
+                 register const bool                remove,
+                 register struct LeafHint* const    hint,
+                 register const unsigned int        level) const
   {
    uint8_t* data = cacheEntry->getDataPointer();
 
@@ -506,27 +3135,33 @@ class BPlusTree
 
    assert(data);
 
-   if ((((struct header*)data)->version & ~0x80) != version)
+   if (!isSupportedVersion(((struct header*)data)->version))
    {
     /* unsupported version. */
     assert(0);
    }
 
-   register const bool    isLittle =(((struct header*)data)->version & 0x80) != bigEndian;
-   register const uint8_t keys = ((struct header*)data)->keys;
-   register const bool    isLeaf   =
+   register const bool         isLittle =(((struct header*)data)->version & 0x80) != bigEndian;
+   register const unsigned int keys     = nodeKeys(data, isLittle);
+   register const bool         isLeaf   =
     (fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) &
-     BPlusTree::isLeaf) != 0; 
+     BPlusTree::isLeaf) != 0;
 
    register unsigned int keyIndex;
-   register bool found = search(keyIndex,
-                                data + sizeof(struct header) + (isLeaf ? 0 :  sizeof(struct firstLocation)),
-                                keys, isLeaf, isLittle, key);
+   register bool found = search(keyIndex, data, keys, isLeaf, isLittle, key);
 
    register bool success = false;
-   
+
    if (isLeaf)
    {
+    /* A node this transaction wrote itself is seen by nobody else, so it
+       is changed in its own sector, if need be rebuilt from a scratch
+       copy. reuse is set until the sector is taken by the first
+       replacement, held until cacheEntry is unlocked with it. */
+    uint8_t                   scratch[sectorSize];
+    register BlockCacheEntry* reuse = 0;
+    register bool             held  = true;
+
     if (remove && !found)
     {
      /* Cannot remove since the key is not found. */ 
@@ -535,598 +3170,689 @@ class BPlusTree
     else
     {
      /* Add, replace or remove key or value. */
+     assert(keyIndex <= keys);
 
-     register class LBA          dataLBA;
+     uint8_t                   value[sectorSize];
+     register struct leafEntry pair;
 
-     assert(keyIndex <= keys);
+     pair.key        = key;
+     pair.payload    = value;
+     pair.size       = 0;
+     pair.isLocation = false;
+
+     if (!remove)
+     {
+      if (source.size() > (sectorSize - sizeof(struct header) - sizeof(struct leafKey)))
+      {
+       /* Need to store the data in separate sectors. */
+       writeExtent(*(struct leafLocation*) value, source, rootDevice, transaction, isLittle);
+
+       pair.size       = sizeof(struct leafLocation);
+       pair.isLocation = true;
+      }
+      else
+      {
+       if (!source.toFileSystem(value, isLittle))
+        assert(0);
 
-     register const uint16_t     dataSpace =
-      fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) & (sectorSize-1);
-     register const unsigned int usedSpace = sizeof(struct header) +
-                                             keys * sizeof(struct leafKey) +
-                                             dataSpace;
+       pair.size = source.size();
+      }
+     }
 
-     register uint16_t           existingSize = 0;
-     register uint16_t           targetSize = sectorSize;
+     /* Size the new contents first. If they do not fit they are split in
+        two around the middle. In the worst case a very large new value
+        ends up in a sector of its own, making three. */
+     register struct leafEdit    edit;
+     register struct leafEntry   entry;
+     register struct leafSize    total;
+     register unsigned int       live      = 0;
+     register const unsigned int position  = found ? keyIndex - 1 : keyIndex;
+     register const bool         isPrivate = cacheEntry->isPrivate(transaction);
 
-     register bool               indirect = false;
+     startLeafSize(total);
+     startEdit(edit, data, isLittle, position, found, remove ? 0 : &pair);
 
-     assert(usedSpace < sectorSize);
-     
-     if (found)
+     while (nextEdited(edit, entry))
      {
-      assert(keyIndex > 0);
-      register const struct leafKey* const key = ((const struct leafKey*) (data + sizeof(struct header))) + keyIndex - 1;
-      existingSize = fromFileSystemEndian(&(key->size), isLittle) + sizeof(struct leafKey);
+      addToLeafSize(total, entry.key, entry.size);
+      live += entry.size;
      }
-     
-     register class BlockCacheEntry*           newCacheEntry;
-     register enum BlockCache::BlockCacheError cacheError;
 
-     if (!remove)
+     /* A plain leaf that stays plain is changed in place if it can be,
+        otherwise the new contents are written out anew. */
+     if (editLeaf(siblingsInfo, data, position, found, remove ? 0 : &pair, total, live,
+                  isPrivate ? cacheEntry : 0, nodeLBA, transaction, isLittle))
+      held = !isPrivate;
+     else
      {
-      if (source.size() > (sectorSize - sizeof(struct header) - sizeof(struct leafKey)))
+      reuse = takeOver(data, scratch, cacheEntry, transaction);
+
+      register const bool         split        = !leafFits(total);
+      register const unsigned int splitAt      = (split && !remove && !found) ?
+                                                 orderedSplit(data, isLittle, keys, keyIndex, pair) : 0;
+      register const unsigned int targetSize   = split ? (leafBytes(total) / 2) : sectorSize;
+      register unsigned int       siblingIndex = 0;
+      register unsigned int       index        = 0;
+      register Key                previousKey;
+      leafBuilder                 leaf;
+
+      startEdit(edit, data, isLittle, position, found, remove ? 0 : &pair);
+
+      for(; nextEdited(edit, entry); index++)
       {
-       /* Need to store the data in a separate sector. */
-       if (!BlockCache::getInstance().allocate(newCacheEntry, cacheError, transaction))
+       if (leaf.count() && (splitAt ? (index == splitAt) : (leaf.bytes() >= targetSize)))
+        writeLeaf(siblingsInfo, siblingIndex, previousKey, leaf, reuse, nodeLBA, transaction, isLittle);
+
+       if (!leaf.add(entry))
        {
-        assert(0);
+        writeLeaf(siblingsInfo, siblingIndex, previousKey, leaf, reuse, nodeLBA, transaction, isLittle);
+
+        if (!leaf.add(entry))
+         assert(0);
        }
+      }
+
+      /* An empty leaf is dropped. */
+      if (leaf.count())
+       writeLeaf(siblingsInfo, siblingIndex, previousKey, leaf, reuse, nodeLBA, transaction, isLittle);
+     }
+
+     error = noError;
+     success = true;
+    }
 
-       assert(cacheError == BlockCache::noError);
-   
-       register uint8_t* newNodeData = newCacheEntry->getDataPointer();
+    /* A node changed or rebuilt in place was unlocked as its first
+       replacement. */
+    if (held && ((data != scratch) || reuse))
+     cacheEntry->unlock(data, cacheEntry, transaction);
 
-       assert(newNodeData);
+    if (hint)
+    {
+     hint->depth = level + 1;
+     hint->valid = success && isUnchanged(siblingsInfo, nodeLBA);
+    }
 
-       memset(newNodeData, 0, sectorSize);
-       
-       assert(source.size() >= 0);
-       assert(source.size() < sectorSize);
+    return success;
+   }
 
-       if(!source.toFileSystem(newNodeData, isLittle))
-        assert(0);
+   /* Need to descend. */
+   register const LBA indirectLBA = childAt(data, keyIndex, isLittle);
 
-       register enum FileSystem::FileSystemError fileSystemError;
+   if (hint)
+    recordStep(*hint, level, data, keyIndex, keys, indirectLBA, isLittle);
 
-       if (!transaction->getFileSystem()->getAvailableLBA(dataLBA, fileSystemError))
-        assert(0); 
+   /* Retrieve data from disk. */
+   register class BlockCacheEntry*           newCacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+ 
+   if (!BlockCache::getInstance().readLookup(newCacheEntry, cacheError, transaction, rootDevice, indirectLBA, verifyNode))
+   {
+    assert(0);
+   }
 
-       assert(fileSystemError == FileSystem::noError);
+   assert(newCacheEntry);
+   assert(cacheError == BlockCache::noError);
 
-       if (!newCacheEntry->setLBA(rootDevice, dataLBA))
-       {
-        assert(0);
-       }
+   register struct splitAndMergeInfo childrenInfo;
 
-       newCacheEntry->unlock(newNodeData, newCacheEntry, transaction);
+   success = insertOrRemove(childrenInfo, error, newCacheEntry, indirectLBA, source, key, transaction, remove,
+                            hint, level + 1);
 
-       indirect = true;
-      }
+   replaceChild(siblingsInfo, cacheEntry, nodeLBA, keyIndex, childrenInfo, transaction);
 
-      if ((usedSpace + sizeof(struct leafKey) + 
-           (indirect ? sizeof(struct leafLocation) : source.size()) - existingSize) >= sectorSize)
-      {
-       /* Need to split node. In the worst case scenario we could end
-        * up with three new sectors if the newly added value is very
-        * large. */
-
-       /* This is a little approxiate as we only consider the payload
-        * size. Realistically, that is what make sense to use
-        * though. */
-       targetSize = (usedSpace + sizeof(struct leafKey) + 
-                     (indirect ? sizeof(struct leafLocation) : source.size()) -
-                     existingSize) / 2;
-      }
-     }
+   return success;
+  }
 
-     register const struct leafKey* oldKeys = ((const struct leafKey*) (data + sizeof(struct header)));
- 
-     register unsigned int siblingIndex = 0;
-     
-     register unsigned int index = 0;
+  /*! Change the plain leaf at data as insertOrRemove would rebuild it,
+      with pair put in at position, replacing the old pair if replace is
+      set, or the pair at position removed if pair is null: the key
+      structs behind position are moved and a new value goes in the gap
+      below the others, or over the old one if it is no longer. total
+      and live give the size of the new contents and the bytes of their
+      values. The change is made in the sector of reuse, the private
+      entry of the leaf, if given, in a new sector otherwise.
+
+      Returns false, changing nothing, if the leaf is not plain or would
+      not stay plain, if the gap is too small or if the leaf would hold
+      more than maxFragmented unused bytes, so that it is written anew. */
+  inline bool
+  editLeaf(register struct splitAndMergeInfo& siblingsInfo,
+           register const uint8_t* const      data,
+           register const unsigned int        position,
+           register const bool                replace,
+           register const struct leafEntry*   pair,
+           register const struct leafSize&    total,
+           register const unsigned int        live,
+           register BlockCacheEntry*          reuse,
+           register const struct LBA          nodeLBA,
+           register class Transaction* const  transaction,
+           register const bool                isLittle) const
+  {
+   register const struct header* const header = (const struct header*) data;
 
-     register bool         dataToBeProcessed = true;
-        
-     do
-     {
-      assert(siblingIndex < 3);       
+   if ((((header->version & ~bigEndian) != version) && ((header->version & ~bigEndian) != indexedVersion)) ||
+       !total.keys || (total.keys > UINT8_MAX) || isPackable(total))
+    return false;
 
-      /* Allocate new cache entry and copy data as we traverse the key array. */ 
-      if (!BlockCache::getInstance().allocate(newCacheEntry, cacheError, transaction))
-      {
-       assert(0);
-      }
+   register const unsigned int          keys      = header->keys;
+   register const struct leafKey* const keyStruct = ((const struct leafKey*) (header + 1)) + position;
+   register const unsigned int          dataSpace = leafDataSpace(data, isLittle);
+   register const bool                  overOld   = replace && pair &&
+                                                    (pair->size <= fromFileSystemEndian(&keyStruct->size, isLittle));
+   register const unsigned int          newSpace  = dataSpace + ((pair && !overOld) ? pair->size : 0);
 
-      assert(cacheError == BlockCache::noError);
-   
-      register uint8_t*        newNodeData = newCacheEntry->getDataPointer();
+   assert((position + (replace ? 1 : 0)) <= keys);
+   assert(newSpace >= live);
 
-      assert(newNodeData);
+   if (((sizeof(struct header) + total.keys * sizeof(struct leafKey)) > (sectorSize - newSpace)) ||
+       ((newSpace - live) > maxFragmented))
+    return false;
 
-      register struct leafKey* newKeys = ((struct leafKey*) (newNodeData + sizeof(struct header)));
+   register const uint16_t  offset = overOld ? fromFileSystemEndian(&keyStruct->offset, isLittle) :
+                                               (sectorSize - newSpace);
+   register BlockCacheEntry* newCacheEntry;
+   register bool             reused;
+   register unsigned int     siblingIndex = 0;
 
-      memset(newNodeData, 0, sectorSize);
+   register uint8_t* const newNodeData = startSibling(newCacheEntry, reused, reuse, transaction);
 
-      register uint16_t newSize    = 0;
-      register uint16_t actualSize = sizeof(struct header);
+   if (newNodeData != data)
+    memcpy(newNodeData, data, sectorSize);
 
-      register uint8_t newNbrOfKeys = 0;
+   register struct header* const  newHeader = (struct header*) newNodeData;
+   register struct leafKey* const newKey    = ((struct leafKey*) (newHeader + 1)) + position;
 
-      if (keys == 0)
-      {
-       /* Bootstrap an empty node. */
-       newNbrOfKeys = 1;
+   if (!replace)
+    memmove(newKey + 1, newKey, (keys - position) * sizeof(struct leafKey));
+   else if (!pair)
+    memmove(newKey, newKey + 1, (keys - position - 1) * sizeof(struct leafKey));
 
-       toFileSystemEndian(&newKeys->major, key.major, isLittle);
-       toFileSystemEndian(&newKeys->minor, key.minor, isLittle);
-       newKeys->type = key.type;
-       newKeys->isLocation = indirect;
+   if (pair)
+   {
+    toFileSystemEndian(&newKey->major, pair->key.major, isLittle);
+    toFileSystemEndian(&newKey->minor, pair->key.minor, isLittle);
+    toFileSystemEndian(&newKey->offset, offset, isLittle);
+    toFileSystemEndian(&newKey->size, pair->size, isLittle);
+    newKey->type       = pair->key.type;
+    newKey->isLocation = pair->isLocation;
+
+    memcpy(newNodeData + offset, pair->payload, pair->size);
+   }
 
-       siblingsInfo.children[siblingIndex].key = key;
+   /* The search index, if any, is built again when the leaf is sealed. */
+   newHeader->version = version | (isLittle ? 0 : bigEndian);
+   newHeader->keys    = total.keys;
+   toFileSystemEndian(&newHeader->spaceUsedNFlags, newSpace | BPlusTree::isLeaf, isLittle);
 
-       assert(!indirect && source.size() >= 0);
-       assert(!indirect && source.size() < sectorSize);
+   siblingsInfo.children[0].key  = keyAt(newNodeData, 0, true, isLittle);
+   siblingsInfo.children[0].keys = total.keys;
+   siblingsInfo.children[0].leaf = true;
 
-       toFileSystemEndian(&newKeys->size, (indirect ? sizeof(struct leafLocation) : source.size()),
-                          isLittle);
+   finishSibling(siblingsInfo, siblingIndex, newCacheEntry, newNodeData, reused, nodeLBA, transaction, isLittle);
 
-       newSize += (indirect ? sizeof(struct leafLocation) : source.size());
+   return true;
+  }
 
-       register const uint16_t offset = sectorSize - newSize;
+  /*! Give what the internal node at nodeLBA comes out as when its child
+      keyIndex is replaced by childrenInfo, and unlock it. */
+  inline void
+  replaceChild(register struct splitAndMergeInfo&       siblingsInfo,
+               register BlockCacheEntry*                cacheEntry,
+               register const struct LBA                nodeLBA,
+               register const unsigned int              keyIndex,
+               register const struct splitAndMergeInfo& childrenInfo,
+               register class Transaction* const        transaction) const
+  {
+   uint8_t* data = cacheEntry->getDataPointer();
 
-       assert(offset < sectorSize);
-      
-       toFileSystemEndian(&newKeys->offset, offset, isLittle);
+   siblingsInfo.init();
 
-       if (!indirect)
-       {
-        if(!source.toFileSystem(newNodeData + offset, isLittle))
-         assert(0);
-       }
-       else
-       {
-        /* Construct leafLocation. */
-        register struct leafLocation* const location = (struct leafLocation *) (newNodeData + offset); 
-        toFileSystemEndian(&location->theLBA, dataLBA.theLBA, isLittle);
-        toFileSystemEndian(&location->size, source.size(), isLittle);
-       }
+   assert(data);
 
-       /* Make sure the loop is terminated. */
-       index = 1;
-      }
-      else
-      {
-       for(; index <= keys; index++)
-       {
-rerun:
-        /* Start a new node if we are over the targetSize. */
-        if (actualSize >= targetSize)
-         break;
-
-        if (dataToBeProcessed || (index != keyIndex))
-        {
-         if (index == keyIndex)
-         {
-          dataToBeProcessed = false;
-
-          if (remove)
-          {
-           /* We have earlier tested for the error case: remove && !found. */
-           oldKeys++;
-           continue;
-          }
-
-          if (found)
-          {
-           /* replace the existing <key, value> */ 
-           oldKeys++;
-           goto rerun;
-          }
-         }
-
-         if (index == 0)
-         {
-          if (index == keyIndex)
-           goto rerun;
-
-          continue;
-         }
-
-         if (newNbrOfKeys == 0)
-         {
-          Key splitKey;
-
-          splitKey.major = fromFileSystemEndian(&oldKeys->major, isLittle);
-          splitKey.minor = fromFileSystemEndian(&oldKeys->minor, isLittle);
-          splitKey.type  = oldKeys->type;
-
-          siblingsInfo.children[siblingIndex].key = splitKey;
-         }
-
-         newNbrOfKeys++;
-
-         *newKeys = *oldKeys;
-
-         register const uint16_t oldOffset = fromFileSystemEndian(&oldKeys->offset, isLittle);
-         register const uint16_t oldSize = fromFileSystemEndian(&oldKeys->size, isLittle);
-
-         assert(oldSize >= 0);
-         assert(oldSize < sectorSize);
-         assert(oldOffset < sectorSize); 
-
-         newSize += oldSize;
-       
-         actualSize += sizeof(struct leafKey) + oldSize;
-
-         register const uint16_t offset = sectorSize - newSize;
-
-         assert(offset < sectorSize);
-         assert((((uint8_t*)(newKeys + 1)) - newNodeData) <= offset);
-       
-         toFileSystemEndian(&newKeys->offset, offset, isLittle);
-
-         memcpy(newNodeData + offset, data + oldOffset, oldSize);
-
-         newKeys++;
-         oldKeys++;
-
-         /* A little ugly but allows us to split nodes after any key. */
-         if (index == keyIndex)
-          goto rerun;
-        }
-        else if (index == keyIndex)
-        {
-         /* Check if the new data can fit in the sector. If not, split immediately. */
-         register const uint16_t tmpNewSize =
-          newSize + (indirect ? sizeof(struct leafLocation) : source.size());
-
-         if ((((uint8_t*)(newKeys + 1)) - newNodeData) >= (sectorSize - tmpNewSize))
-          break;
-        
-         if (newNbrOfKeys == 0)
-         {
-          siblingsInfo.children[siblingIndex].key = key;
-         }
-
-         newNbrOfKeys++;
-
-         toFileSystemEndian(&newKeys->major, key.major, isLittle);
-         toFileSystemEndian(&newKeys->minor, key.minor, isLittle);
-         newKeys->type = key.type;
-         newKeys->isLocation = indirect;
-
-         assert(!indirect && (source.size() >= 0));
-         assert(!indirect && (source.size() < sectorSize));
-
-         toFileSystemEndian(&newKeys->size, (indirect ? sizeof(struct leafLocation) : source.size()), 
-                            isLittle);
-
-         newSize = tmpNewSize; 
-         actualSize += sizeof(struct leafKey) +
-                       (indirect ? sizeof(struct leafLocation) : source.size());
-
-         register const uint16_t offset = sectorSize - newSize;
+   register const bool         isLittle = (((struct header*)data)->version & 0x80) != bigEndian;
+   register const unsigned int keys     = nodeKeys(data, isLittle);
 
-         assert(offset < sectorSize);
-      
-         assert((((uint8_t*)(newKeys + 1)) - newNodeData) <= offset);
+   assert(keyIndex <= keys);
+   assert(!(fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) & BPlusTree::isLeaf));
 
-         toFileSystemEndian(&newKeys->offset, offset, isLittle);
- 
-         if (!indirect)
-         {
-          if (!source.toFileSystem(newNodeData + offset, isLittle))
-           assert(0);
-         }
-         else
-         {
-          /* Construct leafLocation. */
-          register struct leafLocation* const location = (struct leafLocation *) (newNodeData + offset);  
-          toFileSystemEndian(&location->theLBA, dataLBA.theLBA, isLittle);
-          toFileSystemEndian(&location->size, source.size(), isLittle);
-         }
-     
-         newKeys++;	 
-        }
-       }
-      }
+   /* The child was changed in its own sector, so this node is unchanged. */
+   if (isUnchanged(childrenInfo, childAt(data, keyIndex, isLittle)))
+   {
+    siblingsInfo.children[0]        = childrenInfo.children[0];
+    siblingsInfo.children[0].theLBA = nodeLBA;
+    siblingsInfo.children[0].leaf   = false;
 
-      assert(((uintptr_t)newKeys) <= (((uintptr_t)newNodeData) + sectorSize - newSize));
+    cacheEntry->unlock(data, cacheEntry, transaction);
+    return;
+   }
 
-      /* Make sure we discard empty nodes. */
-      if (newNbrOfKeys > 0)
-      {
-       register struct header* const newHeader = (struct header*) newNodeData;
+   uint8_t                   scratch[sectorSize];
+   register BlockCacheEntry* reuse = takeOver(data, scratch, cacheEntry, transaction);
 
-       assert(newNbrOfKeys <= ((sectorSize - sizeof(struct header) - newSize) / sizeof(struct leafKey)));
+   /* The children in order, keyIndex replaced with what it came out as,
+      which may be nothing. The first of those keeps the separator it
+      replaces. Its own key is the smallest key it holds, which may be
+      larger after a remove. */
+   Key                          childKeys[maxInternalChildren + 2];
+   struct LBA                   childLBAs[maxInternalChildren + 2];
+   register unsigned int        count = 0;
+   register struct internalSize total;
 
-       newHeader->version = version | (isLittle ? 0 : bigEndian);
+   assert(keys < maxInternalChildren);
 
-       assert(newNbrOfKeys >= 1);
+   startInternalSize(total);
 
-       newHeader->keys    = newNbrOfKeys;
-  
-       toFileSystemEndian(&newHeader->spaceUsedNFlags,
-                          newSize | BPlusTree::isLeaf, isLittle);
+   for(register unsigned int index = 0; index <= keys; index++)
+   {
+    register Key separator = {.type = 0, .major = 0, .minor = 0};
 
-       siblingsInfo.children[siblingIndex].size = newSize;
-       siblingsInfo.children[siblingIndex].keys = newNbrOfKeys;
-       siblingsInfo.children[siblingIndex].leaf = isLeaf;
+    if (index)
+     separator = separatorAt(data, index, isLittle);
+    else if (keyIndex == 0)
+     separator = childrenInfo.children[0].key;
 
-       register enum FileSystem::FileSystemError fileSystemError;
+    if (index != keyIndex)
+    {
+     childKeys[count] = separator;
+     childLBAs[count] = childAt(data, index, isLittle);
 
-       if (!transaction->getFileSystem()->getAvailableLBA(siblingsInfo.children[siblingIndex].theLBA, fileSystemError))
-        assert(0); 
+     addToInternalSize(total, childKeys[count]);
+     count++;
+     continue;
+    }
 
-       assert(fileSystemError == FileSystem::noError);
-     
-       if (!newCacheEntry->setLBA(rootDevice, siblingsInfo.children[siblingIndex].theLBA))
-       {
-        assert(0);
-       }
-    
-       siblingsInfo.children[siblingIndex].valid = true;
+    for(register unsigned int i = 0; i < 3; i++)
+    {
+     if (!childrenInfo.children[i].valid)
+      continue;
 
-       siblingIndex++;
-      }
-      newCacheEntry->unlock(newNodeData, newCacheEntry, transaction);
-     } while (index <= keys);
+     childKeys[count] = i ? childrenInfo.children[i].key : separator;
+     childLBAs[count] = childrenInfo.children[i].theLBA;
 
-     error = noError;
-     success = true;
+     addToInternalSize(total, childKeys[count]);
+     count++;
     }
-    cacheEntry->unlock(data, cacheEntry, transaction);
-    return success;
    }
 
-   /* Need to descend. */
-   register uint16_t offset;
-
-   if (keyIndex == 0)
+   if (count == 1)
    {
-    register const struct firstLocation* const location =
-     ((const struct firstLocation*) (data  + sizeof(struct header)));
-    offset = fromFileSystemEndian(&(location->offset), isLittle);
+    /* Promote the child up. */
+    siblingsInfo.children[0].valid  = true;
+    siblingsInfo.children[0].key    = childKeys[0];
+    siblingsInfo.children[0].theLBA = childLBAs[0];
+    siblingsInfo.children[0].size   = 0;
+    siblingsInfo.children[0].keys   = 0;
+    siblingsInfo.children[0].leaf   = false;
    }
-   else
+   else if (count > 1)
    {
-    register const struct internalKey* const key =
-     ((const struct internalKey*) (data  + sizeof(struct header) + sizeof(struct firstLocation))) + keyIndex - 1;
-    offset = fromFileSystemEndian(&(key->offset), isLittle);
-   }
+    /*! \todo add support for merging of small nodes. */
 
-   assert(offset > (sizeof(struct header) + sizeof(struct firstLocation)));
-   assert(offset <= (sectorSize - sizeof(struct internalLocation)));
+    /* Split evenly by count if the children do not fit, each part fits
+       since its separators are no wider. */
+    register const unsigned int perNode = maxChildrenPerNode(internalWidth(total));
+    register const unsigned int nodes   = internalFits(total) ? 1 : ((count + perNode - 1) / perNode);
+    register unsigned int       siblingIndex = 0;
+    internalBuilder             internal;
 
-   register const struct internalLocation* const location =
-    (const struct internalLocation*) (data  + offset);
-  
+    assert(nodes <= 3);
 
-   register LBA indirectLBA;
-   indirectLBA.theLBA = fromFileSystemEndian(&(location->theLBA), isLittle);
+    for(register unsigned int node = 0; node < nodes; node++)
+    {
+     register const unsigned int begin = (count * node) / nodes;
+     register const unsigned int end   = (count * (node + 1)) / nodes;
 
-   /* Retrieve data from disk. */
-   register class BlockCacheEntry*           newCacheEntry;
-   register enum BlockCache::BlockCacheError cacheError;
- 
-   if (!BlockCache::getInstance().readLookup(newCacheEntry, cacheError, transaction, rootDevice, indirectLBA))
-   {
-    assert(0);
+     for(register unsigned int i = begin; i < end; i++)
+     {
+      if (!internal.add(childKeys[i], childLBAs[i]))
+       assert(0);
+     }
+
+     writeInternal(siblingsInfo, siblingIndex, internal, reuse, nodeLBA, transaction, isLittle);
+    }
    }
 
-   assert(newCacheEntry);
-   assert(cacheError == BlockCache::noError);
+   if ((data != scratch) || reuse)
+    cacheEntry->unlock(data, cacheEntry, transaction);
+  }
 
-   register struct splitAndMergeInfo childrenInfo;
+  /*! If this transaction allocated the node and holds the only pin, copy
+      it to scratch, point data there and hand back the entry so the node
+      can be rebuilt in its own sector. Otherwise the node is shared with
+      an older tree and must be copied on write. */
+  static inline BlockCacheEntry*
+  takeOver(register uint8_t* &                     data,
+           register uint8_t* const                 scratch,
+           register BlockCacheEntry* const         cacheEntry,
+           register const class Transaction* const transaction)
+  {
+   if (!cacheEntry->isPrivate(transaction))
+    return 0;
 
-   success = insertOrRemove(childrenInfo, error, newCacheEntry, source, key, transaction, remove);
+   memcpy(scratch, data, sectorSize);
+   data = scratch;
 
-   /* Check if we need to split nodes. Internal nodes can be split into at most two sectors. */
-   register const uint16_t     dataSpace =
-    fromFileSystemEndian(&(((struct header*)data)->spaceUsedNFlags), isLittle) & (sectorSize-1);
-   register const unsigned int usedSpace = sizeof(struct header) +
-                                           sizeof(struct firstLocation) +
-                                           (keys - 1) * sizeof(struct internalKey) +
-                                           dataSpace;
-   register uint16_t           targetSize = sectorSize;
+   return cacheEntry;
+  }
 
-   assert(usedSpace < sectorSize);
+  /*! The sector for the next sibling: the one handed back by takeOver
+      if it is still unused, a new one otherwise. */
+  static inline uint8_t*
+  startSibling(register BlockCacheEntry* &        newCacheEntry,
+               register bool&                     reused,
+               register BlockCacheEntry* &        reuse,
+               register class Transaction* const  transaction)
+  {
+   register enum BlockCache::BlockCacheError cacheError;
 
-   register unsigned int       children = 0;
-   for(register unsigned int i = 0; i < 3; i++)
-    if (childrenInfo.children[i].valid)
-     children++;
+   reused = (reuse != 0);
 
-   if ((children > 0) &&
-       ((usedSpace + (children -  1) * (sizeof(struct internalKey) + sizeof(struct internalLocation))) >
-       sectorSize))
+   if (reused)
+   {
+    newCacheEntry = reuse;
+    reuse         = 0;
+   }
+   else if (!BlockCache::getInstance().allocate(newCacheEntry, cacheError, transaction))
    {
-    targetSize = (dataSpace + 
-                  (children -  1) * (sizeof(struct internalKey) + sizeof(struct internalLocation))) / 2;
+    assert(0);
    }
 
-   register unsigned int siblingIndex = 0;
-     
-   register unsigned int index = 0;
+   assert(reused || (cacheError == BlockCache::noError));
 
-   register unsigned int childIndex = 0;
+   register uint8_t* const newNodeData = newCacheEntry->getDataPointer();
 
-   /* Weave children in. */
-   do
+   assert(newNodeData);
+
+   return newNodeData;
+  }
+
+  /*! Give the sibling filled in at newNodeData its LBA, seal it and
+      record it in siblingsInfo. Its key is already set. */
+  inline void
+  finishSibling(register struct splitAndMergeInfo& siblingsInfo,
+                register unsigned int&             siblingIndex,
+                register BlockCacheEntry*          newCacheEntry,
+                register uint8_t*                  newNodeData,
+                register const bool                reused,
+                register const struct LBA          nodeLBA,
+                register class Transaction* const  transaction,
+                register const bool                isLittle) const
+  {
+   siblingsInfo.children[siblingIndex].size = fromFileSystemEndian(&((struct header*) newNodeData)->spaceUsedNFlags, isLittle) &
+                                              (sectorSize - 1);
+
+   if (reused)
+    siblingsInfo.children[siblingIndex].theLBA = nodeLBA;
+   else
    {
-    assert(siblingIndex < 3);       
+    register enum FileSystem::FileSystemError fileSystemError;
 
-    if (!BlockCache::getInstance().allocate(newCacheEntry, cacheError, transaction))
+    if (!transaction->getFileSystem()->getAvailableLBA(siblingsInfo.children[siblingIndex].theLBA, fileSystemError))
+     assert(0);
+
+    assert(fileSystemError == FileSystem::noError);
+
+    if (!newCacheEntry->setLBA(rootDevice, siblingsInfo.children[siblingIndex].theLBA))
     {
      assert(0);
     }
+   }
 
-    assert(cacheError == BlockCache::noError);
-   
-    register uint8_t*                    newNodeData   = newCacheEntry->getDataPointer();
+   siblingsInfo.children[siblingIndex].valid = true;
+   siblingIndex++;
 
-    assert(newNodeData);
+   seal(newNodeData, isLittle);
+   newCacheEntry->unlock(newNodeData, newCacheEntry, transaction);
+  }
 
-    memset(newNodeData, 0, sectorSize);
+  /*! Write leaf as the next sibling and start leaf over. A sibling after
+      the first is keyed by the shortest separator from the last key of
+      the one before, kept in previousKey. */
+  inline void
+  writeLeaf(register struct splitAndMergeInfo& siblingsInfo,
+            register unsigned int&             siblingIndex,
+            register Key&                      previousKey,
+            register leafBuilder&              leaf,
+            register BlockCacheEntry* &        reuse,
+            register const struct LBA          nodeLBA,
+            register class Transaction* const  transaction,
+            register const bool                isLittle) const
+  {
+   register BlockCacheEntry* newCacheEntry;
+   register bool             reused;
 
-    register struct header* const        newHeader     = (struct header*) newNodeData;
-    register struct firstLocation* const firstLocation = (struct firstLocation*) (newHeader + 1);
-    register struct internalKey*         internalKey   = (struct internalKey*) (firstLocation + 1);
+   assert(siblingIndex < 3);
+   assert(leaf.count());
 
-    register uint8_t                     newNbrOfKeys = 0;
-    register uint16_t                    newSize = 0;
+   register uint8_t* const newNodeData = startSibling(newCacheEntry, reused, reuse, transaction);
 
-    assert(keys > 0);
+   leaf.write(newNodeData, isLittle);
 
-    /*! \todo add support for merging of small nodes. */
+   siblingsInfo.children[siblingIndex].key  = siblingIndex ? shortestSeparator(previousKey, leaf.firstKey()) :
+                                                             leaf.firstKey();
+   siblingsInfo.children[siblingIndex].keys = leaf.count();
+   siblingsInfo.children[siblingIndex].leaf = true;
 
-    for(; index <= keys; index++)
-    {
-rerunInternal:
-     if (newSize >= targetSize)
-      break;
- 
-     register LBA newLBA = {.theLBA = 0};
-     register Key newKey = {.type = 0, .major = 0, .minor = 0};
+   previousKey = leaf.lastKey();
 
-     /* We take some short cuts here. For example, we assume we can at
-      * least three keys in a sector. */
+   finishSibling(siblingsInfo, siblingIndex, newCacheEntry, newNodeData, reused, nodeLBA, transaction, isLittle);
 
-     if (index == keyIndex)
-     {
-      /* Regardless of operation keyIndex is replaced with the children
-       * even if that means removing a key. */
-      if (childIndex < 3)
-      {
-       if (!childrenInfo.children[childIndex].valid)
-       {
-        childIndex++;
-        goto rerunInternal;
-       }
-       else
-       {
-        /* Extract information from childInfo. */
-        newLBA = childrenInfo.children[childIndex].theLBA;
-        newKey = childrenInfo.children[childIndex].key;
-       }
+   leaf.reset();
+  }
 
-       childIndex++;
-      }
-      else
-       continue;
-     }
-     else
-     { 
-      /* Extract data from the old location. */
+  /*! Write internal as the next sibling and start it over. */
+  inline void
+  writeInternal(register struct splitAndMergeInfo& siblingsInfo,
+                register unsigned int&             siblingIndex,
+                register internalBuilder&          internal,
+                register BlockCacheEntry* &        reuse,
+                register const struct LBA          nodeLBA,
+                register class Transaction* const  transaction,
+                register const bool                isLittle) const
+  {
+   register BlockCacheEntry* newCacheEntry;
+   register bool             reused;
 
-      register uint16_t oldOffset = 0;
-      if (index == 0)
-      {
-       register const struct firstLocation* const location =
-        ((const struct firstLocation*) (data  + sizeof(struct header)));
-       oldOffset = fromFileSystemEndian(&(location->offset), isLittle);
-      }
-      else
-      {
-       register const struct internalKey* const key =
-       ((const struct internalKey*) (data  + sizeof(struct header) + sizeof(struct firstLocation))) + index - 1;
-       oldOffset = fromFileSystemEndian(&(key->offset), isLittle);
-
-       /* Read key. */
-       newKey.type = key->type;
-       newKey.major = fromFileSystemEndian(&key->major, isLittle); 
-       newKey.minor = fromFileSystemEndian(&key->minor, isLittle); 
-      }
+   assert(siblingIndex < 3);
+   assert(internal.count() >= 2);
 
-      /* Read LBA from the payload. */
-      register const struct internalLocation* const location =
-       (const struct internalLocation*) (data  + oldOffset);
-  
-      newLBA.theLBA = fromFileSystemEndian(&(location->theLBA), isLittle);
-     }
+   register uint8_t* const newNodeData = startSibling(newCacheEntry, reused, reuse, transaction);
 
-     /* insert data into new node. */
-     newSize += sizeof(struct internalLocation);
+   internal.write(newNodeData, isLittle);
 
-     register struct internalLocation* internalLocation = (struct internalLocation*) (newNodeData + sectorSize - newSize);
-     toFileSystemEndian(&internalLocation->theLBA, newLBA.theLBA, isLittle);
+   siblingsInfo.children[siblingIndex].key  = internal.firstKey();
+   siblingsInfo.children[siblingIndex].keys = internal.count();
+   siblingsInfo.children[siblingIndex].leaf = false;
 
-     if (newNbrOfKeys == 0)
-     {
-      toFileSystemEndian(&firstLocation->offset, sectorSize - newSize, isLittle);
-
-      /* Prepare for the possible case of no actual keys which means
-       * that the "0" index must be promoted. */
-      siblingsInfo.children[siblingIndex].theLBA = newLBA;
-      siblingsInfo.children[siblingIndex].size = 0;
-      siblingsInfo.children[siblingIndex].keys = 0;
-      siblingsInfo.children[siblingIndex].leaf = false;       
-     }
-     else
-     {
-      internalKey->type = newKey.type;
-      toFileSystemEndian(&internalKey->major, newKey.major, isLittle); 
-      toFileSystemEndian(&internalKey->minor, newKey.minor, isLittle); 
+   finishSibling(siblingsInfo, siblingIndex, newCacheEntry, newNodeData, reused, nodeLBA, transaction, isLittle);
 
-      toFileSystemEndian(&internalKey->offset, sectorSize - newSize, isLittle); 
-      internalKey++;
-     }
-      
-     newNbrOfKeys++;
+   internal.reset();
+  }
 
-     if ((index == keyIndex) && (childIndex < 3))
-      goto rerunInternal;
+  /*! Insert source under key, or remove key if source is null, in a
+      copy of a buffered tree. */
+  bool
+  updateBuffered(register const BPlusTree* &        newTree,
+                 register enum BPlusTreeError&      error,
+                 register const Serializable* const source,
+                 register const Key                 key,
+                 register class Transaction* const  transaction) const;
+
+  /*! Insert, or remove, key in a copy of the tree. A key the hint covers
+      starts at the leaf and only climbs the path as far as what a node
+      comes out as differs from the node. */
+  inline bool
+  update(register const BPlusTree* &       newTree,
+         register enum BPlusTreeError&     error,
+         register const Serializable&      source,
+         register const Key                key,
+         register class Transaction* const transaction,
+         register const bool               remove,
+         register struct LeafHint* const   hint) const
+  {
+   register BlockCacheEntry*                 cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+   register struct splitAndMergeInfo         childrenInfo;
+
+   assert(transaction);
+
+   if (hint && isHinted(*hint, key))
+   {
+    register unsigned int level = hint->depth - 1;
+
+    if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, hint->path[level],
+                                              verifyNode))
+    {
+     assert(0);
     }
 
-    assert(((uintptr_t)internalKey) <= (((uintptr_t)newNodeData) + sectorSize - newSize));
+    register const bool isLittle = (((struct header*)(cacheEntry->getDataPointer()))->version & 0x80) != bigEndian;
 
-    if (newNbrOfKeys > 1)
+    if (!insertOrRemove(childrenInfo, error, cacheEntry, hint->path[level], source, key, transaction, remove, 0, level))
     {
-     assert(newNbrOfKeys <= ((sectorSize - sizeof(struct header) - sizeof(struct firstLocation) - newSize) / sizeof(struct internalKey)));
-     newHeader->version = version | (isLittle ? 0 : bigEndian);
-     assert(newNbrOfKeys >= 1);
-     newHeader->keys    = newNbrOfKeys - 1;
-     toFileSystemEndian(&newHeader->spaceUsedNFlags, newSize, isLittle);
+     assert(0);
+    }
 
-     siblingsInfo.children[siblingIndex].size = newSize;
-     siblingsInfo.children[siblingIndex].keys = newNbrOfKeys;
-     siblingsInfo.children[siblingIndex].leaf = false;
+    /* The hint holds as long as the leaf stays in its sector. */
+    if (!isUnchanged(childrenInfo, hint->path[level]))
+     hint->invalidate();
 
-     register enum FileSystem::FileSystemError fileSystemError;
+    while (level && !isUnchanged(childrenInfo, hint->path[level]))
+    {
+     register struct splitAndMergeInfo siblingsInfo;
 
-     if (!transaction->getFileSystem()->getAvailableLBA(siblingsInfo.children[siblingIndex].theLBA, fileSystemError))
-      assert(0); 
+     level--;
 
-     assert(fileSystemError == FileSystem::noError);
-    
-     if (!newCacheEntry->setLBA(rootDevice, siblingsInfo.children[siblingIndex].theLBA))
+     if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, hint->path[level],
+                                               verifyNode))
      {
       assert(0);
      }
-    
-     siblingsInfo.children[siblingIndex].valid = true;
 
-     siblingIndex++;
+     replaceChild(siblingsInfo, cacheEntry, hint->path[level], hint->index[level], childrenInfo, transaction);
+     childrenInfo = siblingsInfo;
     }
-    else
+
+    if (level)
+     newTree = this;
+    else if (!createNewRoot(newTree, childrenInfo, transaction, isLittle))
     {
-     /* Promote the child up. */
-     if (siblingIndex == 0)
-      siblingsInfo.children[siblingIndex].valid = true;
+     assert(0);
     }
 
-    newCacheEntry->unlock(newNodeData, newCacheEntry, transaction);
-   } while (index <= keys);
+    assert(newTree);
 
-   cacheEntry->unlock(data, cacheEntry, transaction);
-   return success;
+    error = noError;
+    return true;
+   }
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, rootDevice, rootLBA, verifyNode))
+   {
+    assert(0);
+   }
+
+   assert(cacheEntry);
+
+   register uint8_t*   rootData = cacheEntry->getDataPointer();
+   register const bool isLittle = (((struct header*) rootData)->version & 0x80) != bigEndian;
+
+   /* Messages go in at the root and are only pushed down in bulk. */
+   if (isBuffered(rootData) ||
+       (newTreeIsBuffered && !(fromFileSystemEndian(&((struct header*) rootData)->spaceUsedNFlags, isLittle) & isLeaf)))
+   {
+    cacheEntry->unlock(rootData, cacheEntry, transaction);
+
+    if (hint)
+     hint->invalidate();
+
+    return updateBuffered(newTree, error, remove ? 0 : &source, key, transaction);
+   }
+
+   if (hint)
+    startHint(*hint);
+
+   if (!insertOrRemove(childrenInfo, error, cacheEntry, rootLBA, source, key, transaction, remove, hint, 0))
+   {
+    assert(0);
+   }
+
+   assert(error == noError);
+
+   if (!createNewRoot(newTree, childrenInfo, transaction, isLittle))
+   {
+    assert(0);
+   }
+
+   assert(newTree);
+   assert(error == noError);
+
+   error = noError;
+   return true;
+  }
+
+  inline bool
+  isHinted(register const struct LeafHint& hint,
+           register const Key              key) const
+  {
+   return hint.valid && (hint.tree == this) && (hint.rootLBA.theLBA == rootLBA.theLBA) &&
+          (!hint.hasLow || (compareKeys(key, hint.low) >= 0)) &&
+          (!hint.hasHigh || (compareKeys(key, hint.high) < 0));
   }
 
+  /*! Start recording the path of a descent from the root. */
+  inline void
+  startHint(register struct LeafHint& hint) const
+  {
+   hint.invalidate();
+
+   hint.tree    = this;
+   hint.rootLBA = rootLBA;
+   hint.path[0] = rootLBA;
+   hint.depth   = 0;
+   hint.hasLow  = false;
+   hint.hasHigh = false;
+  }
+
+  /*! Record that the descent takes child keyIndex, at theLBA, of the
+      internal node at level. */
+  static inline void
+  recordStep(register struct LeafHint&     hint,
+             register const unsigned int   level,
+             register const uint8_t* const data,
+             register const unsigned int   keyIndex,
+             register const unsigned int   keys,
+             register const struct LBA     theLBA,
+             register const bool           isLittle)
+  {
+   assert((level + 1) < LeafHint::maxDepth);
+
+   hint.index[level]    = keyIndex;
+   hint.path[level + 1] = theLBA;
+
+   if (keyIndex)
+   {
+    hint.low    = separatorAt(data, keyIndex, isLittle);
+    hint.hasLow = true;
+   }
+
+   if (keyIndex < keys)
+   {
+    hint.high    = separatorAt(data, keyIndex + 1, isLittle);
+    hint.hasHigh = true;
+   }
+  }
+
+  /*! The node at theLBA came out as itself, in its own sector. */
+  static inline bool
+  isUnchanged(register const struct splitAndMergeInfo& info,
+              register const struct LBA                theLBA)
+  {
+   return info.children[0].valid && !info.children[1].valid && !info.children[2].valid &&
+          (info.children[0].theLBA.theLBA == theLBA.theLBA);
+  }
 
   inline bool
   createNewRoot(register const BPlusTree*&              newTree,
-                register enum BPlusTreeError&           error,
                 register const struct splitAndMergeInfo childrenInfo,
                 register class Transaction* const       transaction,
                 register const bool                     isLittle) const
@@ -1135,6 +3861,13 @@ rerunInternal:
        !childrenInfo.children[1].valid &&
        !childrenInfo.children[2].valid)
    {
+    /* The root was changed in place. */
+    if (childrenInfo.children[0].theLBA.theLBA == rootLBA.theLBA)
+    {
+     newTree = this;
+     return true;
+    }
+
     newTree = new BPlusTree(rootDevice, childrenInfo.children[0].theLBA);
     assert(newTree);
     return true;
@@ -1152,56 +3885,39 @@ rerunInternal:
 
     assert(cacheError == BlockCache::noError);
    
-    register uint8_t*                    newNodeData   = newCacheEntry->getDataPointer();
+    register uint8_t* newNodeData = newCacheEntry->getDataPointer();
 
     assert(newNodeData);
 
-    memset(newNodeData, 0, sectorSize);
-
-    register struct header* const        newHeader     = (struct header*) newNodeData;
-    register struct firstLocation* const firstLocation = (struct firstLocation*) (newHeader + 1);
-    register struct internalKey*         internalKey   = (struct internalKey*) (firstLocation + 1);
-
-    register uint8_t                     newNbrOfKeys = 0;
-    register uint16_t                    newSize = 0;
-
     if (childrenInfo.children[0].valid)
     {
-     newSize = sizeof(struct internalLocation);
-
-     toFileSystemEndian(&firstLocation->offset, sectorSize - newSize, isLittle); 
+     internalBuilder internal;
 
-     register struct internalLocation*    internalLocation = (struct internalLocation*) (newNodeData + sectorSize - newSize);
-     toFileSystemEndian(&internalLocation->theLBA, childrenInfo.children[0].theLBA.theLBA, isLittle);
-     internalLocation--; 
-
-     for(register unsigned int index = 1; index < 3; index++)
+     for(register unsigned int index = 0; index < 3; index++)
      {
-      if (childrenInfo.children[index].valid)
-      {
-       internalKey->type = childrenInfo.children[index].key.type;
-       toFileSystemEndian(&internalKey->major, childrenInfo.children[index].key.major, isLittle); 
-       toFileSystemEndian(&internalKey->minor, childrenInfo.children[index].key.minor, isLittle);  
+      if (childrenInfo.children[index].valid && !internal.add(childrenInfo.children[index].key,
+                                                              childrenInfo.children[index].theLBA))
+       assert(0);
+     }
 
-       newSize += sizeof(struct internalLocation);
-       toFileSystemEndian(&internalKey->offset, sectorSize - newSize, isLittle); 
+     internal.write(newNodeData, isLittle);
 
-       toFileSystemEndian(&internalLocation->theLBA, childrenInfo.children[index].theLBA.theLBA, isLittle);
-       internalLocation--;
-       internalKey++;
-       newNbrOfKeys++;
-      }
-     }
+     if (newTreeIsBuffered)
+      writeMessages(newNodeData, isLittle, 0, 0, false);
     }
     else
     {
      assert(!childrenInfo.children[1].valid);
      assert(!childrenInfo.children[2].valid);
+
+     /* Everything was removed, the root is an empty leaf. */
+     memset(newNodeData, 0, sectorSize);
+
+     ((struct header*) newNodeData)->version = version | (isLittle ? 0 : bigEndian);
+     toFileSystemEndian(&((struct header*) newNodeData)->spaceUsedNFlags, isLeaf, isLittle);
     }
 
-    newHeader->version = version | (isLittle ? 0 : bigEndian);
-    newHeader->keys    = newNbrOfKeys;
-    toFileSystemEndian(&newHeader->spaceUsedNFlags, newSize, isLittle);
+    seal(newNodeData, isLittle);
 
     register enum FileSystem::FileSystemError fileSystemError;
     register LBA                              newLBA;
@@ -0,0 +1,1588 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef BPLUSTREEBATCH_HPP
+# define BPLUSTREEBATCH_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <string.h>
+
+# include <Globals.hpp>
+# include <Key.hpp>
+# include <LBA.hpp>
+# include <BlockCacheEntry.hpp>
+# include <BlockCache.hpp>
+# include <FileSystem.hpp>
+# include <Transaction.hpp>
+# include <BPlusTree.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <BatchOperation.hpp>
+# include <Serializable.hpp>
+
+/*! Applies a sorted batch of inserts and removes to a BPlusTree in one
+    copy-on-write pass. The batch is pushed down from the root and split
+    at every internal node by its separators, so each node on the path
+    of at least one operation is read once and replaced once, however
+    many operations land in it. Subtrees no operation reaches are shared
+    with the old tree. Nodes this transaction wrote itself are rewritten
+    in their own sectors.
+
+    A rewritten node may come out as several nodes, or none when all its
+    keys are removed. The parent packs whatever its children came out as
+    into as few evenly filled nodes as needed, up to a new root.
+
+    In a buffered tree, see BPlusTree::bufferedVersion, the operations
+    stop as messages in the first internal node they reach. Only when
+    its buffer is full are the messages bound for the child with the
+    most of them pushed down, as a batch of their own, so a page rewrite
+    is shared by many operations on the way to the leaves.
+
+    A range of keys to remove goes down the same way, but only along the
+    paths to its two ends. The subtrees between them are dropped whole
+    and their sectors given back, with those of the values they keep out
+    of line, see removeRange. */
+class BPlusTreeBatch
+{
+ public:
+  enum BPlusTreeBatchError
+  {
+   noError = 0,
+   keyOutOfOrder
+  };
+
+  inline
+  BPlusTreeBatch()
+  {
+   transaction = 0;
+   device      = 0;
+   isLittle    = true;
+   buffered    = false;
+   flushAll    = false;
+   hasRange    = false;
+
+   droppedKeys     = 0;
+   droppedCount    = 0;
+   droppedCapacity = 0;
+  }
+
+  /*! Apply count operations, in strictly ascending key order, to a copy
+      of tree. newTree is tree itself if its root stays in its sector. */
+  inline bool
+  apply(register const class BPlusTree* &                newTree,
+        register enum BPlusTreeBatchError&               error,
+        register const class BPlusTree* const            tree,
+        register const struct BatchOperation* const*     operations,
+        register const unsigned int                      count,
+        register class Transaction* const                transaction)
+  {
+   assert(tree);
+   assert(transaction);
+   assert(!count || operations);
+
+   for(register unsigned int i = 1; i < count; i++)
+   {
+    if (compareKeys(operations[i - 1]->key, operations[i]->key) >= 0)
+    {
+     error = keyOutOfOrder;
+     return false;
+    }
+   }
+
+   start(tree, transaction);
+
+   /* Values are turned into what the leaves hold up front, so messages
+      and leaves take them alike. */
+   register unsigned int bytes = 0;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    if (operations[i]->value)
+     bytes += isIndirect(*operations[i]->value) ? sizeof(struct BPlusTree::leafLocation) : operations[i]->value->size();
+   }
+
+   register struct BPlusTree::leafEntry* const ops    = new struct BPlusTree::leafEntry[count ? count : 1];
+   register uint8_t* const                     values = new uint8_t[bytes ? bytes : 1];
+
+   assert(ops);
+   assert(values);
+
+   bytes = 0;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    register const Serializable* const value = operations[i]->value;
+
+    ops[i].key        = operations[i]->key;
+    ops[i].payload    = 0;
+    ops[i].size       = 0;
+    ops[i].isLocation = false;
+
+    if (!value)
+     continue;
+
+    ops[i].payload    = values + bytes;
+    ops[i].isLocation = isIndirect(*value);
+
+    if (ops[i].isLocation)
+    {
+     BPlusTree::writeExtent(*(struct BPlusTree::leafLocation*) (values + bytes), *value, device, transaction, isLittle);
+     ops[i].size = sizeof(struct BPlusTree::leafLocation);
+    }
+    else
+    {
+     if (!value->toFileSystem(values + bytes, isLittle))
+      assert(0);
+
+     ops[i].size = value->size();
+    }
+
+    bytes += ops[i].size;
+   }
+
+   finish(newTree, tree, ops, count);
+
+   delete [] ops;
+   delete [] values;
+
+   error = noError;
+   return true;
+  }
+
+  /*! As apply, for count pairs in strictly ascending key order that are
+      already in the form the leaves hold them, see BPlusTree::relocate. */
+  inline void
+  applyPairs(register const class BPlusTree* &                 newTree,
+             register const class BPlusTree* const             tree,
+             register const struct BPlusTree::leafEntry* const pairs,
+             register const unsigned int                       count,
+             register class Transaction* const                 transaction)
+  {
+   assert(tree);
+   assert(transaction);
+
+   start(tree, transaction);
+   finish(newTree, tree, pairs, count);
+  }
+
+  /*! Remove every pair from first to last, both included, from a copy of
+      tree. Subtrees that lie wholly in between are unlinked, and their
+      sectors handed to transaction to be freed once it commits, see
+      Transaction::releaseLBA. So are the sectors of the values removed
+      that are stored out of line, which takes reading the leaves of
+      those subtrees too. */
+  inline bool
+  removeRange(register const class BPlusTree* &     newTree,
+              register enum BPlusTreeBatchError&    error,
+              register const class BPlusTree* const tree,
+              register const Key                    first,
+              register const Key                    last,
+              register class Transaction* const     transaction)
+  {
+   assert(tree);
+   assert(transaction);
+
+   if (compareKeys(first, last) > 0)
+   {
+    error = keyOutOfOrder;
+    return false;
+   }
+
+   start(tree, transaction);
+
+   hasRange   = true;
+   rangeFirst = first;
+   rangeLast  = last;
+
+   finish(newTree, tree, 0, 0);
+
+   hasRange = false;
+
+   delete [] droppedKeys;
+
+   droppedKeys     = 0;
+   droppedCount    = 0;
+   droppedCapacity = 0;
+
+   error = noError;
+   return true;
+  }
+
+  /*! Make the pairs of a copy of tree under the count keys, in strictly
+      ascending order, what they are in source: copied if source holds
+      the key and removed if it does not. Values in sectors of their own
+      are shared with source, not copied. source must be drained. */
+  inline bool
+  copyKeys(register const class BPlusTree* &     newTree,
+           register enum BPlusTreeBatchError&    error,
+           register const class BPlusTree* const tree,
+           register const class BPlusTree* const source,
+           register const Key* const             keys,
+           register const unsigned int           count,
+           register class Transaction* const     transaction)
+  {
+   assert(tree);
+   assert(source);
+   assert(transaction);
+   assert(!count || keys);
+
+   for(register unsigned int i = 1; i < count; i++)
+   {
+    if (compareKeys(keys[i - 1], keys[i]) >= 0)
+    {
+     error = keyOutOfOrder;
+     return false;
+    }
+   }
+
+   start(tree, transaction);
+
+   register struct BPlusTree::leafEntry* const ops     = new struct BPlusTree::leafEntry[count ? count : 1];
+   register unsigned int* const                offsets = new unsigned int[count ? count : 1];
+   register uint8_t*                           values  = 0;
+   register unsigned int                       bytes   = 0;
+   register unsigned int                       room    = 0;
+   register bool                               ended   = false;
+   BPlusTreeCursor                             cursor;
+   register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+
+   assert(ops);
+   assert(offsets);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    ops[i].key        = keys[i];
+    ops[i].payload    = 0;
+    ops[i].size       = 0;
+    ops[i].isLocation = false;
+    offsets[i]        = UINT32_MAX;
+
+    /* Keys past the last one of source are removed. */
+    if (ended || !cursor.seek(cursorError, source, transaction, keys[i]))
+    {
+     ended = true;
+     continue;
+    }
+
+    if (compareKeys(cursor.getKey(), keys[i]))
+     continue;
+
+    register const struct BPlusTree::leafEntry& entry = cursor.currentEntry();
+
+    assert(cursor.path[cursor.depth - 1].isLittle == isLittle);
+
+    if (bytes + entry.size > room)
+    {
+     register const unsigned int newRoom   = 2 * (bytes + entry.size);
+     register uint8_t* const     newValues = new uint8_t[newRoom];
+
+     assert(newValues);
+
+     if (bytes)
+      memcpy(newValues, values, bytes);
+
+     delete [] values;
+
+     values = newValues;
+     room   = newRoom;
+    }
+
+    memcpy(values + bytes, entry.payload, entry.size);
+
+    offsets[i]        = bytes;
+    ops[i].size       = entry.size;
+    ops[i].isLocation = entry.isLocation;
+    bytes            += entry.size;
+   }
+
+   cursor.close();
+
+   if (!values)
+   {
+    values = new uint8_t[1];
+    assert(values);
+   }
+
+   /* The buffer has moved while it grew. */
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    if (offsets[i] != UINT32_MAX)
+     ops[i].payload = values + offsets[i];
+   }
+
+   finish(newTree, tree, ops, count);
+
+   delete [] ops;
+   delete [] offsets;
+   delete [] values;
+
+   error = noError;
+   return true;
+  }
+
+  /*! Hand the sectors of the nodes of tree that only transaction has
+      seen to Transaction::releaseLBA, for a tree about to be dropped.
+      Below a node others may see there are none. */
+  inline void
+  releasePrivate(register const class BPlusTree* const tree,
+                 register class Transaction* const     transaction)
+  {
+   assert(tree);
+   assert(transaction);
+
+   start(tree, transaction);
+   releasePrivateNode(tree->rootLBA);
+
+   this->transaction = 0;
+  }
+
+  /*! Push every message of a buffered tree down to the leaves, as a
+      cursor only reads those. Any other tree comes back as it is. */
+  inline bool
+  drain(register const class BPlusTree* &     newTree,
+        register enum BPlusTreeBatchError&    error,
+        register const class BPlusTree* const tree,
+        register class Transaction* const     transaction)
+  {
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   assert(tree);
+   assert(transaction);
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, tree->rootDevice, tree->rootLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t*   data       = cacheEntry->getDataPointer();
+   register const bool nodeLittle = (((struct BPlusTree::header*) data)->version & BPlusTree::bigEndian) !=
+                                    BPlusTree::bigEndian;
+   register const bool drained    = !BPlusTree::messageCount(data, nodeLittle) &&
+                                    !BPlusTree::hasMessagesBelow(data, nodeLittle);
+
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   if (drained)
+   {
+    newTree = tree;
+    error   = noError;
+    return true;
+   }
+
+   start(tree, transaction);
+
+   flushAll = true;
+   finish(newTree, tree, 0, 0);
+   flushAll = false;
+
+   error = noError;
+   return true;
+  }
+
+ private:
+  struct child
+  {
+   Key        key;
+   struct LBA theLBA;
+   /*! Neither the node nor any below it holds messages. */
+   bool       quiet;
+  };
+
+  /*! The nodes a subtree came out as, in key order, each with the
+      smallest key it may hold. */
+  class childList
+  {
+   public:
+    struct child* children;
+    unsigned int  count;
+
+    inline
+    childList()
+    {
+     children = 0;
+     count    = 0;
+     capacity = 0;
+    }
+
+    inline
+    ~childList()
+    {
+     delete [] children;
+    }
+
+    inline void
+    add(register const Key        key,
+        register const struct LBA theLBA,
+        register const bool       quiet)
+    {
+     if (count == capacity)
+     {
+      register const unsigned int newCapacity = capacity ? 2 * capacity : 16;
+      register struct child* const newChildren = new struct child[newCapacity];
+
+      assert(newChildren);
+
+      if (count)
+       memcpy(newChildren, children, count * sizeof(struct child));
+
+      delete [] children;
+
+      children = newChildren;
+      capacity = newCapacity;
+     }
+
+     children[count].key    = key;
+     children[count].theLBA = theLBA;
+     children[count].quiet  = quiet;
+     count++;
+    }
+
+    inline void
+    swap(register childList& other)
+    {
+     register struct child* const children = this->children;
+     register const unsigned int  count    = this->count;
+     register const unsigned int  capacity = this->capacity;
+
+     this->children = other.children;
+     this->count    = other.count;
+     this->capacity = other.capacity;
+
+     other.children = children;
+     other.count    = count;
+     other.capacity = capacity;
+    }
+
+   private:
+    unsigned int  capacity;
+  };
+
+  /*! The operations an internal node sends to one of its children. */
+  struct share
+  {
+   unsigned int first;
+   unsigned int end;
+   unsigned int bytes;
+   bool         flush;
+  };
+
+  /*! Where a merge of the keys of a leaf and the operations stands. */
+  struct mergeState
+  {
+   struct BPlusTree::leafReader           reader;
+   /*! The next old pair, if hasOld. */
+   struct BPlusTree::leafEntry            old;
+   bool                                   hasOld;
+   const struct BPlusTree::leafEntry*     ops;
+   unsigned int                           count;
+   unsigned int                           operation;
+   /*! Old pairs from first to last are dropped, if first is set. */
+   const Key*                             first;
+   const Key*                             last;
+  };
+
+  /*! Most a leaf can take, as counted by BPlusTree::leafBytes. */
+  static const unsigned int
+  leafCapacity = sectorSize - 1;
+
+  class Transaction*                  transaction;
+  class VirtualBlockDevice*           device;
+  bool                                isLittle;
+  /*! Internal nodes are written with a messageBuffer. */
+  bool                                buffered;
+  /*! Every message is pushed down to the leaves. */
+  bool                                flushAll;
+  /*! Pairs from rangeFirst to rangeLast are removed. */
+  bool                                hasRange;
+  Key                                 rangeFirst;
+  Key                                 rangeLast;
+
+  /*! Keys of messages in the range dropped so far, in order, see
+      dropPair. */
+  Key*                                droppedKeys;
+  unsigned int                        droppedCount;
+  unsigned int                        droppedCapacity;
+
+  /*! The leaf being filled by rewriteLeaf. */
+  BPlusTree::leafBuilder              leaf;
+
+  /*! The node being filled by pack. */
+  BPlusTree::internalBuilder          internal;
+
+  inline void
+  start(register const class BPlusTree* const tree,
+        register class Transaction* const     transaction)
+  {
+   this->transaction = transaction;
+   this->device      = tree->rootDevice;
+
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   /* New nodes keep the byte order and the format of the tree. */
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, device, tree->rootLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t* data = cacheEntry->getDataPointer();
+
+   isLittle = (((struct BPlusTree::header*) data)->version & BPlusTree::bigEndian) != BPlusTree::bigEndian;
+   buffered = BPlusTree::isBuffered(data) || BPlusTree::newTreeIsBuffered;
+
+   cacheEntry->unlock(data, cacheEntry, transaction);
+  }
+
+  /*! Run ops down tree and build the root above what it came out as. */
+  inline void
+  finish(register const class BPlusTree* &           newTree,
+         register const class BPlusTree* const       tree,
+         register const struct BPlusTree::leafEntry* ops,
+         register const unsigned int                 count)
+  {
+   register const Key first = {.type = 0, .major = 0, .minor = 0};
+   childList          level;
+
+   rewrite(level, tree->rootLBA, ops, count, first, 0);
+
+   while (level.count > 1)
+   {
+    childList                       above;
+    register class BlockCacheEntry* none = 0;
+
+    pack(above, level, 0, 0, none, tree->rootLBA);
+    level.swap(above);
+   }
+
+   register struct LBA rootLBA;
+
+   if (level.count)
+    rootLBA = level.children[0].theLBA;
+   else
+   {
+    /* Everything was removed. */
+    register class BlockCacheEntry* cacheEntry;
+    register class BlockCacheEntry* none = 0;
+    register bool                   reused;
+    register uint8_t* const         newData = newNode(cacheEntry, reused, none);
+
+    toFileSystemEndian(&((struct BPlusTree::header*) newData)->spaceUsedNFlags, BPlusTree::isLeaf, isLittle);
+    rootLBA = closeNode(cacheEntry, reused, tree->rootLBA);
+   }
+
+   if (rootLBA.theLBA == tree->rootLBA.theLBA)
+    newTree = tree;
+   else
+   {
+    newTree = new BPlusTree(device, rootLBA);
+    assert(newTree);
+   }
+
+   this->transaction = 0;
+  }
+
+  /*! Apply the count ops to the subtree at theLBA, which holds keys
+      from lowerBound up to upperBound, if there is one, and add what
+      replaces it to out. Returns false, having added the subtree itself,
+      when no operation changes anything. */
+  inline bool
+  rewrite(register childList&                          out,
+          register const struct LBA                    theLBA,
+          register const struct BPlusTree::leafEntry* const ops,
+          register const unsigned int                  count,
+          register const Key                           lowerBound,
+          register const Key* const                    upperBound)
+  {
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, device, theLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t* data = cacheEntry->getDataPointer();
+
+   assert(data);
+
+   register const struct BPlusTree::header* const header = (const struct BPlusTree::header*) data;
+
+   if (!BPlusTree::isSupportedVersion(header->version))
+   {
+    /* unsupported version. */
+    assert(0);
+   }
+
+   register const bool         nodeLittle = (header->version & BPlusTree::bigEndian) != BPlusTree::bigEndian;
+   register const unsigned int keys       = BPlusTree::nodeKeys(data, nodeLittle);
+   register const bool         isLeaf     =
+    (fromFileSystemEndian(&header->spaceUsedNFlags, nodeLittle) & BPlusTree::isLeaf) != 0;
+   register const bool         quiet      = !BPlusTree::messageCount(data, nodeLittle) &&
+                                            !BPlusTree::hasMessagesBelow(data, nodeLittle);
+
+   /* Old values are moved over byte for byte. */
+   assert(nodeLittle == isLittle);
+
+   /* Nothing to do here. */
+   if (!count && quiet && !meetsRange(lowerBound, upperBound))
+   {
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+    out.add(lowerBound, theLBA, true);
+    return false;
+   }
+
+   /* A node only this transaction has seen is read from a copy and
+      rewritten in its sector. */
+   register class BlockCacheEntry* reuse = 0;
+   uint8_t                         copy[sectorSize];
+
+   if (cacheEntry->isPrivate(transaction))
+   {
+    memcpy(copy, data, sectorSize);
+
+    reuse      = cacheEntry;
+    cacheEntry = 0;
+    data       = copy;
+   }
+
+   register const bool changed = isLeaf ?
+    rewriteLeaf(out, data, keys, ops, count, lowerBound, reuse, theLBA) :
+    rewriteInternal(out, data, keys, ops, count, lowerBound, upperBound, reuse, theLBA);
+
+   if (cacheEntry)
+    cacheEntry->unlock(data, cacheEntry, transaction);
+
+   /* Left as it was. */
+   if (reuse)
+   {
+    data = reuse->getDataPointer();
+    reuse->unlock(data, reuse, transaction);
+   }
+
+   if (!changed)
+    out.add(lowerBound, theLBA, quiet);
+
+   return changed;
+  }
+  inline bool
+  rewriteInternal(register childList&                          out,
+                  register const uint8_t* const                data,
+                  register const unsigned int                  keys,
+                  register const struct BPlusTree::leafEntry* const ops,
+                  register const unsigned int                  count,
+                  register const Key                           lowerBound,
+                  register const Key* const                    upperBound,
+                  register class BlockCacheEntry* &            reuse,
+                  register const struct LBA                    nodeLBA)
+  {
+   register const unsigned int                 messages = BPlusTree::messageCount(data, isLittle);
+   register const bool                         below    = BPlusTree::hasMessagesBelow(data, isLittle);
+   register struct BPlusTree::leafEntry* const merged   =
+    messages ? new struct BPlusTree::leafEntry[messages + count] : 0;
+   register const struct BPlusTree::leafEntry* pending  = ops;
+   register unsigned int                       total    = count;
+
+   register bool                               dropped  = false;
+
+   /* The messages of the node are older than the operations. */
+   if (messages)
+   {
+    total   = mergeMessages(merged, data, messages, ops, count);
+    pending = merged;
+
+    /* Messages in the range to remove go with it. */
+    if (hasRange)
+    {
+     register unsigned int kept = 0;
+
+     for(register unsigned int i = 0; i < total; i++)
+     {
+      if (!inRange(merged[i].key))
+       merged[kept++] = merged[i];
+      else
+       dropPair(merged[i], true);
+     }
+
+     dropped = (kept != total);
+     total   = kept;
+    }
+   }
+
+   register struct share* const shares = new struct share[keys + 1];
+   register unsigned int        next   = 0;
+   register unsigned int        kept   = 0;
+
+   assert(shares);
+
+   for(register unsigned int child = 0; child <= keys; child++)
+   {
+    register unsigned int end = total;
+
+    /* The operations below the next separator belong to this child. */
+    if (child < keys)
+    {
+     register const Key upper = separator(data, child + 1);
+
+     for(end = next; (end < total) && (compareKeys(pending[end].key, upper) < 0); end++)
+      ;
+    }
+
+    shares[child].first = next;
+    shares[child].end   = end;
+    shares[child].bytes = 0;
+    shares[child].flush = false;
+
+    for(register unsigned int i = next; i < end; i++)
+     shares[child].bytes += BPlusTree::messageSize(pending[i]);
+
+    kept += shares[child].bytes;
+    next  = end;
+   }
+
+   assert(next == total);
+
+   /* Without a buffer everything goes down. With one, the largest shares
+      go down until the rest fits. */
+   register const unsigned int room = (buffered && !flushAll) ?
+                                      (BPlusTree::bufferReserve - sizeof(struct BPlusTree::messageBuffer)) : 0;
+
+   while (kept > room)
+   {
+    register unsigned int largest = keys + 1;
+
+    for(register unsigned int child = 0; child <= keys; child++)
+    {
+     if (!shares[child].flush && shares[child].bytes &&
+         ((largest > keys) || (shares[child].bytes > shares[largest].bytes)))
+      largest = child;
+    }
+
+    assert(largest <= keys);
+
+    shares[largest].flush  = true;
+    kept                  -= shares[largest].bytes;
+   }
+
+   childList                             children;
+   register bool                         changed   = (count != 0) || dropped;
+   register struct BPlusTree::leafEntry* held      = total ? new struct BPlusTree::leafEntry[total] : 0;
+   register unsigned int                 heldCount = 0;
+
+   for(register unsigned int child = 0; child <= keys; child++)
+   {
+    register const Key         childBound = child ? separator(data, child) : lowerBound;
+    register const struct LBA  theLBA     = childLBA(data, child);
+    register const struct share& part     = shares[child];
+    Key                        above;
+    register const Key* const  upper      = upperOf(above, data, child, keys, upperBound);
+
+    if (coversRange(childBound, upper))
+    {
+     /* The children after it up to the other end of the range go with
+        it. Their messages were in the range too. */
+     register unsigned int end = child + 1;
+
+     while ((end <= keys) && coversRange(separator(data, end), upperOf(above, data, end, keys, upperBound)))
+      end++;
+
+     for(register unsigned int i = child; i < end; i++)
+      assert(shares[i].first == shares[i].end);
+
+     changed = true;
+     releaseChildren(data, child, end);
+
+     child = end - 1;
+     continue;
+    }
+
+    /* An end of the range takes its messages along, as it may come out
+       as nothing. */
+    if (part.flush || meetsRange(childBound, upper))
+    {
+     if (rewrite(children, theLBA, pending + part.first, part.end - part.first, childBound, upper) ||
+         part.flush)
+      changed = true;
+    }
+    else
+    {
+     for(register unsigned int i = part.first; i < part.end; i++)
+      held[heldCount++] = pending[i];
+
+     /* Draining also reaches every node below that holds messages. */
+     if (flushAll && below)
+     {
+      if (rewrite(children, theLBA, 0, 0, childBound, upper))
+       changed = true;
+     }
+     else
+      children.add(childBound, theLBA, !below);
+    }
+   }
+
+   delete [] shares;
+
+   if (changed && (children.count == 1) && heldCount)
+   {
+    /* A lone child is linked straight to the level above, and takes the
+       messages with it. */
+    childList lone;
+
+    lone.swap(children);
+    rewrite(children, lone.children[0].theLBA, held, heldCount, lone.children[0].key, upperBound);
+
+    heldCount = 0;
+   }
+
+   if (changed)
+    pack(out, children, held, heldCount, reuse, nodeLBA);
+
+   delete [] held;
+   delete [] merged;
+
+   return changed;
+  }
+
+  inline bool
+  rewriteLeaf(register childList&                          out,
+              register const uint8_t* const                data,
+              register const unsigned int                  keys,
+              register const struct BPlusTree::leafEntry* const ops,
+              register const unsigned int                  count,
+              register const Key                           lowerBound,
+              register class BlockCacheEntry* &            reuse,
+              register const struct LBA                    nodeLBA)
+  {
+   register struct mergeState           state;
+   register struct BPlusTree::leafEntry entry;
+   register struct BPlusTree::leafSize  total;
+   register bool                        changed = false;
+
+   assert(keys == BPlusTree::nodeKeys(data, isLittle));
+
+   if (hasRange)
+    dropLeaf(data, keys);
+
+   /* Size the result first so it can be spread evenly. */
+   BPlusTree::startLeafSize(total);
+   startMerge(state, data, ops, count);
+
+   while (nextEntry(state, changed, entry))
+    BPlusTree::addToLeafSize(total, entry.key, entry.size);
+
+   if (!changed || !total.keys)
+    return changed;
+
+   register const unsigned int bytes    = BPlusTree::leafBytes(total);
+   register const unsigned int leaves   = (bytes + leafCapacity - 1) / leafCapacity;
+   register unsigned int       target   = (bytes + leaves - 1) / leaves;
+   register unsigned int*      cuts     = 0;
+   register unsigned int       cutCount = 0;
+   register Key                firstKey = lowerBound;
+
+   /* Keys arriving in order all go past the end of the leaf, or in front
+      of it. The leaves are then filled up rather than evenly, the one
+      with the old pairs first for an append and last for a prepend, so
+      the next batch does not leave a half empty leaf behind, see
+      BPlusTree::orderedSplit. An append fills them from the front. For
+      a prepend they are cut from the back, as leaf sizes do not add up. */
+   if ((leaves > 1) && keys && !hasRange)
+   {
+    register struct BPlusTree::leafReader reader;
+    register struct BPlusTree::leafEntry  first;
+    register struct BPlusTree::leafEntry  last;
+    register bool                         appends  = true;
+    register bool                         prepends = true;
+
+    BPlusTree::openLeaf(reader, data, isLittle);
+    BPlusTree::readLeaf(reader, first);
+    BPlusTree::seekLeaf(reader, keys - 1);
+    BPlusTree::readLeaf(reader, last);
+
+    for(register unsigned int i = 0; (appends || prepends) && (i < count); i++)
+    {
+     appends  = appends && ops[i].payload && (compareKeys(ops[i].key, last.key) > 0);
+     prepends = prepends && ops[i].payload && (compareKeys(ops[i].key, first.key) < 0);
+    }
+
+    if (appends)
+     target = leafCapacity;
+    else if (prepends)
+    {
+     register Key* const          pairKeys  = new Key[total.keys];
+     register unsigned int* const pairSizes = new unsigned int[total.keys];
+     register unsigned int        pairs     = 0;
+     register unsigned int        end       = total.keys;
+
+     assert(pairKeys && pairSizes);
+
+     cuts = new unsigned int[total.keys];
+     assert(cuts);
+
+     startMerge(state, data, ops, count);
+
+     while (nextEntry(state, changed, entry))
+     {
+      pairKeys[pairs]  = entry.key;
+      pairSizes[pairs] = entry.size;
+      pairs++;
+     }
+
+     assert(pairs == total.keys);
+
+     /* The fewest pairs from the back that no longer fit go first. */
+     while (!fitsLeaf(pairKeys, pairSizes, 0, end))
+     {
+      register unsigned int low  = 0;
+      register unsigned int high = end - 1;
+
+      while ((high - low) > 1)
+      {
+       register const unsigned int middle = (low + high) / 2;
+
+       if (fitsLeaf(pairKeys, pairSizes, middle, end))
+        high = middle;
+       else
+        low = middle;
+      }
+
+      cuts[cutCount++] = high;
+      end              = high;
+     }
+
+     /* In key order. */
+     for(register unsigned int i = 0; i < cutCount / 2; i++)
+     {
+      register const unsigned int cut = cuts[i];
+
+      cuts[i]                = cuts[cutCount - 1 - i];
+      cuts[cutCount - 1 - i] = cut;
+     }
+
+     target = leafCapacity;
+
+     delete [] pairKeys;
+     delete [] pairSizes;
+    }
+   }
+
+   register unsigned int index   = 0;
+   register unsigned int nextCut = 0;
+
+   leaf.reset();
+   startMerge(state, data, ops, count);
+
+   while (nextEntry(state, changed, entry))
+   {
+    if (nextCut < cutCount)
+    {
+     if (index == cuts[nextCut])
+     {
+      firstKey = closeLeaf(out, firstKey, entry.key, reuse, nodeLBA);
+      nextCut++;
+     }
+    }
+    else if (leaf.count() && (leaf.bytes() >= target))
+     firstKey = closeLeaf(out, firstKey, entry.key, reuse, nodeLBA);
+
+    /* Values stored out of line are shared with the old leaf. */
+    if (!leaf.add(entry))
+    {
+     firstKey = closeLeaf(out, firstKey, entry.key, reuse, nodeLBA);
+
+     if (!leaf.add(entry))
+      assert(0);
+    }
+
+    index++;
+   }
+
+   delete [] cuts;
+
+   out.add(firstKey, closeLeaf(reuse, nodeLBA), true);
+   return true;
+  }
+
+  /*! Whether the pairs from first up to end, of the keys and value sizes
+      given, make a leaf. */
+  static inline bool
+  fitsLeaf(register const Key* const          keys,
+           register const unsigned int* const sizes,
+           register const unsigned int        first,
+           register const unsigned int        end)
+  {
+   register struct BPlusTree::leafSize size;
+
+   BPlusTree::startLeafSize(size);
+
+   for(register unsigned int i = first; i < end; i++)
+    BPlusTree::addToLeafSize(size, keys[i], sizes[i]);
+
+   return BPlusTree::leafFits(size);
+  }
+
+  /*! Build internal nodes over children and add them to out. Each node
+      gets the count messages, in key order, that fall between its
+      separators. */
+  inline void
+  pack(register childList&                          out,
+       register const childList&                    children,
+       register const struct BPlusTree::leafEntry* const messages,
+       register const unsigned int                  count,
+       register class BlockCacheEntry* &            reuse,
+       register const struct LBA                    nodeLBA)
+  {
+   if (!children.count)
+   {
+    assert(!count);
+    return;
+   }
+
+   if (children.count == 1)
+   {
+    /* A lone child is linked straight to the level above. Lookups go by
+       the node type, not the depth, so the tree stays searchable. */
+    assert(!count);
+
+    out.add(children.children[0].key, children.children[0].theLBA, children.children[0].quiet);
+    return;
+   }
+
+   register struct BPlusTree::internalSize total;
+
+   BPlusTree::startInternalSize(total);
+
+   for(register unsigned int i = 0; i < children.count; i++)
+    BPlusTree::addToInternalSize(total, children.children[i].key);
+
+   /* Every node fits since its separators are no wider than all of them.
+      A buffered node leaves its reserve to the messages. */
+   register const unsigned int room    = buffered ? (sectorSize - BPlusTree::bufferReserve) : sectorSize;
+   register const unsigned int perNode = BPlusTree::maxChildrenPerNode(BPlusTree::internalWidth(total), room);
+   register const unsigned int nodes   = BPlusTree::internalFits(total, room) ? 1 :
+                                         ((children.count + perNode - 1) / perNode);
+   register unsigned int       message = 0;
+
+   for(register unsigned int node = 0; node < nodes; node++)
+   {
+    register const unsigned int begin = (children.count * node) / nodes;
+    register const unsigned int end   = (children.count * (node + 1)) / nodes;
+    register const unsigned int first = message;
+    register bool               below = false;
+
+    assert((end - begin) >= 2);
+
+    for(register unsigned int i = begin; i < end; i++)
+    {
+     if (!internal.add(children.children[i].key, children.children[i].theLBA))
+      assert(0);
+
+     below = below || !children.children[i].quiet;
+    }
+
+    if (end < children.count)
+    {
+     while ((message < count) && (compareKeys(messages[message].key, children.children[end].key) < 0))
+      message++;
+    }
+    else
+     message = count;
+
+    register class BlockCacheEntry* cacheEntry;
+    register bool                   reused;
+    register uint8_t* const         newData = newNode(cacheEntry, reused, reuse);
+
+    internal.write(newData, isLittle);
+    internal.reset();
+
+    if (buffered)
+     BPlusTree::writeMessages(newData, isLittle, messages + first, message - first, below);
+
+    out.add(children.children[begin].key, closeNode(cacheEntry, reused, nodeLBA), (message == first) && !below);
+   }
+  }
+
+  /*! Merge the messages of the buffer at data with the newer ops into
+      merged, a message and an op on the same key giving the op. Returns
+      how many came out. */
+  inline unsigned int
+  mergeMessages(register struct BPlusTree::leafEntry* const       merged,
+                register const uint8_t* const                     data,
+                register const unsigned int                       messages,
+                register const struct BPlusTree::leafEntry* const ops,
+                register const unsigned int                       count) const
+  {
+   register struct BPlusTree::leafEntry message;
+   register unsigned int                index     = 0;
+   register unsigned int                operation = 0;
+   register unsigned int                total     = 0;
+
+   while ((index < messages) || (operation < count))
+   {
+    register int order;
+
+    if (index < messages)
+     BPlusTree::messageAt(message, data, index, messages, isLittle);
+
+    if (operation == count)
+     order = -1;
+    else if (index == messages)
+     order = 1;
+    else
+     order = compareKeys(message.key, ops[operation].key);
+
+    if (order < 0)
+    {
+     merged[total++] = message;
+     index++;
+     continue;
+    }
+
+    if (order == 0)
+     index++;
+
+    merged[total++] = ops[operation++];
+   }
+
+   return total;
+  }
+
+  inline void
+  startMerge(register struct mergeState&                       state,
+             register const uint8_t* const                     data,
+             register const struct BPlusTree::leafEntry* const ops,
+             register const unsigned int                       count) const
+  {
+   BPlusTree::openLeaf(state.reader, data, isLittle);
+
+   state.ops       = ops;
+   state.count     = count;
+   state.operation = 0;
+   state.first     = hasRange ? &rangeFirst : 0;
+   state.last      = &rangeLast;
+
+   nextOld(state);
+  }
+
+  static inline void
+  nextOld(register struct mergeState& state)
+  {
+   state.hasOld = state.reader.index < state.reader.keys;
+
+   if (state.hasOld)
+    BPlusTree::readLeaf(state.reader, state.old);
+  }
+
+  /*! Step to the next pair of the new leaf contents. Old pairs are
+      replaced or dropped by an operation on the same key, removes of
+      absent keys do nothing. changed is set if the contents differ from
+      the old leaf. */
+  static inline bool
+  nextEntry(register struct mergeState&           state,
+            register bool&                        changed,
+            register struct BPlusTree::leafEntry& entry)
+  {
+   for(;;)
+   {
+    register const bool hasOperation = state.operation < state.count;
+
+    if (!state.hasOld && !hasOperation)
+     return false;
+
+    register int order;
+
+    if (!hasOperation)
+     order = -1;
+    else if (!state.hasOld)
+     order = 1;
+    else
+     order = compareKeys(state.old.key, state.ops[state.operation].key);
+
+    if (order < 0)
+    {
+     entry = state.old;
+
+     nextOld(state);
+
+     if (state.first &&
+         (compareKeys(entry.key, *state.first) >= 0) &&
+         (compareKeys(entry.key, *state.last) <= 0))
+     {
+      changed = true;
+      continue;
+     }
+
+     return true;
+    }
+
+    if (order == 0)
+    {
+     nextOld(state);
+     changed = true;
+    }
+
+    entry = state.ops[state.operation++];
+
+    if (!entry.payload)
+     continue;
+
+    changed = true;
+    return true;
+   }
+  }
+
+  /*! The bound above child of the node at data, that above the node for
+      its last child. */
+  inline const Key*
+  upperOf(register Key&                 storage,
+          register const uint8_t* const data,
+          register const unsigned int   child,
+          register const unsigned int   keys,
+          register const Key* const     upperBound) const
+  {
+   if (child == keys)
+    return upperBound;
+
+   storage = separator(data, child + 1);
+   return &storage;
+  }
+
+  inline bool
+  inRange(register const Key key) const
+  {
+   return hasRange && (compareKeys(key, rangeFirst) >= 0) && (compareKeys(key, rangeLast) <= 0);
+  }
+
+  /*! Whether the range to remove meets the keys from lowerBound up to
+      upperBound, or up from lowerBound if there is none. */
+  inline bool
+  meetsRange(register const Key        lowerBound,
+             register const Key* const upperBound) const
+  {
+   return hasRange && (compareKeys(rangeLast, lowerBound) >= 0) &&
+          (!upperBound || (compareKeys(rangeFirst, *upperBound) < 0));
+  }
+
+  /*! Whether the range to remove holds every key from lowerBound up to
+      upperBound. */
+  inline bool
+  coversRange(register const Key        lowerBound,
+              register const Key* const upperBound) const
+  {
+   return hasRange && upperBound && (compareKeys(rangeFirst, lowerBound) <= 0) &&
+          (compareKeys(*upperBound, rangeLast) <= 0);
+  }
+
+  /*! Give the sectors of the subtrees of children first to end of the
+      node at data back to the transaction, with those of the values
+      their pairs and messages hold out of line, see dropPair. */
+  inline void
+  releaseChildren(register const uint8_t* const data,
+                  register const unsigned int   first,
+                  register const unsigned int   end)
+  {
+   register enum BlockCache::BlockCacheError cacheError;
+   register struct LBA                       theLBAs[BlockCache::maxPrefetch];
+
+   assert(first < end);
+
+   for(register unsigned int child = first; child < end; )
+   {
+    register unsigned int batched = 0;
+
+    for(register unsigned int i = child; (i < end) && (batched < BlockCache::maxPrefetch); i++)
+     theLBAs[batched++] = childLBA(data, i);
+
+    if ((batched > 1) &&
+        !BlockCache::getInstance().prefetch(cacheError, device, theLBAs, batched, BPlusTree::verifyNode))
+     assert(0);
+
+    for(register unsigned int i = 0; i < batched; i++, child++)
+     releaseSubtree(theLBAs[i]);
+   }
+  }
+
+  inline void
+  releaseSubtree(register const struct LBA theLBA)
+  {
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, device, theLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t*           data = cacheEntry->getDataPointer();
+   register const unsigned int keys = BPlusTree::nodeKeys(data, isLittle);
+
+   if (fromFileSystemEndian(&((const struct BPlusTree::header*) data)->spaceUsedNFlags, isLittle) &
+       BPlusTree::isLeaf)
+    dropLeaf(data, keys);
+   else
+   {
+    register const unsigned int         messages = BPlusTree::messageCount(data, isLittle);
+    register struct BPlusTree::leafEntry message;
+
+    /* The messages are newer than anything below. */
+    for(register unsigned int i = 0; i < messages; i++)
+    {
+     BPlusTree::messageAt(message, data, i, messages, isLittle);
+     dropPair(message, true);
+    }
+
+    releaseChildren(data, 0, keys + 1);
+   }
+
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   transaction->releaseLBA(theLBA);
+  }
+
+  /*! Drop the pairs of the range in the leaf at data, see dropPair. */
+  inline void
+  dropLeaf(register const uint8_t* const data,
+           register const unsigned int   keys)
+  {
+   register struct BPlusTree::leafReader reader;
+   register struct BPlusTree::leafEntry  entry;
+
+   BPlusTree::openLeaf(reader, data, isLittle);
+
+   for(register unsigned int i = 0; i < keys; i++)
+   {
+    BPlusTree::readLeaf(reader, entry);
+
+    if (inRange(entry.key))
+     dropPair(entry, false);
+   }
+  }
+
+  /*! A pair, or a message, of the range is dropped. If it is the newest
+      version of its key, the sectors of its value, if that is stored out
+      of line, are handed to the transaction. The pairs are met from the
+      root down, so the key of a message is kept to skip the older
+      versions below it. Those may share sectors with it, or have had
+      some given back already, see BPlusTree::writePart. */
+  inline void
+  dropPair(register const struct BPlusTree::leafEntry& entry,
+           register const bool                         isMessage)
+  {
+   register unsigned int low  = 0;
+   register unsigned int high = droppedCount;
+
+   while (low < high)
+   {
+    register const unsigned int middle = (low + high) / 2;
+    register const int          order  = compareKeys(droppedKeys[middle], entry.key);
+
+    if (!order)
+     return;
+
+    if (order < 0)
+     low = middle + 1;
+    else
+     high = middle;
+   }
+
+   if (isMessage)
+   {
+    if (droppedCount == droppedCapacity)
+    {
+     register const unsigned int newCapacity = droppedCapacity ? 2 * droppedCapacity : 64;
+     register Key* const         newKeys     = new Key[newCapacity];
+
+     assert(newKeys);
+
+     if (droppedCount)
+      memcpy(newKeys, droppedKeys, droppedCount * sizeof(Key));
+
+     delete [] droppedKeys;
+
+     droppedKeys     = newKeys;
+     droppedCapacity = newCapacity;
+    }
+
+    memmove(droppedKeys + low + 1, droppedKeys + low, (droppedCount - low) * sizeof(Key));
+
+    droppedKeys[low] = entry.key;
+    droppedCount++;
+   }
+
+   if (!entry.isLocation || !entry.payload)
+    return;
+
+   register struct BPlusTree::valueExtents extents;
+
+   BPlusTree::readExtents(extents, entry, isLittle);
+
+   register const unsigned int sectors = (extents.size + sectorSize - 1) / sectorSize;
+
+   for(register unsigned int sector = 0; sector < sectors; sector++)
+   {
+    register struct LBA theLBA;
+
+    BPlusTree::extentLBAs(&theLBA, extents, sector, 1);
+    transaction->releaseLBA(theLBA);
+   }
+  }
+
+  inline void
+  releasePrivateNode(register const struct LBA theLBA)
+  {
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, device, theLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t* data = cacheEntry->getDataPointer();
+
+   if (!cacheEntry->isPrivate(transaction))
+   {
+    cacheEntry->unlock(data, cacheEntry, transaction);
+    return;
+   }
+
+   if (!(fromFileSystemEndian(&((const struct BPlusTree::header*) data)->spaceUsedNFlags, isLittle) &
+         BPlusTree::isLeaf))
+   {
+    register const unsigned int children = BPlusTree::nodeKeys(data, isLittle) + 1;
+
+    for(register unsigned int child = 0; child < children; child++)
+     releasePrivateNode(childLBA(data, child));
+   }
+
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   transaction->releaseLBA(theLBA);
+  }
+
+  inline Key
+  separator(register const uint8_t* const data,
+            register const unsigned int   child) const
+  {
+   return BPlusTree::separatorAt(data, child, isLittle);
+  }
+
+  inline struct LBA
+  childLBA(register const uint8_t* const data,
+           register const unsigned int   child) const
+  {
+   return BPlusTree::childAt(data, child, isLittle);
+  }
+
+  /*! Same rule as BPlusTree::insert for values given their own sector. */
+  static inline bool
+  isIndirect(register const Serializable& value)
+  {
+   return value.size() > (sectorSize - sizeof(struct BPlusTree::header) - sizeof(struct BPlusTree::leafKey));
+  }
+
+  /*! A cleared sector for the next node: that of reuse if it is still
+      unused, a new one otherwise. */
+  inline uint8_t*
+  newNode(register class BlockCacheEntry* & cacheEntry,
+          register bool&                    reused,
+          register class BlockCacheEntry* & reuse)
+  {
+   register enum BlockCache::BlockCacheError cacheError;
+
+   reused = (reuse != 0);
+
+   if (reused)
+   {
+    cacheEntry = reuse;
+    reuse      = 0;
+   }
+   else if (!BlockCache::getInstance().allocate(cacheEntry, cacheError, transaction))
+    assert(0);
+
+   register uint8_t* const data = cacheEntry->getDataPointer();
+
+   assert(data);
+
+   memset(data, 0, sectorSize);
+
+   ((struct BPlusTree::header*) data)->version = BPlusTree::version | (isLittle ? 0 : BPlusTree::bigEndian);
+
+   return data;
+  }
+
+  /*! Close the leaf, keyed by firstKey, and hand back the key of the
+      leaf that starts with nextKey: the shortest separator between the
+      two. */
+  inline Key
+  closeLeaf(register childList&               out,
+            register const Key                firstKey,
+            register const Key                nextKey,
+            register class BlockCacheEntry* & reuse,
+            register const struct LBA         nodeLBA)
+  {
+   register const Key lastKey = leaf.lastKey();
+
+   out.add(firstKey, closeLeaf(reuse, nodeLBA), true);
+
+   return BPlusTree::shortestSeparator(lastKey, nextKey);
+  }
+
+  inline struct LBA
+  closeLeaf(register class BlockCacheEntry* & reuse,
+            register const struct LBA         nodeLBA)
+  {
+   register class BlockCacheEntry* cacheEntry;
+   register bool                   reused;
+   register uint8_t* const         data = newNode(cacheEntry, reused, reuse);
+
+   assert(leaf.count());
+
+   leaf.write(data, isLittle);
+   leaf.reset();
+
+   return closeNode(cacheEntry, reused, nodeLBA);
+  }
+
+  /*! Seal a finished node and give it a home, the sector of the node at
+      nodeLBA if it was reused. */
+  inline struct LBA
+  closeNode(register class BlockCacheEntry* & cacheEntry,
+            register const bool               reused,
+            register const struct LBA         nodeLBA)
+  {
+   register uint8_t* data = cacheEntry->getDataPointer();
+
+   BPlusTree::seal(data, isLittle);
+
+   if (reused)
+   {
+    cacheEntry->unlock(data, cacheEntry, transaction);
+    return nodeLBA;
+   }
+
+   return finishSector(cacheEntry, data);
+  }
+
+  /*! The sector stays in the cache, owned by the transaction, until it
+      commits. */
+  inline struct LBA
+  finishSector(register class BlockCacheEntry* & cacheEntry,
+               register uint8_t* &               data)
+  {
+   register struct LBA                       theLBA;
+   register enum FileSystem::FileSystemError fileSystemError;
+
+   if (!transaction->getFileSystem()->getAvailableLBA(theLBA, fileSystemError))
+    assert(0);
+
+   if (!cacheEntry->setLBA(device, theLBA))
+    assert(0);
+
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   return theLBA;
+  }
+};
+
+#endif
@@ -0,0 +1,495 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef BPLUSTREEBUILDER_HPP
+# define BPLUSTREEBUILDER_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <string.h>
+
+# include <Globals.hpp>
+# include <Key.hpp>
+# include <LBA.hpp>
+# include <BlockCacheEntry.hpp>
+# include <BlockCache.hpp>
+# include <FileSystem.hpp>
+# include <Transaction.hpp>
+# include <BPlusTree.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <Serializable.hpp>
+
+/*! A sorted stream of <key, value> pairs for BPlusTreeBuilder. */
+class BulkLoadSource
+{
+ public:
+  /*! Produce the next pair. Keys must be strictly ascending. The value
+      must stay valid until the following call. Returns false at the
+      end of the stream. */
+  virtual bool
+  next(register Key&                 key,
+       register const Serializable*& value) = 0;
+};
+
+/*! Builds a BPlusTree bottom-up from keys given in ascending order.
+    Leaves are packed full and each finished node is handed to the
+    internal level above, so every node is built and written exactly
+    once. Finished nodes are written in large batches of consecutive
+    LBAs and then left in the cache as ordinary clean sectors, so the
+    size of a load is not bounded by the cache.
+
+    Given an existing tree the builder merges: the old pairs are streamed
+    in through a cursor and interleaved with the new ones, new values
+    replacing old values with the same key. Values stored out of line in
+    the old tree are shared, not copied. */
+class BPlusTreeBuilder
+{
+ public:
+  enum BPlusTreeBuilderError
+  {
+   noError = 0,
+   keyOutOfOrder
+  };
+
+  inline
+  BPlusTreeBuilder()
+  {
+   transaction = 0;
+   device      = 0;
+  }
+
+  inline
+  ~BPlusTreeBuilder()
+  {
+   assert(!transaction);
+  }
+
+  /*! Start a load into a copy of tree, which may be empty. */
+  inline bool
+  start(register enum BPlusTreeBuilderError& error,
+        register const class BPlusTree* const tree,
+        register class Transaction* const     transaction)
+  {
+   assert(tree);
+   assert(transaction);
+   assert(!this->transaction);
+
+   this->transaction = transaction;
+   this->device      = tree->rootDevice;
+
+   register class BlockCacheEntry*           cacheEntry;
+   register enum BlockCache::BlockCacheError cacheError;
+
+   /* New nodes keep the byte order of the tree. */
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, transaction, device, tree->rootLBA,
+                                             BPlusTree::verifyNode))
+    assert(0);
+
+   register uint8_t* data = cacheEntry->getDataPointer();
+
+   isLittle = (((struct BPlusTree::header*) data)->version & BPlusTree::bigEndian) != BPlusTree::bigEndian;
+   cacheEntry->unlock(data, cacheEntry, transaction);
+
+   height        = 1;
+   pendingCount  = 0;
+
+   leaf.reset();
+   hasLastKey    = false;
+
+   for(register unsigned int i = 0; i < maxDepth; i++)
+   {
+    levels[i].cacheEntry = 0;
+    levels[i].entries    = 0;
+    levels[i].emitted    = 0;
+
+    internal[i].reset();
+   }
+
+   register Key                                        first    = {.type = 0, .major = 0, .minor = 0};
+   register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+
+   /* An empty tree simply leaves the cursor closed. */
+   existing.seek(cursorError, tree, transaction, first);
+
+   error = noError;
+   return true;
+  }
+
+  inline bool
+  add(register enum BPlusTreeBuilderError& error,
+      register const Key                   key,
+      register const Serializable&         value)
+  {
+   assert(transaction);
+
+   if (hasLastKey && (compareKeys(key, lastKey) <= 0))
+   {
+    error = keyOutOfOrder;
+    return false;
+   }
+
+   hasLastKey = true;
+   lastKey    = key;
+
+   /* Old pairs in front of the new key go first, an equal one is
+      replaced. */
+   register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+
+   while (existing.isValid())
+   {
+    register const int order = compareKeys(existing.getKey(), key);
+
+    if (order > 0)
+     break;
+
+    if (order < 0)
+     copyExisting();
+
+    existing.next(cursorError);
+   }
+
+   register struct BPlusTree::leafEntry entry;
+   register uint8_t                     payload[sectorSize];
+
+   entry.key        = key;
+   entry.payload    = payload;
+   entry.isLocation = false;
+
+   if (value.size() > (sectorSize - sizeof(struct BPlusTree::header) - sizeof(struct BPlusTree::leafKey)))
+   {
+    /* Same rule as BPlusTree::insert, the value gets sectors of its own. */
+    register class BlockCacheEntry* sectors[ValueView::maxSectors];
+
+    BPlusTree::writeExtent(*(struct BPlusTree::leafLocation*) payload, value, device, transaction, isLittle, sectors);
+
+    for(register unsigned int i = 0; i < BPlusTree::extentSectors(value.size()); i++)
+     queueSector(sectors[i]);
+
+    entry.isLocation = true;
+    entry.size       = sizeof(struct BPlusTree::leafLocation);
+   }
+   else
+   {
+    if (!value.toFileSystem(payload, isLittle))
+     assert(0);
+
+    entry.size = value.size();
+   }
+
+   addToLeaf(entry);
+
+   error = noError;
+   return true;
+  }
+
+  /*! Copy the rest of the old tree, close every level and return the new
+      tree. */
+  inline bool
+  finish(register enum BPlusTreeBuilderError& error,
+         register const class BPlusTree* &    newTree)
+  {
+   assert(transaction);
+
+   register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+
+   while (existing.isValid())
+   {
+    copyExisting();
+    existing.next(cursorError);
+   }
+
+   register struct LBA rootLBA;
+
+   for(register unsigned int level = 0; ; level++)
+   {
+    assert(level < height);
+
+    register struct openNode& node   = levels[level];
+    register const bool       isTop  = (level == height - 1) && !node.emitted;
+
+    if (isTop)
+    {
+     /* An internal root needs at least two children. */
+     if ((level > 0) && (node.entries == 1))
+      rootLBA = node.firstChild;
+     else
+     {
+      if (!node.cacheEntry)
+       openNode(level);
+
+      closeNode(level, rootLBA);
+     }
+
+     break;
+    }
+
+    if (!node.entries)
+     continue;
+
+    if ((level > 0) && (node.entries == 1))
+    {
+     /* A lone child is linked straight to the level above. Lookups go by
+        the node type, not the depth, so the tree stays searchable. */
+     register const struct LBA child = node.firstChild;
+
+     BlockCache::getInstance().detach(node.cacheEntry);
+     node.cacheEntry->unlock(node.data, node.cacheEntry, transaction);
+     discard(node);
+     internal[level].reset();
+     addToInternal(level + 1, node.firstKey, child);
+    }
+    else
+    {
+     register struct LBA theLBA;
+
+     closeNode(level, theLBA);
+     addToInternal(level + 1, node.firstKey, theLBA);
+    }
+   }
+
+   flushPending();
+
+   newTree = new BPlusTree(device, rootLBA);
+   assert(newTree);
+
+   existing.close();
+   transaction = 0;
+
+   error = noError;
+   return true;
+  }
+
+ private:
+  static const unsigned int
+  maxDepth = 16;
+
+  /*! Finished sectors are written in batches of this many. */
+  static const unsigned int
+  maxPending = 256;
+
+  struct openNode
+  {
+   class BlockCacheEntry* cacheEntry;
+   uint8_t*               data;
+   /*! Keys in a leaf, children in an internal node. */
+   unsigned int           entries;
+   Key                    firstKey;
+   /*! Only used to promote a lone child. */
+   struct LBA             firstChild;
+   /*! Nodes already closed on this level. */
+   unsigned int           emitted;
+  } levels[maxDepth];
+
+  class Transaction*        transaction;
+  class VirtualBlockDevice* device;
+  unsigned int              height;
+  bool                      isLittle;
+
+  class BlockCacheEntry*    pending[maxPending];
+  unsigned int              pendingCount;
+
+  BPlusTreeCursor           existing;
+
+  /*! Pairs of the open leaf, written to its sector when it is closed. */
+  BPlusTree::leafBuilder    leaf;
+
+  /*! Children of the open internal node of each level. */
+  BPlusTree::internalBuilder internal[maxDepth];
+
+  Key                       lastKey;
+  bool                      hasLastKey;
+
+  /*! Move the pair under the cursor over as it is. */
+  inline void
+  copyExisting(void)
+  {
+   /* Values are moved over byte for byte. */
+   assert(existing.path[existing.depth - 1].isLittle == isLittle);
+
+   addToLeaf(existing.currentEntry());
+  }
+
+  /*! Queue a filled sector for writing. It stays pinned until then. */
+  inline void
+  finishSector(register class BlockCacheEntry* const cacheEntry,
+               register const struct LBA             theLBA)
+  {
+   if (!cacheEntry->setLBA(device, theLBA))
+    assert(0);
+
+   queueSector(cacheEntry);
+  }
+
+  inline void
+  queueSector(register class BlockCacheEntry* const cacheEntry)
+  {
+   if (pendingCount == maxPending)
+    flushPending();
+
+   pending[pendingCount++] = cacheEntry;
+  }
+
+  inline void
+  flushPending(void)
+  {
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!pendingCount)
+    return;
+
+   if (!BlockCache::getInstance().write(cacheError, pending, pendingCount))
+    assert(0);
+
+   for(register unsigned int i = 0; i < pendingCount; i++)
+   {
+    register uint8_t* data = pending[i]->getDataPointer();
+
+    BlockCache::getInstance().detach(pending[i]);
+    pending[i]->unlock(data, pending[i], transaction);
+   }
+
+   pendingCount = 0;
+  }
+
+  inline void
+  openNode(register const unsigned int level)
+  {
+   register struct openNode& node = levels[level];
+
+   assert(!node.cacheEntry);
+
+   /* The LBA is taken when the node is closed so the nodes of a level
+      end up next to each other. */
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().allocate(node.cacheEntry, cacheError, transaction))
+    assert(0);
+
+   node.data = node.cacheEntry->getDataPointer();
+   assert(node.data);
+
+   memset(node.data, 0, sectorSize);
+
+   node.entries = 0;
+
+   if (level >= height)
+   {
+    assert(level == height);
+    assert(level < maxDepth);
+
+    height++;
+   }
+  }
+
+  static inline void
+  discard(register struct openNode& node)
+  {
+   node.cacheEntry = 0;
+   node.data       = 0;
+   node.entries    = 0;
+  }
+
+  inline void
+  closeNode(register const unsigned int level,
+            register struct LBA&        theLBA)
+  {
+   register struct openNode&                 node = levels[level];
+   register enum FileSystem::FileSystemError fileSystemError;
+
+   assert(node.cacheEntry);
+
+   if (level == 0)
+   {
+    leaf.write(node.data, isLittle);
+    leaf.reset();
+   }
+   else
+   {
+    assert(node.entries >= 2);
+
+    internal[level].write(node.data, isLittle);
+    internal[level].reset();
+   }
+
+   BPlusTree::seal(node.data, isLittle);
+
+   if (!transaction->getFileSystem()->getAvailableLBA(theLBA, fileSystemError))
+    assert(0);
+
+   /* The entry is detached once written, so the transaction keeps the
+      LBA itself to give it back if it aborts. */
+   transaction->writtenLBA(theLBA);
+
+   finishSector(node.cacheEntry, theLBA);
+
+   node.emitted++;
+   discard(node);
+  }
+
+  inline void
+  addToLeaf(register const struct BPlusTree::leafEntry& entry)
+  {
+   register struct openNode& node = levels[0];
+
+   if (!node.cacheEntry)
+    openNode(0);
+
+   if (!leaf.add(entry))
+   {
+    register struct LBA theLBA;
+    register const Key  firstKey    = node.firstKey;
+    register const Key  previousKey = leaf.lastKey();
+
+    closeNode(0, theLBA);
+    addToInternal(1, firstKey, theLBA);
+    openNode(0);
+
+    if (!leaf.add(entry))
+     assert(0);
+
+    /* The leaf is keyed by the shortest separator from the one before. */
+    node.firstKey = BPlusTree::shortestSeparator(previousKey, entry.key);
+   }
+   else if (leaf.count() == 1)
+    node.firstKey = entry.key;
+
+   node.entries = leaf.count();
+  }
+
+  inline void
+  addToInternal(register const unsigned int level,
+                register const Key          key,
+                register const struct LBA   child)
+  {
+   assert(level > 0);
+   assert(level < maxDepth);
+
+   register struct openNode& node = levels[level];
+
+   if (!node.cacheEntry)
+    openNode(level);
+
+   if (!internal[level].add(key, child))
+   {
+    register struct LBA theLBA;
+    register const Key  firstKey = node.firstKey;
+
+    closeNode(level, theLBA);
+    addToInternal(level + 1, firstKey, theLBA);
+    openNode(level);
+
+    if (!internal[level].add(key, child))
+     assert(0);
+   }
+
+   node.entries    = internal[level].count();
+   node.firstKey   = internal[level].firstKey();
+   node.firstChild = internal[level].firstChild();
+  }
+};
+
+#endif
@@ -0,0 +1,443 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef BPLUSTREECURSOR_HPP
+# define BPLUSTREECURSOR_HPP
+
+# include <assert.h>
+# include <stdint.h>
+
+# include <Globals.hpp>
+# include <Key.hpp>
+# include <LBA.hpp>
+# include <BlockCacheEntry.hpp>
+# include <BlockCache.hpp>
+# include <BPlusTree.hpp>
+# include <Serializable.hpp>
+
+/*! Ordered scan over a BPlusTree. The cursor keeps every node from the
+    root down to the current leaf pinned in the block cache, so stepping
+    to the neighbouring leaf only climbs as far as the nearest common
+    ancestor. When the scan enters a leaf the next few leaves in the scan
+    direction are read into the cache with one vectored request.
+
+    The cursor sees the tree it was positioned on. It must be closed, or
+    destroyed, before the transaction that opened it ends. It only reads
+    leaves, so a buffered tree must be drained first, see
+    BPlusTreeBatch::drain. */
+class BPlusTreeCursor
+{
+ friend class BPlusTreeBuilder;
+ friend class BPlusTreeBatch;
+
+ public:
+  enum BPlusTreeCursorError
+  {
+   noError = 0,
+   endOfTree,
+   dataTooBig,
+   sizeIsNotAcceptable
+  };
+
+  static const unsigned int
+  defaultPrefetchDepth = 8;
+
+  inline
+  BPlusTreeCursor()
+  {
+   depth         = 0;
+   device        = 0;
+   transaction   = 0;
+   prefetchDepth = defaultPrefetchDepth;
+   prefetchedTo  = -1;
+   hasEntry      = false;
+  }
+
+  inline
+  ~BPlusTreeCursor()
+  {
+   close();
+  }
+
+  /*! Position the cursor on the first key at or after key. Fails with
+      endOfTree if there is no such key. */
+  inline bool
+  seek(register enum BPlusTreeCursorError&  error,
+       register const class BPlusTree* const tree,
+       register class Transaction* const     transaction,
+       register const Key                    key)
+  {
+   assert(tree);
+
+   close();
+
+   this->device      = tree->rootDevice;
+   this->transaction = transaction;
+
+   if (!descend(tree->rootLBA))
+    assert(0);
+
+   /* Walk down the tree keeping the path pinned. */
+   while (!top().isLeaf)
+   {
+    register unsigned int keyIndex;
+
+    if (!BPlusTree::search(keyIndex, top().data, top().keys, false, top().isLittle, key))
+     assert(0);
+
+    top().index = keyIndex;
+
+    if (!descend(childLBA(top(), keyIndex)))
+     assert(0);
+   }
+
+   register unsigned int keyIndex;
+
+   /* A hit is one based, a miss gives the number of smaller keys. */
+   if (BPlusTree::search(keyIndex, top().data, top().keys, true, top().isLittle, key))
+    keyIndex--;
+
+   top().index = keyIndex;
+   prefetch(true);
+
+   if (keyIndex >= top().keys)
+    return next(error);
+
+   error = noError;
+   return true;
+  }
+
+  /*! Step to the following key. Fails with endOfTree, and closes the
+      cursor, when there is none. */
+  inline bool
+  next(register enum BPlusTreeCursorError& error)
+  {
+   assert(depth);
+
+   if (top().index < top().keys)
+    top().index++;
+
+   while (top().index >= top().keys)
+   {
+    if (!stepLeaf(true))
+    {
+     close();
+     error = endOfTree;
+     return false;
+    }
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! Step to the preceding key. Fails with endOfTree, and closes the
+      cursor, when there is none. */
+  inline bool
+  previous(register enum BPlusTreeCursorError& error)
+  {
+   assert(depth);
+
+   while (top().index == 0)
+   {
+    if (!stepLeaf(false))
+    {
+     close();
+     error = endOfTree;
+     return false;
+    }
+
+    top().index = top().keys;
+   }
+
+   top().index--;
+
+   error = noError;
+   return true;
+  }
+
+  inline bool
+  isValid(void) const
+  {
+   return depth > 0;
+  }
+
+  inline Key
+  getKey(void) const
+  {
+   assert(isValid());
+
+   return currentEntry().key;
+  }
+
+  /*! Read the value under the cursor, same rules as BPlusTree::lookup. */
+  inline bool
+  read(register Serializable&              destination,
+       register uint_fast32_t&             size,
+       register enum BPlusTreeCursorError& error) const
+  {
+   assert(isValid());
+
+   register const struct BPlusTree::leafEntry& entry    = currentEntry();
+   register const bool                         isLittle = path[depth - 1].isLittle;
+   register const uint_fast32_t                dataSize = BPlusTree::valueSize(entry, isLittle);
+
+   size = dataSize;
+
+   if (destination.size() < dataSize)
+   {
+    error = dataTooBig;
+    return false;
+   }
+
+   if (!destination.isSizeAcceptable(dataSize))
+   {
+    error = sizeIsNotAcceptable;
+    return false;
+   }
+
+   if (!entry.isLocation)
+   {
+    if (!destination.fromFileSystem(entry.payload, dataSize, isLittle))
+     assert(0);
+   }
+   else
+   {
+    ValueView                               view;
+    register struct BPlusTree::valueExtents extents;
+
+    BPlusTree::readExtents(extents, entry, isLittle);
+    BPlusTree::viewExtent(view, extents, device, transaction, isLittle);
+
+    if (!BPlusTree::fromView(destination, view))
+     assert(0);
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! How many leaves to read ahead. Zero disables read ahead. */
+  inline void
+  setPrefetchDepth(register const unsigned int prefetchDepth)
+  {
+   this->prefetchDepth = prefetchDepth;
+  }
+
+  /*! Release the pinned path. */
+  inline void
+  close(void)
+  {
+   while (depth)
+    ascend();
+
+   prefetchedTo = -1;
+  }
+
+ private:
+  /*! Enough for any tree that fits in 2^64 sectors. */
+  static const unsigned int
+  maxDepth = 16;
+
+  struct level
+  {
+   class BlockCacheEntry* cacheEntry;
+   uint8_t*               data;
+   /*! Child index in internal nodes, zero based key index in leaves. */
+   unsigned int           index;
+   unsigned int           keys;
+   bool                   isLeaf;
+   bool                   isLittle;
+  } path[maxDepth];
+
+  unsigned int              depth;
+  class VirtualBlockDevice* device;
+  class Transaction*        transaction;
+  unsigned int              prefetchDepth;
+  /*! Last child of the leaf parent already read ahead, in the direction
+      of the scan. */
+  int                       prefetchedTo;
+
+  mutable struct BPlusTree::leafReader reader;
+  mutable struct BPlusTree::leafEntry  entry;
+  mutable unsigned int                 entryIndex;
+  mutable bool                         hasEntry;
+
+  inline struct level&
+  top(void)
+  {
+   assert(depth);
+
+   return path[depth - 1];
+  }
+
+  /*! The pair under the cursor, decoded once. Stepping forward in a
+      packed leaf decodes on from the previous pair. */
+  inline const struct BPlusTree::leafEntry&
+  currentEntry(void) const
+  {
+   register const struct level& leaf = path[depth - 1];
+
+   assert(leaf.isLeaf);
+   assert(leaf.index < leaf.keys);
+
+   if (!hasEntry || (entryIndex != leaf.index))
+   {
+    BPlusTree::seekLeaf(reader, leaf.index);
+    BPlusTree::readLeaf(reader, entry);
+
+    entryIndex = leaf.index;
+    hasEntry   = true;
+   }
+
+   return entry;
+  }
+
+  static inline struct LBA
+  childLBA(register const struct level& level,
+           register const unsigned int  child)
+  {
+   assert(!level.isLeaf);
+   assert(child <= level.keys);
+
+   return BPlusTree::childAt(level.data, child, level.isLittle);
+  }
+
+  inline bool
+  descend(register const struct LBA theLBA)
+  {
+   assert(depth < maxDepth);
+
+   register struct level&                    level = path[depth];
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().readLookup(level.cacheEntry, cacheError, transaction, device, theLBA,
+                                             BPlusTree::verifyNode))
+    return false;
+
+   level.data = level.cacheEntry->getDataPointer();
+
+   register const struct BPlusTree::header* const header = (const struct BPlusTree::header*) level.data;
+
+   if (!BPlusTree::isSupportedVersion(header->version))
+   {
+    /* unsupported version. */
+    assert(0);
+   }
+
+   level.isLittle = (header->version & BPlusTree::bigEndian) != BPlusTree::bigEndian;
+   level.keys     = BPlusTree::nodeKeys(level.data, level.isLittle);
+   level.isLeaf   = (fromFileSystemEndian(&header->spaceUsedNFlags, level.isLittle) & BPlusTree::isLeaf) != 0;
+   level.index    = 0;
+
+   if (level.isLeaf)
+   {
+    BPlusTree::openLeaf(reader, level.data, level.isLittle);
+    hasEntry = false;
+   }
+
+   depth++;
+   return true;
+  }
+
+  inline void
+  ascend(void)
+  {
+   assert(depth);
+
+   depth--;
+   path[depth].cacheEntry->unlock(path[depth].data, path[depth].cacheEntry, transaction);
+  }
+
+  /*! Move to the neighbouring leaf. The new leaf is entered at its first
+      key going forward and past its last key going backward. */
+  inline bool
+  stepLeaf(register const bool forward)
+  {
+   register unsigned int level = depth - 1;
+
+   /* Find the nearest ancestor with a child left in that direction. */
+   do
+   {
+    if (!level)
+     return false;
+
+    level--;
+   } while (forward ? (path[level].index >= path[level].keys) : (path[level].index == 0));
+
+   register const bool leafParentChanged = (level != depth - 2);
+
+   while (depth > level + 1)
+    ascend();
+
+   if (leafParentChanged)
+    prefetchedTo = -1;
+
+   top().index += forward ? 1 : -1;
+
+   /* Back down along the edge closest to where we came from. */
+   for(;;)
+   {
+    if (!descend(childLBA(top(), top().index)))
+     assert(0);
+
+    if (top().isLeaf)
+     break;
+
+    top().index = forward ? 0 : top().keys;
+   }
+
+   top().index = 0;
+   prefetch(forward);
+
+   return true;
+  }
+
+  /*! Read ahead the leaves following the current one. */
+  inline void
+  prefetch(register const bool forward)
+  {
+   if (!prefetchDepth || (depth < 2))
+    return;
+
+   register const struct level& parent = path[depth - 2];
+   register const int           child  = parent.index;
+
+   /* Only issue a new request when the scan has caught up. */
+   if ((prefetchedTo >= 0) &&
+       (forward ? (child < prefetchedTo) : (child > prefetchedTo)))
+    return;
+
+   register struct LBA   theLBAs[maxPrefetchDepth];
+   register unsigned int count = 0;
+   register int          last  = child;
+
+   for(register int i = child + (forward ? 1 : -1);
+       (i >= 0) && (i <= (int) parent.keys) &&
+       (count < prefetchDepth) && (count < maxPrefetchDepth);
+       i += forward ? 1 : -1)
+   {
+    theLBAs[count++] = childLBA(parent, i);
+    last             = i;
+   }
+
+   prefetchedTo = last;
+
+   if (!count)
+    return;
+
+   register enum BlockCache::BlockCacheError cacheError;
+
+   /* Read ahead is only a hint, a failure shows up again on the visit. */
+   BlockCache::getInstance().prefetch(cacheError, device, theLBAs, count, BPlusTree::verifyNode);
+  }
+
+  static const unsigned int
+  maxPrefetchDepth = 64;
+};
+
+#endif
@@ -0,0 +1,23 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef BATCHOPERATION_HPP
+# define BATCHOPERATION_HPP
+
+# include <Key.hpp>
+# include <Serializable.hpp>
+
+/*! One mutation in a batch given to Transaction::applyBatch. */
+struct BatchOperation
+{
+ Key                 key;
+ /*! The value to store under key, or 0 to remove key. Removing a key
+     that is not in the tree is not an error. */
+ const Serializable* value;
+};
+
+#endif
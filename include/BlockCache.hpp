@@ -9,33 +9,60 @@
 # define BLOCKCACHE_HPP
 
 # include <assert.h>
+# include <stdlib.h>
+# include <pthread.h>
 
 # include <LBA.hpp>
 # include <BlockCacheEntry.hpp>
 # include <VirtualBlockDevice.hpp>
 
+/*! Threads share the cache. Every call takes its lock for as long as it
+    looks at or changes the entries, the hash table or the clock, device
+    I/O included. Pins are counted atomically, so an entry is unlocked
+    without it. Nothing that takes a lock is called with it held, other
+    than the devices. */
 class BlockCache
 {
  public:
   enum BlockCacheError
   {
-   noError = 0
+   noError = 0,
+   deviceError,
+   checksumError,
+   /*! Every entry is locked, allocated or a leader. */
+   outOfEntries
   };
 
+  /*! Checks the contents of a sector just read from its device. */
+  typedef bool (*verifyFunction)(register const uint8_t* const data);
+
+  /*! Most sectors one prefetch reads, the rest are left out. */
+  static const unsigned int
+  maxPrefetch = 64;
+
   static inline BlockCache& 
   getInstance()
   {
    return instance;
   }
 
+  /*! If verify is given it is run on the sector when it has to be read
+      from the device. A sector that fails it is not cached and the lookup
+      fails with checksumError. */
   inline bool
   readLookup(register BlockCacheEntry* &              returnedCacheEntry,
              register enum BlockCacheError&           error,
              register const class Transaction* const  transaction,
              register class VirtualBlockDevice* const device,
-             register const struct LBA                theLBA)
+             register const struct LBA                theLBA,
+             register const verifyFunction            verify = 0)
   {
-   return lookup(returnedCacheEntry, error, transaction, device, theLBA, false);
+   enter();
+
+   register const bool success = lookup(returnedCacheEntry, error, transaction, device, theLBA, false, verify);
+
+   leave();
+   return success;
   }
    
 
@@ -46,7 +73,12 @@ class BlockCache
                   register class VirtualBlockDevice* const device,
                   register const struct LBA                theLBA)
   {
-   return lookup(returnedCacheEntry, error, transaction, device, theLBA, true);
+   enter();
+
+   register const bool success = lookup(returnedCacheEntry, error, transaction, device, theLBA, true);
+
+   leave();
+   return success;
   }
 
   inline bool
@@ -54,9 +86,17 @@ class BlockCache
            register enum BlockCacheError&          error,
            register const class Transaction* const transaction)
   {
+   enter();
+
    register unsigned int index = findEntry();
 
-   assert(index < cacheEntries);
+   if (index == cacheEntries)
+   {
+    leave();
+
+    error = outOfEntries;
+    return false;
+   }
 
    entries[index].locked    = 0;
    entries[index].lock();
@@ -65,11 +105,57 @@ class BlockCache
    entries[index].setDirty();
    entries[index].leader  = false;
 
+   leave();
+
    returnedCacheEntry = &entries[index];
    error = noError;
    return true;
   }
 
+  /*! Give cacheEntry the location theLBA on device, see
+      BlockCacheEntry::setLBA. */
+  inline bool
+  setLBA(register class BlockCacheEntry* const    cacheEntry,
+         register class VirtualBlockDevice* const device,
+         register const struct LBA                theLBA)
+  {
+   enter();
+
+   register const bool success = cacheEntry->addLocation(device, theLBA);
+
+   leave();
+   return success;
+  }
+
+  /*! Hand the entries a transaction allocated, chained by next, over to
+      the cache as ordinary sectors, when its tree is about to be made
+      current. Other threads may read them from then on. */
+  inline void
+  adopt(register class BlockCacheEntry* allocatedEntries)
+  {
+   enter();
+
+   while (allocatedEntries)
+   {
+    register class BlockCacheEntry* const cacheEntry = allocatedEntries;
+
+    /* The entry may be handed to another transaction later. */
+    allocatedEntries = cacheEntry->next;
+    cacheEntry->next = 0;
+
+    for(register unsigned int location = 0;
+        location < BlockCacheEntry::maxLocations;
+        location++)
+     cacheEntry->locations[location].transactional = false;
+
+    cacheEntry->allocated   = false;
+    cacheEntry->transaction = 0;
+   }
+
+   leave();
+  }
+
+  /*! The caller holds the lock of the cache. */
   inline void
   addToHashTable(register BlockCacheEntry* const cacheEntry,
                  register unsigned int location)
@@ -89,6 +175,7 @@ class BlockCache
    hashBuckets[hashIndex] = cacheEntry;
   }
 
+  /*! As addToHashTable. */
   inline void
   removeFromHashTable(register const BlockCacheEntry* const cacheEntry,
                       register unsigned int location)
@@ -109,10 +196,356 @@ class BlockCache
    hashBuckets[hashIndex] = (BlockCacheEntry*) 0x1;
   }
 
+  /*! Write back every dirty entry that is not owned by a running
+      transaction. The entries are handed to their devices in LBA order
+      and in large batches so that the devices can merge consecutive
+      sectors and spread the writes over their members. */
+  inline bool
+  flush(register enum BlockCacheError& error)
+  {
+   register struct flushRequest batch[maxFlush];
+   register bool                more = true;
+
+   enter();
+
+   while (more)
+   {
+    register class VirtualBlockDevice* device = 0;
+    register unsigned int              count  = 0;
+
+    more = false;
+
+    for(register unsigned int i = 0; i < cacheEntries; i++)
+    {
+     if (!entries[i].dirty || entries[i].pins())
+      continue;
+
+     register int         location      = -1;
+     register bool        transactional = false;
+
+     for(register unsigned int j = 0; j < BlockCacheEntry::maxLocations; j++)
+     {
+      if (entries[i].locations[j].valid)
+      {
+       /*! \todo handle the case when multiple locations are placed on an entry. */
+       assert(location < 0);
+       location = j;
+      }
+
+      if (entries[i].locations[j].transactional)
+       transactional = true;
+     }
+
+     if (transactional)
+      continue;
+
+     if (location < 0)
+     {
+      /* Never given a location, nothing to write. */
+      entries[i].dirty = false;
+      continue;
+     }
+
+     if (!device)
+      device = entries[i].locations[location].device;
+
+     if ((entries[i].locations[location].device != device) ||
+         (count == maxFlush))
+     {
+      more = true;
+      continue;
+     }
+
+     batch[count].cacheEntry = &entries[i];
+     batch[count].theLBA     = entries[i].locations[location].lba;
+     count++;
+    }
+
+    if (!count)
+     break;
+
+    if (!writeBatch(error, device, batch, count))
+    {
+     leave();
+     return false;
+    }
+   }
+
+   leave();
+
+   error = noError;
+   return true;
+  }
+
+  /*! Bring the given sectors into the cache without pinning them, so a
+      later lookup finds them. Sectors already cached are skipped and the
+      rest are read with a single vectored request. If the cache runs out
+      of entries the sectors found room for are still read, and the
+      prefetch fails with outOfEntries. */
+  inline bool
+  prefetch(register enum BlockCacheError&           error,
+           register class VirtualBlockDevice* const device,
+           register const struct LBA* const         theLBAs,
+           register const unsigned int              count,
+           register const verifyFunction            verify = 0)
+  {
+   register class BlockCacheEntry* batchEntries[maxPrefetch];
+   register struct LBA             batchLBAs[maxPrefetch];
+   register unsigned int           batched = 0;
+   register bool                   full    = false;
+
+   assert(device);
+
+   enter();
+
+   for(register unsigned int i = 0; (i < count) && (batched < maxPrefetch); i++)
+   {
+    if (findInHashTable(device, theLBAs[i]))
+     continue;
+
+    register const unsigned int index = findEntry();
+
+    if (index == cacheEntries)
+    {
+     full = true;
+     break;
+    }
+
+    /* Keep the entry locked until it is filled so findEntry does not hand
+       it out again. */
+    entries[index].locked    = 0;
+    entries[index].lock();
+    entries[index].allocated = false;
+    entries[index].accessed  = true;
+    entries[index].dirty     = false;
+    entries[index].leader    = false;
+
+    batchEntries[batched] = &entries[index];
+    batchLBAs[batched]    = theLBAs[i];
+    batched++;
+   }
+
+   if (!batched)
+   {
+    leave();
+
+    error = full ? outOfEntries : noError;
+    return !full;
+   }
+
+   register enum VirtualBlockDevice::VirtualBlockDeviceError blockError;
+   register const bool success = device->readSectors(blockError, batchEntries, batchLBAs, batched);
+
+   for(register unsigned int i = 0; i < batched; i++)
+   {
+    if (success &&
+        (!verify || verify(batchEntries[i]->getDataPointerUnsafe())))
+     batchEntries[i]->addLocation(device, batchLBAs[i]);
+    else
+     batchEntries[i]->accessed = false;
+
+    batchEntries[i]->locked = 0;
+   }
+
+   leave();
+
+   if (!success)
+   {
+    error = deviceError;
+    return false;
+   }
+
+   error = full ? outOfEntries : noError;
+   return !full;
+  }
+
+  /*! Take an allocated entry away from its transaction and leave it in
+      the cache as an ordinary sector that may be evicted. The entry must
+      have been written back, or never been given a location. */
+  inline void
+  detach(register class BlockCacheEntry* const cacheEntry)
+  {
+   register bool hasLocation = false;
+
+   assert(cacheEntry->pins());
+   assert(!cacheEntry->transaction);
+
+   enter();
+
+   for(register unsigned int location = 0; location < BlockCacheEntry::maxLocations; location++)
+   {
+    if (cacheEntry->locations[location].valid)
+     hasLocation = true;
+
+    cacheEntry->locations[location].transactional = false;
+   }
+
+   assert(!hasLocation || !cacheEntry->dirty);
+
+   cacheEntry->allocated = false;
+
+   if (!hasLocation)
+    cacheEntry->dirty = false;
+
+   leave();
+  }
+
+  /*! Drop what the cache holds for theLBA without writing it back, its
+      contents are no longer needed. */
+  inline void
+  forget(register const class VirtualBlockDevice* const device,
+         register const struct LBA                      theLBA)
+  {
+   enter();
+
+   register BlockCacheEntry* const cacheEntry = findInHashTable(device, theLBA);
+
+   if (!cacheEntry)
+   {
+    leave();
+    return;
+   }
+
+   assert(!cacheEntry->pins());
+   assert(!cacheEntry->allocated);
+
+   register bool hasLocation = false;
+
+   for(register unsigned int location = 0; location < BlockCacheEntry::maxLocations; location++)
+   {
+    if (!cacheEntry->locations[location].valid)
+     continue;
+
+    if ((cacheEntry->locations[location].device == device) &&
+        (cacheEntry->locations[location].lba.theLBA == theLBA.theLBA))
+    {
+     removeFromHashTable(cacheEntry, location);
+     cacheEntry->locations[location].valid = false;
+    }
+    else
+     hasLocation = true;
+   }
+
+   if (!hasLocation)
+   {
+    cacheEntry->dirty    = false;
+    cacheEntry->accessed = false;
+   }
+
+   leave();
+  }
+
+  /*! Give back an entry of a transaction that aborts, without writing
+      it. It is handed out again before the clock looks any further. */
+  inline void
+  discard(register class BlockCacheEntry* const cacheEntry)
+  {
+   assert(!cacheEntry->pins());
+   assert(cacheEntry->allocated);
+
+   enter();
+
+   for(register unsigned int location = 0; location < BlockCacheEntry::maxLocations; location++)
+   {
+    if (cacheEntry->locations[location].valid)
+     removeFromHashTable(cacheEntry, location);
+
+    cacheEntry->locations[location].valid         = false;
+    cacheEntry->locations[location].transactional = false;
+   }
+
+   cacheEntry->allocated   = false;
+   cacheEntry->accessed    = false;
+   cacheEntry->dirty       = false;
+   cacheEntry->transaction = 0;
+
+   if (freeCount < cacheEntries)
+    freeEntries[freeCount++] = cacheEntry - entries;
+
+   leave();
+  }
+
+  /*! Write the given entries back now, whoever owns them, and mark them
+      clean. Entries that never got a location are skipped. */
+  inline bool
+  write(register enum BlockCacheError&               error,
+        register class BlockCacheEntry* const* const writeEntries,
+        register const unsigned int                  count)
+  {
+   register struct flushRequest        batch[maxFlush];
+   register class VirtualBlockDevice*  device = 0;
+   register unsigned int               batched = 0;
+
+   enter();
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    register class BlockCacheEntry* const cacheEntry = writeEntries[i];
+    register int                          location   = -1;
+
+    assert(cacheEntry);
+
+    for(register unsigned int j = 0; j < BlockCacheEntry::maxLocations; j++)
+    {
+     if (cacheEntry->locations[j].valid)
+     {
+      /*! \todo handle the case when multiple locations are placed on an entry. */
+      assert(location < 0);
+      location = j;
+     }
+    }
+
+    if (location < 0)
+    {
+     cacheEntry->dirty = false;
+     continue;
+    }
+
+    if (!cacheEntry->dirty)
+     continue;
+
+    if (batched &&
+        ((batched == maxFlush) || (cacheEntry->locations[location].device != device)))
+    {
+     if (!writeBatch(error, device, batch, batched))
+     {
+      leave();
+      return false;
+     }
+
+     batched = 0;
+    }
+
+    device                     = cacheEntry->locations[location].device;
+    batch[batched].cacheEntry  = cacheEntry;
+    batch[batched].theLBA      = cacheEntry->locations[location].lba;
+    batched++;
+   }
+
+   register const bool success = !batched || writeBatch(error, device, batch, batched);
+
+   leave();
+
+   if (!success)
+    return false;
+
+   error = noError;
+   return true;
+  }
+
  private: 
   static const unsigned int
   cacheEntries = 16 * 1024;
 
+  static const unsigned int
+  maxFlush = 1024;
+
+  struct flushRequest
+  {
+   struct LBA             theLBA;
+   class BlockCacheEntry* cacheEntry;
+  };
+
   static BlockCache
   instance;
 
@@ -124,11 +557,25 @@ class BlockCache
 
   unsigned int
   clockIndex;
+
+  /*! Entries given back by discard. */
+  unsigned int
+  freeEntries[cacheEntries];
+
+  unsigned int
+  freeCount;
+
+  pthread_mutex_t
+  cacheLock;
   
   inline
   BlockCache()
   {
    clockIndex = 0;
+   freeCount  = 0;
+
+   if (pthread_mutex_init(&cacheLock, 0))
+    assert(0);
     
    for(register unsigned int i = 0; i < BlockCacheEntry::maxLocations * cacheEntries; i++)
     hashBuckets[i] = 0;   
@@ -138,7 +585,14 @@ class BlockCache
   ~BlockCache()
   {
    register bool rerun = true;
-   /* Write out all cache entries on exit. */
+   register enum BlockCacheError error;
+
+   /* Write out all cache entries on exit, in as few device requests as
+      possible. Anything still left dirty is pushed out by the clock. */
+   if (!flush(error))
+    assert(0);
+
+   enter();
 
    while(rerun)
    {
@@ -146,32 +600,70 @@ class BlockCache
 
     for(register unsigned int i = 0; i < cacheEntries; i++)
     {
-     assert(!entries[i].locked);
+     assert(!entries[i].pins());
 
      while(entries[i].dirty)
      {
       rerun = true;
-      findEntry();
+
+      if (findEntry() == cacheEntries)
+       assert(0);
      }
     }
    }
+
+   leave();
   }
 
+  inline void
+  enter(void)
+  {
+   if (pthread_mutex_lock(&cacheLock))
+    assert(0);
+  }
+
+  inline void
+  leave(void)
+  {
+   if (pthread_mutex_unlock(&cacheLock))
+    assert(0);
+  }
+
+  /*! The index of an entry that may be reused, or cacheEntries if every
+      entry is locked, allocated or a leader. The first pass clears the
+      accessed bits, so two passes find an entry if there is one. */
   inline unsigned int
   findEntry(void)
   {
-   bool          done = false;
-   unsigned int returnValue;
-   
+   /* Entries given back go first, unless they were taken by the clock
+      since. */
+   while (freeCount)
+   {
+    register class BlockCacheEntry& entry  = entries[freeEntries[--freeCount]];
+    register bool                   unused = !entry.pins() && !entry.allocated && !entry.leader;
+
+    for(register unsigned int location = 0; location < BlockCacheEntry::maxLocations; location++)
+     unused = unused && !entry.locations[location].valid;
+
+    if (unused)
+     return freeEntries[freeCount];
+   }
+
    /*! \todo rewrite into not using fields directly. */
-   for(; !done; clockIndex = (clockIndex + 1) % cacheEntries)
+   for(register unsigned int swept = 0;
+       swept < 2 * cacheEntries;
+       swept++, clockIndex = (clockIndex + 1) % cacheEntries)
    {
-    if (entries[clockIndex].locked)
+    if (entries[clockIndex].pins())
      continue;
 
     if (entries[clockIndex].leader)
      continue;    
 
+    /* Owned by a running transaction until it ends. */
+    if (entries[clockIndex].allocated)
+     continue;
+
     if (entries[clockIndex].accessed)
     {
      entries[clockIndex].accessed = false;
@@ -210,9 +702,10 @@ class BlockCache
        alreadyWritten = true;
       }
      }
-       
+
+     /* Written back, and not accessed since the last pass, so it goes
+        like a clean entry would. */
      entries[clockIndex].dirty = false;
-     continue;
     }
 
     for(register unsigned int location = 0; location < BlockCacheEntry::maxLocations; location++)
@@ -223,45 +716,79 @@ class BlockCache
      entries[clockIndex].locations[location].valid = false;
     }
     
-    done = true;
-    returnValue = clockIndex;
+    register const unsigned int returnValue = clockIndex;
+
+    clockIndex = (clockIndex + 1) % cacheEntries;
+    return returnValue;
    }
 
-   return returnValue;
+   return cacheEntries;
   }
 
-  inline unsigned int
-  calculateHashIndex(register const class VirtualBlockDevice* const device,
-                     register const struct LBA                      lba)
+  static int
+  compareFlushRequests(register const void* const left,
+                       register const void* const right)
   {
-   register const unsigned int hashIndex =
-    (((uintptr_t)device) ^
-     (((uintptr_t)device) >> 32) ^
-     lba.theLBA ^
-     lba.theLBA >> 32) %
-     (BlockCacheEntry::maxLocations * cacheEntries);
-   assert(hashIndex < (BlockCacheEntry::maxLocations * cacheEntries));
+   register const uint_fast64_t leftLBA  = ((const struct flushRequest*) left)->theLBA.theLBA;
+   register const uint_fast64_t rightLBA = ((const struct flushRequest*) right)->theLBA.theLBA;
 
-   return hashIndex;
+   return (leftLBA > rightLBA) - (leftLBA < rightLBA);
   }
 
   inline bool
-  lookup(register BlockCacheEntry* &              returnedCacheEntry,
-         register enum BlockCacheError&           error,
-         register const class Transaction* const  transaction,
-         register class VirtualBlockDevice* const device,
-         register const struct LBA                theLBA,
-         register const bool                      write)
+  writeBatch(register enum BlockCacheError&           error,
+             register class VirtualBlockDevice* const device,
+             register struct flushRequest* const      batch,
+             register const unsigned int              count)
+  {
+   register class BlockCacheEntry* batchEntries[maxFlush];
+   register struct LBA             theLBAs[maxFlush];
+
+   assert(device);
+   assert(count <= maxFlush);
+
+   qsort(batch, count, sizeof(batch[0]), compareFlushRequests);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    batchEntries[i] = batch[i].cacheEntry;
+    theLBAs[i]      = batch[i].theLBA;
+   }
+
+   register enum VirtualBlockDevice::VirtualBlockDeviceError blockError;
+
+   if (!device->writeSectors(blockError, batchEntries, theLBAs, count))
+   {
+    error = deviceError;
+    return false;
+   }
+
+   assert(blockError == VirtualBlockDevice::noError);
+
+   for(register unsigned int i = 0; i < count; i++)
+    batch[i].cacheEntry->dirty = false;
+
+   error = noError;
+   return true;
+  }
+
+  inline BlockCacheEntry*
+  findInHashTable(register const class VirtualBlockDevice* const device,
+                  register const struct LBA                      theLBA)
   {
    register unsigned int hashIndex = calculateHashIndex(device,
                                                         theLBA); 
    
    assert(hashIndex < (BlockCacheEntry::maxLocations * cacheEntries));
 
+   /* Tombstones are skipped, they are never valid. */
    for(;
        hashBuckets[hashIndex];
        hashIndex = (hashIndex + 1) % (BlockCacheEntry::maxLocations * cacheEntries))
    {
+    if ((uintptr_t)hashBuckets[hashIndex] == 0x1)
+     continue;
+
     for(register unsigned int location = 0;
         location < BlockCacheEntry::maxLocations;
         location++)
@@ -269,36 +796,70 @@ class BlockCache
      if (hashBuckets[hashIndex]->locations[location].valid &&
          (hashBuckets[hashIndex]->locations[location].device == device) &&
          (hashBuckets[hashIndex]->locations[location].lba.theLBA == theLBA.theLBA))
-      goto done;
+      return hashBuckets[hashIndex];
     }
    }
 
-done:
-   if (hashBuckets[hashIndex])
+   return 0;
+  }
+
+  inline unsigned int
+  calculateHashIndex(register const class VirtualBlockDevice* const device,
+                     register const struct LBA                      lba)
+  {
+   register const unsigned int hashIndex =
+    (((uintptr_t)device) ^
+     (((uintptr_t)device) >> 32) ^
+     lba.theLBA ^
+     lba.theLBA >> 32) %
+     (BlockCacheEntry::maxLocations * cacheEntries);
+   assert(hashIndex < (BlockCacheEntry::maxLocations * cacheEntries));
+
+   return hashIndex;
+  }
+
+  inline bool
+  lookup(register BlockCacheEntry* &              returnedCacheEntry,
+         register enum BlockCacheError&           error,
+         register const class Transaction* const  transaction,
+         register class VirtualBlockDevice* const device,
+         register const struct LBA                theLBA,
+         register const bool                      write,
+         register const verifyFunction            verify = 0)
+  {
+   register BlockCacheEntry* const cachedEntry = findInHashTable(device, theLBA);
+
+   if (cachedEntry)
    {
+    /* Nodes are never changed in place so any number of readers may pin
+       an entry at the same time. */
     /*! \todo add readers-writer locking. */
-    assert(!hashBuckets[hashIndex]->locked);
+    assert(!write || !cachedEntry->pins());
 
-    if (hashBuckets[hashIndex]->allocated &&
-        (hashBuckets[hashIndex]->transaction != transaction))
+    if (cachedEntry->allocated &&
+        (cachedEntry->transaction != transaction))
      assert(0);
    
-    hashBuckets[hashIndex]->lock();
+    cachedEntry->lock();
 
     if (write)
-     hashBuckets[hashIndex]->setDirty();
+     cachedEntry->setDirty();
 
-    hashBuckets[hashIndex]->accessed = true;
+    cachedEntry->accessed = true;
    
-    returnedCacheEntry = hashBuckets[hashIndex];
+    returnedCacheEntry = cachedEntry;
     error = noError;
     return true;
    }
 
    /* Load the sector. */
    register unsigned int index = findEntry();
-   
-   assert(index < cacheEntries);
+
+   if (index == cacheEntries)
+   {
+    error = outOfEntries;
+    return false;
+   }
 
    entries[index].locked    = 0;
    entries[index].lock();
@@ -322,7 +883,18 @@ done:
 
    assert(blockError == VirtualBlockDevice::noError);
 
-   entries[index].setLBA(device, theLBA);
+   if (verify && !verify(entries[index].getDataPointerUnsafe()))
+   {
+    /* Torn or misdirected write. Give the entry back unhashed. */
+    entries[index].locked   = 0;
+    entries[index].accessed = false;
+    entries[index].dirty    = false;
+
+    error = checksumError;
+    return false;
+   }
+
+   entries[index].addLocation(device, theLBA);
    
    returnedCacheEntry = &entries[index];
    error = noError;
@@ -31,7 +31,7 @@ class BlockCacheEntry
          register class BlockCacheEntry* & entryPointer,
          register class Transaction* const transaction)
   {
-   assert(locked);
+   assert(pins());
 
    if (allocated)
    {
@@ -43,7 +43,7 @@ class BlockCacheEntry
     }
    }
 
-   locked--;
+   __atomic_sub_fetch(&locked, 1, __ATOMIC_RELEASE);
    dataPointer  = 0;
    entryPointer = 0;
   }
@@ -51,11 +51,22 @@ class BlockCacheEntry
   uint8_t*
   getDataPointer(void)
   {
-   assert(locked);
+   assert(pins());
    
    return data;
   }
 
+  /*! True if transaction allocated the entry and holds the only pin on
+      it. Nobody else can see such a sector, so it may be changed in
+      place. */
+  inline bool
+  isPrivate(register const class Transaction* const transaction) const
+  {
+   assert(pins());
+
+   return allocated && (this->transaction == transaction) && (pins() == 1);
+  }
+
   /* Not inlined. In BlockCacheEntry.cpp */
   bool
   setLBA(register class VirtualBlockDevice* device,
@@ -112,7 +123,7 @@ class BlockCacheEntry
   inline void
   setDirty(void)
   {
-   assert(locked);
+   assert(pins());
    
    dirty = true;
   }
@@ -120,10 +131,22 @@ class BlockCacheEntry
   inline void
   lock(void)
   {
-   assert(locked < UINT32_MAX);
+   assert(pins() < UINT32_MAX);
    
-   locked++;
+   __atomic_add_fetch(&locked, 1, __ATOMIC_ACQUIRE);
+  }
+
+  /*! The number of pins, which other threads may drop at any time. */
+  inline uint32_t
+  pins(void) const
+  {
+   return __atomic_load_n(&locked, __ATOMIC_ACQUIRE);
   }
+
+  /* Not inlined. In BlockCacheEntry.cpp */
+  bool
+  addLocation(register class VirtualBlockDevice* device,
+              register const struct LBA          lba);
 };
 
 #endif
@@ -8,6 +8,7 @@
 # include <sys/stat.h>
 # include <unistd.h>
 # include <fcntl.h>
+# include <sys/uio.h>
 
 # include <Globals.hpp>
 # include <LBA.hpp>
@@ -27,17 +28,15 @@ class BlockDevice : public VirtualBlockDevice
   {
    assert(devicefd != -1);
    assert(theLBA.theLBA < sectors);
-
-   register const off_t off = lseek(devicefd, sectorSize * theLBA.theLBA, SEEK_SET);
-
-   assert(off == sectorSize * theLBA.theLBA);
    assert(cacheEntry);
    
    register uint8_t* const data = cacheEntry->getDataPointer();
  
    assert(data);
 
-   register const ssize_t readError = read(devicefd, data, sectorSize);
+   /* pread leaves the file offset alone so members of a striped or
+      mirrored device can be driven from several threads. */
+   register const ssize_t readError = pread(devicefd, data, sectorSize, sectorSize * theLBA.theLBA);
 
    assert(readError == sectorSize);
 
@@ -52,17 +51,13 @@ class BlockDevice : public VirtualBlockDevice
   {
    assert(devicefd != -1);
    assert(theLBA.theLBA < sectors);
-
-   register const off_t off = lseek(devicefd, sectorSize * theLBA.theLBA, SEEK_SET);
-
-   assert(off == sectorSize * theLBA.theLBA);
    assert(cacheEntry);
    
    register const uint8_t* const data = cacheEntry->getDataPointerUnsafe();
  
    assert(data);
 
-   register const ssize_t writeError = write(devicefd, data, sectorSize);
+   register const ssize_t writeError = pwrite(devicefd, data, sectorSize, sectorSize * theLBA.theLBA);
 
    assert(writeError == sectorSize);
 
@@ -70,6 +65,39 @@ class BlockDevice : public VirtualBlockDevice
    return true;
   }
 
+  inline bool
+  readSectors(register enum VirtualBlockDeviceError&       error,
+              register class BlockCacheEntry* const* const cacheEntries,
+              register const struct LBA* const             theLBAs,
+              register const unsigned int                  count)
+  {
+   return transfer(error, cacheEntries, theLBAs, count, false);
+  }
+
+  inline bool
+  writeSectors(register enum VirtualBlockDeviceError&       error,
+               register class BlockCacheEntry* const* const cacheEntries,
+               register const struct LBA* const             theLBAs,
+               register const unsigned int                  count)
+  {
+   return transfer(error, cacheEntries, theLBAs, count, true);
+  }
+
+  inline bool
+  sync(register enum VirtualBlockDeviceError& error)
+  {
+   assert(devicefd != -1);
+
+   if (fdatasync(devicefd))
+   {
+    error = deviceError;
+    return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
   inline bool
   getSizeInSectors(register struct LBA& size) const
   {
@@ -79,6 +107,54 @@ class BlockDevice : public VirtualBlockDevice
   }
    
  private:
+  static const unsigned int
+  maxRun = 64;
+
+  /*! Merge runs of consecutive LBAs into single preadv/pwritev calls. */
+  inline bool
+  transfer(register enum VirtualBlockDeviceError&       error,
+           register class BlockCacheEntry* const* const cacheEntries,
+           register const struct LBA* const             theLBAs,
+           register const unsigned int                  count,
+           register const bool                          write)
+  {
+   assert(devicefd != -1);
+
+   register struct iovec vector[maxRun];
+   register unsigned int i = 0;
+
+   while (i < count)
+   {
+    register unsigned int run = 0;
+
+    do
+    {
+     assert(cacheEntries[i + run]);
+     assert(theLBAs[i + run].theLBA < sectors);
+
+     vector[run].iov_base = write ?
+                            cacheEntries[i + run]->getDataPointerUnsafe() :
+                            cacheEntries[i + run]->getDataPointer();
+     vector[run].iov_len  = sectorSize;
+     run++;
+    } while ((i + run < count) &&
+             (run < maxRun) &&
+             (theLBAs[i + run].theLBA == theLBAs[i].theLBA + run));
+
+    register const off_t   offset = sectorSize * theLBAs[i].theLBA;
+    register const ssize_t done   = write ?
+                                    pwritev(devicefd, vector, run, offset) :
+                                    preadv(devicefd, vector, run, offset);
+
+    assert(done == (ssize_t) (run * sectorSize));
+
+    i += run;
+   }
+
+   error = noError;
+   return true;
+  }
+
   inline
   BlockDevice(register const char* const devicePath)
   {
@@ -0,0 +1,293 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef BULKLOADSTRESSTESTEVENTLISTENER_HPP
+# define BULKLOADSTRESSTESTEVENTLISTENER_HPP
+
+# include <assert.h>
+# include <stdint.h>
+
+# include <EventListener.hpp>
+
+# include <EventListenerManager.hpp>
+# include <UUID.hpp>
+# include <FileSystemManager.hpp>
+# include <TransactionManager.hpp>
+# include <FileSystem.hpp>
+# include <SubTreeTransaction.hpp>
+# include <SubTreeBlobKey.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <RawData.hpp>
+
+class BulkLoadStressTestEventListener : public EventListener
+{
+ public:
+  inline
+  BulkLoadStressTestEventListener()
+  {
+   alreadyRun = false;
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().registerListener(error, this, __func__))
+   {
+    assert(0);
+   }
+   
+   assert(error == EventListenerManager::noError);
+  }
+
+  inline virtual bool
+  handleEvent(register unsigned int&            receiver,
+              register class Event*&            outgoingEvent,
+              register const unsigned int       sender,
+              register const class Event* const incomingEvent)
+  {
+   
+   /* Consume event when done with it. */
+   delete incomingEvent;
+
+   if (alreadyRun)
+    return false;
+
+   alreadyRun = true;
+
+   register struct UUID fsUUID = {1, 0};
+   register enum FileSystemManager::FileSystemManagerError
+   fileSystemManagerError;
+
+   class FileSystem* fileSystem = 0;
+  
+   /* Lookup the precreated file system. */ 
+   if(!FileSystemManager::getInstance().getFileSystem(fileSystem, fileSystemManagerError, fsUUID))
+   {
+    assert(0);
+   }
+
+   assert(fileSystem);
+   assert(fileSystemManagerError == FileSystemManager::noError); 
+
+   register class SubTreeTransaction*
+   transaction;
+
+   register enum TransactionManager::TransactionManagerError
+   transactionManagerError;
+
+   register struct UUID subTreeUUID = {0x8000000000000000, 0};
+ 
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+   {
+    /*! \todo add error handling. */
+    assert(0);
+   }
+
+   assert(transactionManagerError == TransactionManager::noError);
+
+   /* File operations can be done on sub tree. */
+
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   struct SubTreeBlobKey subKey;
+ 
+   if (!transaction->allocateBlob(subKey, transactionError, SubTreeBlobKey::data))
+   {
+    assert(0);
+   }
+
+   assert(transactionError == SubTreeTransaction::noError);
+
+   /* Load the even minors, then merge the odd ones in. Every 1000th
+      value is too big to be stored in a leaf. */
+   {
+    Source even(0, 2);
+
+    if (!transaction->bulkInsertData(transactionError, subKey, even))
+     assert(0);
+
+    assert(transactionError == SubTreeTransaction::noError);
+
+    Source odd(1, 2);
+
+    if (!transaction->bulkInsertData(transactionError, subKey, odd))
+     assert(0);
+
+    assert(transactionError == SubTreeTransaction::noError);
+   }
+
+   /* The loaded tree must still take ordinary updates. */
+   for(uint64_t minor = 0; minor < keys; minor += 97)
+   {
+    const uint16_t value = ~minor;
+
+    if(!transaction->insertData(transactionError, (const uint8_t*) &value, sizeof(value), subKey, minor))
+     assert(0);
+
+    assert(transactionError == SubTreeTransaction::noError);
+   }
+
+   /* Check every value in order. */
+   {
+    register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+    register const struct Key                           firstKey = transaction->getTreeKey(subKey, 0);
+    BPlusTreeCursor                                     cursor;
+    uint64_t                                            minor    = 0;
+
+    if (!transaction->seekData(cursor, transactionError, subKey, 0))
+     assert(0);
+
+    do
+    {
+     const struct Key key = cursor.getKey();
+
+     if ((key.type != firstKey.type) || (key.major != firstKey.major))
+      break;
+
+     assert(key.minor == minor);
+
+     static uint8_t readData[sectorSize];
+     uint_fast32_t  readSize = sizeof(readData);
+     RawData        rawData(readData, readSize);
+
+     if (!cursor.read(rawData, readSize, cursorError))
+      assert(0);
+
+     check(minor, readData, readSize, (minor % 97) == 0);
+
+     minor++;
+    } while (cursor.next(cursorError));
+
+    assert(minor == keys);
+   }
+
+   /* And a few point lookups. */
+   for(uint64_t minor = 0; minor < keys; minor += 1013)
+   {
+    static uint8_t readData[sectorSize];
+    uint_fast32_t  readSize = sizeof(readData);
+
+    if(!transaction->lookupData(readData, readSize, transactionError, subKey, minor))
+     assert(0);
+
+    assert(transactionError == SubTreeTransaction::noError);
+
+    check(minor, readData, readSize, (minor % 97) == 0);
+   }
+
+   /* End transaction. */
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+   {
+    /*! \todo add error handling. */
+    assert(0);
+   }
+
+   assert(transactionManagerError == TransactionManager::noError);
+
+   /* An aborted load gives back the nodes it wrote. The second one takes
+      them all from what the first gave back, and gives them back again. */
+   for(register unsigned int run = 0; run < 2; run++)
+   {
+    register const uint64_t free      = fileSystem->getFreeLBAs();
+    register const uint64_t handedOut = fileSystem->getHandedOutLBAs();
+
+    if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+     assert(0);
+
+    Source odd(1, 2);
+
+    if (!transaction->bulkInsertData(transactionError, subKey, odd))
+     assert(0);
+
+    if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, transaction))
+     assert(0);
+
+    assert(fileSystem->getHandedOutLBAs() > handedOut);
+    assert(fileSystem->getFreeLBAs() >= fileSystem->getHandedOutLBAs() - handedOut);
+    assert(!run || (fileSystem->getFreeLBAs() == free));
+   }
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().deRegisterListener(error, this))
+   {
+    assert(0);
+   }
+   
+   assert(error == EventListenerManager::noError);
+   
+   return false;
+  }
+
+ private:
+  static const uint64_t
+  keys = 100000;
+
+  /*! Every step-th minor starting at first, in order. */
+  class Source : public BulkLoadSource
+  {
+   public:
+    inline
+    Source(register const uint64_t first,
+           register const uint64_t step)
+    {
+     this->minor = first;
+     this->step  = step;
+    }
+
+    inline bool
+    next(register Key&                 key,
+         register const Serializable*& value)
+    {
+     if (minor >= keys)
+      return false;
+
+     register const uint_fast32_t size = ((minor % 1000) == 0) ? sectorSize : sizeof(uint64_t);
+
+     for(register unsigned int i = 0; i < size; i++)
+      data[i] = minor + i;
+
+     rawData = RawData(data, size);
+
+     key.type  = 0;
+     key.major = 0;
+     key.minor = minor;
+     value     = &rawData;
+
+     minor += step;
+     return true;
+    }
+
+   private:
+    uint64_t minor;
+    uint64_t step;
+    uint8_t  data[sectorSize];
+    RawData  rawData;
+  };
+
+  static inline void
+  check(register const uint64_t       minor,
+        register const uint8_t* const data,
+        register const uint_fast32_t  size,
+        register const bool           updated)
+  {
+   if (updated)
+   {
+    assert(size == sizeof(uint16_t));
+    assert(*(const uint16_t*) data == (uint16_t) ~minor);
+    return;
+   }
+
+   assert(size == (((minor % 1000) == 0) ? sectorSize : sizeof(uint64_t)));
+
+   for(register unsigned int i = 0; i < size; i++)
+    assert(data[i] == (uint8_t) (minor + i));
+  }
+
+  bool alreadyRun;
+};
+
+#endif
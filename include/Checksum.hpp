@@ -0,0 +1,96 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef CHECKSUM_HPP
+# define CHECKSUM_HPP
+
+# include <assert.h>
+# include <stddef.h>
+# include <stdint.h>
+
+/*! CRC32C (Castagnoli) as used by iSCSI, ext4 and btrfs. The SSE4.2
+    crc32 instruction is used when the processor has it, otherwise a
+    slicing table. The choice is made once, on the first call, and
+    published atomically, so threads may make that call at the same
+    time. */
+class Checksum
+{
+ public:
+  static inline uint32_t
+  crc32c(register const void* const data,
+         register const size_t      length)
+  {
+   return ~update(~0U, data, length);
+  }
+
+  /*! Continue a running CRC. Start with ~0 and invert the result, or use
+      crc32c() for a single buffer. */
+  static inline uint32_t
+  update(register const uint32_t    crc,
+         register const void* const data,
+         register const size_t      length)
+  {
+   return __atomic_load_n(&implementation, __ATOMIC_ACQUIRE)(crc, (const uint8_t*) data, length);
+  }
+
+  /*! True if the hardware implementation is in use. */
+  static bool
+  isAccelerated(void);
+
+  /*! update with the slicing table, whatever the processor has. For
+      tests and benchmarks. */
+  static inline uint32_t
+  updateSoftware(register const uint32_t    crc,
+                 register const void* const data,
+                 register const size_t      length)
+  {
+   /* Sets up the table. */
+   isAccelerated();
+
+   return software(crc, (const uint8_t*) data, length);
+  }
+
+  /*! update with the crc32 instruction. Only if isAccelerated(). */
+  static inline uint32_t
+  updateHardware(register const uint32_t    crc,
+                 register const void* const data,
+                 register const size_t      length)
+  {
+   if (!isAccelerated())
+    assert(0);
+
+   return hardware(crc, (const uint8_t*) data, length);
+  }
+
+ private:
+  typedef uint32_t (*crcFunction)(register const uint32_t       crc,
+                                  register const uint8_t* const data,
+                                  register const size_t         length);
+
+  /* Points at the resolver until the first call, which stores the
+     implementation with release order. update loads it with acquire
+     order, so the table is set up for any thread that finds it. */
+  static crcFunction
+  implementation;
+
+  static uint32_t
+  resolve(register const uint32_t       crc,
+          register const uint8_t* const data,
+          register const size_t         length);
+
+  static uint32_t
+  hardware(register const uint32_t       crc,
+           register const uint8_t* const data,
+           register const size_t         length);
+
+  static uint32_t
+  software(register const uint32_t       crc,
+           register const uint8_t* const data,
+           register const size_t         length);
+};
+
+#endif
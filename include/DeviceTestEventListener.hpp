@@ -0,0 +1,677 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef DEVICETESTEVENTLISTENER_HPP
+# define DEVICETESTEVENTLISTENER_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <stdio.h>
+# include <string.h>
+# include <time.h>
+
+# include <EventListener.hpp>
+
+# include <EventListenerManager.hpp>
+# include <UUID.hpp>
+# include <FileSystemManager.hpp>
+# include <TransactionManager.hpp>
+# include <FileSystem.hpp>
+# include <BlockCache.hpp>
+# include <VirtualBlockDevice.hpp>
+# include <LatencyBlockDevice.hpp>
+# include <StripedBlockDevice.hpp>
+# include <MirroredBlockDevice.hpp>
+
+/*! Checks the block device decorators on their own, below the cache and
+    the file system. */
+class DeviceTestEventListener : public EventListener
+{
+ public:
+  inline
+  DeviceTestEventListener()
+  {
+   alreadyRun = false;
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().registerListener(error, this, __func__))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+  }
+
+  inline virtual bool
+  handleEvent(register unsigned int&            receiver,
+              register class Event*&            outgoingEvent,
+              register const unsigned int       sender,
+              register const class Event* const incomingEvent)
+  {
+
+   /* Consume event when done with it. */
+   delete incomingEvent;
+
+   if (alreadyRun)
+    return false;
+
+   alreadyRun = true;
+
+   testLatencyModel();
+   testSlowMember();
+
+   register struct UUID fsUUID = {1, 0};
+   register enum FileSystemManager::FileSystemManagerError
+   fileSystemManagerError;
+
+   class FileSystem* fileSystem = 0;
+
+   /* Lookup the precreated file system, its transactions hand out the
+      cache entries the sectors are moved through. */
+   if(!FileSystemManager::getInstance().getFileSystem(fileSystem, fileSystemManagerError, fsUUID))
+   {
+    assert(0);
+   }
+
+   assert(fileSystem);
+   assert(fileSystemManagerError == FileSystemManager::noError);
+
+   testStriping(fileSystem);
+   testMirroring(fileSystem);
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().deRegisterListener(error, this))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+   return false;
+  }
+
+ private:
+  /*! Takes every request and keeps nothing, so the decorator above it is
+      all that is measured. */
+  class NullBlockDevice : public VirtualBlockDevice
+  {
+   public:
+    inline bool
+    readSector(register enum VirtualBlockDeviceError& error,
+               register class BlockCacheEntry* const  cacheEntry,
+               register const struct LBA              theLBA)
+    {
+     error = noError;
+     return true;
+    }
+
+    inline bool
+    writeSector(register enum VirtualBlockDeviceError& error,
+                register class BlockCacheEntry* const  cacheEntry,
+                register const struct LBA              theLBA)
+    {
+     error = noError;
+     return true;
+    }
+
+    inline bool
+    getSizeInSectors(register struct LBA& size) const
+    {
+     size.theLBA = sectors;
+     return true;
+    }
+  };
+
+  /*! Keeps the sectors in memory, in place of a member file. Once set
+      to fail it fails every request, like a disk that died. */
+  class MemoryBlockDevice : public VirtualBlockDevice
+  {
+   public:
+    /*! Requests that reached the device, failed or not. */
+    unsigned int requests;
+    bool         failing;
+
+    inline
+    MemoryBlockDevice(register const uint_fast64_t sectors)
+    {
+     this->sectors = sectors;
+     requests      = 0;
+     failing       = false;
+     data          = new uint8_t[sectors * sectorSize];
+
+     assert(data);
+
+     memset(data, 0, sectors * sectorSize);
+    }
+
+    inline
+    ~MemoryBlockDevice()
+    {
+     delete [] data;
+    }
+
+    inline bool
+    readSector(register enum VirtualBlockDeviceError& error,
+               register class BlockCacheEntry* const  cacheEntry,
+               register const struct LBA              theLBA)
+    {
+     assert(theLBA.theLBA < sectors);
+
+     if (fail(error))
+      return false;
+
+     memcpy(cacheEntry->getDataPointer(), getSector(theLBA.theLBA), sectorSize);
+
+     error = noError;
+     return true;
+    }
+
+    inline bool
+    writeSector(register enum VirtualBlockDeviceError& error,
+                register class BlockCacheEntry* const  cacheEntry,
+                register const struct LBA              theLBA)
+    {
+     assert(theLBA.theLBA < sectors);
+
+     if (fail(error))
+      return false;
+
+     memcpy(getSector(theLBA.theLBA), cacheEntry->getDataPointer(), sectorSize);
+
+     error = noError;
+     return true;
+    }
+
+    inline bool
+    sync(register enum VirtualBlockDeviceError& error)
+    {
+     if (fail(error))
+      return false;
+
+     error = noError;
+     return true;
+    }
+
+    inline bool
+    getSizeInSectors(register struct LBA& size) const
+    {
+     size.theLBA = sectors;
+     return true;
+    }
+
+    inline uint8_t*
+    getSector(register const uint_fast64_t theLBA)
+    {
+     return &data[theLBA * sectorSize];
+    }
+
+   private:
+    uint8_t*      data;
+    uint_fast64_t sectors;
+
+    inline bool
+    fail(register enum VirtualBlockDeviceError& error)
+    {
+     requests++;
+
+     if (!failing)
+      return false;
+
+     error = deviceError;
+     return true;
+    }
+  };
+
+  static const uint_fast64_t sectors  = 1024 * 1024;
+  static const unsigned int  requests = 2000;
+
+  static const unsigned int  stripeMembers  = 3;
+  static const unsigned int  stripeUnit     = 4;
+  static const unsigned int  memberSectors  = 64;
+  static const unsigned int  stripeEntries  = 128;
+
+  static const unsigned int  mirrorMembers  = 2;
+  static const unsigned int  mirrorReads    = 1000;
+
+  bool alreadyRun;
+
+  /*! In nanoseconds. */
+  static inline uint64_t
+  now(void)
+  {
+   struct timespec time;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &time))
+    assert(0);
+
+   return ((uint64_t) time.tv_sec) * 1000000000ULL + time.tv_nsec;
+  }
+
+  /*! The same mix of single, vectored and sync requests every time. */
+  static inline void
+  runPattern(register class LatencyBlockDevice& device)
+  {
+   register enum VirtualBlockDevice::VirtualBlockDeviceError error;
+   register uint64_t                                         random = 42;
+   struct LBA                                                theLBAs[8];
+   class BlockCacheEntry*                                    cacheEntries[8] = {0};
+
+   for(register unsigned int i = 0; i < requests; i++)
+   {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+
+    register struct LBA theLBA;
+
+    theLBA.theLBA = random % (sectors - 8);
+
+    switch(i % 5)
+    {
+     case 0:
+      if (!device.readSector(error, 0, theLBA))
+       assert(0);
+      break;
+
+     case 1:
+      if (!device.writeSector(error, 0, theLBA))
+       assert(0);
+      break;
+
+     case 2:
+      /* Two runs of four. */
+      for(register unsigned int j = 0; j < 8; j++)
+       theLBAs[j].theLBA = theLBA.theLBA + j + ((j < 4) ? 0 : 1);
+
+      if (!device.writeSectors(error, cacheEntries, theLBAs, 8))
+       assert(0);
+      break;
+
+     case 3:
+      for(register unsigned int j = 0; j < 8; j++)
+       theLBAs[j].theLBA = theLBA.theLBA + j;
+
+      if (!device.readSectors(error, cacheEntries, theLBAs, 8))
+       assert(0);
+      break;
+
+     default:
+      if (!device.sync(error))
+       assert(0);
+    }
+   }
+  }
+
+  /*! Profiles run on virtual time, so the device time is the same for
+      the same seed, differs for another, and is not spent waiting. */
+  static inline void
+  testLatencyModel(void)
+  {
+   register class NullBlockDevice backing;
+
+   for(register unsigned int profile = LatencyBlockDevice::hddProfile;
+       profile <= LatencyBlockDevice::nvmeProfile;
+       profile++)
+   {
+    struct LatencyBlockDevice::Statistics statistics[3];
+    register const uint64_t               seeds[3] = {7, 7, 8};
+    register const uint64_t               start    = now();
+
+    for(register unsigned int run = 0; run < 3; run++)
+    {
+     register class LatencyBlockDevice device(&backing, (enum LatencyBlockDevice::Profile) profile, seeds[run]);
+
+     runPattern(device);
+     device.getStatistics(statistics[run]);
+    }
+
+    register const uint64_t elapsed = now() - start;
+
+    assert(statistics[0].reads == statistics[1].reads);
+    assert(statistics[0].writes == statistics[1].writes);
+    assert(statistics[0].syncs == statistics[1].syncs);
+    assert(statistics[0].seeks == statistics[1].seeks);
+    assert(statistics[0].deviceTime == statistics[1].deviceTime);
+    assert(statistics[0].responseTime == statistics[1].responseTime);
+
+    /* Only the jitter depends on the seed. */
+    assert(statistics[0].reads == statistics[2].reads);
+    assert(statistics[0].deviceTime != statistics[2].deviceTime);
+
+    assert(statistics[0].deviceTime);
+    assert(elapsed < statistics[0].deviceTime);
+
+    printf("DeviceTest: %s profile %llu ns simulated in %llu ns\n",
+           (profile == LatencyBlockDevice::hddProfile) ? "hdd" : "nvme",
+           (unsigned long long) statistics[0].deviceTime,
+           (unsigned long long) elapsed);
+   }
+  }
+
+  /*! Two members on virtual time, one of which takes far longer to read.
+      The mirror goes by the time the members charge, so once it has seen
+      both the reads stay on the fast one, single and vectored alike. */
+  static inline void
+  testSlowMember(void)
+  {
+   register class NullBlockDevice                   backing;
+   register enum VirtualBlockDevice::VirtualBlockDeviceError error;
+   register struct LatencyBlockDevice::Parameters  slow =
+    LatencyBlockDevice::getProfile(LatencyBlockDevice::nvmeProfile);
+
+   slow.readLatency *= 50;
+
+   register class LatencyBlockDevice fastMember(&backing, LatencyBlockDevice::nvmeProfile, 7);
+   register class LatencyBlockDevice slowMember(&backing, slow, 7);
+   class VirtualBlockDevice*         members[mirrorMembers] = {&fastMember, &slowMember};
+   register class MirroredBlockDevice mirrored(members, mirrorMembers);
+   struct LBA                        theLBAs[8];
+   class BlockCacheEntry*            cacheEntries[8] = {0};
+
+   for(register unsigned int i = 0; i < mirrorReads; i++)
+   {
+    register struct LBA theLBA;
+
+    theLBA.theLBA = (i * 8) % (sectors - 8);
+
+    if (!mirrored.readSector(error, 0, theLBA))
+     assert(0);
+
+    for(register unsigned int j = 0; j < 8; j++)
+     theLBAs[j].theLBA = theLBA.theLBA + j;
+
+    if (!mirrored.readSectors(error, cacheEntries, theLBAs, 8))
+     assert(0);
+   }
+
+   struct LatencyBlockDevice::Statistics fastStatistics;
+   struct LatencyBlockDevice::Statistics slowStatistics;
+
+   fastMember.getStatistics(fastStatistics);
+   slowMember.getStatistics(slowStatistics);
+
+   assert(fastStatistics.reads + slowStatistics.reads == mirrorReads * 9);
+   assert(slowStatistics.reads > 0);
+   assert(slowStatistics.reads * 100 < fastStatistics.reads);
+
+   printf("DeviceTest: slow mirror member served %llu of %u reads\n",
+          (unsigned long long) slowStatistics.reads, mirrorReads * 9);
+  }
+
+  /*! Every sector carries its own LBA. */
+  static inline void
+  stamp(register uint8_t* const      data,
+        register const uint_fast64_t theLBA)
+  {
+   register const uint64_t value = theLBA + 1;
+
+   for(register unsigned int i = 0; i < sectorSize; i += sizeof(value))
+    memcpy(&data[i], &value, sizeof(value));
+  }
+
+  static inline bool
+  isStamped(register const uint8_t* const data,
+            register const uint_fast64_t  theLBA)
+  {
+   register uint8_t expected[sectorSize];
+
+   stamp(expected, theLBA);
+
+   return !memcmp(data, expected, sectorSize);
+  }
+
+  /*! Ranges that cross stripe units, and wrap around the members, land
+      where the stripe layout puts them and read back whole, in one
+      vectored request and sector by sector. */
+  static inline void
+  testStriping(register class FileSystem* const fileSystem)
+  {
+   register enum TransactionManager::TransactionManagerError transactionManagerError;
+   register enum BlockCache::BlockCacheError                 cacheError;
+   register enum VirtualBlockDevice::VirtualBlockDeviceError error;
+   class Transaction*                                        holder;
+   static class BlockCacheEntry*                             cacheEntries[stripeEntries];
+   static struct LBA                                         theLBAs[stripeEntries];
+   static bool                                               written[stripeMembers * memberSectors];
+
+   if(!TransactionManager::getInstance().startTransaction(holder, transactionManagerError, fileSystem))
+    assert(0);
+
+   for(register unsigned int i = 0; i < stripeEntries; i++)
+    if (!BlockCache::getInstance().allocate(cacheEntries[i], cacheError, holder))
+     assert(0);
+
+   class MemoryBlockDevice* members[stripeMembers];
+
+   for(register unsigned int i = 0; i < stripeMembers; i++)
+    members[i] = new MemoryBlockDevice(memberSectors);
+
+   register class StripedBlockDevice* const striped =
+    new StripedBlockDevice((class VirtualBlockDevice* const*) members, stripeMembers, stripeUnit);
+   register struct LBA size;
+
+   if (!striped->getSizeInSectors(size))
+    assert(0);
+
+   assert(size.theLBA == stripeMembers * memberSectors);
+
+   /* Two runs starting and ending inside stripe units, and more of them
+      than there are members, written in one request. */
+   register unsigned int count = 0;
+
+   for(register uint_fast64_t theLBA = 2; theLBA < 41; theLBA++, count++)
+    theLBAs[count].theLBA = theLBA;
+
+   for(register uint_fast64_t theLBA = 110; theLBA < 127; theLBA++, count++)
+    theLBAs[count].theLBA = theLBA;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    stamp(cacheEntries[i]->getDataPointer(), theLBAs[i].theLBA);
+    written[theLBAs[i].theLBA] = true;
+   }
+
+   if (!striped->writeSectors(error, cacheEntries, theLBAs, count))
+    assert(0);
+
+   /* And one sector on its own. */
+   theLBAs[count].theLBA = 150;
+   stamp(cacheEntries[count]->getDataPointer(), theLBAs[count].theLBA);
+   written[theLBAs[count].theLBA] = true;
+
+   if (!striped->writeSector(error, cacheEntries[count], theLBAs[count]))
+    assert(0);
+
+   /* Unit u of the device is unit u / members of member u % members. */
+   for(register unsigned int member = 0; member < stripeMembers; member++)
+   {
+    for(register uint_fast64_t memberLBA = 0; memberLBA < memberSectors; memberLBA++)
+    {
+     register const uint_fast64_t theLBA =
+      ((memberLBA / stripeUnit) * stripeMembers + member) * stripeUnit + memberLBA % stripeUnit;
+     register const uint8_t* const data = members[member]->getSector(memberLBA);
+
+     if (written[theLBA])
+      assert(isStamped(data, theLBA));
+     else
+      assert(!data[0] && !memcmp(data, data + 1, sectorSize - 1));
+    }
+   }
+
+   /* Read back a range around the first run into other entries. */
+   count = 0;
+
+   for(register uint_fast64_t theLBA = 0; theLBA < 45; theLBA++, count++)
+    theLBAs[count].theLBA = theLBA;
+
+   if (!striped->readSectors(error, &cacheEntries[stripeEntries - count], theLBAs, count))
+    assert(0);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    register const uint8_t* const data = cacheEntries[stripeEntries - count + i]->getDataPointer();
+
+    if (written[theLBAs[i].theLBA])
+     assert(isStamped(data, theLBAs[i].theLBA));
+    else
+     assert(!data[0] && !memcmp(data, data + 1, sectorSize - 1));
+   }
+
+   for(register unsigned int i = 0; i < stripeMembers * memberSectors; i++)
+   {
+    if (!written[i])
+     continue;
+
+    register struct LBA theLBA;
+
+    theLBA.theLBA = i;
+
+    if (!striped->readSector(error, cacheEntries[0], theLBA))
+     assert(0);
+
+    assert(isStamped(cacheEntries[0]->getDataPointer(), i));
+   }
+
+   delete striped;
+
+   for(register unsigned int i = 0; i < stripeMembers; i++)
+    delete members[i];
+
+   register uint8_t* dataPointer;
+
+   for(register unsigned int i = 0; i < stripeEntries; i++)
+    cacheEntries[i]->unlock(dataPointer, cacheEntries[i], holder);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, holder))
+    assert(0);
+
+   printf("DeviceTest: striping over %u members in units of %u sectors\n",
+          stripeMembers, stripeUnit);
+  }
+  /*! A member that fails is taken out of service and left alone from
+      then on. Reads and writes carry on while one member works, and fail
+      with deviceError once none does. */
+  static inline void
+  testMirroring(register class FileSystem* const fileSystem)
+  {
+   register enum TransactionManager::TransactionManagerError transactionManagerError;
+   register enum BlockCache::BlockCacheError                 cacheError;
+   register enum VirtualBlockDevice::VirtualBlockDeviceError error;
+   class Transaction*                                        holder;
+   static class BlockCacheEntry*                             cacheEntries[stripeEntries];
+   static struct LBA                                         theLBAs[stripeEntries];
+
+   if(!TransactionManager::getInstance().startTransaction(holder, transactionManagerError, fileSystem))
+    assert(0);
+
+   for(register unsigned int i = 0; i < stripeEntries; i++)
+    if (!BlockCache::getInstance().allocate(cacheEntries[i], cacheError, holder))
+     assert(0);
+
+   class MemoryBlockDevice* members[mirrorMembers];
+
+   for(register unsigned int i = 0; i < mirrorMembers; i++)
+    members[i] = new MemoryBlockDevice(memberSectors);
+
+   register class MirroredBlockDevice* const mirrored =
+    new MirroredBlockDevice((class VirtualBlockDevice* const*) members, mirrorMembers);
+
+   /* Every other sector, so a vectored read is dealt out over both
+      members one sector at a time. */
+   register const unsigned int count = memberSectors / 2;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    theLBAs[i].theLBA = 2 * i;
+    stamp(cacheEntries[i]->getDataPointer(), theLBAs[i].theLBA);
+   }
+
+   if (!mirrored->writeSectors(error, cacheEntries, theLBAs, count))
+    assert(0);
+
+   for(register unsigned int member = 0; member < mirrorMembers; member++)
+    for(register unsigned int i = 0; i < count; i++)
+     assert(isStamped(members[member]->getSector(theLBAs[i].theLBA), theLBAs[i].theLBA));
+
+   /* A read that hits the dead member is served by the other one. */
+   members[0]->failing = true;
+
+   if (!mirrored->readSectors(error, &cacheEntries[count], theLBAs, count))
+    assert(0);
+
+   for(register unsigned int i = 0; i < count; i++)
+    assert(isStamped(cacheEntries[count + i]->getDataPointer(), theLBAs[i].theLBA));
+
+   assert(members[0]->requests > 0);
+   assert(mirrored->getWorkingMembers() == mirrorMembers - 1);
+
+   /* From then on the member sees nothing, and the mirror keeps going on
+      the member left. */
+   register const unsigned int deadRequests = members[0]->requests;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    theLBAs[i].theLBA = 2 * i + 1;
+    stamp(cacheEntries[i]->getDataPointer(), theLBAs[i].theLBA);
+   }
+
+   if (!mirrored->writeSectors(error, cacheEntries, theLBAs, count))
+    assert(0);
+
+   if (!mirrored->writeSector(error, cacheEntries[0], theLBAs[0]))
+    assert(0);
+
+   if (!mirrored->sync(error))
+    assert(0);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    if (!mirrored->readSector(error, cacheEntries[count + i], theLBAs[i]))
+     assert(0);
+
+    assert(isStamped(cacheEntries[count + i]->getDataPointer(), theLBAs[i].theLBA));
+    assert(isStamped(members[1]->getSector(theLBAs[i].theLBA), theLBAs[i].theLBA));
+   }
+
+   assert(members[0]->requests == deadRequests);
+
+   /* A write that reaches no working member fails. */
+   members[1]->failing = true;
+
+   assert(!mirrored->writeSectors(error, cacheEntries, theLBAs, count));
+   assert(error == VirtualBlockDevice::deviceError);
+   assert(!mirrored->getWorkingMembers());
+
+   assert(!mirrored->readSector(error, cacheEntries[0], theLBAs[0]));
+   assert(error == VirtualBlockDevice::deviceError);
+
+   assert(!mirrored->sync(error));
+   assert(error == VirtualBlockDevice::deviceError);
+
+   assert(members[0]->requests == deadRequests);
+
+   delete mirrored;
+
+   for(register unsigned int i = 0; i < mirrorMembers; i++)
+    delete members[i];
+
+   register uint8_t* dataPointer;
+
+   for(register unsigned int i = 0; i < stripeEntries; i++)
+    cacheEntries[i]->unlock(dataPointer, cacheEntries[i], holder);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, holder))
+    assert(0);
+
+   printf("DeviceTest: mirroring over %u members survives all but the last\n", mirrorMembers);
+  }
+};
+
+#endif
@@ -0,0 +1,338 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef DURABLECOMMITTESTEVENTLISTENER_HPP
+# define DURABLECOMMITTESTEVENTLISTENER_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <stdio.h>
+# include <pthread.h>
+
+# include <EventListener.hpp>
+
+# include <EventListenerManager.hpp>
+# include <UUID.hpp>
+# include <FileSystemManager.hpp>
+# include <TransactionManager.hpp>
+# include <FileSystem.hpp>
+# include <SubTreeTransaction.hpp>
+# include <SubTreeBlobKey.hpp>
+# include <BlockCache.hpp>
+
+/*! Commits from several threads in durable mode, which must be grouped
+    into fewer syncs than commits and leave the last tree in the
+    superblock. Then commits lazily over the durable tree, whose pages
+    must not be reused before a superblock past it is stable. */
+class DurableCommitTestEventListener : public EventListener
+{
+ public:
+  inline
+  DurableCommitTestEventListener()
+  {
+   alreadyRun = false;
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().registerListener(error, this, __func__))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+  }
+
+  inline virtual bool
+  handleEvent(register unsigned int&            receiver,
+              register class Event*&            outgoingEvent,
+              register const unsigned int       sender,
+              register const class Event* const incomingEvent)
+  {
+
+   /* Consume event when done with it. */
+   delete incomingEvent;
+
+   if (alreadyRun)
+    return false;
+
+   alreadyRun = true;
+
+   register struct UUID fsUUID = {1, 0};
+   register enum FileSystemManager::FileSystemManagerError
+   fileSystemManagerError;
+
+   class FileSystem* fileSystem = 0;
+
+   /* Lookup the precreated file system. */
+   if(!FileSystemManager::getInstance().getFileSystem(fileSystem, fileSystemManagerError, fsUUID))
+   {
+    assert(0);
+   }
+
+   assert(fileSystem);
+   assert(fileSystemManagerError == FileSystemManager::noError);
+
+   register enum TransactionManager::TransactionManagerError transactionManagerError;
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   register enum FileSystem::FileSystemError                 fileSystemError;
+   class SubTreeTransaction*                                 transaction;
+   register const struct UUID                                subTreeUUID = {0x8000000000000000, 0};
+   static struct committer                                   committers[threadCount];
+
+   struct SubTreeBlobKey                                     blobKey;
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   if (!transaction->allocateBlob(blobKey, transactionError, SubTreeBlobKey::data))
+    assert(0);
+
+   /* The threads share the blob, each writes a range of keys of its own. */
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    committers[i].fileSystem = fileSystem;
+    committers[i].blobKey    = blobKey;
+    committers[i].first      = i * rounds;
+   }
+
+   /* And enough keys past theirs for the tree to have many leaves. */
+   fill(transaction, blobKey, 0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   /* Leaders wait a little for the others to join their group. */
+   fileSystem->setGroupCommitWindow(1000000);
+
+   if (!fileSystem->setCommitMode(fileSystemError, FileSystem::durableCommit))
+    assert(0);
+
+   register const uint64_t firstGeneration  = fileSystem->getDurableGeneration();
+   register const uint64_t firstSuperBlocks = fileSystem->getSuperBlockWrites();
+
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    if (pthread_create(&committers[i].thread, 0, commit, &committers[i]))
+     assert(0);
+   }
+
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    if (pthread_join(committers[i].thread, 0))
+     assert(0);
+   }
+
+   register const uint64_t commits     = fileSystem->getDurableGeneration() - firstGeneration;
+   register const uint64_t superBlocks = fileSystem->getSuperBlockWrites() - firstSuperBlocks;
+
+   assert(commits >= threadCount * rounds);
+   assert(superBlocks < commits);
+
+   /* The superblock holds the last tree, with every commit in it. */
+   if (!fileSystem->remount(fileSystemError))
+    assert(0);
+
+   check(fileSystem, committers, 0);
+
+   /* Lazy commits over the durable tree. */
+   if (!fileSystem->setCommitMode(fileSystemError, FileSystem::lazyCommit))
+    assert(0);
+
+   for(register unsigned int round = 0; round < rounds; round++)
+   {
+    if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                  fileSystem, subTreeUUID))
+     assert(0);
+
+    for(register unsigned int i = 0; i < threadCount; i++)
+    {
+     register const uint64_t value = ~(committers[i].first + round);
+
+     if(!transaction->insertData(transactionError, (const uint8_t*) &value, sizeof(value),
+                                 blobKey, committers[i].first + round))
+      assert(0);
+    }
+
+    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+     assert(0);
+   }
+
+   /* Dropping the filling releases the leaves of the durable tree that
+      hold it, and writing it again would reuse their LBAs at once
+      without the generation gate. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   if (!transaction->removeDataRange(transactionError, blobKey, fillFirst, fillFirst + fillKeys - 1))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   fill(transaction, blobKey, ~0ULL);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   check(fileSystem, committers, ~0ULL);
+
+   /* Put the lazy pages on the device, over anything they reused. */
+   register enum BlockCache::BlockCacheError cacheError;
+
+   if (!BlockCache::getInstance().flush(cacheError))
+    assert(0);
+
+   /* And the durable tree is still whole. */
+   if (!fileSystem->remount(fileSystemError))
+    assert(0);
+
+   check(fileSystem, committers, 0);
+
+   printf("DurableCommitTest: %llu commits from %u threads in %llu syncs\n",
+          (unsigned long long) commits, threadCount, (unsigned long long) superBlocks);
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().deRegisterListener(error, this))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+   return false;
+  }
+
+ private:
+  static const unsigned int threadCount = 4;
+  static const unsigned int rounds      = 25;
+  /*! Keys written by no committer, from fillFirst on. */
+  static const unsigned int fillFirst   = threadCount * rounds;
+  static const unsigned int fillKeys    = 2048;
+
+  struct committer
+  {
+   pthread_t             thread;
+   class FileSystem*     fileSystem;
+   struct SubTreeBlobKey blobKey;
+   /*! Key and value of the first round. */
+   uint64_t              first;
+  };
+
+  bool alreadyRun;
+
+  /*! One durable commit per round, each of one key of its own range. */
+  static void*
+  commit(register void* const argument)
+  {
+   register const struct committer* const committer = (const struct committer*) argument;
+
+   for(register unsigned int round = 0; round < rounds; round++)
+   {
+    register enum TransactionManager::TransactionManagerError transactionManagerError;
+    register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+    class SubTreeTransaction*                                 transaction;
+    register const struct UUID                                subTreeUUID = {0x8000000000000000, 0};
+    register const uint64_t                                   value = committer->first + round;
+
+    if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                  committer->fileSystem, subTreeUUID))
+     assert(0);
+
+    for(;;)
+    {
+     if(!transaction->insertData(transactionError, (const uint8_t*) &value, sizeof(value),
+                                 committer->blobKey, value))
+      assert(0);
+
+     if(TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+      break;
+
+     /* Started over on the tree that conflicted. */
+     assert(transactionManagerError == TransactionManager::conflict);
+    }
+   }
+
+   return 0;
+  }
+
+  /*! Write the filling, each key holding its minor xored with mask. */
+  static inline void
+  fill(register class SubTreeTransaction* const transaction,
+       register const struct SubTreeBlobKey     blobKey,
+       register const uint64_t                  mask)
+  {
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+
+   for(register unsigned int i = 0; i < fillKeys; i++)
+   {
+    register const uint64_t value = (fillFirst + i) ^ mask;
+
+    if(!transaction->insertData(transactionError, (const uint8_t*) &value, sizeof(value),
+                                blobKey, fillFirst + i))
+     assert(0);
+   }
+  }
+
+  /*! The key of every round of every committer, and of the filling, holds
+      its value xored with mask. */
+  static inline void
+  check(register class FileSystem* const       fileSystem,
+        register const struct committer* const committers,
+        register const uint64_t                mask)
+  {
+   register enum TransactionManager::TransactionManagerError transactionManagerError;
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   class SubTreeTransaction*                                 transaction;
+   register const struct UUID                                subTreeUUID = {0x8000000000000000, 0};
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    for(register unsigned int round = 0; round < rounds; round++)
+    {
+     uint64_t      value = 0;
+     uint_fast32_t size  = sizeof(value);
+
+     if(!transaction->lookupData((uint8_t*) &value, size, transactionError, committers[i].blobKey,
+                                 committers[i].first + round))
+      assert(0);
+
+     assert(size == sizeof(value));
+     assert(value == ((committers[i].first + round) ^ mask));
+    }
+   }
+
+   for(register unsigned int i = 0; i < fillKeys; i++)
+   {
+    uint64_t      value = 0;
+    uint_fast32_t size  = sizeof(value);
+
+    if(!transaction->lookupData((uint8_t*) &value, size, transactionError, committers[0].blobKey,
+                                fillFirst + i))
+     assert(0);
+
+    assert(size == sizeof(value));
+    assert(value == ((fillFirst + i) ^ mask));
+   }
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+  }
+};
+
+#endif
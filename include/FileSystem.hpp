@@ -2,9 +2,12 @@
 # define FILESYSTEM_HPP
 
 # include <assert.h>
+# include <stdint.h>
+# include <pthread.h>
 
 # include <UUID.hpp>
 # include <LBA.hpp>
+# include <KeyRangeSet.hpp>
 
 class FileSystem
 {
@@ -15,14 +18,29 @@ class FileSystem
   enum FileSystemError
   {
    noError = 0,
-   outOfSpace 
+   outOfSpace,
+   deviceError,
+   /*! A commit after the transaction started changed a key it read. */
+   conflict,
+   /*! The tree the new one was built on is no longer current. */
+   staleTree
+  };
+
+  /*! In lazy mode a commit only switches the current tree and the pages
+      reach the disk whenever the cache evicts them. In durable mode a
+      commit returns once its pages and a superblock pointing at the new
+      tree are stable. */
+  enum CommitMode
+  {
+   lazyCommit = 0,
+   durableCommit
   };
 
   inline bool
   getCurrentTree(register const class BPlusTree* & returnedTree,
                  register enum FileSystemError&    error) const
   {
-   returnedTree = currentTree;
+   returnedTree = __atomic_load_n(&currentTree, __ATOMIC_SEQ_CST);
    error        = noError;
 
    return true;
@@ -31,32 +49,232 @@ class FileSystem
   bool
   updateTree(register const class BPlusTree* const newTree);
 
+  /*! Make newTree the current tree. In durable mode the caller must have
+      written the pages of newTree already, and the call waits until a
+      superblock pointing at newTree, or at a later tree, is stable.
+      Concurrent committers are grouped so they share a single device
+      sync.
+
+      writes, normalized, are the keys newTree changes. They are taken
+      over, leaving writes empty, for changedSince. Without them the
+      commit is taken to change every key.
+
+      A transaction gives the tree base it built newTree on, the commit
+      sequence it started after and the keys it read, normalized. Its
+      tree is made current only if base still is, and fails with
+      staleTree if not, so nothing committed in between is lost. It fails
+      with conflict if a commit since sequence changed a key of reads.
+      entries, the pages the transaction allocated, are handed to the
+      cache as newTree is made current, see BlockCache::adopt.
+
+      The checks and the switch are made under commitLock, which is
+      dropped while a durable commit waits and not held while the
+      superblock is written. The cache is only called with commitLock
+      held, never the other way round, and the caller holds neither. */
+  bool
+  commitTree(register enum FileSystemError&        error,
+             register const class BPlusTree* const newTree,
+             register KeyRangeSet* const           writes   = 0,
+             register const class BPlusTree* const base     = 0,
+             register const uint64_t               sequence = 0,
+             register const KeyRangeSet* const     reads    = 0,
+             register class BlockCacheEntry* const entries  = 0);
+
+  /*! The number of the last commit. */
+  inline uint64_t
+  getCommitSequence(void) const
+  {
+   return __atomic_load_n(&commitSequence, __ATOMIC_ACQUIRE);
+  }
+
+  /*! Whether a commit after the one numbered sequence changed a key of
+      reads, which must be normalized. */
+  bool
+  changedSince(register const uint64_t     sequence,
+               register const KeyRangeSet& reads);
+
+  /*! Switching to durable mode writes back everything that is dirty and
+      the superblock so later commits only need to write their own pages. */
+  bool
+  setCommitMode(register enum FileSystemError& error,
+                register const enum CommitMode mode);
+
+  inline enum CommitMode
+  getCommitMode(void) const
+  {
+   return commitMode;
+  }
+
+  /*! Let a group commit leader wait this long for more committers to
+      join before it syncs. Zero, the default, relies on the time the
+      previous sync takes to gather the next group. */
+  inline void
+  setGroupCommitWindow(register const uint64_t nanoseconds)
+  {
+   groupCommitWindow = nanoseconds;
+  }
+
+  /*! The generation of the last superblock made stable. Each durable
+      commit gets its own generation. */
+  inline uint64_t
+  getDurableGeneration(void) const
+  {
+   return durableGeneration;
+  }
+
+  /*! One for each group of durable commits that was synced. */
+  inline uint64_t
+  getSuperBlockWrites(void) const
+  {
+   return superBlockWrites;
+  }
+
+  /*! LBAs getAvailableLBAs has handed out so far. */
+  inline uint64_t
+  getHandedOutLBAs(void) const
+  {
+   return handedOutLBAs;
+  }
+
+  /*! LBAs given back that getAvailableLBAs hands out again first. */
+  inline uint64_t
+  getFreeLBAs(void)
+  {
+   register uint64_t free = 0;
+
+   if (pthread_mutex_lock(&commitLock))
+    assert(0);
+
+   for(register unsigned int i = 0; i < freeCount; i++)
+    free += freeRuns[i].count;
+
+   if (pthread_mutex_unlock(&commitLock))
+    assert(0);
+
+   return free;
+  }
+
+  /*! Read the superblock back from the device and make the tree it points
+      at current, as mounting the device again would. The LBAs handed out
+      so far stay in use. Fails with deviceError unless the superblock is
+      the last one made stable. No transaction may be open. */
+  bool
+  remount(register enum FileSystemError& error);
+
   inline UUID
   getUUID(void) const
   {
    return myUUID;
   }
 
+  /*! Transactions in other threads allocate too, so this takes
+      commitLock, which also guards the runs reclaim frees. */
   inline bool
   getAvailableLBA(register struct LBA&           returnedLBA,
 		  register enum FileSystemError& error)
   {
-   if (theLBAClock.theLBA < maxLBA.theLBA)
+   return getAvailableLBAs(returnedLBA, 1, error);
+  }
+
+  /*! count consecutive LBAs, the first one returned. */
+  inline bool
+  getAvailableLBAs(register struct LBA&           returnedLBA,
+                   register const unsigned int    count,
+                   register enum FileSystemError& error)
+  {
+   assert(count);
+
+   if (pthread_mutex_lock(&commitLock))
+    assert(0);
+
+   /* Freed LBAs go first. */
+   for(register unsigned int i = freeCount; i > 0; i--)
+   {
+    register struct LBARun& run = freeRuns[i - 1];
+
+    if (run.count >= count)
+    {
+     returnedLBA         = run.first;
+     run.first.theLBA   += count;
+     run.count          -= count;
+
+     if (!run.count)
+      freeRuns[i - 1] = freeRuns[--freeCount];
+
+     handedOutLBAs += count;
+
+     if (pthread_mutex_unlock(&commitLock))
+      assert(0);
+
+     error = noError;
+     return true;
+    }
+   }
+
+   register const bool success = (maxLBA.theLBA - theLBAClock.theLBA) >= count;
+
+   if (success)
    {   
     returnedLBA = theLBAClock;
-    theLBAClock.theLBA++;
-    error = noError;
-
-    return true;
+    theLBAClock.theLBA += count;
+    handedOutLBAs      += count;
    }
 
-   error = outOfSpace;
-   return false;
+   if (pthread_mutex_unlock(&commitLock))
+    assert(0);
+
+   error = success ? noError : outOfSpace;
+   return success;
+  }
+
+  /*! Give back the LBAs of count runs that the tree just committed no
+      longer uses. They are handed out again once no transaction that
+      may still read an older tree is running, and no superblock points
+      at a tree that uses them. */
+  void
+  releaseLBAs(register const struct LBARun* const runs,
+              register const unsigned int         count);
+
+  /*! Give back LBAs no tree committed has used, the pages of a
+      transaction that aborts. They are handed out again right away, and
+      what the cache holds for them is dropped. */
+  void
+  freeLBAs(register const struct LBARun* const runs,
+           register const unsigned int         count);
+
+  /*! Every transaction on the file system is between these two, see
+      releaseLBAs. Returns the number of the last commit, to be read
+      before the current tree, see changedSince. */
+  inline uint64_t
+  openTransaction(void)
+  {
+   /* Counted before the current tree is read, see updateTree. */
+   __atomic_add_fetch(&openTransactions, 1, __ATOMIC_SEQ_CST);
+
+   return __atomic_load_n(&commitSequence, __ATOMIC_ACQUIRE);
   }
 
+  void
+  closeTransaction(void);
+
  private:
   static const uint8_t      rawDataType              = 0;
 
+  /*! The superblock lives in the first sector and holds the root of the
+      last durable tree. */
+  static const uint64_t     superBlockLBA            = 0;
+  static const uint64_t     superBlockMagic          = 0x6b636f6c42786e46ULL;
+  static const uint8_t      superBlockVersion        = 1;
+
+  struct __attribute__ ((__packed__)) superBlock
+  {
+   uint64_t magic;
+   uint64_t generation;
+   uint64_t rootLBA;
+   uint64_t nextLBA;
+   uint8_t  version;
+  };
+
   struct UUID               myUUID;
   class VirtualBlockDevice* blockDevice;
   const class BPlusTree*    currentTree;
@@ -64,12 +282,85 @@ class FileSystem
   /*! \todo replace this with a proper garbage collector. */
   struct LBA                theLBAClock;
   struct LBA                maxLBA;
+
+  /*! Released runs, each with the superblock generation that must be
+      stable before it can be reused. */
+  struct releasedRun
+  {
+   struct LBARun            run;
+   uint64_t                 generation;
+  }*                        releasedRuns;
+  unsigned int              releasedCount;
+  unsigned int              releasedCapacity;
+
+  /*! Runs ready to be handed out, taken from the end. */
+  struct LBARun*            freeRuns;
+  unsigned int              freeCount;
+  unsigned int              freeCapacity;
+
+  unsigned int              openTransactions;
+
+  /*! Trees replaced while transactions were open, which may still be
+      reading them. */
+  const class BPlusTree**   retiredTrees;
+  unsigned int              retiredCount;
+  unsigned int              retiredCapacity;
+
+  /*! The keys each commit changed, kept while transactions that started
+      before it may still be open, see changedSince. Oldest first. */
+  static const unsigned int maxHistory               = 1024;
+
+  struct commit
+  {
+   uint64_t                 sequence;
+   /*! Every key, if 0. */
+   KeyRangeSet*             writes;
+  }                         history[maxHistory];
+  unsigned int              historyCount;
+  uint64_t                  commitSequence;
+  /*! Commits up to this one are no longer in history. */
+  uint64_t                  forgottenSequence;
+
+  enum CommitMode           commitMode;
+
+  /* Group commit state, protected by commitLock. */
+  pthread_mutex_t           commitLock;
+  pthread_cond_t            commitDone;
+  uint64_t                  requestedGeneration;
+  uint64_t                  durableGeneration;
+  uint64_t                  groupCommitWindow;
+  uint64_t                  superBlockWrites;
+  uint64_t                  handedOutLBAs;
+  bool                      flushing;
   
   /*! Create a new file system with UUID theFSUUID on device with UUID
       theVirtualBlockDeviceUUID. */
   FileSystem(register const UUID theFSUUID,
 	     register const UUID theVirtualBlockDeviceUUID);
 
+  /*! Move the released runs that can be reused to freeRuns. */
+  void
+  reclaim(void);
+
+  void
+  addFreeRun(register const struct LBARun run);
+
+  /*! Delete the retired trees and the history, once no transaction is
+      open. */
+  void
+  forgetHistory(void);
+
+  /*! changedSince, for a caller that holds commitLock. */
+  bool
+  wasChanged(register const uint64_t     sequence,
+             register const KeyRangeSet& reads);
+
+  /*! Sync the pages written so far, then write and sync a superblock. */
+  bool
+  writeSuperBlock(register enum FileSystemError& error,
+                  register const uint64_t        generation,
+                  register const struct LBA      rootLBA,
+                  register const struct LBA      nextLBA);
 };
 
 #endif
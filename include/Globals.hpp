@@ -21,37 +21,64 @@ sectorSize = 4096;
 #error Must be compiled with GNU g++
 #endif
 
+static const bool
+hostIsLittle = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+/*! Byte swaps, by size. */
+static inline uint16_t
+swapBytes(register const uint16_t value)
+{
+ return __builtin_bswap16(value);
+}
+
+static inline uint32_t
+swapBytes(register const uint32_t value)
+{
+ return __builtin_bswap32(value);
+}
+
+static inline uint64_t
+swapBytes(register const uint64_t value)
+{
+ return __builtin_bswap64(value);
+}
+
+/*! Fields of an image in a byte order known at compile time. The native
+    order is a plain access, the other one a single swap. */
+template <bool isLittle, typename T>
+static inline void
+toFileSystemEndian(register T* const ptr,
+                   register const T  value)
+{
+ *ptr = (isLittle == hostIsLittle) ? value : swapBytes(value);
+}
+
+template <bool isLittle, typename T>
+static inline T
+fromFileSystemEndian(register const T* const ptr)
+{
+ return (isLittle == hostIsLittle) ? *ptr : swapBytes(*ptr);
+}
+
+/*! The same for a byte order only known at run time. Code that touches
+    many fields of a node is better off dispatching once on the order and
+    using the ones above. */
 static inline void
 toFileSystemEndian(register uint16_t* const ptr,
                    register const uint16_t  value,
                    register const bool      isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- *ptr = value;
-# else
-# error Big endian not supported
-# endif
+ if (isLittle)
+  toFileSystemEndian<true>(ptr, value);
+ else
+  toFileSystemEndian<false>(ptr, value);
 }
 
 static inline uint16_t
 fromFileSystemEndian(register const uint16_t* const ptr,
                      register const bool            isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- return *ptr;
-# else
-# error Big endian not supported
-# endif
+ return isLittle ? fromFileSystemEndian<true>(ptr) : fromFileSystemEndian<false>(ptr);
 }
 
 static inline void
@@ -59,32 +86,17 @@ toFileSystemEndian(register uint32_t* const ptr,
                    register const uint32_t  value,
                    register const bool      isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- *ptr = value;
-# else
-# error Big endian not supported
-# endif
+ if (isLittle)
+  toFileSystemEndian<true>(ptr, value);
+ else
+  toFileSystemEndian<false>(ptr, value);
 }
 
 static inline uint32_t
 fromFileSystemEndian(register const uint32_t* const ptr,
                      register const bool            isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- return *ptr;
-# else
-# error Big endian not supported
-# endif
+ return isLittle ? fromFileSystemEndian<true>(ptr) : fromFileSystemEndian<false>(ptr);
 }
 
 static inline void
@@ -92,32 +104,17 @@ toFileSystemEndian(register uint64_t* const ptr,
                    register const uint64_t  value,
                    register const bool      isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- *ptr = value;
-# else
-# error Big endian not supported
-# endif
+ if (isLittle)
+  toFileSystemEndian<true>(ptr, value);
+ else
+  toFileSystemEndian<false>(ptr, value);
 }
 
 static inline uint64_t
 fromFileSystemEndian(register const uint64_t* const ptr,
                      register const bool            isLittle)
 {
-# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
- while (!isLittle)
- {
-  assert(0);
- }
-
- return *ptr;
-# else
-# error Big endian not supported
-# endif
+ return isLittle ? fromFileSystemEndian<true>(ptr) : fromFileSystemEndian<false>(ptr);
 }
 
 
@@ -112,7 +112,7 @@ class InsertRemoveReversedStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, minor))
      assert(0);
@@ -129,7 +129,7 @@ class InsertRemoveReversedStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, minor))
      assert(0);
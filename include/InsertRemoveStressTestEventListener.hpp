@@ -10,6 +10,7 @@
 
 # include <assert.h>
 # include <stdint.h>
+# include <string.h>
 
 # include <EventListener.hpp>
 
@@ -20,6 +21,9 @@
 # include <FileSystem.hpp>
 # include <SubTreeTransaction.hpp>
 # include <SubTreeBlobKey.hpp>
+# include <BatchOperation.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <RawData.hpp>
 
 class InsertRemoveStressTestEventListener : public EventListener
 {
@@ -112,7 +116,7 @@ class InsertRemoveStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, minor))
      assert(0);
@@ -129,7 +133,7 @@ class InsertRemoveStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, minor))
      assert(0);
@@ -151,6 +155,12 @@ class InsertRemoveStressTestEventListener : public EventListener
     assert(transactionError == SubTreeTransaction::keyNotFound);
    }
 
+   /* Now the same kind of churn as batches. */
+   batchTest(transaction, subKey);
+
+   /* And most of it gone at once. */
+   rangeTest(transaction, subKey);
+
    /* End transaction. */
    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
    {
@@ -174,7 +184,235 @@ class InsertRemoveStressTestEventListener : public EventListener
   }
 
  private:
+  static const unsigned int
+  batchKeys = 3000;
+
   bool alreadyRun;
+
+  uint8_t values[batchKeys + batchKeys / 2];
+  uint8_t bigValue[sectorSize];
+
+  inline void
+  check(register class SubTreeTransaction* const transaction,
+        register const struct SubTreeBlobKey     subKey,
+        register const uint64_t                  minor,
+        register const bool                      present)
+  {
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   uint8_t                                                   readData[sectorSize];
+   uint_fast32_t                                             readSize = sizeof(readData);
+
+   if (!transaction->lookupData(readData, readSize, transactionError, subKey, minor))
+   {
+    assert(!present);
+    assert(transactionError == SubTreeTransaction::keyNotFound);
+    return;
+   }
+
+   assert(present);
+
+   if ((minor < batchKeys) && ((minor % 500) == 0))
+   {
+    assert(readSize == sizeof(bigValue));
+    assert(!memcmp(readData, bigValue, sizeof(bigValue)));
+   }
+   else
+   {
+    assert(readSize == 1);
+    assert(readData[0] == values[minor]);
+   }
+  }
+
+  inline void
+  batchTest(register class SubTreeTransaction* const transaction,
+            register const struct SubTreeBlobKey     subKey)
+  {
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   register const unsigned int                               maxOperations = batchKeys + batchKeys / 2 + 20;
+   register struct BatchOperation* const                     operations    = new struct BatchOperation[maxOperations];
+   register RawData* const                                   data          = new RawData[batchKeys + batchKeys / 2];
+   register RawData                                          big(bigValue, sizeof(bigValue));
+   register unsigned int                                     count         = 0;
+
+   assert(operations);
+   assert(data);
+
+   memset(bigValue, 0x5a, sizeof(bigValue));
+
+   for(register unsigned int minor = 0; minor < (batchKeys + batchKeys / 2); minor++)
+   {
+    values[minor] = minor * 7;
+    data[minor]   = RawData(values + minor, 1);
+   }
+
+   /* Insert out of order. A removed key is inserted again later in the
+      same batch, the last operation must win. */
+   for(register unsigned int i = 0; i < batchKeys; i++)
+   {
+    register const uint64_t minor = (i * 7) % batchKeys;
+
+    operations[count].key.minor = minor;
+    operations[count].value     = ((minor % 500) == 0) ? &big : data + minor;
+    count++;
+
+    if ((minor % 100) == 1)
+    {
+     operations[count].key.minor = minor;
+     operations[count].value     = 0;
+     count++;
+    }
+   }
+
+   for(register uint64_t minor = 1; minor < batchKeys; minor += 100)
+   {
+    operations[count].key.minor = minor;
+    operations[count].value     = data + minor;
+    count++;
+   }
+
+   assert(count <= maxOperations);
+
+   if (!transaction->applyDataBatch(transactionError, subKey, operations, count))
+    assert(0);
+
+   assert(transactionError == SubTreeTransaction::noError);
+
+   for(register uint64_t minor = 0; minor < batchKeys; minor++)
+    check(transaction, subKey, minor, true);
+
+   /* Remove every third key, update every fifth, append some and remove
+      keys that are not there. */
+   count = 0;
+
+   for(register uint64_t minor = 0; minor < batchKeys; minor++)
+   {
+    if ((minor % 3) == 0)
+    {
+     operations[count].key.minor = minor;
+     operations[count].value     = 0;
+     count++;
+    }
+    else if (((minor % 5) == 0) && (minor % 500))
+    {
+     values[minor]               = ~values[minor];
+     operations[count].key.minor = minor;
+     operations[count].value     = data + minor;
+     count++;
+    }
+   }
+
+   for(register uint64_t minor = batchKeys; minor < (batchKeys + batchKeys / 2); minor++)
+   {
+    operations[count].key.minor = minor;
+    operations[count].value     = data + minor;
+    count++;
+   }
+
+   for(register uint64_t minor = 0; minor < 10; minor++)
+   {
+    operations[count].key.minor = 2 * batchKeys + minor;
+    operations[count].value     = 0;
+    count++;
+   }
+
+   assert(count <= maxOperations);
+
+   if (!transaction->applyDataBatch(transactionError, subKey, operations, count))
+    assert(0);
+
+   assert(transactionError == SubTreeTransaction::noError);
+
+   for(register uint64_t minor = 0; minor < (batchKeys + batchKeys / 2); minor++)
+    check(transaction, subKey, minor, (minor >= batchKeys) || (minor % 3));
+
+   check(transaction, subKey, 2 * batchKeys, false);
+
+   /* The rebuilt nodes must still be in order and take single updates. */
+   register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+   register unsigned int                               found = 0;
+   BPlusTreeCursor                                     cursor;
+
+   if (!transaction->seekData(cursor, transactionError, subKey, 0))
+    assert(0);
+
+   for(register uint64_t minor = 0; cursor.isValid(); cursor.next(cursorError))
+   {
+    if ((cursor.getKey().type != transaction->getTreeKey(subKey, 0).type) ||
+        (cursor.getKey().major != transaction->getTreeKey(subKey, 0).major))
+     break;
+
+    assert(!found || (cursor.getKey().minor > minor));
+
+    minor = cursor.getKey().minor;
+    found++;
+   }
+
+   cursor.close();
+
+   assert(found == (batchKeys - batchKeys / 3 + batchKeys / 2));
+
+   if (!transaction->remove(transactionError, subKey, 1))
+    assert(0);
+
+   check(transaction, subKey, 1, false);
+
+   if (!transaction->insertData(transactionError, values + 3, 1, subKey, 3))
+    assert(0);
+
+   check(transaction, subKey, 3, true);
+
+   delete [] data;
+   delete [] operations;
+  }
+
+  /*! What batchTest left behind. */
+  static inline bool
+  isPresent(register const uint64_t minor)
+  {
+   if (minor == 1)
+    return false;
+
+   return (minor >= batchKeys) || (minor % 3) || (minor == 3);
+  }
+
+  inline void
+  rangeTest(register class SubTreeTransaction* const transaction,
+            register const struct SubTreeBlobKey     subKey)
+  {
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   register const uint64_t                                   first = 100;
+   register const uint64_t                                   last  = batchKeys + 899;
+   struct TreeStatistics                                     before;
+   struct TreeStatistics                                     after;
+
+   transaction->getStatistics(before);
+
+   if (!transaction->removeDataRange(transactionError, subKey, first, last))
+    assert(0);
+
+   assert(transactionError == SubTreeTransaction::noError);
+
+   for(register uint64_t minor = 0; minor < (batchKeys + batchKeys / 2); minor++)
+    check(transaction, subKey, minor, isPresent(minor) && ((minor < first) || (minor > last)));
+
+   transaction->getStatistics(after);
+
+   assert(after.leaves < before.leaves);
+
+   register uint64_t removed = 0;
+
+   for(register uint64_t minor = first; minor <= last; minor++)
+    removed += isPresent(minor);
+
+   assert(after.keys == before.keys - removed);
+
+   /* Nothing left to remove. */
+   if (!transaction->removeDataRange(transactionError, subKey, first, last))
+    assert(0);
+
+   check(transaction, subKey, first - 1, isPresent(first - 1));
+   check(transaction, subKey, last + 1, isPresent(last + 1));
+  }
 };
 
 #endif
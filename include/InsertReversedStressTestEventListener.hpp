@@ -10,6 +10,7 @@
 
 # include <assert.h>
 # include <stdint.h>
+# include <stdio.h>
 
 # include <EventListener.hpp>
 
@@ -110,7 +111,7 @@ class InsertReversedStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, index))
      assert(0);
@@ -120,6 +121,16 @@ class InsertReversedStressTestEventListener : public EventListener
     assert(readData == test);
    }
 
+   /* How full the pages came out. */
+   struct TreeStatistics statistics;
+
+   transaction->getStatistics(statistics);
+
+   printf("%s: %llu keys in %llu pages, height %u, leaves %u%% full, internal nodes %u%% full\n",
+          "InsertReversedStressTest", (unsigned long long) statistics.keys,
+          (unsigned long long) statistics.pages(), statistics.height, statistics.leafFill(),
+          statistics.internalFill());
+
    /* End transaction. */
    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
    {
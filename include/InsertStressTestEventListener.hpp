@@ -10,6 +10,7 @@
 
 # include <assert.h>
 # include <stdint.h>
+# include <stdio.h>
 
 # include <EventListener.hpp>
 
@@ -20,6 +21,8 @@
 # include <FileSystem.hpp>
 # include <SubTreeTransaction.hpp>
 # include <SubTreeBlobKey.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <RawData.hpp>
 
 class InsertStressTestEventListener : public EventListener
 {
@@ -98,7 +101,7 @@ class InsertStressTestEventListener : public EventListener
 
    assert(transactionError == SubTreeTransaction::noError);
 
-   for(unsigned int index = 0; index < 1000; index++)
+   for(unsigned int index = 0; index < 5000; index++)
    {
     const char test = 128 - index;
 
@@ -110,7 +113,7 @@ class InsertStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, index))
      assert(0);
@@ -120,6 +123,71 @@ class InsertStressTestEventListener : public EventListener
     assert(readData == test);
    }
 
+   /* Read everything back in order, then backwards. */
+   {
+    register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+    register const struct Key                           firstKey = transaction->getTreeKey(subKey, 0);
+    BPlusTreeCursor                                     cursor;
+    unsigned int                                        index    = 0;
+
+    if (!transaction->seekData(cursor, transactionError, subKey, 0))
+     assert(0);
+
+    do
+    {
+     const struct Key key = cursor.getKey();
+
+     if ((key.type != firstKey.type) || (key.major != firstKey.major))
+      break;
+
+     assert(key.minor == index);
+
+     char          readData = 0;
+     uint_fast32_t readSize = sizeof(readData);
+     RawData       rawData((uint8_t*) &readData, readSize);
+
+     if (!cursor.read(rawData, readSize, cursorError))
+      assert(0);
+
+     assert(readSize == sizeof(readData));
+     assert(readData == (char) (128 - index));
+
+     index++;
+    } while (cursor.next(cursorError));
+
+    assert(index == 5000);
+
+    if (!transaction->seekData(cursor, transactionError, subKey, 4999))
+     assert(0);
+
+    do
+    {
+     const struct Key key = cursor.getKey();
+
+     if ((key.type != firstKey.type) || (key.major != firstKey.major))
+      break;
+
+     assert(key.minor == --index);
+    } while (cursor.previous(cursorError));
+
+    assert(index == 0);
+   }
+
+   /* How full the pages came out. */
+   struct TreeStatistics statistics;
+
+   transaction->getStatistics(statistics);
+
+   printf("%s: %llu keys in %llu pages, height %u, leaves %u%% full, internal nodes %u%% full\n",
+          "InsertStressTest", (unsigned long long) statistics.keys,
+          (unsigned long long) statistics.pages(), statistics.height, statistics.leafFill(),
+          statistics.internalFill());
+
+   /* Keys in order fill each leaf before they go on to the next. Only
+      the last leaf of the blob and the one of the keys of the file
+      system itself are left partly empty. */
+   assert(statistics.leaves <= ((statistics.leafBytes + sectorSize - 1) / sectorSize) + 1);
+
    /* End transaction. */
    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
    {
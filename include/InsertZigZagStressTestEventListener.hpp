@@ -10,6 +10,7 @@
 
 # include <assert.h>
 # include <stdint.h>
+# include <stdio.h>
 
 # include <EventListener.hpp>
 
@@ -112,7 +113,7 @@ class InsertZigZagStressTestEventListener : public EventListener
 
     /* Try to read it back! */
     char          readData = 0;
-    uint_fast16_t readSize = sizeof(readData);
+    uint_fast32_t readSize = sizeof(readData);
 
     if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, minor))
      assert(0);
@@ -122,6 +123,16 @@ class InsertZigZagStressTestEventListener : public EventListener
     assert(readData == test);
    }
 
+   /* How full the pages came out. */
+   struct TreeStatistics statistics;
+
+   transaction->getStatistics(statistics);
+
+   printf("%s: %llu keys in %llu pages, height %u, leaves %u%% full, internal nodes %u%% full\n",
+          "InsertZigZagStressTest", (unsigned long long) statistics.keys,
+          (unsigned long long) statistics.pages(), statistics.height, statistics.leafFill(),
+          statistics.internalFill());
+
    /* End transaction. */
    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
    {
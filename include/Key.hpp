@@ -10,4 +10,21 @@ struct Key
  uint_fast64_t minor;
 };
 
+/*! Order of keys in the tree: by type, then major, then minor. */
+static inline int
+compareKeys(register const struct Key left,
+            register const struct Key right)
+{
+ if (left.type != right.type)
+  return (left.type < right.type) ? -1 : 1;
+
+ if (left.major != right.major)
+  return (left.major < right.major) ? -1 : 1;
+
+ if (left.minor != right.minor)
+  return (left.minor < right.minor) ? -1 : 1;
+
+ return 0;
+}
+
 #endif
@@ -0,0 +1,227 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef KEYRANGESET_HPP
+# define KEYRANGESET_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <stdlib.h>
+# include <string.h>
+
+# include <Key.hpp>
+
+/*! The keys a transaction read or wrote, as ranges with both ends
+    included. Ranges are added in any order and may overlap, normalize
+    sorts and merges them before two sets are compared. */
+class KeyRangeSet
+{
+ public:
+  struct range
+  {
+   Key first;
+   Key last;
+  };
+
+  /*! At or below every key in the tree. */
+  static inline Key
+  firstKey(void)
+  {
+   register const Key key = {.type = 0, .major = 0, .minor = 0};
+
+   return key;
+  }
+
+  /*! At or above every key in the tree. */
+  static inline Key
+  lastKey(void)
+  {
+   register const Key key = {.type = UINT8_MAX, .major = UINT64_MAX, .minor = UINT64_MAX};
+
+   return key;
+  }
+
+  inline
+  KeyRangeSet()
+  {
+   ranges     = 0;
+   count      = 0;
+   capacity   = 0;
+   normalized = true;
+  }
+
+  inline
+  ~KeyRangeSet()
+  {
+   delete [] ranges;
+  }
+
+  inline void
+  clear(void)
+  {
+   count      = 0;
+   normalized = true;
+  }
+
+  inline void
+  add(register const Key key)
+  {
+   add(key, key);
+  }
+
+  inline void
+  add(register const Key first,
+      register const Key last)
+  {
+   assert(compareKeys(first, last) <= 0);
+
+   /* Runs of the same key, or of keys in ascending order that overlap,
+      take no more room. */
+   if (count &&
+       (compareKeys(ranges[count - 1].first, first) <= 0) &&
+       (compareKeys(first, ranges[count - 1].last) <= 0))
+   {
+    if (compareKeys(last, ranges[count - 1].last) > 0)
+     ranges[count - 1].last = last;
+
+    return;
+   }
+
+   if (count == capacity)
+   {
+    register const unsigned int  newCapacity = capacity ? 2 * capacity : 16;
+    register struct range* const newRanges   = new struct range[newCapacity];
+
+    assert(newRanges);
+
+    if (count)
+     memcpy(newRanges, ranges, count * sizeof(*ranges));
+
+    delete [] ranges;
+
+    ranges   = newRanges;
+    capacity = newCapacity;
+   }
+
+   if (count && (compareKeys(first, ranges[count - 1].first) < 0))
+    normalized = false;
+
+   ranges[count].first = first;
+   ranges[count].last  = last;
+   count++;
+  }
+
+  inline void
+  add(register const KeyRangeSet& other)
+  {
+   for(register unsigned int i = 0; i < other.count; i++)
+    add(other.ranges[i].first, other.ranges[i].last);
+  }
+
+  /*! Sort the ranges and merge those that overlap. */
+  inline void
+  normalize(void)
+  {
+   if (!normalized)
+    qsort(ranges, count, sizeof(*ranges), compareRanges);
+
+   normalized = true;
+
+   if (!count)
+    return;
+
+   register unsigned int kept = 1;
+
+   for(register unsigned int i = 1; i < count; i++)
+   {
+    register struct range& last = ranges[kept - 1];
+
+    if (compareKeys(ranges[i].first, last.last) <= 0)
+    {
+     if (compareKeys(ranges[i].last, last.last) > 0)
+      last.last = ranges[i].last;
+
+     continue;
+    }
+
+    ranges[kept++] = ranges[i];
+   }
+
+   count = kept;
+  }
+
+  /*! Whether a key is in both sets. Both must be normalized. */
+  inline bool
+  intersects(register const KeyRangeSet& other) const
+  {
+   register unsigned int mine   = 0;
+   register unsigned int theirs = 0;
+
+   assert(normalized && other.normalized);
+
+   while ((mine < count) && (theirs < other.count))
+   {
+    if (compareKeys(ranges[mine].last, other.ranges[theirs].first) < 0)
+     mine++;
+    else if (compareKeys(other.ranges[theirs].last, ranges[mine].first) < 0)
+     theirs++;
+    else
+     return true;
+   }
+
+   return false;
+  }
+
+  inline unsigned int
+  size(void) const
+  {
+   return count;
+  }
+
+  inline const struct range&
+  operator[](register const unsigned int index) const
+  {
+   assert(index < count);
+
+   return ranges[index];
+  }
+
+  inline void
+  swap(register KeyRangeSet& other)
+  {
+   register struct range* const ranges     = this->ranges;
+   register const unsigned int  count      = this->count;
+   register const unsigned int  capacity   = this->capacity;
+   register const bool          normalized = this->normalized;
+
+   this->ranges     = other.ranges;
+   this->count      = other.count;
+   this->capacity   = other.capacity;
+   this->normalized = other.normalized;
+
+   other.ranges     = ranges;
+   other.count      = count;
+   other.capacity   = capacity;
+   other.normalized = normalized;
+  }
+
+ private:
+  struct range* ranges;
+  unsigned int  count;
+  unsigned int  capacity;
+  /*! The ranges are in order of their first key. */
+  bool          normalized;
+
+  static int
+  compareRanges(register const void* const left,
+                register const void* const right)
+  {
+   return compareKeys(((const struct range*) left)->first, ((const struct range*) right)->first);
+  }
+};
+
+#endif
@@ -0,0 +1,75 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef KEYSEARCH_HPP
+# define KEYSEARCH_HPP
+
+# include <stdint.h>
+
+/*! Scans an array of unsigned 32 bit fingerprints for a probe. The
+    array is compared as a whole with AVX2 or SSE2 compare and movemask
+    when the processor has them, so a search costs no unpredictable
+    branches. The choice is made once, on the first call. */
+class KeySearch
+{
+ public:
+  /*! Count the fingerprints below probe and those equal to it. */
+  static inline void
+  count(register const uint32_t* const fingerprints,
+        register const unsigned int    entries,
+        register const uint32_t        probe,
+        register unsigned int&         less,
+        register unsigned int&         equal)
+  {
+   implementation(fingerprints, entries, probe, less, equal);
+  }
+
+  /*! True if a vector implementation is in use. */
+  static bool
+  isAccelerated(void);
+
+ private:
+  typedef void (*countFunction)(register const uint32_t* const fingerprints,
+                                register const unsigned int    entries,
+                                register const uint32_t        probe,
+                                register unsigned int&         less,
+                                register unsigned int&         equal);
+
+  /* Points at the resolver until the first call. */
+  static countFunction
+  implementation;
+
+  static void
+  resolve(register const uint32_t* const fingerprints,
+          register const unsigned int    entries,
+          register const uint32_t        probe,
+          register unsigned int&         less,
+          register unsigned int&         equal);
+
+  static void
+  avx2(register const uint32_t* const fingerprints,
+       register const unsigned int    entries,
+       register const uint32_t        probe,
+       register unsigned int&         less,
+       register unsigned int&         equal);
+
+  static void
+  sse2(register const uint32_t* const fingerprints,
+       register const unsigned int    entries,
+       register const uint32_t        probe,
+       register unsigned int&         less,
+       register unsigned int&         equal);
+
+  static void
+  software(register const uint32_t* const fingerprints,
+           register const unsigned int    entries,
+           register const uint32_t        probe,
+           register unsigned int&         less,
+           register unsigned int&         equal);
+};
+
+#endif
@@ -8,4 +8,11 @@ struct LBA
  uint_fast64_t theLBA;
 };
 
+/*! count consecutive LBAs, from first on. */
+struct LBARun
+{
+ struct LBA    first;
+ uint_fast64_t count;
+};
+
 #endif
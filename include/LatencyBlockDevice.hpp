@@ -0,0 +1,508 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef LATENCYBLOCKDEVICE_HPP
+# define LATENCYBLOCKDEVICE_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <errno.h>
+# include <math.h>
+# include <pthread.h>
+# include <time.h>
+
+# include <Globals.hpp>
+# include <LBA.hpp>
+
+# include <VirtualBlockDevice.hpp>
+
+/*! Decorator that makes any VirtualBlockDevice behave like a slower
+    storage device. Every I/O is charged a service time built from a fixed
+    access latency, an optional seek cost proportional to the square root of
+    the head movement, a seeded random jitter and the transfer time at the
+    configured bandwidth. Requests are placed on queueDepth service channels
+    so a device with a deep queue overlaps the latency of concurrent I/Os
+    while the transfers still share the bandwidth.
+
+    The model runs on a simulated clock. By default the device only keeps
+    the books, which makes the reported device time a pure function of the
+    access pattern and the seed. In real time mode the caller is also put
+    to sleep until the simulated completion time, for benchmarks that time
+    themselves with the wall clock.
+
+    Member devices of a striped or mirrored device are called from
+    several threads, so the clock, the queue and the statistics are kept
+    under a lock. Sleeping in real time mode happens outside it. */
+class LatencyBlockDevice : public VirtualBlockDevice
+{
+ public:
+  enum Profile
+  {
+   hddProfile = 0,
+   nvmeProfile
+  };
+
+  struct Parameters
+  {
+   /* All times are in nanoseconds. */
+   uint64_t readLatency;
+   uint64_t writeLatency;
+   uint64_t jitter;
+   /*! Cost of moving the head across the whole device. Zero disables
+       the seek model. */
+   uint64_t fullSeek;
+   uint64_t trackSeek;
+   /*! Cost of draining the volatile write cache on sync. */
+   uint64_t syncLatency;
+   /*! Bytes per second. Zero means infinitely fast transfers. */
+   uint64_t bandwidth;
+   unsigned int queueDepth;
+   /*! Sleep until each request completes. Off in every profile. */
+   bool realTime;
+  };
+
+  struct Statistics
+  {
+   uint64_t reads;
+   uint64_t writes;
+   uint64_t syncs;
+   uint64_t seeks;
+   /*! Simulated time from the first request until the last completion. */
+   uint64_t deviceTime;
+   /*! Sum of the time the requests spent queued and in service. */
+   uint64_t responseTime;
+  };
+
+  static const unsigned int
+  maxQueueDepth = 64;
+
+  inline
+  LatencyBlockDevice(register class VirtualBlockDevice* const device,
+                     register const enum Profile              profile,
+                     register const uint64_t                  seed)
+  {
+   init(device, getProfile(profile), seed);
+  }
+
+  inline
+  LatencyBlockDevice(register class VirtualBlockDevice* const device,
+                     register const struct Parameters&        parameters,
+                     register const uint64_t                  seed)
+  {
+   init(device, parameters, seed);
+  }
+
+  static inline struct Parameters
+  getProfile(register const enum Profile profile)
+  {
+   register struct Parameters parameters;
+
+   switch(profile)
+   {
+    case hddProfile:
+     /* 7200 RPM disk: half a rotation per random access. */
+     parameters.readLatency  = 4166000;
+     parameters.writeLatency = 4166000;
+     parameters.jitter       = 1000000;
+     parameters.fullSeek     = 15000000;
+     parameters.trackSeek    = 500000;
+     parameters.syncLatency  = 8333000;
+     parameters.bandwidth    = 150 * 1000 * 1000;
+     parameters.queueDepth   = 1;
+     break;
+
+    case nvmeProfile:
+     parameters.readLatency  = 80000;
+     parameters.writeLatency = 20000;
+     parameters.jitter       = 10000;
+     parameters.fullSeek     = 0;
+     parameters.trackSeek    = 0;
+     parameters.syncLatency  = 30000;
+     parameters.bandwidth    = 3000ULL * 1000 * 1000;
+     parameters.queueDepth   = 32;
+     break;
+
+    default:
+     assert(0);
+   }
+
+   parameters.realTime = false;
+
+   return parameters;
+  }
+
+  inline bool
+  readSector(register enum VirtualBlockDeviceError& error,
+             register class BlockCacheEntry* const  cacheEntry,
+             register const struct LBA              theLBA)
+  {
+   if (!device->readSector(error, cacheEntry, theLBA))
+    return false;
+
+   charge(statistics.reads, theLBA, 1, parameters.readLatency);
+   return true;
+  }
+
+  inline bool
+  writeSector(register enum VirtualBlockDeviceError& error,
+              register class BlockCacheEntry* const  cacheEntry,
+              register const struct LBA              theLBA)
+  {
+   if (!device->writeSector(error, cacheEntry, theLBA))
+    return false;
+
+   charge(statistics.writes, theLBA, 1, parameters.writeLatency);
+   return true;
+  }
+
+  inline bool
+  readSectors(register enum VirtualBlockDeviceError&       error,
+              register class BlockCacheEntry* const* const cacheEntries,
+              register const struct LBA* const             theLBAs,
+              register const unsigned int                  count)
+  {
+   if (!device->readSectors(error, cacheEntries, theLBAs, count))
+    return false;
+
+   chargeRuns(statistics.reads, theLBAs, count, parameters.readLatency);
+   return true;
+  }
+
+  inline bool
+  writeSectors(register enum VirtualBlockDeviceError&       error,
+               register class BlockCacheEntry* const* const cacheEntries,
+               register const struct LBA* const             theLBAs,
+               register const unsigned int                  count)
+  {
+   if (!device->writeSectors(error, cacheEntries, theLBAs, count))
+    return false;
+
+   chargeRuns(statistics.writes, theLBAs, count, parameters.writeLatency);
+   return true;
+  }
+
+  inline bool
+  sync(register enum VirtualBlockDeviceError& error)
+  {
+   if (!device->sync(error))
+    return false;
+
+   /* Where the head is does not matter to a flush. */
+   register struct LBA head;
+
+   head.theLBA = 0;
+
+   charge(statistics.syncs, head, 0, parameters.syncLatency);
+   return true;
+  }
+
+  inline bool
+  getSizeInSectors(register struct LBA& size) const
+  {
+   return device->getSizeInSectors(size);
+  }
+
+  /*! The response time of every request so far. */
+  inline bool
+  getChargedTime(register uint64_t& time)
+  {
+   lock();
+
+   time = statistics.responseTime;
+
+   unlock();
+   return true;
+  }
+
+  inline void
+  getStatistics(register struct Statistics& statistics)
+  {
+   lock();
+
+   statistics = this->statistics;
+   statistics.deviceTime = lastCompletion - firstRequest;
+
+   unlock();
+  }
+
+ private:
+  class VirtualBlockDevice* device;
+
+  struct Parameters         parameters;
+  struct Statistics         statistics;
+
+  /*! Simulated time at which each service channel becomes idle. */
+  uint64_t                  channelFree[maxQueueDepth];
+  /*! Simulated time at which the transfer path becomes idle. */
+  uint64_t                  busFree;
+  uint64_t                  virtualNow;
+  uint64_t                  firstRequest;
+  uint64_t                  lastCompletion;
+  uint64_t                  realBase;
+  uint64_t                  random;
+
+  uint_fast64_t             headLBA;
+  uint_fast64_t             sectors;
+  bool                      started;
+
+  /*! Guards everything above but device and parameters. */
+  pthread_mutex_t           modelLock;
+
+  inline void
+  init(register class VirtualBlockDevice* const device,
+       register const struct Parameters&        parameters,
+       register const uint64_t                  seed)
+  {
+   assert(device);
+   assert(parameters.queueDepth > 0);
+   assert(parameters.queueDepth <= maxQueueDepth);
+
+   this->device     = device;
+   this->parameters = parameters;
+
+   statistics.reads        = 0;
+   statistics.writes       = 0;
+   statistics.syncs        = 0;
+   statistics.seeks        = 0;
+   statistics.deviceTime   = 0;
+   statistics.responseTime = 0;
+
+   for(register unsigned int i = 0; i < maxQueueDepth; i++)
+    channelFree[i] = 0;
+
+   busFree        = 0;
+   virtualNow     = 0;
+   firstRequest   = 0;
+   lastCompletion = 0;
+   realBase       = monotonicTime();
+   /* xorshift must never be seeded with zero. */
+   random         = seed ? seed : 0x9e3779b97f4a7c15ULL;
+   headLBA        = 0;
+   started        = false;
+
+   register struct LBA size;
+
+   if (!device->getSizeInSectors(size))
+    assert(0);
+
+   sectors = size.theLBA;
+
+   if (pthread_mutex_init(&modelLock, 0))
+    assert(0);
+  }
+
+  inline void
+  lock(void)
+  {
+   if (pthread_mutex_lock(&modelLock))
+    assert(0);
+  }
+
+  inline void
+  unlock(void)
+  {
+   if (pthread_mutex_unlock(&modelLock))
+    assert(0);
+  }
+
+  static inline uint64_t
+  monotonicTime(void)
+  {
+   register struct timespec now;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &now))
+    assert(0);
+
+   return ((uint64_t) now.tv_sec) * 1000000000ULL + now.tv_nsec;
+  }
+
+  inline uint64_t
+  nextRandom(void)
+  {
+   /* xorshift64* */
+   random ^= random >> 12;
+   random ^= random << 25;
+   random ^= random >> 27;
+
+   return random * 0x2545f4914f6cdd1dULL;
+  }
+
+  inline uint64_t
+  positioningTime(register const struct LBA     theLBA,
+                  register const uint64_t       latency)
+  {
+   /* Streaming from where the head already is costs nothing extra. */
+   if (parameters.fullSeek && (theLBA.theLBA == headLBA))
+    return 0;
+
+   register uint64_t time = latency;
+
+   if (parameters.jitter)
+    time += nextRandom() % (parameters.jitter + 1);
+
+   if (parameters.fullSeek && sectors)
+   {
+    register const uint_fast64_t distance = (theLBA.theLBA > headLBA) ?
+                                            (theLBA.theLBA - headLBA) :
+                                            (headLBA - theLBA.theLBA);
+
+    time += parameters.trackSeek +
+            (uint64_t) ((parameters.fullSeek - parameters.trackSeek) *
+                        sqrt((double) distance / (double) sectors));
+    statistics.seeks++;
+   }
+
+   return time;
+  }
+
+  /*! A run of consecutive LBAs is one request to the device. The runs
+      of a vectored request are queued together and the caller waits
+      for the last of them. counter is the statistic to add count to. */
+  inline void
+  chargeRuns(register uint64_t&               counter,
+             register const struct LBA* const theLBAs,
+             register const unsigned int      count,
+             register const uint64_t          latency)
+  {
+   lock();
+
+   counter += count;
+
+   register const uint64_t now  = currentTime();
+   register uint64_t       last = now;
+   register unsigned int   i    = 0;
+
+   while (i < count)
+   {
+    register unsigned int run = 1;
+
+    while ((i + run < count) &&
+           (theLBAs[i + run].theLBA == theLBAs[i].theLBA + run))
+     run++;
+
+    register const uint64_t completion = schedule(now, theLBAs[i], run, latency);
+
+    if (completion > last)
+     last = completion;
+
+    i += run;
+   }
+
+   settle(last);
+  }
+
+  /*! Account for one request of count sectors at theLBA, and one in
+      counter. A request with no sectors is a cache flush: it waits for
+      everything queued before it and then takes latency without moving
+      the head. */
+  inline void
+  charge(register uint64_t&           counter,
+         register const struct LBA    theLBA,
+         register const unsigned int  count,
+         register const uint64_t      latency)
+  {
+   lock();
+
+   counter += count ? count : 1;
+
+   settle(schedule(currentTime(), theLBA, count, latency));
+  }
+
+  inline uint64_t
+  currentTime(void) const
+  {
+   return parameters.realTime ? (monotonicTime() - realBase) : virtualNow;
+  }
+
+  /*! Queue a request issued at now and return when it completes. */
+  inline uint64_t
+  schedule(register const uint64_t      now,
+           register const struct LBA    theLBA,
+           register const unsigned int  count,
+           register const uint64_t      latency)
+  {
+   if (!started)
+   {
+    firstRequest = now;
+    started      = true;
+   }
+
+   /* Pick the channel that frees up first. */
+   register unsigned int channel = 0;
+
+   for(register unsigned int i = 1; i < parameters.queueDepth; i++)
+    if (channelFree[i] < channelFree[channel])
+     channel = i;
+
+   register uint64_t start = (channelFree[channel] > now) ? channelFree[channel] : now;
+
+   if (count)
+   {
+    start += positioningTime(theLBA, latency);
+    headLBA = theLBA.theLBA + count;
+   }
+   else
+   {
+    for(register unsigned int i = 0; i < parameters.queueDepth; i++)
+     if (channelFree[i] > start)
+      start = channelFree[i];
+
+    start += latency;
+   }
+
+   /* Transfers are serialized on the bus. */
+   if (busFree > start)
+    start = busFree;
+
+   register uint64_t completion = start;
+
+   if (parameters.bandwidth)
+    completion += ((uint64_t) count * sectorSize * 1000000000ULL) / parameters.bandwidth;
+
+   busFree              = completion;
+   channelFree[channel] = completion;
+
+   if (completion > lastCompletion)
+    lastCompletion = completion;
+
+   statistics.responseTime += completion - now;
+
+   return completion;
+  }
+
+  /*! Let the caller go once its requests complete. Called with the lock
+      held, which it drops. */
+  inline void
+  settle(register const uint64_t completion)
+  {
+   if (!parameters.realTime)
+   {
+    /* Callers on other threads may have moved the clock further. */
+    if (completion > virtualNow)
+     virtualNow = completion;
+
+    unlock();
+    return;
+   }
+
+   unlock();
+
+   register const uint64_t wakeUp = realBase + completion;
+   register struct timespec until;
+   register int             result;
+
+   until.tv_sec  = wakeUp / 1000000000ULL;
+   until.tv_nsec = wakeUp % 1000000000ULL;
+
+   while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, 0)) == EINTR);
+
+   if (result)
+    assert(0);
+  }
+};
+
+#endif
@@ -0,0 +1,51 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef LEAFHINT_HPP
+# define LEAFHINT_HPP
+
+# include <Key.hpp>
+# include <LBA.hpp>
+
+/*! The leaf the last lookup, insert or remove of a transaction ended in,
+    with the path down to it and the range of keys it covers. A key in
+    that range goes straight to the leaf instead of down from the root.
+
+    The hint only holds for the tree, and the root LBA, it was taken in.
+    BPlusTree keeps it up to date through changes that leave the leaf in
+    its sector and drops it on any other change. */
+struct LeafHint
+{
+ static const unsigned int
+ maxDepth = 16;
+
+ const class BPlusTree* tree;
+ struct LBA             rootLBA;
+ bool                   valid;
+
+ /*! The leaf holds keys at or above low, if hasLow, and below high, if
+     hasHigh. */
+ bool                   hasLow;
+ bool                   hasHigh;
+ Key                    low;
+ Key                    high;
+
+ /*! Nodes from the root down to the leaf, the leaf last. */
+ unsigned int           depth;
+ struct LBA             path[maxDepth];
+ /*! The child taken in each internal node of path. */
+ unsigned int           index[maxDepth];
+
+ inline void
+ invalidate(void)
+ {
+  valid = false;
+  tree  = 0;
+ }
+};
+
+#endif
@@ -0,0 +1,355 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MEMBERIO_HPP
+# define MEMBERIO_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <pthread.h>
+# include <time.h>
+
+# include <LBA.hpp>
+
+# include <VirtualBlockDevice.hpp>
+
+/*! Fan-out helper for devices built from member devices. It holds one
+    request per member, each a vectored read or write on that member, and
+    a worker thread per member that waits for requests for the lifetime of
+    the device. issue() runs the first non empty request in the calling
+    thread, so a request that touches a single member never changes
+    threads, and hands the others to their workers and waits for all of
+    them. A sync request flushes the member instead of transferring
+    sectors.
+
+    The requests are shared, so a caller holds the lock from reset() until
+    it is done with the results. */
+class MemberIO
+{
+ public:
+  static const unsigned int
+  maxMembers = 16;
+
+  /*! Member requests are filled in chunks of at most this many sectors
+      so that they need no further allocation. */
+  static const unsigned int
+  maxBatch = 256;
+
+  struct request
+  {
+   class VirtualBlockDevice*                       device;
+   class BlockCacheEntry*                          cacheEntries[maxBatch];
+   struct LBA                                      theLBAs[maxBatch];
+   unsigned int                                    count;
+   /*! Nanoseconds the member took to serve the request, see
+       deviceClock. */
+   uint64_t                                        time;
+   bool                                            write;
+   bool                                            sync;
+   bool                                            success;
+   enum VirtualBlockDevice::VirtualBlockDeviceError error;
+  };
+
+  inline
+  MemberIO()
+  {
+   nbrOfMembers = 0;
+  }
+
+  inline
+  ~MemberIO()
+  {
+   if (!nbrOfMembers)
+    return;
+
+   if (pthread_mutex_lock(&queueLock))
+    assert(0);
+
+   stopping = true;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+    if (pthread_cond_signal(&workers[i].wake))
+     assert(0);
+
+   if (pthread_mutex_unlock(&queueLock))
+    assert(0);
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    if (workers[i].started && pthread_join(workers[i].thread, 0))
+     assert(0);
+
+    pthread_cond_destroy(&workers[i].wake);
+   }
+
+   pthread_cond_destroy(&done);
+   pthread_mutex_destroy(&queueLock);
+   pthread_mutex_destroy(&ioLock);
+  }
+
+  /*! Start a worker for each member. A member whose worker cannot be
+      started is served in the calling thread. */
+  inline void
+  init(register class VirtualBlockDevice* const* const devices,
+       register const unsigned int                     nbrOfMembers)
+  {
+   assert(!this->nbrOfMembers);
+   assert(nbrOfMembers > 0);
+   assert(nbrOfMembers <= maxMembers);
+
+   this->nbrOfMembers = nbrOfMembers;
+   remaining          = 0;
+   stopping           = false;
+
+   if (pthread_mutex_init(&ioLock, 0) ||
+       pthread_mutex_init(&queueLock, 0) ||
+       pthread_cond_init(&done, 0))
+    assert(0);
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    assert(devices[i]);
+
+    this->devices[i]   = devices[i];
+    workers[i].io      = this;
+    workers[i].member  = i;
+    workers[i].pending = false;
+
+    if (pthread_cond_init(&workers[i].wake, 0))
+     assert(0);
+
+    workers[i].started = !pthread_create(&workers[i].thread, 0, work, &workers[i]);
+   }
+  }
+
+  inline void
+  acquire(void)
+  {
+   if (pthread_mutex_lock(&ioLock))
+    assert(0);
+  }
+
+  inline void
+  release(void)
+  {
+   if (pthread_mutex_unlock(&ioLock))
+    assert(0);
+  }
+
+  inline void
+  reset(register const bool write)
+  {
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    requests[i].device  = devices[i];
+    requests[i].count   = 0;
+    requests[i].time    = 0;
+    requests[i].write   = write;
+    requests[i].sync    = false;
+    requests[i].success = true;
+    requests[i].error   = VirtualBlockDevice::noError;
+   }
+  }
+
+  inline void
+  add(register const unsigned int            member,
+      register class BlockCacheEntry* const  cacheEntry,
+      register const struct LBA              theLBA)
+  {
+   assert(member < nbrOfMembers);
+   assert(requests[member].count < maxBatch);
+
+   requests[member].cacheEntries[requests[member].count] = cacheEntry;
+   requests[member].theLBAs[requests[member].count]      = theLBA;
+   requests[member].count++;
+  }
+
+  inline const struct request&
+  operator[](register const unsigned int member) const
+  {
+   assert(member < nbrOfMembers);
+
+   return requests[member];
+  }
+
+  /*! Time on the clock device goes by: the device time it charged so
+      far if it models its timing, see VirtualBlockDevice::getChargedTime,
+      the wall clock otherwise. */
+  static inline uint64_t
+  deviceClock(register class VirtualBlockDevice* const device)
+  {
+   register uint64_t time;
+
+   if (device->getChargedTime(time))
+    return time;
+
+   register struct timespec now;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &now))
+    assert(0);
+
+   return ((uint64_t) now.tv_sec) * 1000000000ULL + now.tv_nsec;
+  }
+
+  /*! Sync the members in parallel, only those set in included if it is
+      given. */
+  inline bool
+  sync(register enum VirtualBlockDevice::VirtualBlockDeviceError& error,
+       register const bool* const                               included = 0)
+  {
+   reset(false);
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+    requests[i].sync = !included || included[i];
+
+   issue();
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    if (!requests[i].success)
+    {
+     error = requests[i].error;
+     return false;
+    }
+   }
+
+   error = VirtualBlockDevice::noError;
+   return true;
+  }
+
+  inline void
+  issue(void)
+  {
+   register int local = -1;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    if (!requests[i].count && !requests[i].sync)
+     continue;
+
+    if (local < 0)
+    {
+     local = i;
+     continue;
+    }
+
+    if (!workers[i].started)
+    {
+     run(&requests[i]);
+     continue;
+    }
+
+    if (pthread_mutex_lock(&queueLock))
+     assert(0);
+
+    workers[i].pending = true;
+    remaining++;
+
+    if (pthread_cond_signal(&workers[i].wake) ||
+        pthread_mutex_unlock(&queueLock))
+     assert(0);
+   }
+
+   if (local < 0)
+    return;
+
+   run(&requests[local]);
+
+   if (pthread_mutex_lock(&queueLock))
+    assert(0);
+
+   while (remaining)
+    if (pthread_cond_wait(&done, &queueLock))
+     assert(0);
+
+   if (pthread_mutex_unlock(&queueLock))
+    assert(0);
+  }
+
+ private:
+  struct worker
+  {
+   class MemberIO* io;
+   unsigned int    member;
+   pthread_t       thread;
+   pthread_cond_t  wake;
+   /*! The request of the member is waiting for the worker. */
+   bool            pending;
+   bool            started;
+  };
+
+  class VirtualBlockDevice* devices[maxMembers];
+  struct request            requests[maxMembers];
+  struct worker             workers[maxMembers];
+  unsigned int              nbrOfMembers;
+
+  /*! Held by the caller across reset, issue and reading the results. */
+  pthread_mutex_t           ioLock;
+  /*! Guards pending, remaining and stopping. */
+  pthread_mutex_t           queueLock;
+  pthread_cond_t            done;
+  /*! Requests handed to workers and not yet completed. */
+  unsigned int              remaining;
+  bool                      stopping;
+
+  static void*
+  work(register void* const argument)
+  {
+   register struct worker* const worker = (struct worker*) argument;
+   register class MemberIO* const io     = worker->io;
+
+   if (pthread_mutex_lock(&io->queueLock))
+    assert(0);
+
+   for(;;)
+   {
+    while (!worker->pending && !io->stopping)
+     if (pthread_cond_wait(&worker->wake, &io->queueLock))
+      assert(0);
+
+    if (!worker->pending)
+     break;
+
+    if (pthread_mutex_unlock(&io->queueLock))
+     assert(0);
+
+    run(&io->requests[worker->member]);
+
+    if (pthread_mutex_lock(&io->queueLock))
+     assert(0);
+
+    worker->pending = false;
+
+    if (!--io->remaining && pthread_cond_signal(&io->done))
+     assert(0);
+   }
+
+   if (pthread_mutex_unlock(&io->queueLock))
+    assert(0);
+
+   return 0;
+  }
+
+  static inline void
+  run(register struct request* const request)
+  {
+   register const uint64_t start = deviceClock(request->device);
+
+   if (request->sync)
+    request->success = request->device->sync(request->error);
+   else if (request->write)
+    request->success = request->device->writeSectors(request->error, request->cacheEntries,
+                                                     request->theLBAs, request->count);
+   else
+    request->success = request->device->readSectors(request->error, request->cacheEntries,
+                                                    request->theLBAs, request->count);
+
+   request->time = deviceClock(request->device) - start;
+  }
+};
+
+#endif
@@ -0,0 +1,393 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MIRROREDBLOCKDEVICE_HPP
+# define MIRROREDBLOCKDEVICE_HPP
+
+# include <assert.h>
+# include <stdint.h>
+
+# include <Globals.hpp>
+# include <LBA.hpp>
+
+# include <VirtualBlockDevice.hpp>
+# include <MemberIO.hpp>
+
+/*! RAID-1 over a set of member devices. Writes go to every working member
+    in parallel. Reads are served by a single member, picked by the number
+    of I/Os already outstanding on it weighted by a moving average of its
+    recent service time, so a member that turns slow stops attracting reads
+    until it recovers. Vectored reads are dealt out over the members the
+    same way and run in parallel. Service times are taken from
+    MemberIO::deviceClock, so members that model their timing are ranked by
+    the time they charge rather than by the wall clock.
+
+    Every request, single sectors included, runs under the lock of the
+    member queue, which also guards the balancing state.
+
+    A member that fails an I/O is taken out of service for good: reads it
+    failed are retried on the other members, and pickMember, writes and
+    syncs skip it from then on. The mirror keeps working as long as one
+    member is left, after that every request fails with deviceError. */
+class MirroredBlockDevice : public VirtualBlockDevice
+{
+ public:
+  static const unsigned int
+  maxMembers = MemberIO::maxMembers;
+
+  inline
+  MirroredBlockDevice(register class VirtualBlockDevice* const* const members,
+                      register const unsigned int                     nbrOfMembers)
+  {
+   assert(members);
+   assert(nbrOfMembers > 0);
+   assert(nbrOfMembers <= maxMembers);
+
+   this->nbrOfMembers = nbrOfMembers;
+   this->roundRobin   = 0;
+
+   sectors = UINT64_MAX;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    assert(members[i]);
+
+    this->members[i].device       = members[i];
+    this->members[i].outstanding  = 0;
+    this->members[i].averageTime  = 0;
+    this->members[i].working      = true;
+
+    register struct LBA size;
+
+    if (!members[i]->getSizeInSectors(size))
+     assert(0);
+
+    if (size.theLBA < sectors)
+     sectors = size.theLBA;
+   }
+
+   io.init(members, nbrOfMembers);
+  }
+
+  inline bool
+  readSector(register enum VirtualBlockDeviceError& error,
+             register class BlockCacheEntry* const  cacheEntry,
+             register const struct LBA              theLBA)
+  {
+   io.acquire();
+
+   register const bool success = readOne(error, cacheEntry, theLBA);
+
+   io.release();
+   return success;
+  }
+
+  inline bool
+  writeSector(register enum VirtualBlockDeviceError& error,
+              register class BlockCacheEntry* const  cacheEntry,
+              register const struct LBA              theLBA)
+  {
+   return writeSectors(error, &cacheEntry, &theLBA, 1);
+  }
+
+  inline bool
+  readSectors(register enum VirtualBlockDeviceError&       error,
+              register class BlockCacheEntry* const* const cacheEntries,
+              register const struct LBA* const             theLBAs,
+              register const unsigned int                  count)
+  {
+   io.acquire();
+
+   for(register unsigned int done = 0; done < count; )
+   {
+    register const unsigned int chunk = ((count - done) < MemberIO::maxBatch) ?
+                                        (count - done) : MemberIO::maxBatch;
+
+    io.reset(false);
+
+    /* Give out runs of consecutive sectors, each to the member with the
+       lowest projected load, so runs stay mergeable within a member. */
+    register unsigned int i = done;
+
+    while (i < done + chunk)
+    {
+     register unsigned int run = 1;
+
+     while ((i + run < done + chunk) &&
+            (theLBAs[i + run].theLBA == theLBAs[i].theLBA + run))
+      run++;
+
+     register const int member = pickMember();
+
+     if (member < 0)
+     {
+      io.release();
+      error = deviceError;
+      return false;
+     }
+
+     members[member].outstanding += run;
+
+     for(register unsigned int j = i; j < i + run; j++)
+     {
+      assert(theLBAs[j].theLBA < sectors);
+      io.add(member, cacheEntries[j], theLBAs[j]);
+     }
+
+     i += run;
+    }
+
+    if (!issue())
+    {
+     /* Retry what the failed members did not deliver, one by one. The
+        failed members are out of service by now. */
+     for(register unsigned int member = 0; member < nbrOfMembers; member++)
+     {
+      if (io[member].success)
+       continue;
+
+      for(register unsigned int j = 0; j < io[member].count; j++)
+      {
+       if (!readOne(error, io[member].cacheEntries[j], io[member].theLBAs[j]))
+       {
+        io.release();
+        return false;
+       }
+      }
+     }
+    }
+
+    done += chunk;
+   }
+
+   io.release();
+
+   error = noError;
+   return true;
+  }
+
+  inline bool
+  writeSectors(register enum VirtualBlockDeviceError&       error,
+               register class BlockCacheEntry* const* const cacheEntries,
+               register const struct LBA* const             theLBAs,
+               register const unsigned int                  count)
+  {
+   io.acquire();
+
+   for(register unsigned int done = 0; done < count; )
+   {
+    register const unsigned int chunk = ((count - done) < MemberIO::maxBatch) ?
+                                        (count - done) : MemberIO::maxBatch;
+
+    io.reset(true);
+
+    for(register unsigned int member = 0; member < nbrOfMembers; member++)
+    {
+     if (!members[member].working)
+      continue;
+
+     members[member].outstanding += chunk;
+
+     for(register unsigned int i = done; i < done + chunk; i++)
+     {
+      assert(theLBAs[i].theLBA < sectors);
+      io.add(member, cacheEntries[i], theLBAs[i]);
+     }
+    }
+
+    issue();
+
+    /* The write stands as long as one copy made it. */
+    if (pickMember() < 0)
+    {
+     io.release();
+     error = deviceError;
+     return false;
+    }
+
+    done += chunk;
+   }
+
+   io.release();
+
+   error = noError;
+   return true;
+  }
+
+  inline bool
+  sync(register enum VirtualBlockDeviceError& error)
+  {
+   register bool working[maxMembers];
+
+   io.acquire();
+
+   /* Members out of service are left alone. */
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+    working[i] = members[i].working;
+
+   io.sync(error, working);
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    if (working[i] && !io[i].success)
+     members[i].working = false;
+   }
+
+   register const bool success = pickMember() >= 0;
+
+   io.release();
+
+   error = success ? noError : deviceError;
+   return success;
+  }
+
+  inline bool
+  getSizeInSectors(register struct LBA& size) const
+  {
+   size.theLBA = sectors;
+
+   return sectors != 0;
+  }
+
+  inline unsigned int
+  getWorkingMembers(void) const
+  {
+   register unsigned int working = 0;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+    if (members[i].working)
+     working++;
+
+   return working;
+  }
+
+ private:
+  /*! Weight of the newest sample in the service time average, as a shift. */
+  static const unsigned int
+  averageShift = 3;
+
+  struct
+  {
+   class VirtualBlockDevice* device;
+   /*! Sectors handed to the member and not yet completed. */
+   uint64_t                  outstanding;
+   /*! Moving average of the per sector service time in nanoseconds. */
+   uint64_t                  averageTime;
+   bool                      working;
+  } members[maxMembers];
+
+  unsigned int   nbrOfMembers;
+  unsigned int   roundRobin;
+  uint_fast64_t  sectors;
+  class MemberIO io;
+
+  /*! Read a sector from the best member, falling back to the others if it
+      fails. The caller holds the lock of io. */
+  inline bool
+  readOne(register enum VirtualBlockDeviceError& error,
+          register class BlockCacheEntry* const  cacheEntry,
+          register const struct LBA              theLBA)
+  {
+   assert(theLBA.theLBA < sectors);
+
+   for(register int member = pickMember(); member >= 0; member = pickMember())
+   {
+    register class VirtualBlockDevice* const device = members[member].device;
+
+    members[member].outstanding++;
+
+    register const uint64_t start   = MemberIO::deviceClock(device);
+    register const bool     success = device->readSector(error, cacheEntry, theLBA);
+
+    completed(member, 1, MemberIO::deviceClock(device) - start, success);
+
+    if (success)
+     return true;
+   }
+
+   error = deviceError;
+   return false;
+  }
+
+  /*! Pick the working member expected to finish a new read first. Members
+      that have no history yet count as fast so they get sampled. Ties are
+      broken round robin to spread reads over equal members. */
+  inline int
+  pickMember(void)
+  {
+   register int      best     = -1;
+   register uint64_t bestCost = 0;
+
+   roundRobin = (roundRobin + 1) % nbrOfMembers;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    register const unsigned int member = (roundRobin + i) % nbrOfMembers;
+
+    if (!members[member].working)
+     continue;
+
+    register const uint64_t cost = (members[member].outstanding + 1) *
+                                   (members[member].averageTime + 1);
+
+    if ((best < 0) || (cost < bestCost))
+    {
+     best     = member;
+     bestCost = cost;
+    }
+   }
+
+   return best;
+  }
+
+  inline void
+  completed(register const unsigned int member,
+            register const unsigned int count,
+            register const uint64_t     time,
+            register const bool         success)
+  {
+   members[member].outstanding -= count;
+
+   if (!success)
+   {
+    members[member].working = false;
+    return;
+   }
+
+   register const uint64_t sample = time / (count ? count : 1);
+
+   if (!members[member].averageTime)
+    members[member].averageTime = sample;
+   else
+    members[member].averageTime += (sample >> averageShift) - (members[member].averageTime >> averageShift);
+  }
+
+  /*! Run the member requests in parallel and account for them. Returns
+      false if any member failed. */
+  inline bool
+  issue(void)
+  {
+   register bool success = true;
+
+   io.issue();
+
+   for(register unsigned int member = 0; member < nbrOfMembers; member++)
+   {
+    if (!io[member].count)
+     continue;
+
+    completed(member, io[member].count, io[member].time, io[member].success);
+
+    if (!io[member].success)
+     success = false;
+   }
+
+   return success;
+  }
+};
+
+#endif
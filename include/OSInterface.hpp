@@ -3,6 +3,8 @@
 
 # include <assert.h>
 # include <stdint.h>
+# include <stdio.h>
+# include <stdlib.h>
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <unistd.h>
@@ -12,6 +14,13 @@
 # include <UUID.hpp>
 
 # include <BlockDevice.hpp>
+# include <LatencyBlockDevice.hpp>
+# include <StripedBlockDevice.hpp>
+# include <MirroredBlockDevice.hpp>
+
+# ifndef SIMULATED_DEVICE_SEED
+#  define SIMULATED_DEVICE_SEED 1
+# endif
 
 class OSInterface
 {
@@ -99,11 +108,15 @@ class OSInterface
   uint32_t
   tick;
 
+  /*! Devices made so far, each simulated one gets a seed of its own. */
+  unsigned int
+  createdDevices;
+
   inline void
-  initDevice(register const unsigned int device,
+  initDevice(register const char* const  devicePath,
              register const unsigned int sectors)
   {
-   int fd = open(devices[device].devicePath, O_CREAT | O_TRUNC | O_RDWR, 0700);
+   int fd = open(devicePath, O_CREAT | O_TRUNC | O_RDWR, 0700);
 
    assert (fd != -1);
 
@@ -122,6 +135,40 @@ class OSInterface
    assert(error != -1);
   }
 
+  /*! Create a backing file and open it as a device, wrapped in the
+      simulated device model when the build asks for one. Simulated
+      devices are seeded SIMULATED_DEVICE_SEED, SIMULATED_DEVICE_SEED + 1
+      and so on, in the order they are made. */
+  inline class VirtualBlockDevice*
+  createDevice(register const char* const  devicePath,
+               register const unsigned int sectors)
+  {
+   initDevice(devicePath, sectors);
+
+   register class VirtualBlockDevice* device = new BlockDevice(devicePath);
+
+   assert(device);
+
+# ifdef SIMULATED_DEVICE_PROFILE
+   /* Benchmark builds model real storage on top of the backing file,
+      e.g. make DEVICE_FLAGS=-DSIMULATED_DEVICE_PROFILE=hddProfile
+      The model runs on virtual time unless SIMULATED_DEVICE_REALTIME is
+      set in the environment, then every request also takes that long. */
+   register struct LatencyBlockDevice::Parameters parameters =
+    LatencyBlockDevice::getProfile(LatencyBlockDevice::SIMULATED_DEVICE_PROFILE);
+
+   parameters.realTime = getenv("SIMULATED_DEVICE_REALTIME") != 0;
+
+   device = new LatencyBlockDevice(device, parameters, SIMULATED_DEVICE_SEED + createdDevices);
+
+   assert(device);
+# endif
+
+   createdDevices++;
+
+   return device;
+  }
+
   inline
   OSInterface()
   {
@@ -137,9 +184,48 @@ class OSInterface
    devices[0].uuid.major = 0;
    devices[0].uuid.minor = 0;
 
-   initDevice(0, 16 * 1024);
+   createdDevices = 0;
+
+# ifdef STRIPED_DEVICE_MEMBERS
+   /* Spread dev0 over several backing files,
+      e.g. make DEVICE_FLAGS="-DSTRIPED_DEVICE_MEMBERS=4 -DSTRIPE_UNIT=16" */
+#  ifndef STRIPE_UNIT
+#   define STRIPE_UNIT 16
+#  endif
+   {
+    register class VirtualBlockDevice* members[STRIPED_DEVICE_MEMBERS];
+
+    for(register unsigned int i = 0; i < STRIPED_DEVICE_MEMBERS; i++)
+    {
+     register char memberPath[32];
+
+     snprintf(memberPath, sizeof(memberPath), "%s.%u", devices[0].devicePath, i);
 
-   devices[0].device = new BlockDevice(devices[0].devicePath);
+     members[i] = createDevice(memberPath, (16 * 1024) / STRIPED_DEVICE_MEMBERS);
+    }
+
+    devices[0].device = new StripedBlockDevice(members, STRIPED_DEVICE_MEMBERS, STRIPE_UNIT);
+   }
+# elif defined(MIRRORED_DEVICE_MEMBERS)
+   /* Keep a full copy of dev0 in each of several backing files,
+      e.g. make DEVICE_FLAGS=-DMIRRORED_DEVICE_MEMBERS=2 */
+   {
+    register class VirtualBlockDevice* members[MIRRORED_DEVICE_MEMBERS];
+
+    for(register unsigned int i = 0; i < MIRRORED_DEVICE_MEMBERS; i++)
+    {
+     register char memberPath[32];
+
+     snprintf(memberPath, sizeof(memberPath), "%s.%u", devices[0].devicePath, i);
+
+     members[i] = createDevice(memberPath, 16 * 1024);
+    }
+
+    devices[0].device = new MirroredBlockDevice(members, MIRRORED_DEVICE_MEMBERS);
+   }
+# else
+   devices[0].device = createDevice(devices[0].devicePath, 16 * 1024);
+# endif
 
    assert(devices[0].device);
 
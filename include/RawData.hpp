@@ -19,13 +19,13 @@ class RawData : public Serializable
 
   inline
   RawData(register uint8_t* const       data,
-          register const uint_fast16_t  size)
+          register const uint_fast32_t  size)
   {
    this->data   = data;
    this->mySize = size;
   }
 
-  inline uint_fast16_t
+  inline uint_fast32_t
   size(void) const
   {
    return mySize;
@@ -46,7 +46,7 @@ class RawData : public Serializable
 
   inline bool
   fromFileSystem(register const uint8_t*      source,
-                 register const uint_fast16_t size,
+                 register const uint_fast32_t size,
                  register const bool          isLittle)
   {
    assert(data);
@@ -58,9 +58,36 @@ class RawData : public Serializable
    return true;
   }
 
+  inline bool
+  toSectors(register uint8_t* const* const sectors,
+            register const unsigned int    count,
+            register const bool            isLittle) const
+  {
+   assert(data);
+
+   for(register unsigned int i = 0; i < count; i++)
+    memcpy(sectors[i], data + i * sectorSize, ((i + 1) < count) ? sectorSize : (mySize - i * sectorSize));
+
+   return true;
+  }
+
+  inline bool
+  fromSectors(register const uint8_t* const* const sectors,
+              register const unsigned int          count,
+              register const uint_fast32_t         size,
+              register const bool                  isLittle)
+  {
+   assert(data);
+
+   for(register unsigned int i = 0; i < count; i++)
+    memcpy(data + i * sectorSize, sectors[i], ((i + 1) < count) ? sectorSize : (size - i * sectorSize));
+
+   return true;
+  }
+
  private:
   uint8_t*      data;
-  uint_fast16_t mySize; 
+  uint_fast32_t mySize; 
 };
 
 #endif
@@ -1,16 +1,20 @@
 #ifndef  SERIALIZABLE_HPP
 # define SERIALIZABLE_HPP
 
+# include <assert.h>
 # include <stdint.h>
+# include <string.h>
+
+# include <Globals.hpp>
 
 class Serializable
 {
  public:
-  virtual uint_fast16_t
+  virtual uint_fast32_t
   size(void) const = 0;
 
   virtual bool
-  isSizeAcceptable(register const uint_fast16_t size) const
+  isSizeAcceptable(register const uint_fast32_t size) const
   {
    return size <= this->size();
   }
@@ -21,8 +25,54 @@ class Serializable
 
   virtual bool
   fromFileSystem(register const uint8_t*      source,
-                 register const uint_fast16_t size,
+                 register const uint_fast32_t size,
                  register const bool          isLittle) = 0;  
+
+  /*! toFileSystem for a value stored out of line, straight into the
+      count sectors that hold it, each sectorSize bytes but the last.
+      The default lays the value out whole on the heap first. */
+  virtual bool
+  toSectors(register uint8_t* const* const sectors,
+            register const unsigned int    count,
+            register const bool            isLittle) const
+  {
+   register const uint_fast32_t size  = this->size();
+   register uint8_t* const      whole = new uint8_t[size];
+
+   assert(whole);
+   assert(count == (size + sectorSize - 1) / sectorSize);
+
+   register const bool success = toFileSystem(whole, isLittle);
+
+   for(register unsigned int i = 0; success && (i < count); i++)
+    memcpy(sectors[i], whole + i * sectorSize, ((i + 1) < count) ? sectorSize : (size - i * sectorSize));
+
+   delete [] whole;
+   return success;
+  }
+
+  /*! fromFileSystem for a value of size bytes stored out of line, from
+      the count sectors that hold it. The default gathers them on the
+      heap first. */
+  virtual bool
+  fromSectors(register const uint8_t* const* const sectors,
+              register const unsigned int          count,
+              register const uint_fast32_t         size,
+              register const bool                  isLittle)
+  {
+   register uint8_t* const whole = new uint8_t[size];
+
+   assert(whole);
+   assert(count == (size + sectorSize - 1) / sectorSize);
+
+   for(register unsigned int i = 0; i < count; i++)
+    memcpy(whole + i * sectorSize, sectors[i], ((i + 1) < count) ? sectorSize : (size - i * sectorSize));
+
+   register const bool success = fromFileSystem(whole, size, isLittle);
+
+   delete [] whole;
+   return success;
+  }
 };
 
 #endif
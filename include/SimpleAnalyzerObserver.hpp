@@ -36,7 +36,7 @@ class SimpleAnalyzerObserver : public SubTreeObserver
    register enum Transaction::TransactionError
    transactionError;
 
-   register uint_fast16_t
+   register uint_fast32_t
    size;
 
    if(!transaction->lookup(counter, size, transactionError, counter.getKey()))
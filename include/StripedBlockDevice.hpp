@@ -0,0 +1,193 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef STRIPEDBLOCKDEVICE_HPP
+# define STRIPEDBLOCKDEVICE_HPP
+
+# include <assert.h>
+# include <stdint.h>
+
+# include <Globals.hpp>
+# include <LBA.hpp>
+
+# include <VirtualBlockDevice.hpp>
+# include <MemberIO.hpp>
+
+/*! RAID-0 over a set of member devices. The address space is cut into
+    stripe units of stripeUnit sectors which are dealt out round robin over
+    the members. Vectored requests are split per member and the member
+    requests are issued in parallel on the member workers of MemberIO, so
+    a large flush or read runs at the aggregate bandwidth of the members. */
+class StripedBlockDevice : public VirtualBlockDevice
+{
+ public:
+  static const unsigned int
+  maxMembers = MemberIO::maxMembers;
+
+  inline
+  StripedBlockDevice(register class VirtualBlockDevice* const* const members,
+                     register const unsigned int                     nbrOfMembers,
+                     register const unsigned int                     stripeUnit)
+  {
+   assert(members);
+   assert(nbrOfMembers > 0);
+   assert(nbrOfMembers <= maxMembers);
+   assert(stripeUnit > 0);
+
+   this->nbrOfMembers = nbrOfMembers;
+   this->stripeUnit   = stripeUnit;
+
+   register uint_fast64_t memberSectors = UINT64_MAX;
+
+   for(register unsigned int i = 0; i < nbrOfMembers; i++)
+   {
+    assert(members[i]);
+
+    this->members[i] = members[i];
+
+    register struct LBA size;
+
+    if (!members[i]->getSizeInSectors(size))
+     assert(0);
+
+    if (size.theLBA < memberSectors)
+     memberSectors = size.theLBA;
+   }
+
+   /* Only whole stripe units that exist on every member are usable. */
+   sectors = (memberSectors / stripeUnit) * stripeUnit * nbrOfMembers;
+
+   io.init(this->members, nbrOfMembers);
+  }
+
+  /*! Single sectors take the vectored path too, so they are ordered with
+      the member requests of other threads. MemberIO runs a request on a
+      single member in the calling thread. */
+  inline bool
+  readSector(register enum VirtualBlockDeviceError& error,
+             register class BlockCacheEntry* const  cacheEntry,
+             register const struct LBA              theLBA)
+  {
+   return transfer(error, &cacheEntry, &theLBA, 1, false);
+  }
+
+  inline bool
+  writeSector(register enum VirtualBlockDeviceError& error,
+              register class BlockCacheEntry* const  cacheEntry,
+              register const struct LBA              theLBA)
+  {
+   return transfer(error, &cacheEntry, &theLBA, 1, true);
+  }
+
+  inline bool
+  readSectors(register enum VirtualBlockDeviceError&       error,
+              register class BlockCacheEntry* const* const cacheEntries,
+              register const struct LBA* const             theLBAs,
+              register const unsigned int                  count)
+  {
+   return transfer(error, cacheEntries, theLBAs, count, false);
+  }
+
+  inline bool
+  writeSectors(register enum VirtualBlockDeviceError&       error,
+               register class BlockCacheEntry* const* const cacheEntries,
+               register const struct LBA* const             theLBAs,
+               register const unsigned int                  count)
+  {
+   return transfer(error, cacheEntries, theLBAs, count, true);
+  }
+
+  inline bool
+  sync(register enum VirtualBlockDeviceError& error)
+  {
+   io.acquire();
+
+   register const bool success = io.sync(error);
+
+   io.release();
+   return success;
+  }
+
+  inline bool
+  getSizeInSectors(register struct LBA& size) const
+  {
+   size.theLBA = sectors;
+
+   return sectors != 0;
+  }
+
+ private:
+  class VirtualBlockDevice* members[maxMembers];
+  unsigned int              nbrOfMembers;
+  unsigned int              stripeUnit;
+  uint_fast64_t             sectors;
+  class MemberIO            io;
+
+  inline void
+  map(register unsigned int&    member,
+      register struct LBA&      memberLBA,
+      register const struct LBA theLBA) const
+  {
+   assert(theLBA.theLBA < sectors);
+
+   register const uint_fast64_t stripe = theLBA.theLBA / stripeUnit;
+
+   member           = stripe % nbrOfMembers;
+   memberLBA.theLBA = (stripe / nbrOfMembers) * stripeUnit + theLBA.theLBA % stripeUnit;
+  }
+
+  inline bool
+  transfer(register enum VirtualBlockDeviceError&       error,
+           register class BlockCacheEntry* const* const cacheEntries,
+           register const struct LBA* const             theLBAs,
+           register const unsigned int                  count,
+           register const bool                          write)
+  {
+   io.acquire();
+
+   for(register unsigned int done = 0; done < count; )
+   {
+    register const unsigned int chunk = ((count - done) < MemberIO::maxBatch) ?
+                                        (count - done) : MemberIO::maxBatch;
+
+    io.reset(write);
+
+    /* Keep the caller's order within each member so consecutive LBAs stay
+       consecutive and the member can merge them. */
+    for(register unsigned int i = done; i < done + chunk; i++)
+    {
+     register unsigned int member;
+     register struct LBA   memberLBA;
+
+     map(member, memberLBA, theLBAs[i]);
+
+     io.add(member, cacheEntries[i], memberLBA);
+    }
+
+    io.issue();
+
+    for(register unsigned int i = 0; i < nbrOfMembers; i++)
+    {
+     if (!io[i].success)
+     {
+      error = io[i].error;
+      io.release();
+      return false;
+     }
+    }
+
+    done += chunk;
+   }
+
+   io.release();
+
+   error = noError;
+   return true;
+  }
+};
+
+#endif
@@ -26,14 +26,14 @@ class SubTreeCount : public Serializable
    this->count = count;
   }
 
-  inline uint_fast16_t
+  inline uint_fast32_t
   size(void) const
   {
    return sizeof(uint64_t);
   }
 
   inline bool
-  isSizeAcceptable(register const uint_fast16_t size) const
+  isSizeAcceptable(register const uint_fast32_t size) const
   {
    return size == this->size();
   }
@@ -65,7 +65,7 @@ class SubTreeCount : public Serializable
 
   inline bool
   fromFileSystem(register const uint8_t*      source,
-                 register const uint_fast16_t size,
+                 register const uint_fast32_t size,
                  register const bool          isLittle)
   {
    count = fromFileSystemEndian((uint64_t*) source, isLittle);
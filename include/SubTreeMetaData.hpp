@@ -41,14 +41,14 @@ class SubTreeMetaData : public Serializable
    this->bits         = bits;
   }
 
-  inline uint_fast16_t
+  inline uint_fast32_t
   size(void) const
   {
    return sizeof(struct MetaData);
   }
 
   inline bool
-  isSizeAcceptable(register const uint_fast16_t size) const
+  isSizeAcceptable(register const uint_fast32_t size) const
   {
    return size == this->size();
   }
@@ -83,7 +83,7 @@ class SubTreeMetaData : public Serializable
 
   inline bool
   fromFileSystem(register const uint8_t*      source,
-                 register const uint_fast16_t size,
+                 register const uint_fast32_t size,
                  register const bool          isLittle)
   {
    assert(source);
@@ -40,7 +40,7 @@ class SubTreeObserver
 
   virtual inline void
   notifyLookup(register class Transaction* const transaction,
-               register const uint_fast16_t      size,
+               register const uint_fast32_t      size,
                register const uint64_t           subTreeId,
                register const uint64_t           major,
                register const uint64_t           minor)
@@ -49,7 +49,7 @@ class SubTreeObserver
 
   virtual inline void
   notifyInsert(register class Transaction* const transaction,
-               register const uint_fast16_t      size,
+               register const uint_fast32_t      size,
                register const uint64_t           subTreeId,
                register const uint64_t           major,
                register const uint64_t           minor)
@@ -64,6 +64,17 @@ class SubTreeObserver
   {
   }
 
+  /*! The minors from firstMinor to lastMinor, both included, were
+      removed, whichever of them were there. */
+  virtual inline void
+  notifyRemoveRange(register class Transaction* const transaction,
+                    register const uint64_t           subTreeId,
+                    register const uint64_t           major,
+                    register const uint64_t           firstMinor,
+                    register const uint64_t           lastMinor)
+  {
+  }
+
  private:
 };
 
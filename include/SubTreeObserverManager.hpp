@@ -91,7 +91,7 @@ class SubTreeObserverManager
 
   inline void
   notifyLookup(register class Transaction* const transaction,
-               register const uint_fast16_t      size,
+               register const uint_fast32_t      size,
                register const uint64_t           subTreeId,
                register const uint64_t           major,
                register const uint64_t           minor)
@@ -109,7 +109,7 @@ class SubTreeObserverManager
 
   inline void
   notifyInsert(register class Transaction* const transaction,
-               register const uint_fast16_t      size,
+               register const uint_fast32_t      size,
                register const uint64_t           subTreeId,
                register const uint64_t           major,
                register const uint64_t           minor)
@@ -141,6 +141,24 @@ class SubTreeObserverManager
    }
   }
 
+  inline void
+  notifyRemoveRange(register class Transaction* const transaction,
+                    register const uint64_t           subTreeId,
+                    register const uint64_t           major,
+                    register const uint64_t           firstMinor,
+                    register const uint64_t           lastMinor)
+  {
+   for(register unsigned int i = 0; i < maxObservers; i++)
+   {
+    if (observers[i])
+     observers[i]->notifyRemoveRange(transaction,
+                                     subTreeId,
+                                     major,
+                                     firstMinor,
+                                     lastMinor);
+   }
+  }
+
                
  private:
   static const unsigned int
@@ -13,10 +13,13 @@
 
 # include <SubTreeBlobKey.hpp>
 # include <Transaction.hpp>
+# include <BPlusTreeBuilder.hpp>
+# include <BatchOperation.hpp>
 # include <Key.hpp>
 # include <Serializable.hpp>
 
 # include <RawData.hpp>
+# include <ValueView.hpp>
 # include <SubTreeCount.hpp>
 # include <SubTreeMetaData.hpp>
 
@@ -30,7 +33,10 @@ class SubTreeTransaction : protected Transaction
   enum SubTreeTransactionError
   {
    noError = 0,
-   keyNotFound
+   keyNotFound,
+   outOfRange,
+   /*! The tree is damaged on the way to the key. */
+   checksumError
   };    
   
   inline bool
@@ -50,7 +56,7 @@ class SubTreeTransaction : protected Transaction
 
   inline bool
   lookupData(register uint8_t* const                destination,
-             register uint_fast16_t&                size,
+             register uint_fast32_t&                size,
              register enum SubTreeTransactionError& error,
              register const struct SubTreeBlobKey   key,
              register const uint_fast64_t           minor)
@@ -74,6 +80,10 @@ class SubTreeTransaction : protected Transaction
       error = keyNotFound;
      break;
 
+     case Transaction::checksumError:
+      error = checksumError;
+     break;
+
      default:  
       assert(0);
     }
@@ -89,10 +99,229 @@ class SubTreeTransaction : protected Transaction
    return true;
   }
 
+  /*! lookupData for the count values of blob key at minors, in strictly
+      ascending order, in one pass over the tree. Value i is copied to
+      destinations[i], which takes up to sizes[i] bytes, and sizes[i]
+      set to its size. found[i] tells if it is there. If the tree is
+      damaged on the way to some of them, those are not found and it
+      fails with checksumError. */
+  inline bool
+  multiLookupData(register uint8_t* const* const          destinations,
+                  register uint_fast32_t* const           sizes,
+                  register bool* const                    found,
+                  register enum SubTreeTransactionError&  error,
+                  register const struct SubTreeBlobKey    key,
+                  register const uint_fast64_t* const     minors,
+                  register const unsigned int             count)
+  {
+   register const unsigned int                         slots   = count ? count : 1;
+   register RawData* const                             values  = new RawData[slots];
+   register Serializable** const                       targets = new Serializable*[slots];
+   register Key* const                                 keys    = new Key[slots];
+   register enum Transaction::TransactionError* const  errors  = new enum Transaction::TransactionError[slots];
+
+   assert(values && targets && keys && errors);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    values[i]  = RawData(destinations[i], sizes[i]);
+    targets[i] = values + i;
+    keys[i]    = getTreeKey(key, minors[i]);
+   }
+
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::multiLookup(targets, sizes, errors, transactionError, keys, count))
+    assert(0);
+
+   assert(transactionError == Transaction::noError);
+
+   register bool damaged = false;
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    assert((errors[i] == Transaction::noError) || (errors[i] == Transaction::keyNotFound) ||
+           (errors[i] == Transaction::checksumError));
+
+    found[i] = errors[i] == Transaction::noError;
+
+    if (errors[i] == Transaction::checksumError)
+     damaged = true;
+
+    if (found[i])
+     SubTreeObserverManager::getInstance().notifyLookup(this, sizes[i], subTreeMajor, key.major, minors[i]);
+   }
+
+   delete [] values;
+   delete [] targets;
+   delete [] keys;
+   delete [] errors;
+
+   /* The values that were found are still delivered. */
+   if (damaged)
+   {
+    error = checksumError;
+    return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! As lookupData, but shows the data in place instead of copying it. */
+  inline bool
+  lookupDataView(register ValueView&                    view,
+                 register enum SubTreeTransactionError& error,
+                 register const struct SubTreeBlobKey   key,
+                 register const uint_fast64_t           minor)
+  {
+   register struct Key treeKey;
+
+   treeKey.type  = FileSystem::rawDataType;
+   treeKey.major = subTreeMajor | key.major;
+   treeKey.minor = minor;
+
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::lookupView(view, transactionError, treeKey))
+   {
+    switch(transactionError)
+    {
+     case Transaction::keyNotFound:
+      error = keyNotFound;
+     break;
+
+     case Transaction::checksumError:
+      error = checksumError;
+     break;
+
+     default:  
+      assert(0);
+    }
+
+    return false;
+   }
+
+   assert(transactionError == Transaction::noError);
+
+   error = noError;
+
+   SubTreeObserverManager::getInstance().notifyLookup(this, view.size(), subTreeMajor, key.major, minor);
+   return true;
+  }
+
+  /*! Store a run of values of blob key in one bulk load. The source
+      gives the minors in its keys, in ascending order, and the rest of
+      each key is filled in here. */
+  inline bool
+  bulkInsertData(register enum SubTreeTransactionError& error,
+                 register const struct SubTreeBlobKey   key,
+                 register class BulkLoadSource&         source)
+  {
+   register BlobSource blobSource(source, this, subTreeMajor, key.major);
+
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::bulkLoad(transactionError, blobSource))
+    assert(0);
+
+   assert(transactionError == Transaction::noError);
+
+   error = noError;
+   return true;
+  }
+
+  /*! Apply inserts and removes of values of blob key in one pass. The
+      keys of the operations only give the minors. */
+  inline bool
+  applyDataBatch(register enum SubTreeTransactionError&      error,
+                 register const struct SubTreeBlobKey        key,
+                 register const struct BatchOperation* const operations,
+                 register const unsigned int                 count)
+  {
+   register struct BatchOperation* const treeOperations = new struct BatchOperation[count ? count : 1];
+
+   assert(treeOperations);
+
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    treeOperations[i]       = operations[i];
+    treeOperations[i].key   = getTreeKey(key, operations[i].key.minor);
+
+    if (operations[i].value)
+     SubTreeObserverManager::getInstance().notifyInsert(this, operations[i].value->size(), subTreeMajor,
+                                                        key.major, operations[i].key.minor);
+    else
+     SubTreeObserverManager::getInstance().notifyRemove(this, subTreeMajor, key.major, operations[i].key.minor);
+   }
+
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::applyBatch(transactionError, treeOperations, count))
+    assert(0);
+
+   assert(transactionError == Transaction::noError);
+
+   delete [] treeOperations;
+
+   error = noError;
+   return true;
+  }
+
+  /*! Position cursor on the first value at or after minor. The keys the
+      cursor returns are tree keys, the blob ends where their major
+      changes. */
+  inline bool
+  seekData(register class BPlusTreeCursor&        cursor,
+           register enum SubTreeTransactionError& error,
+           register const struct SubTreeBlobKey   key,
+           register const uint_fast64_t           minor)
+  {
+   register struct Key treeKey;
+
+   treeKey.type  = FileSystem::rawDataType;
+   treeKey.major = subTreeMajor | key.major;
+   treeKey.minor = minor;
+
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::seek(cursor, transactionError, treeKey))
+   {
+    assert(transactionError == Transaction::keyNotFound);
+
+    error = keyNotFound;
+    return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! The shape of the whole tree the sub tree is kept in. */
+  inline void
+  getStatistics(register struct TreeStatistics& statistics)
+  {
+   Transaction::getStatistics(statistics);
+  }
+
+  /*! The tree key that holds minor of blob key. */
+  inline struct Key
+  getTreeKey(register const struct SubTreeBlobKey key,
+             register const uint_fast64_t         minor) const
+  {
+   register struct Key treeKey;
+
+   treeKey.type  = FileSystem::rawDataType;
+   treeKey.major = subTreeMajor | key.major;
+   treeKey.minor = minor;
+
+   return treeKey;
+  }
+
   inline bool
   insertData(register enum SubTreeTransactionError& error,
              register const uint8_t* const          source,
-             register const uint_fast16_t           size,
+             register const uint_fast32_t           size,
              register const struct SubTreeBlobKey   key,
              register const uint_fast64_t           minor)
   {
@@ -117,6 +346,84 @@ class SubTreeTransaction : protected Transaction
    return true;
   }
 
+  /*! Copy length bytes of the data, from offset on, to destination. */
+  inline bool
+  readDataPart(register uint8_t* const                destination,
+               register const uint_fast32_t           offset,
+               register const uint_fast32_t           length,
+               register enum SubTreeTransactionError& error,
+               register const struct SubTreeBlobKey   key,
+               register const uint_fast64_t           minor)
+  {
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::readPart(destination, offset, length, transactionError, getTreeKey(key, minor)))
+   {
+    switch(transactionError)
+    {
+     case Transaction::keyNotFound:
+      error = keyNotFound;
+     break;
+
+     case Transaction::checksumError:
+      error = checksumError;
+     break;
+
+     case Transaction::outOfRange:
+      error = outOfRange;
+     break;
+
+     default:  
+      assert(0);
+    }
+
+    return false;
+   }
+
+   error = noError;
+   SubTreeObserverManager::getInstance().notifyLookup(this, length, subTreeMajor, key.major, minor);
+   return true;
+  }
+
+  /*! Overwrite length bytes of the data, from offset on, with source. */
+  inline bool
+  writeDataPart(register enum SubTreeTransactionError& error,
+                register const uint8_t* const          source,
+                register const uint_fast32_t           offset,
+                register const uint_fast32_t           length,
+                register const struct SubTreeBlobKey   key,
+                register const uint_fast64_t           minor)
+  {
+   enum Transaction::TransactionError transactionError;
+
+   if (!Transaction::writePart(transactionError, source, offset, length, getTreeKey(key, minor)))
+   {
+    switch(transactionError)
+    {
+     case Transaction::keyNotFound:
+      error = keyNotFound;
+     break;
+
+     case Transaction::checksumError:
+      error = checksumError;
+     break;
+
+     case Transaction::outOfRange:
+      error = outOfRange;
+     break;
+
+     default:  
+      assert(0);
+    }
+
+    return false;
+   }
+
+   error = noError;
+   SubTreeObserverManager::getInstance().notifyInsert(this, length, subTreeMajor, key.major, minor);
+   return true;
+  }
+
   inline bool
   remove(register enum SubTreeTransactionError& error,
          register const struct SubTreeBlobKey   key,
@@ -140,14 +447,76 @@ class SubTreeTransaction : protected Transaction
    SubTreeObserverManager::getInstance().notifyRemove(this, subTreeMajor, key.major, minor);
    return true;
   }
+
+  /*! Remove the values of blob key from firstMinor to lastMinor, both
+      included, in one pass, see Transaction::removeRange. */
+  inline bool
+  removeDataRange(register enum SubTreeTransactionError& error,
+                  register const struct SubTreeBlobKey   key,
+                  register const uint_fast64_t           firstMinor,
+                  register const uint_fast64_t           lastMinor)
+  {
+   enum Transaction::TransactionError transactionError;
+
+   assert(firstMinor <= lastMinor);
+
+   if (!Transaction::removeRange(transactionError, getTreeKey(key, firstMinor), getTreeKey(key, lastMinor)))
+    assert(0);
+
+   assert(transactionError == Transaction::noError);
+
+   error = noError;
+   SubTreeObserverManager::getInstance().notifyRemoveRange(this, subTreeMajor, key.major, firstMinor, lastMinor);
+   return true;
+  }
   
  private:
+  /*! Maps the minors of a caller's stream into the sub tree. */
+  class BlobSource : public BulkLoadSource
+  {
+   public:
+    inline
+    BlobSource(register class BulkLoadSource&     source,
+               register class Transaction* const  transaction,
+               register const uint64_t            subTreeMajor,
+               register const uint64_t            major) : source(source)
+    {
+     this->transaction  = transaction;
+     this->subTreeMajor = subTreeMajor;
+     this->major        = major;
+    }
+
+    inline bool
+    next(register Key&                 key,
+         register const Serializable*& value)
+    {
+     if (!source.next(key, value))
+      return false;
+
+     SubTreeObserverManager::getInstance().notifyInsert(transaction, value->size(), subTreeMajor, major, key.minor);
+
+     key.type  = FileSystem::rawDataType;
+     key.major = subTreeMajor | major;
+     return true;
+    }
+
+   private:
+    class BulkLoadSource& source;
+    class Transaction*    transaction;
+    uint64_t              subTreeMajor;
+    uint64_t              major;
+  };
+
   unsigned int
   majorBitsUsed;
 
   uint64_t
   subTreeMajor;
 
+  /*! Kept to start over after a conflict. */
+  struct UUID
+  subTreeUUID;
+
   /*! \todo remove this when proper blob allocation routine has been added. */
   bool
   allocatedBlob;
@@ -167,8 +536,10 @@ class SubTreeTransaction : protected Transaction
    if (!Transaction::reinit(fileSystem))
     assert(0);
 
+   this->subTreeUUID = subTreeUUID;
+
    register SubTreeCount  count;
-   register uint_fast16_t size;
+   register uint_fast32_t size;
 
    /* Search through the meta data searching for the sub tree meta data. */
    register enum TransactionError transactionError;
@@ -9,8 +9,11 @@
 # define TESTEVENTLISTENER_HPP
 
 # include <assert.h>
+# include <stdio.h>
 # include <stdlib.h>
 # include <stdint.h>
+# include <string.h>
+# include <time.h>
 
 # include <EventListener.hpp>
 
@@ -21,6 +24,12 @@
 # include <FileSystem.hpp>
 # include <SubTreeTransaction.hpp>
 # include <SubTreeBlobKey.hpp>
+# include <BlockCache.hpp>
+# include <BPlusTree.hpp>
+# include <BPlusTreeCursor.hpp>
+# include <RawData.hpp>
+# include <Checksum.hpp>
+# include <VirtualBlockDevice.hpp>
 
 class TestEventListener : public EventListener
 {
@@ -109,7 +118,7 @@ class TestEventListener : public EventListener
 
    /* Try to read it back! */
    char          readData = 0;
-   uint_fast16_t readSize = sizeof(readData);
+   uint_fast32_t readSize = sizeof(readData);
 
    if(!transaction->lookupData((uint8_t*)&readData, readSize, transactionError, subKey, 0))
     assert(0);
@@ -117,7 +126,238 @@ class TestEventListener : public EventListener
    assert(transactionError == SubTreeTransaction::noError);
    assert(readSize == sizeof(readData));
    assert(readData == 'A');
- 
+
+   /* And in place. */
+   {
+    ValueView view;
+
+    if(!transaction->lookupDataView(view, transactionError, subKey, 0))
+     assert(0);
+
+    assert(view.size() == sizeof(readData));
+    assert(*(const char*)view.getData() == 'A');
+   }
+
+   /* A value several sectors long. */
+   static uint8_t bigData[3 * sectorSize + 100];
+   static uint8_t bigRead[sizeof(bigData)];
+
+   for(register unsigned int i = 0; i < sizeof(bigData); i++)
+    bigData[i] = (uint8_t) (i * 7);
+
+   if(!transaction->insertData(transactionError, bigData, sizeof(bigData), subKey, 1))
+    assert(0);
+
+   readSize = sizeof(bigRead);
+
+   if(!transaction->lookupData(bigRead, readSize, transactionError, subKey, 1))
+    assert(0);
+
+   assert(readSize == sizeof(bigData));
+   assert(!memcmp(bigRead, bigData, sizeof(bigData)));
+
+   {
+    ValueView view;
+
+    if(!transaction->lookupDataView(view, transactionError, subKey, 1))
+     assert(0);
+
+    assert(view.sectorCount() == 4);
+
+    for(register unsigned int i = 0; i < view.sectorCount(); i++)
+     assert(!memcmp(view.getSector(i), bigData + i * sectorSize, view.sectorLength(i)));
+   }
+
+   /* One longer than the 16 bits values once had for their size. */
+   {
+    static uint8_t hugeData[100 * 1024 + 1];
+    static uint8_t hugeRead[sizeof(hugeData)];
+
+    for(register unsigned int i = 0; i < sizeof(hugeData); i++)
+     hugeData[i] = (uint8_t) (i / 3);
+
+    if(!transaction->insertData(transactionError, hugeData, sizeof(hugeData), subKey, 2))
+     assert(0);
+
+    readSize = sizeof(hugeRead);
+
+    if(!transaction->lookupData(hugeRead, readSize, transactionError, subKey, 2))
+     assert(0);
+
+    assert(readSize == sizeof(hugeData));
+    assert(!memcmp(hugeRead, hugeData, sizeof(hugeData)));
+
+    ValueView view;
+
+    if(!transaction->lookupDataView(view, transactionError, subKey, 2))
+     assert(0);
+
+    assert(view.size() == sizeof(hugeData));
+    assert(view.sectorCount() == (sizeof(hugeData) + sectorSize - 1) / sectorSize);
+    assert(!memcmp(view.getSector(view.sectorCount() - 1), hugeData + sizeof(hugeData) - 1, 1));
+
+    /* And through a cursor. */
+    register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+    BPlusTreeCursor                                     cursor;
+    RawData                                             rawData(hugeRead, sizeof(hugeRead));
+
+    memset(hugeRead, 0, sizeof(hugeRead));
+
+    if (!transaction->seekData(cursor, transactionError, subKey, 2))
+     assert(0);
+
+    readSize = sizeof(hugeRead);
+
+    if (!cursor.read(rawData, readSize, cursorError))
+     assert(0);
+
+    assert(readSize == sizeof(hugeData));
+    assert(!memcmp(hugeRead, hugeData, sizeof(hugeData)));
+   }
+
+   /* Patch parts of values, one across a sector boundary. */
+   static const uint8_t patch[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+   uint8_t              part[sizeof(patch)];
+   const char           otherTest = 'B';
+
+   if(!transaction->writeDataPart(transactionError, (const uint8_t*) &otherTest, 0, sizeof(otherTest), subKey, 0))
+    assert(0);
+
+   if(!transaction->readDataPart((uint8_t*) &readData, 0, sizeof(readData), transactionError, subKey, 0))
+    assert(0);
+
+   assert(readData == 'B');
+
+   if(!transaction->writeDataPart(transactionError, patch, sectorSize - 4, sizeof(patch), subKey, 1))
+    assert(0);
+
+   memcpy(bigData + sectorSize - 4, patch, sizeof(patch));
+
+   if(!transaction->readDataPart(part, sectorSize - 4, sizeof(part), transactionError, subKey, 1))
+    assert(0);
+
+   assert(!memcmp(part, patch, sizeof(patch)));
+
+   /* A pinned view keeps showing what it did. */
+   {
+    ValueView view;
+
+    if(!transaction->lookupDataView(view, transactionError, subKey, 1))
+     assert(0);
+
+    if(!transaction->writeDataPart(transactionError, (const uint8_t*) &test, 0, sizeof(test), subKey, 1))
+     assert(0);
+
+    assert(view.getSector(0)[0] == bigData[0]);
+   }
+
+   bigData[0] = 'A';
+   readSize   = sizeof(bigRead);
+
+   if(!transaction->lookupData(bigRead, readSize, transactionError, subKey, 1))
+    assert(0);
+
+   assert(readSize == sizeof(bigData));
+   assert(!memcmp(bigRead, bigData, sizeof(bigData)));
+
+   assert(!transaction->readDataPart(part, sizeof(bigData) - 4, sizeof(part), transactionError, subKey, 1));
+   assert(transactionError == SubTreeTransaction::outOfRange);
+
+   /* Values of a second blob share the leaf, which is plain and so
+      changed in place. Removed and outgrown values are left unused in it
+      until there are too many. */
+   struct SubTreeBlobKey otherKey;
+   uint8_t               value[200];
+   uint8_t               valueRead[sizeof(value)];
+   struct TreeStatistics statistics;
+
+   if (!transaction->allocateBlob(otherKey, transactionError, SubTreeBlobKey::data))
+    assert(0);
+
+   for(register unsigned int i = 0; i < 8; i++)
+   {
+    memset(value, i, 100);
+
+    if(!transaction->insertData(transactionError, value, 100, otherKey, i))
+     assert(0);
+   }
+
+   if (!transaction->remove(transactionError, otherKey, 3))
+    assert(0);
+
+   transaction->getStatistics(statistics);
+   assert(statistics.leafFragmented >= 100);
+
+   for(register unsigned int round = 0; round < 64; round++)
+   {
+    register const unsigned int size = (round % 2) ? sizeof(value) : 100;
+
+    memset(value, round, size);
+
+    if(!transaction->insertData(transactionError, value, size, otherKey, 5))
+     assert(0);
+
+    readSize = sizeof(valueRead);
+
+    if(!transaction->lookupData(valueRead, readSize, transactionError, otherKey, 5))
+     assert(0);
+
+    assert(readSize == size);
+    assert(!memcmp(valueRead, value, size));
+   }
+
+   transaction->getStatistics(statistics);
+   assert(statistics.leafFragmented <= (statistics.leaves * sectorSize / 4));
+
+   for(register unsigned int i = 0; i < 8; i++)
+   {
+    readSize = sizeof(valueRead);
+
+    if (i == 3)
+    {
+     assert(!transaction->lookupData(valueRead, readSize, transactionError, otherKey, i));
+     assert(transactionError == SubTreeTransaction::keyNotFound);
+     continue;
+    }
+
+    if(!transaction->lookupData(valueRead, readSize, transactionError, otherKey, i))
+     assert(0);
+
+    assert(readSize == ((i == 5) ? sizeof(value) : 100));
+    assert(valueRead[0] == ((i == 5) ? 63 : i));
+   }
+
+   /* The same values, all in one pass. */
+   {
+    static const unsigned int count = 9;
+    uint8_t                   values[count][sizeof(value)];
+    uint8_t*                  destinations[count];
+    uint_fast32_t             sizes[count];
+    uint_fast64_t             minors[count];
+    bool                      found[count];
+
+    for(register unsigned int i = 0; i < count; i++)
+    {
+     destinations[i] = values[i];
+     sizes[i]        = sizeof(value);
+     minors[i]       = i;
+    }
+
+    if(!transaction->multiLookupData(destinations, sizes, found, transactionError, otherKey, minors, count))
+     assert(0);
+
+    for(register unsigned int i = 0; i < count; i++)
+    {
+     assert(found[i] == ((i != 3) && (i != 8)));
+
+     if (!found[i])
+      continue;
+
+     assert(sizes[i] == ((i == 5) ? sizeof(value) : 100));
+     assert(values[i][0] == ((i == 5) ? 63 : i));
+    }
+   }
+
    /* End transaction. */
    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
    {
@@ -127,6 +367,308 @@ class TestEventListener : public EventListener
 
    assert(transactionManagerError == TransactionManager::noError);
 
+   /* Of two transactions changing the tree at the same time the second
+      to end is replayed onto the tree of the first, as they read nothing
+      the other wrote. */
+   register class SubTreeTransaction* other;
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(other, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   if(!transaction->insertData(transactionError, (const uint8_t*) &test, sizeof(test), otherKey, 3))
+    assert(0);
+
+   if(!other->insertData(transactionError, (const uint8_t*) &otherTest, sizeof(otherTest), otherKey, 8))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, other))
+    assert(0);
+
+   /* One that read a key the first wrote conflicts, and is started over
+      on the tree of the first. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(other, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   readSize = sizeof(readData);
+
+   if(!other->lookupData((uint8_t*) &readData, readSize, transactionError, otherKey, 3))
+    assert(0);
+
+   assert(readData == test);
+
+   if(!other->insertData(transactionError, (const uint8_t*) &otherTest, sizeof(otherTest), otherKey, 3))
+    assert(0);
+
+   if(!transaction->insertData(transactionError, (const uint8_t*) &otherTest, sizeof(otherTest), otherKey, 3))
+    assert(0);
+
+   readSize = sizeof(readData);
+
+   if(!transaction->lookupData((uint8_t*) &readData, readSize, transactionError, otherKey, 8))
+    assert(0);
+
+   assert(readData == otherTest);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   assert(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, other));
+   assert(transactionManagerError == TransactionManager::conflict);
+   assert(other);
+
+   readSize = sizeof(readData);
+
+   if(!other->lookupData((uint8_t*) &readData, readSize, transactionError, otherKey, 3))
+    assert(0);
+
+   assert(readData == otherTest);
+
+   if(!other->insertData(transactionError, (const uint8_t*) &test, sizeof(test), otherKey, 3))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, other))
+    assert(0);
+
+   /* An aborted transaction leaves nothing behind. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   if(!transaction->remove(transactionError, otherKey, 8))
+    assert(0);
+
+   if(!transaction->insertData(transactionError, bigData, sizeof(bigData), otherKey, 9))
+    assert(0);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   assert(!transaction);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   readSize = sizeof(readData);
+
+   if(!transaction->lookupData((uint8_t*) &readData, readSize, transactionError, otherKey, 8))
+    assert(0);
+
+   assert(readData == otherTest);
+
+   readSize = sizeof(readData);
+
+   if(!transaction->lookupData((uint8_t*) &readData, readSize, transactionError, otherKey, 3))
+    assert(0);
+
+   assert(readData == test);
+
+   readSize = sizeof(bigRead);
+   assert(!transaction->lookupData(bigRead, readSize, transactionError, otherKey, 9));
+
+   if(!transaction->insertData(transactionError, bigData, sizeof(bigData), otherKey, 9))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   /* Patching a sector of a committed value copies that sector alone,
+      and the path down to its leaf. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   {
+    register const uint64_t handedOut = fileSystem->getHandedOutLBAs();
+
+    transaction->getStatistics(statistics);
+
+    if(!transaction->writeDataPart(transactionError, patch, 2 * sectorSize + 8, sizeof(patch), otherKey, 9))
+     assert(0);
+
+    assert(fileSystem->getHandedOutLBAs() - handedOut == 1 + statistics.height);
+
+    memcpy(bigData + 2 * sectorSize + 8, patch, sizeof(patch));
+
+    /* Again, in the sector copied already. */
+    if(!transaction->writeDataPart(transactionError, patch, 2 * sectorSize + 16, sizeof(patch), otherKey, 9))
+     assert(0);
+
+    memcpy(bigData + 2 * sectorSize + 16, patch, sizeof(patch));
+    readSize = sizeof(bigRead);
+
+    if(!transaction->lookupData(bigRead, readSize, transactionError, otherKey, 9))
+     assert(0);
+
+    assert(readSize == sizeof(bigData));
+    assert(!memcmp(bigRead, bigData, sizeof(bigData)));
+   }
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   /* Enough values for an internal root. Built with -DBUFFERED_NODES
+      they wait as messages in it, where lookups find them and removes
+      cancel them, until a cursor has them flushed to the leaves. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   for(register uint64_t minor = 1000; minor < 3000; minor++)
+   {
+    if(!transaction->insertData(transactionError, (const uint8_t*) &minor, sizeof(minor), otherKey, minor))
+     assert(0);
+   }
+
+   if (!transaction->remove(transactionError, otherKey, 2999))
+    assert(0);
+
+   transaction->getStatistics(statistics);
+   assert(statistics.height > 1);
+
+# ifdef BUFFERED_NODES
+   assert(statistics.messages);
+# endif
+
+   for(register uint64_t minor = 1000; minor < 2999; minor++)
+   {
+    uint64_t minorRead;
+
+    readSize = sizeof(minorRead);
+
+    if(!transaction->lookupData((uint8_t*) &minorRead, readSize, transactionError, otherKey, minor))
+     assert(0);
+
+    assert(minorRead == minor);
+   }
+
+   readSize = sizeof(bigRead);
+   assert(!transaction->lookupData(bigRead, readSize, transactionError, otherKey, 2999));
+   assert(transactionError == SubTreeTransaction::keyNotFound);
+
+   {
+    register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+    BPlusTreeCursor                                     cursor;
+    uint64_t                                            minorRead;
+    RawData                                             rawData((uint8_t*) &minorRead, sizeof(minorRead));
+    register uint64_t                                   minor = 1000;
+
+    if (!transaction->seekData(cursor, transactionError, otherKey, 1000))
+     assert(0);
+
+    transaction->getStatistics(statistics);
+    assert(!statistics.messages);
+
+    for(; minor < 2999; minor++)
+    {
+     if ((minor > 1000) && !cursor.next(cursorError))
+      assert(0);
+
+     readSize = sizeof(minorRead);
+
+     if (!cursor.read(rawData, readSize, cursorError))
+      assert(0);
+
+     assert(minorRead == minor);
+    }
+
+    /* The removed value did not make it to the leaves. */
+    assert(!cursor.next(cursorError) || (cursor.getKey().minor != 2999));
+
+    cursor.close();
+   }
+
+   if(!transaction->removeDataRange(transactionError, otherKey, 1000, 2998))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   /* Removing a range of values stored out of line gives back their
+      sectors, those in the leaves of dropped subtrees too. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   for(register uint64_t minor = 4000; minor < 5000; minor++)
+   {
+    if(!transaction->insertData(transactionError, bigData, sizeof(bigData), otherKey, minor))
+     assert(0);
+   }
+
+   if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError, fileSystem, subTreeUUID))
+    assert(0);
+
+   {
+    register const uint64_t free      = fileSystem->getFreeLBAs();
+    register const uint64_t handedOut = fileSystem->getHandedOutLBAs();
+
+    transaction->getStatistics(statistics);
+    assert(statistics.leaves > 2);
+
+    if(!transaction->removeDataRange(transactionError, otherKey, 4000, 4999))
+     assert(0);
+
+    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, transaction))
+     assert(0);
+
+    /* What the removal took for its new nodes came from the free LBAs
+       or was handed out on top. */
+    assert((fileSystem->getFreeLBAs() - free) + (fileSystem->getHandedOutLBAs() - handedOut) >=
+           1000 * ((sizeof(bigData) + sectorSize - 1) / sectorSize));
+   }
+
+   /* A transaction holding every cache entry gets an error rather than
+      the clock sweeping forever. */
+   class Transaction* holder;
+
+   if(!TransactionManager::getInstance().startTransaction(holder, transactionManagerError, fileSystem))
+    assert(0);
+
+   register enum BlockCache::BlockCacheError cacheError;
+   register unsigned int                     allocated = 0;
+   BlockCacheEntry*                          cacheEntry;
+   uint8_t*                                  dataPointer;
+
+   while (BlockCache::getInstance().allocate(cacheEntry, cacheError, holder))
+   {
+    dataPointer = cacheEntry->getDataPointer();
+    cacheEntry->unlock(dataPointer, cacheEntry, holder);
+    allocated++;
+   }
+
+   assert(allocated);
+   assert(cacheError == BlockCache::outOfEntries);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, holder))
+    assert(0);
+
+   /* And the entries it held are handed out again. */
+   if(!TransactionManager::getInstance().startTransaction(holder, transactionManagerError, fileSystem))
+    assert(0);
+
+   if (!BlockCache::getInstance().allocate(cacheEntry, cacheError, holder))
+    assert(0);
+
+   dataPointer = cacheEntry->getDataPointer();
+   cacheEntry->unlock(dataPointer, cacheEntry, holder);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, holder))
+    assert(0);
+
+   testChecksum();
+
+#ifndef UNCHECKED_NODES
+   testDamagedNode(fileSystem, subTreeUUID, otherKey);
+#endif
+
    register enum EventListenerManager::EventListenerManagerError
    error;
 
@@ -140,7 +682,211 @@ class TestEventListener : public EventListener
   }
 
  private:
+  /*! Of the timing loops. */
+  static const unsigned int rounds = 2000;
+
   bool alreadyRun;
+
+  /*! In nanoseconds. */
+  static inline double
+  now(void)
+  {
+   struct timespec time;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &time))
+    assert(0);
+
+   return time.tv_sec * 1e9 + time.tv_nsec;
+  }
+
+  /*! The check value of CRC32C, and the two implementations agreeing on
+      every length up to two sectors from every alignment. */
+  static inline void
+  testChecksum(void)
+  {
+   static const char    check[] = "123456789";
+   static const uint32_t checkValue = 0xe3069283;
+   static uint8_t       noise[2 * sectorSize + 8];
+
+   assert(Checksum::crc32c(check, 9) == checkValue);
+   assert(~Checksum::updateSoftware(~0U, check, 9) == checkValue);
+
+   /* A running CRC is the same as one over the whole. */
+   assert(~Checksum::update(Checksum::update(~0U, check, 4), check + 4, 5) == checkValue);
+
+   for(register unsigned int i = 0; i < sizeof(noise); i++)
+    noise[i] = (uint8_t) ((i * 2654435761U) >> 13);
+
+   if (!Checksum::isAccelerated())
+    return;
+
+   assert(~Checksum::updateHardware(~0U, check, 9) == checkValue);
+
+   for(register unsigned int offset = 0; offset < 8; offset++)
+   {
+    for(register unsigned int length = 0; length <= 2 * sectorSize; length++)
+    {
+     assert(Checksum::updateHardware(~0U, noise + offset, length) ==
+            Checksum::updateSoftware(~0U, noise + offset, length));
+    }
+   }
+  }
+
+  /*! Damage the root node on the device behind the cache. Lookups fail
+      with checksumError until it is written back whole. Also times
+      reading the node with the check against reading it without. */
+  static inline void
+  testDamagedNode(register class FileSystem* const     fileSystem,
+                  register const struct UUID           subTreeUUID,
+                  register const struct SubTreeBlobKey blobKey)
+  {
+   register enum TransactionManager::TransactionManagerError transactionManagerError;
+   register enum SubTreeTransaction::SubTreeTransactionError transactionError;
+   register enum FileSystem::FileSystemError                 fileSystemError;
+   register enum BlockCache::BlockCacheError                 cacheError;
+   register enum VirtualBlockDevice::VirtualBlockDeviceError deviceError;
+   class Transaction*                                        holder;
+   class SubTreeTransaction*                                 transaction;
+   const class BPlusTree*                                    tree;
+   class VirtualBlockDevice*                                 device;
+   struct LBA                                                rootLBA;
+   BlockCacheEntry*                                          cacheEntry;
+   uint8_t*                                                  dataPointer;
+   static uint8_t                                            original[sectorSize];
+   char                                                      readData;
+   uint_fast32_t                                             readSize;
+
+   /* So the device has the node as the cache does. */
+   if (!BlockCache::getInstance().flush(cacheError))
+    assert(0);
+
+   if (!fileSystem->getCurrentTree(tree, fileSystemError))
+    assert(0);
+
+   tree->getRoot(device, rootLBA);
+
+   if(!TransactionManager::getInstance().startTransaction(holder, transactionManagerError, fileSystem))
+    assert(0);
+
+   /* The cost of the check, on a node read from the device each time. */
+   register double times[2];
+
+   for(register unsigned int checked = 0; checked < 2; checked++)
+   {
+    register const double start = now();
+
+    for(register unsigned int i = 0; i < rounds; i++)
+    {
+     BlockCache::getInstance().forget(device, rootLBA);
+
+     if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, holder, device, rootLBA,
+                                               checked ? BPlusTree::verifyNode : 0))
+      assert(0);
+
+     dataPointer = cacheEntry->getDataPointer();
+     cacheEntry->unlock(dataPointer, cacheEntry, holder);
+    }
+
+    times[checked] = (now() - start) / rounds;
+   }
+
+   /* And of the check alone, on a sector. */
+   register double sectorTimes[2] = { 0, 0 };
+
+   for(register unsigned int hardware = 0; hardware < 2; hardware++)
+   {
+    if (hardware && !Checksum::isAccelerated())
+     break;
+
+    register const double start = now();
+
+    for(register unsigned int i = 0; i < rounds; i++)
+    {
+     if (hardware)
+      Checksum::updateHardware(~0U, original, sectorSize);
+     else
+      Checksum::updateSoftware(~0U, original, sectorSize);
+    }
+
+    sectorTimes[hardware] = (now() - start) / rounds;
+   }
+
+   printf("Test: reading a node %.0f ns checked, %.0f ns unchecked, crc32c of a sector %.0f ns in hardware, %.0f ns in software\n",
+          times[1], times[0], sectorTimes[1], sectorTimes[0]);
+
+   /* Started first, as starting reads the tree. */
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   /* Flip a bit in the copy on the device only. */
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, holder, device, rootLBA))
+    assert(0);
+
+   dataPointer = cacheEntry->getDataPointer();
+   memcpy(original, dataPointer, sectorSize);
+   dataPointer[sectorSize / 2] ^= 0x10;
+
+   if (!device->writeSector(deviceError, cacheEntry, rootLBA))
+    assert(0);
+
+   memcpy(dataPointer, original, sectorSize);
+   cacheEntry->unlock(dataPointer, cacheEntry, holder);
+
+   BlockCache::getInstance().forget(device, rootLBA);
+
+   assert(!BlockCache::getInstance().readLookup(cacheEntry, cacheError, holder, device, rootLBA,
+                                                BPlusTree::verifyNode));
+   assert(cacheError == BlockCache::checksumError);
+
+   readSize = sizeof(readData);
+
+   assert(!transaction->lookupData((uint8_t*) &readData, readSize, transactionError, blobKey, 3));
+   assert(transactionError == SubTreeTransaction::checksumError);
+
+   {
+    uint8_t*      destinations[1] = { (uint8_t*) &readData };
+    uint_fast32_t sizes[1]        = { sizeof(readData) };
+    uint_fast64_t minors[1]       = { 3 };
+    bool          found[1];
+
+    assert(!transaction->multiLookupData(destinations, sizes, found, transactionError, blobKey, minors, 1));
+    assert(transactionError == SubTreeTransaction::checksumError);
+    assert(!found[0]);
+   }
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, transaction))
+    assert(0);
+
+   /* Repair it, past the check, and the tree reads again. */
+   if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, holder, device, rootLBA))
+    assert(0);
+
+   dataPointer = cacheEntry->getDataPointer();
+   memcpy(dataPointer, original, sectorSize);
+
+   if (!device->writeSector(deviceError, cacheEntry, rootLBA))
+    assert(0);
+
+   cacheEntry->unlock(dataPointer, cacheEntry, holder);
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, holder))
+    assert(0);
+
+   if(!TransactionManager::getInstance().startSubTreeTransaction(transaction, transactionManagerError,
+                                                                 fileSystem, subTreeUUID))
+    assert(0);
+
+   readSize = sizeof(readData);
+
+   if(!transaction->lookupData((uint8_t*) &readData, readSize, transactionError, blobKey, 3))
+    assert(0);
+
+   assert(readData == 'A');
+
+   if(!TransactionManager::getInstance().abortTransaction(transactionManagerError, transaction))
+    assert(0);
+  }
 };
 
 #endif
@@ -2,11 +2,17 @@
 # define TRANSACTION_HPP
 
 # include <assert.h>
+# include <string.h>
 
 # include <UUID.hpp>
+# include <LBA.hpp>
 # include <FileSystem.hpp>
 # include <Key.hpp>
 # include <Serializable.hpp>
+# include <BatchOperation.hpp>
+# include <LeafHint.hpp>
+# include <TreeStatistics.hpp>
+# include <KeyRangeSet.hpp>
 
 class Transaction
 {
@@ -19,7 +25,12 @@ class Transaction
    noError = 0,
    keyNotFound,
    dataTooBig,
-   sizeIsNotAcceptable
+   sizeIsNotAcceptable,
+   outOfRange,
+   keyOutOfOrder,
+   /*! The tree is damaged where the key would be, see
+       BPlusTree::verifyNode. */
+   checksumError
   };    
 
   inline class BlockCacheEntry*
@@ -32,6 +43,24 @@ class Transaction
    return returnValue;
   }
 
+  /*! theLBA is no longer used by the tree of the transaction. It is
+      given back to the file system if the transaction commits, see
+      FileSystem::releaseLBAs. */
+  inline void
+  releaseLBA(register const struct LBA theLBA)
+  {
+   addToRuns(released, releasedCount, releasedCapacity, theLBA);
+  }
+
+  /*! theLBA holds a node written for the tree of the transaction that no
+      entry of the transaction holds, see BPlusTreeBuilder. It is given
+      back to the file system if the tree is not committed. */
+  inline void
+  writtenLBA(register const struct LBA theLBA)
+  {
+   addToRuns(written, writtenCount, writtenCapacity, theLBA);
+  }
+
   virtual inline class FileSystem*
   getFileSystem(void) const
   {
@@ -42,18 +71,85 @@ class Transaction
 
   bool
   lookup(register Serializable&          destination,
-         register uint_fast16_t&         size,
+         register uint_fast32_t&         size,
          register enum TransactionError& error,
          register const Key              key);
+
+  /*! Look up count keys, in strictly ascending order, in one pass over
+      the tree, see BPlusTree::multiLookup. errors[i] tells how key i
+      went. */
+  bool
+  multiLookup(register Serializable* const* const destinations,
+              register uint_fast32_t* const       sizes,
+              register enum TransactionError* const errors,
+              register enum TransactionError&     error,
+              register const Key* const           keys,
+              register const unsigned int         count);
+
+  /*! Look key up in place, see ValueView. view must be released before
+      the transaction ends. */
+  bool
+  lookupView(register class ValueView&       view,
+             register enum TransactionError& error,
+             register const Key              key);
   
+  /*! Copy length bytes of the value of key, from offset on. */
+  bool
+  readPart(register uint8_t* const         destination,
+           register const uint_fast32_t    offset,
+           register const uint_fast32_t    length,
+           register enum TransactionError& error,
+           register const Key              key);
+
   bool
   insert(register enum TransactionError& error,
          register const Serializable&    source,
          register const Key              key);
 
+  /*! Overwrite length bytes of the value of key, from offset on, without
+      storing the rest of it again where that can be avoided. */
+  bool
+  writePart(register enum TransactionError& error,
+            register const uint8_t* const   source,
+            register const uint_fast32_t    offset,
+            register const uint_fast32_t    length,
+            register const Key              key);
+
   bool
   remove(register enum TransactionError& error,
          register const Key              key);
+
+  /*! Remove every key from first to last, both included, see
+      BPlusTree::removeRange. */
+  bool
+  removeRange(register enum TransactionError& error,
+              register const Key              first,
+              register const Key              last);
+
+  /*! Merge a sorted stream of pairs into the tree, building the new tree
+      bottom-up. Values in the stream replace values with the same key. */
+  bool
+  bulkLoad(register enum TransactionError& error,
+           register class BulkLoadSource&  source);
+
+  /*! Apply count inserts and removes in one copy-on-write pass. The
+      operations may come in any order, when a key is given more than
+      once the last operation on it wins. */
+  bool
+  applyBatch(register enum TransactionError&             error,
+             register const struct BatchOperation* const operations,
+             register const unsigned int                 count);
+
+  /*! Position cursor on the first key at or after key in the tree as seen
+      by this transaction. A buffered tree is drained first. */
+  bool
+  seek(register class BPlusTreeCursor&  cursor,
+       register enum TransactionError& error,
+       register const Key              key);
+
+  /*! The shape of the tree as seen by this transaction. */
+  void
+  getStatistics(register struct TreeStatistics& statistics);
   
  private:
   const class BPlusTree*
@@ -67,6 +163,51 @@ class Transaction
 
   class BlockCacheEntry*
   allocatedEntries;
+
+  /*! Where the last lookup, insert or remove ended. */
+  struct LeafHint
+  hint;
+
+  /*! LBAs to give back when the transaction commits, see releaseLBA. */
+  struct LBARun*
+  released;
+
+  unsigned int
+  releasedCount;
+
+  unsigned int
+  releasedCapacity;
+
+  /*! LBAs to give back unless the transaction commits, see writtenLBA. */
+  struct LBARun*
+  written;
+
+  unsigned int
+  writtenCount;
+
+  unsigned int
+  writtenCapacity;
+
+  /*! The keys read, those written and the ranges removed, see
+      isConflicting. */
+  KeyRangeSet
+  readKeys;
+
+  KeyRangeSet
+  writtenKeys;
+
+  KeyRangeSet
+  removedRanges;
+
+  /*! The last commit before the transaction started, see
+      FileSystem::changedSince. */
+  uint64_t
+  startSequence;
+
+  /*! The last commit isConflicting has checked the reads against. Only
+      later ones are checked when the tree is made current, see end. */
+  uint64_t
+  checkedSequence;
    
   inline
   Transaction()
@@ -75,11 +216,27 @@ class Transaction
    currentTree      = 0;
    fileSystem       = 0;
    allocatedEntries = 0;
+   released         = 0;
+   releasedCount    = 0;
+   releasedCapacity = 0;
+   written          = 0;
+   writtenCount     = 0;
+   writtenCapacity  = 0;
+   startSequence    = 0;
+   checkedSequence  = 0;
+
+   hint.invalidate();
   }
   
+  /*! Whether a transaction that changed the tree read a key that another
+      one changed since it started. If not, but the tree was committed
+      in between, its changes are replayed onto the newer tree when it
+      ends, see rebase. */
   inline bool
-  isConflicting(void) const
+  isConflicting(void)
   {
+   checkedSequence = fileSystem->getCommitSequence();
+
    if (this->currentTree == originalTree)
     return false; 
 
@@ -94,11 +251,92 @@ class Transaction
    if (currentTree == originalTree)
     return false;
 
-   return true;
+   readKeys.normalize();
+
+   return fileSystem->changedSince(startSequence, readKeys);
   }
 
+  /*! Commit the tree of the transaction. The check of isConflicting is
+      made again, for what other threads committed since, as the tree is
+      made current. If it fails the transaction is left open for the
+      caller to abort and false is returned. */
   bool
   end(void);
+
+  /*! Write every page allocated by the transaction to disk. */
+  bool
+  writeBack(void);
+
+  /*! Push the messages of a buffered tree down to its leaves, for what
+      only reads those. */
+  void
+  drain(void);
+
+  /*! Make the tree base, committed since the transaction started, with
+      the changes of the transaction on top: the removed ranges first,
+      then every key written as it is in the tree of the transaction. */
+  void
+  rebase(register const class BPlusTree* const base);
+
+  /*! Drop the pages of the transaction in count runs, that nothing
+      uses any more, and hand their LBAs out again at once. */
+  void
+  dropPages(register struct LBARun* const runs,
+            register const unsigned int   count);
+
+  /*! Add theLBA to count runs, growing the one it extends if any. */
+  static inline void
+  addToRuns(register struct LBARun* &  runs,
+            register unsigned int&     count,
+            register unsigned int&     capacity,
+            register const struct LBA  theLBA)
+  {
+   if (count)
+   {
+    register struct LBARun& last = runs[count - 1];
+
+    if (last.first.theLBA + last.count == theLBA.theLBA)
+    {
+     last.count++;
+     return;
+    }
+
+    if (last.first.theLBA == theLBA.theLBA + 1)
+    {
+     last.first = theLBA;
+     last.count++;
+     return;
+    }
+   }
+
+   if (count == capacity)
+   {
+    register const unsigned int   newCapacity = capacity ? 2 * capacity : 64;
+    register struct LBARun* const newRuns     = new struct LBARun[newCapacity];
+
+    assert(newRuns);
+
+    if (count)
+     memcpy(newRuns, runs, count * sizeof(*runs));
+
+    delete [] runs;
+
+    runs     = newRuns;
+    capacity = newCapacity;
+   }
+
+   runs[count].first = theLBA;
+   runs[count].count = 1;
+   count++;
+  }
+
+  inline void
+  clearKeys(void)
+  {
+   readKeys.clear();
+   writtenKeys.clear();
+   removedRanges.clear();
+  }
   
   inline bool
   reinit(register class FileSystem* const fileSystem)
@@ -113,6 +351,13 @@ class Transaction
 
    this->fileSystem = fileSystem;
    originalTree     = 0;
+   releasedCount    = 0;
+   writtenCount     = 0;
+
+   clearKeys();
+
+   startSequence   = fileSystem->openTransaction();
+   checkedSequence = startSequence;
    
    enum FileSystem::FileSystemError error;
 
@@ -123,15 +368,14 @@ class Transaction
    }
 
    currentTree = originalTree;
+   hint.invalidate();
    return true;
   }
 
-  virtual inline bool
-  abort(void)
-  {
-   assert(0);
-   return false;
-  }
+  /*! Drop every change. The pages of the transaction go back to the
+      cache unwritten and their LBAs to the file system. */
+  virtual bool
+  abort(void);
 };
 
 #endif
@@ -9,6 +9,8 @@
 # define TRANSACTIONMANAGER_HPP
 
 # include <assert.h>
+# include <stdint.h>
+# include <pthread.h>
 
 # include <UUID.hpp>
 
@@ -37,72 +39,80 @@ class TransactionManager
                           register class FileSystem* const       fileSystem,
                           register const struct UUID             subTreeUUID)
   {
-   /*! \todo make this more efficient. */
-   for(register unsigned int i = 0; i < maxSubTreeTransactions; i++)
+   register SubTreeTransaction* const transaction = subTreeTransactions.get();
+
+   if (!transaction)
    {
-    if (subTreeTransactions[i].available)
-    {
-     subTreeTransactions[i].available = false;
+    error = outOfTransactions;
+    return false;
+   }
 
-     if (!subTreeTransactions[i].transaction.reinit(fileSystem, subTreeUUID))
-      assert(0);
+   if (!transaction->reinit(fileSystem, subTreeUUID))
+    assert(0);
 
-     returnedTransaction = &subTreeTransactions[i].transaction;
-     
-     error = noError;
- 
-     SubTreeObserverManager::getInstance().notifyStartTransaction(returnedTransaction, subTreeUUID);
-     
-     return true;	
-    }
-   }
+   returnedTransaction = transaction;
 
-   error = outOfTransactions;
-   return false;
+   error = noError;
+
+   SubTreeObserverManager::getInstance().notifyStartTransaction(returnedTransaction, subTreeUUID);
+
+   return true;
   }
 
   inline bool
   abortTransaction(register enum TransactionManagerError& error,
                    register SubTreeTransaction*&          transactionPtr)
   {
-   assert(0);
-   
-   return false;
+   SubTreeObserverManager::getInstance().notifyAbortTransaction(transactionPtr);
+   if (!transactionPtr->abort())
+    assert(0);
+
+   subTreeTransactions.put(transactionPtr);
+
+   error          = noError;
+   transactionPtr = 0;
+
+   return true;
   }
   
+  /*! A transaction conflicts if another one committed a key it read
+      since it started, see Transaction::isConflicting. It is then aborted
+      and started again on the current tree, for the caller to retry. */
   inline bool
   endSubTreeTransaction(register enum TransactionManagerError& error,
                         register SubTreeTransaction*&          transactionPtr)
   {
-   /* check for conflict first. That way we can just return immediately. */
-   if (transactionPtr->isConflicting())
+   /* check for conflict first. That way we can just return immediately.
+      Ending checks again, for commits of other threads in between. */
+   if (!transactionPtr->isConflicting())
    {
-    assert(0);
+    SubTreeObserverManager::getInstance().notifyEndTransaction(transactionPtr);
+    if (transactionPtr->end())
+    {
+     subTreeTransactions.put(transactionPtr);
 
-    /*! \todo rewrite conflict code. */
-    
-    error = conflict;
+     error          = noError;
+     transactionPtr = 0;
 
-    return false;
+     return true;
+    }
    }
 
-   SubTreeObserverManager::getInstance().notifyEndTransaction(transactionPtr);
-   if (!transactionPtr->end())
+   register class FileSystem* const fileSystem  = transactionPtr->getFileSystem();
+   register const struct UUID       subTreeUUID = transactionPtr->subTreeUUID;
+
+   SubTreeObserverManager::getInstance().notifyAbortTransaction(transactionPtr);
+   if (!transactionPtr->abort())
     assert(0);
-   
-   register const int index = ((uintptr_t) transactionPtr -
-                               (uintptr_t) subTreeTransactions) /
-                              sizeof(subTreeTransactions[0]);
 
-   assert(index >= 0 && index < maxSubTreeTransactions);
-   assert(&subTreeTransactions[index].transaction == transactionPtr);
-   assert(!subTreeTransactions[index].available);
+   if (!transactionPtr->reinit(fileSystem, subTreeUUID))
+    assert(0);
 
-   error                         = noError;
-   transactionPtr                = 0;
-   subTreeTransactions[index].available = true;
-      
-   return true;  
+   SubTreeObserverManager::getInstance().notifyStartTransaction(transactionPtr, subTreeUUID);
+
+   error = conflict;
+
+   return false;
   }
   
   inline bool
@@ -110,100 +120,307 @@ class TransactionManager
                    register enum TransactionManagerError& error,
 		   register class FileSystem* const       fileSystem)
   {
-   /*! \todo make this more efficient. */
-   for(register unsigned int i = 0; i < maxTransactions; i++)
+   register Transaction* const transaction = transactions.get();
+
+   if (!transaction)
    {
-    if (transactions[i].available)
-    {
-     transactions[i].available = false;
+    error = outOfTransactions;
+    return false;
+   }
 
-     if (!transactions[i].transaction.reinit(fileSystem))
-      assert(0);
+   if (!transaction->reinit(fileSystem))
+    assert(0);
 
-     returnedTransaction = &transactions[i].transaction;
-     
-     error = noError;
-     return true;	
-    }
-   }
+   returnedTransaction = transaction;
 
-   error = outOfTransactions;
-   return false;
+   error = noError;
+   return true;
   }
 
   inline bool
   abortTransaction(register enum TransactionManagerError& error,
                    register Transaction*&                 transactionPtr)
   {
-   assert(0);
-   return false;
+   if (!transactionPtr->abort())
+    assert(0);
+
+   transactions.put(transactionPtr);
+
+   error          = noError;
+   transactionPtr = 0;
+
+   return true;
   }
   
+  /*! A transaction conflicts if another one committed a key it read
+      since it started, see Transaction::isConflicting. It is then aborted
+      and started again on the current tree, for the caller to retry. */
   inline bool
   endTransaction(register enum TransactionManagerError& error,
                  register Transaction*&                 transactionPtr)
   {
-   /* check for conflict first. That way we can just return immediately. */
-   if (transactionPtr->isConflicting())
+   /* check for conflict first. That way we can just return immediately.
+      Ending checks again, for commits of other threads in between. */
+   if (transactionPtr->isConflicting() || !transactionPtr->end())
    {
+    register class FileSystem* const fileSystem = transactionPtr->getFileSystem();
+
     if(!transactionPtr->abort())
      assert(0); 
-    /*! \todo rewrite this so that fields are not inspected. */
-    transactionPtr->reinit(transactionPtr->fileSystem);
+
+    if (!transactionPtr->reinit(fileSystem))
+     assert(0);
+
     error = conflict;
 
     return false;
    }
-
-   if (!transactionPtr->end())
-    assert(0);
    
-   register const int index = ((uintptr_t) transactionPtr -
-                               (uintptr_t) transactions) /
-                              sizeof(transactions[0]);
+   transactions.put(transactionPtr);
 
-   assert(index >= 0 && index < maxTransactions);
-   assert(&transactions[index].transaction == transactionPtr);
-   assert(!transactions[index].available);
-
-   error                         = noError;
-   transactionPtr                = 0;
-   transactions[index].available = true;
+   error          = noError;
+   transactionPtr = 0;
       
    return true;  
   }
 
  private:
-  static const unsigned int
-  maxTransactions = 16;
+  /*! Transaction objects, made as they are first needed and kept for
+      reuse. Free ones are on a stack that get and put change with a
+      single compare and swap, so neither takes a lock or searches. Each
+      thread keeps the last few it put back for itself, and gets those
+      without touching the stack at all.
+
+      Slots come in chunks that are never freed, so a slot taken off the
+      stack may still be read by a thread whose swap is then bound to
+      fail. The head of the stack holds the slot number with a count of
+      changes in its upper half, so a slot taken and put back in between
+      fails that swap too. */
+  template <class T>
+  class slotPool
+  {
+   public:
+    inline
+    slotPool()
+    {
+     chunkCount = 0;
+     freeHead   = 0;
+
+     if (pthread_mutex_init(&growLock, 0))
+      assert(0);
+
+     if (pthread_key_create(&exitKey, flushCache))
+      assert(0);
+    }
+
+    /*! A free transaction, or 0 if maxChunks chunks are in use. */
+    inline T*
+    get(void)
+    {
+     if (cache.count)
+     {
+      register struct slot* const slot = cache.slots[--cache.count];
+
+      assert(!slot->used);
+
+      slot->used = true;
+      return &slot->transaction;
+     }
+
+     register uint64_t head = __atomic_load_n(&freeHead, __ATOMIC_ACQUIRE);
+
+     for(;;)
+     {
+      register const uint32_t number = (uint32_t) head;
+
+      if (!number)
+      {
+       if (!grow())
+        return 0;
+
+       head = __atomic_load_n(&freeHead, __ATOMIC_ACQUIRE);
+       continue;
+      }
+
+      register struct slot* const slot    = slotAt(number);
+      register const uint64_t     newHead = nextHead(head, __atomic_load_n(&slot->next, __ATOMIC_RELAXED));
+
+      if (__atomic_compare_exchange_n(&freeHead, &head, newHead, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+       assert(!slot->used);
+
+       slot->used = true;
+       return &slot->transaction;
+      }
+     }
+    }
+
+    inline void
+    put(register T* const transaction)
+    {
+     /* The transaction is the first member of its slot. */
+     register struct slot* const slot = (struct slot*) transaction;
+
+     assert(slot->used);
+     assert(slotAt(slot->number) == slot);
+
+     slot->used = false;
+
+     if (cache.count < cacheSlots)
+     {
+      /* What the thread still holds when it exits goes on the stack. */
+      if (!cache.pool)
+      {
+       cache.pool = this;
+
+       if (pthread_setspecific(exitKey, this))
+        assert(0);
+      }
+
+      cache.slots[cache.count++] = slot;
+      return;
+     }
+
+     push(slot->number, slot);
+    }
+
+   private:
+    static const unsigned int
+    chunkSlots = 64;
+
+    /*! 2^20 transactions. */
+    static const unsigned int
+    maxChunks  = 16384;
+
+    struct slot
+    {
+     T        transaction;
+     /*! One based, zero ends the stack. */
+     uint32_t number;
+     uint32_t next;
+     bool     used;
+    };
+
+    static const unsigned int
+    cacheSlots = 8;
+
+    struct slotCache
+    {
+     struct slot*    slots[cacheSlots];
+     unsigned int    count;
+     /*! Set once the thread has exitKey. */
+     slotPool*       pool;
+    };
+
+    struct slot*    chunks[maxChunks];
+    unsigned int    chunkCount;
+    uint64_t        freeHead;
+    /*! Taken to add a chunk. */
+    pthread_mutex_t growLock;
+    /*! Runs flushCache as a thread that put slots in its cache exits. */
+    pthread_key_t   exitKey;
+
+    static __thread struct slotCache
+    cache;
+
+    static void
+    flushCache(register void* const pool)
+    {
+     while (cache.count)
+     {
+      register struct slot* const slot = cache.slots[--cache.count];
+
+      ((slotPool*) pool)->push(slot->number, slot);
+     }
+    }
+
+    inline struct slot*
+    slotAt(register const uint32_t number) const
+    {
+     return &chunks[(number - 1) / chunkSlots][(number - 1) % chunkSlots];
+    }
+
+    static inline uint64_t
+    nextHead(register const uint64_t head,
+             register const uint32_t number)
+    {
+     return (((head >> 32) + 1) << 32) | number;
+    }
+
+    /*! Put the slots from first up to last, linked through next, on the
+        stack. */
+    inline void
+    push(register const uint32_t     first,
+         register struct slot* const last)
+    {
+     register uint64_t head = __atomic_load_n(&freeHead, __ATOMIC_RELAXED);
+
+     do
+     {
+      __atomic_store_n(&last->next, (uint32_t) head, __ATOMIC_RELAXED);
+     } while (!__atomic_compare_exchange_n(&freeHead, &head, nextHead(head, first), true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    /*! Add a chunk of free slots, unless another thread just did. */
+    inline bool
+    grow(void)
+    {
+     register bool grown = true;
+
+     if (pthread_mutex_lock(&growLock))
+      assert(0);
+
+     if (!(uint32_t) __atomic_load_n(&freeHead, __ATOMIC_ACQUIRE))
+     {
+      if (chunkCount == maxChunks)
+       grown = false;
+      else
+      {
+       register struct slot* const chunk = new struct slot[chunkSlots];
+       register const uint32_t     first = chunkCount * chunkSlots + 1;
+
+       assert(chunk);
+
+       for(register unsigned int i = 0; i < chunkSlots; i++)
+       {
+        chunk[i].number = first + i;
+        chunk[i].next   = first + i + 1;
+        chunk[i].used   = false;
+       }
+
+       /* Readers find the chunk before any of its slots. */
+       chunks[chunkCount] = chunk;
+       __atomic_store_n(&chunkCount, chunkCount + 1, __ATOMIC_RELEASE);
+
+       push(first, chunk + chunkSlots - 1);
+      }
+     }
+
+     if (pthread_mutex_unlock(&growLock))
+      assert(0);
+
+     return grown;
+    }
+  };
 
-  static const unsigned int
-  maxSubTreeTransactions = 16;
-  
   static TransactionManager
   instance;
 
-  struct
-  {
-   Transaction transaction;
-   bool        available; 
-  } transactions[maxTransactions];
+  slotPool<Transaction>
+  transactions;
+
+  slotPool<SubTreeTransaction>
+  subTreeTransactions;
 
-  struct
-  {
-   SubTreeTransaction transaction;
-   bool               available; 
-  } subTreeTransactions[maxSubTreeTransactions];
-  
   inline
   TransactionManager()
   {
-   for(register unsigned int i = 0; i < maxTransactions; i++)
-    transactions[i].available = true;   
-
-   for(register unsigned int i = 0; i < maxSubTreeTransactions; i++)
-    subTreeTransactions[i].available = true;   
   }
 };
 
+template <class T>
+__thread struct TransactionManager::slotPool<T>::slotCache
+TransactionManager::slotPool<T>::cache;
+
 #endif
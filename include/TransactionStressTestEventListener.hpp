@@ -0,0 +1,226 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef TRANSACTIONSTRESSTESTEVENTLISTENER_HPP
+# define TRANSACTIONSTRESSTESTEVENTLISTENER_HPP
+
+# include <assert.h>
+# include <stdint.h>
+# include <stdio.h>
+# include <time.h>
+# include <pthread.h>
+
+# include <EventListener.hpp>
+
+# include <EventListenerManager.hpp>
+# include <UUID.hpp>
+# include <FileSystemManager.hpp>
+# include <TransactionManager.hpp>
+# include <FileSystem.hpp>
+# include <SubTreeTransaction.hpp>
+
+/*! Holds thousands of transactions open at once, and times starting and
+    ending one while others are open, from one thread and from several. */
+class TransactionStressTestEventListener : public EventListener
+{
+ public:
+  inline
+  TransactionStressTestEventListener()
+  {
+   alreadyRun = false;
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().registerListener(error, this, __func__))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+  }
+
+  inline virtual bool
+  handleEvent(register unsigned int&            receiver,
+              register class Event*&            outgoingEvent,
+              register const unsigned int       sender,
+              register const class Event* const incomingEvent)
+  {
+
+   /* Consume event when done with it. */
+   delete incomingEvent;
+
+   if (alreadyRun)
+    return false;
+
+   alreadyRun = true;
+
+   register struct UUID fsUUID = {1, 0};
+   register enum FileSystemManager::FileSystemManagerError
+   fileSystemManagerError;
+
+   class FileSystem* fileSystem = 0;
+
+   /* Lookup the precreated file system. */
+   if(!FileSystemManager::getInstance().getFileSystem(fileSystem, fileSystemManagerError, fsUUID))
+   {
+    assert(0);
+   }
+
+   assert(fileSystem);
+   assert(fileSystemManagerError == FileSystemManager::noError);
+
+   register enum TransactionManager::TransactionManagerError
+   transactionManagerError;
+
+   register struct UUID subTreeUUID = {0x8000000000000000, 0};
+
+   static class Transaction*        open[openCount];
+   static class SubTreeTransaction* openSubTree[openCount];
+
+   /* All of them open at the same time, each its own. */
+   for(register unsigned int i = 0; i < openCount; i++)
+   {
+    if(!TransactionManager::getInstance().startTransaction(open[i], transactionManagerError, fileSystem))
+     assert(0);
+
+    if(!TransactionManager::getInstance().startSubTreeTransaction(openSubTree[i], transactionManagerError,
+                                                                  fileSystem, subTreeUUID))
+     assert(0);
+
+    assert(!i || (open[i] != open[i - 1]));
+    assert(!i || (openSubTree[i] != openSubTree[i - 1]));
+   }
+
+   register const double many = startEndTime(fileSystem);
+
+   for(register unsigned int i = 0; i < openCount; i++)
+   {
+    if(!TransactionManager::getInstance().endTransaction(transactionManagerError, open[i]))
+     assert(0);
+
+    if(!TransactionManager::getInstance().endSubTreeTransaction(transactionManagerError, openSubTree[i]))
+     assert(0);
+
+    assert(!open[i] && !openSubTree[i]);
+   }
+
+   /* As many as fitted before. */
+   for(register unsigned int i = 0; i < 15; i++)
+   {
+    if(!TransactionManager::getInstance().startTransaction(open[i], transactionManagerError, fileSystem))
+     assert(0);
+   }
+
+   register const double few = startEndTime(fileSystem);
+
+   for(register unsigned int i = 0; i < 15; i++)
+   {
+    if(!TransactionManager::getInstance().endTransaction(transactionManagerError, open[i]))
+     assert(0);
+   }
+
+   /* Several threads at once. */
+   static struct worker workers[threadCount];
+   register const double                start = now();
+
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    workers[i].fileSystem = fileSystem;
+
+    if (pthread_create(&workers[i].thread, 0, work, &workers[i]))
+     assert(0);
+   }
+
+   for(register unsigned int i = 0; i < threadCount; i++)
+   {
+    if (pthread_join(workers[i].thread, 0))
+     assert(0);
+   }
+
+   register const double threaded = (now() - start) / (threadCount * rounds);
+
+   printf("%s: start and end %.0f ns with 15 open, %.0f ns with %u open, %.0f ns each from %u threads\n",
+          "TransactionStressTest", few, many, 2 * openCount, threaded, threadCount);
+
+   register enum EventListenerManager::EventListenerManagerError
+   error;
+
+   if (!EventListenerManager::getInstance().deRegisterListener(error, this))
+   {
+    assert(0);
+   }
+
+   assert(error == EventListenerManager::noError);
+   return false;
+  }
+
+ private:
+  static const unsigned int openCount   = 4096;
+  static const unsigned int rounds      = 1000000;
+  static const unsigned int threadCount = 4;
+
+  struct worker
+  {
+   pthread_t         thread;
+   class FileSystem* fileSystem;
+  };
+
+  bool alreadyRun;
+
+  /*! In nanoseconds. */
+  static inline double
+  now(void)
+  {
+   struct timespec time;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &time))
+    assert(0);
+
+   return time.tv_sec * 1e9 + time.tv_nsec;
+  }
+
+  /*! Of starting and ending a transaction, in nanoseconds. */
+  static inline double
+  startEndTime(register class FileSystem* const fileSystem)
+  {
+   register const double start = now();
+
+   for(register unsigned int i = 0; i < rounds; i++)
+    startEnd(fileSystem);
+
+   return (now() - start) / rounds;
+  }
+
+  static inline void
+  startEnd(register class FileSystem* const fileSystem)
+  {
+   register class Transaction*                               transaction;
+   register enum TransactionManager::TransactionManagerError error;
+
+   if(!TransactionManager::getInstance().startTransaction(transaction, error, fileSystem))
+    assert(0);
+
+   if(!TransactionManager::getInstance().endTransaction(error, transaction))
+    assert(0);
+  }
+
+  /*! Transactions that read nothing touch no shared state but the pool
+      and the count of open transactions. */
+  static void*
+  work(register void* const argument)
+  {
+   register const struct worker* const worker = (const struct worker*) argument;
+
+   for(register unsigned int i = 0; i < rounds; i++)
+    startEnd(worker->fileSystem);
+
+   return 0;
+  }
+};
+
+#endif
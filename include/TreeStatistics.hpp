@@ -0,0 +1,54 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef TREESTATISTICS_HPP
+# define TREESTATISTICS_HPP
+
+# include <stdint.h>
+
+# include <Globals.hpp>
+
+/*! The shape of a tree: how many pages it takes and how full they are.
+    Bytes are those the nodes would take if written again, headers
+    included. */
+struct TreeStatistics
+{
+ unsigned int height;
+ uint64_t     keys;
+ uint64_t     leaves;
+ uint64_t     leafBytes;
+ /*! Bytes of values plain leaves still hold after they were removed or
+     replaced in place, until the leaf is compacted. */
+ uint64_t     leafFragmented;
+ uint64_t     internalNodes;
+ uint64_t     internalBytes;
+ /*! Inserts and removes buffered in internal nodes, not yet in the
+     leaves, and the bytes their buffers take. */
+ uint64_t     messages;
+ uint64_t     messageBytes;
+
+ inline uint64_t
+ pages(void) const
+ {
+  return leaves + internalNodes;
+ }
+
+ /*! Of the leaves, in percent. */
+ inline unsigned int
+ leafFill(void) const
+ {
+  return leaves ? (unsigned int) ((leafBytes * 100) / (leaves * sectorSize)) : 0;
+ }
+
+ inline unsigned int
+ internalFill(void) const
+ {
+  return internalNodes ? (unsigned int) ((internalBytes * 100) / (internalNodes * sectorSize)) : 0;
+ }
+};
+
+#endif
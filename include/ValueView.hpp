@@ -0,0 +1,184 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef VALUEVIEW_HPP
+# define VALUEVIEW_HPP
+
+# include <assert.h>
+# include <stdint.h>
+
+# include <Globals.hpp>
+# include <BlockCacheEntry.hpp>
+
+/*! A value looked up in place: the bytes of the value in the cache pages
+    that hold it, the leaf or the run of sectors of a value stored out of
+    line. The pages stay pinned until the view is released or destroyed,
+    which must happen before the transaction that looked it up ends. A
+    change the transaction makes meanwhile copies the page rather than
+    change it under the view.
+
+    A value in a single page is shown by getData. A longer one is shown
+    a sector at a time by getSector. The bytes are as stored, in the byte
+    order of the tree. */
+class ValueView
+{
+ friend class BPlusTree;
+
+ public:
+  /*! The most sectors a value can span. They are all pinned at once to
+      show it, which is what bounds the size of a value, not the 32 bits
+      a leaf has for it. */
+  static const unsigned int
+  maxSectors = 256;
+
+  /*! The largest value, in bytes. */
+  static const uint_fast32_t
+  maxSize = maxSectors * sectorSize;
+
+  inline
+  ValueView()
+  {
+   sectors     = 0;
+   bytes       = 0;
+   length      = 0;
+   transaction = 0;
+   little      = true;
+  }
+
+  inline
+  ~ValueView()
+  {
+   release();
+  }
+
+  inline bool
+  isValid(void) const
+  {
+   return sectors != 0;
+  }
+
+  /*! The value, if it is held in a single page. */
+  inline const uint8_t*
+  getData(void) const
+  {
+   assert(isValid());
+   assert(sectors == 1);
+
+   return bytes;
+  }
+
+  inline uint_fast32_t
+  size(void) const
+  {
+   assert(isValid());
+
+   return length;
+  }
+
+  inline bool
+  isLittle(void) const
+  {
+   return little;
+  }
+
+  inline unsigned int
+  sectorCount(void) const
+  {
+   return sectors;
+  }
+
+  /*! The part of the value in its sector'th page, sectorLength bytes. */
+  inline const uint8_t*
+  getSector(register const unsigned int sector) const
+  {
+   assert(sector < sectors);
+
+   return sector ? pinned[sector] : bytes;
+  }
+
+  inline uint_fast32_t
+  sectorLength(register const unsigned int sector) const
+  {
+   assert(sector < sectors);
+
+   if (sectors == 1)
+    return length;
+
+   return ((sector + 1) < sectors) ? sectorSize : (length - sector * sectorSize);
+  }
+
+  /*! Drop the pins. No data may be used after this. */
+  inline void
+  release(void)
+  {
+   while (sectors)
+   {
+    sectors--;
+    cacheEntries[sectors]->unlock(pinned[sectors], cacheEntries[sectors], transaction);
+   }
+
+   bytes       = 0;
+   length      = 0;
+   transaction = 0;
+  }
+
+ private:
+  class BlockCacheEntry* cacheEntries[maxSectors];
+  uint8_t*               pinned[maxSectors];
+  unsigned int           sectors;
+  const uint8_t*         bytes;
+  uint_fast32_t          length;
+  class Transaction*     transaction;
+  bool                   little;
+
+  /* A pin can not be shared. */
+  ValueView(register const ValueView& other);
+
+  ValueView&
+  operator=(register const ValueView& other);
+
+  /*! Take over the pin of cacheEntry, whose page is at data, and show
+      the length bytes at bytes. A value longer than a page starts at
+      data and goes on in the pages given to pinNext. */
+  inline void
+  pin(register class BlockCacheEntry* const cacheEntry,
+      register uint8_t* const               data,
+      register const uint8_t* const         bytes,
+      register const uint_fast32_t          length,
+      register const bool                   isLittle,
+      register class Transaction* const     transaction)
+  {
+   assert(!sectors);
+   assert((length > sectorSize) ? (bytes == data) :
+          ((bytes >= data) && ((bytes + length) <= (data + sectorSize))));
+
+   cacheEntries[0]   = cacheEntry;
+   pinned[0]         = data;
+   sectors           = 1;
+   this->bytes       = bytes;
+   this->length      = length;
+   this->little      = isLittle;
+   this->transaction = transaction;
+  }
+
+  /*! Take over one more page of a value stored out of line. The pages
+      are pinned in order, the first by pin. */
+  inline void
+  pinNext(register class BlockCacheEntry* const cacheEntry,
+          register uint8_t* const               data)
+  {
+   assert(sectors && (sectors < maxSectors));
+   assert(bytes == pinned[0]);
+   assert(length > (sectors * sectorSize));
+
+   cacheEntries[sectors] = cacheEntry;
+   pinned[sectors]       = data;
+   sectors++;
+  }
+};
+
+#endif
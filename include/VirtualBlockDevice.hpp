@@ -24,7 +24,63 @@ class VirtualBlockDevice
   writeSector(register enum VirtualBlockDeviceError& error,
               register class BlockCacheEntry* const  cacheEntry,
               register const struct LBA              theLBA) = 0;
+
+  /*! Vectored variants. The requests need not be contiguous but devices
+      are free to merge runs of consecutive LBAs and to service requests
+      in parallel, so callers should hand over as much as they can at once.
+      The default implementation issues the sectors one by one. */
+  virtual bool
+  readSectors(register enum VirtualBlockDeviceError&       error,
+              register class BlockCacheEntry* const* const cacheEntries,
+              register const struct LBA* const             theLBAs,
+              register const unsigned int                  count)
+  {
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    if (!readSector(error, cacheEntries[i], theLBAs[i]))
+     return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
+  virtual bool
+  writeSectors(register enum VirtualBlockDeviceError&       error,
+               register class BlockCacheEntry* const* const cacheEntries,
+               register const struct LBA* const             theLBAs,
+               register const unsigned int                  count)
+  {
+   for(register unsigned int i = 0; i < count; i++)
+   {
+    if (!writeSector(error, cacheEntries[i], theLBAs[i]))
+     return false;
+   }
+
+   error = noError;
+   return true;
+  }
+
+  /*! Make every completed write stable. Devices without a volatile write
+      cache have nothing to do. */
+  virtual bool
+  sync(register enum VirtualBlockDeviceError& error)
+  {
+   error = noError;
+   return true;
+  }
    
+  /*! Devices that model their own timing give the device time, in
+      nanoseconds, they have charged for requests so far. Callers that
+      balance load over devices go by it, as such devices need not take
+      that long on the wall clock. The others return false. */
+  virtual bool
+  getChargedTime(register uint64_t& time)
+  {
+   time = 0;
+   return false;
+  }
+
   virtual bool
   getSizeInSectors(register struct LBA& size) const = 0;
 };
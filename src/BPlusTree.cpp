@@ -6,6 +6,8 @@
 #include <BlockCacheEntry.hpp>
 #include <BlockCache.hpp>
 #include <FileSystem.hpp>
+#include <BatchOperation.hpp>
+#include <BPlusTreeBatch.hpp>
 
 BPlusTree::BPlusTree(register class VirtualBlockDevice* const device,
 	             register class FileSystem* const         fileSystem,
@@ -30,9 +32,10 @@ BPlusTree::BPlusTree(register class VirtualBlockDevice* const device,
  /* Create an empty root. */
  memset(dataPointer, 0, sectorSize);
 
- ((struct header*) dataPointer)->version = version;
+ ((struct header*) dataPointer)->version = version | (newTreeIsLittle ? 0 : bigEndian);
  ((struct header*) dataPointer)->keys    = 0;
- toFileSystemEndian(&((struct header*) dataPointer)->spaceUsedNFlags, 0 | isLeaf, true);
+ toFileSystemEndian(&((struct header*) dataPointer)->spaceUsedNFlags, 0 | isLeaf, newTreeIsLittle);
+ seal(dataPointer, newTreeIsLittle);
 
  register enum FileSystem::FileSystemError fileSystemError;
 
@@ -46,3 +49,76 @@ BPlusTree::BPlusTree(register class VirtualBlockDevice* const device,
     
  cacheEntry->unlock(dataPointer, cacheEntry, transaction);
 }
+
+bool
+BPlusTree::updateBuffered(register const BPlusTree* &        newTree,
+                          register enum BPlusTreeError&      error,
+                          register const Serializable* const source,
+                          register const Key                 key,
+                          register class Transaction* const  transaction) const
+{
+ register enum BPlusTreeBatch::BPlusTreeBatchError batchError;
+ BPlusTreeBatch                                   batch;
+ struct BatchOperation                            operation;
+ const struct BatchOperation*                     operations[1] = {&operation};
+
+ /* A batch of one: it stops in the buffer of the root, and is pushed
+    down with others once that fills. */
+ operation.key   = key;
+ operation.value = source;
+
+ if (!batch.apply(newTree, batchError, this, operations, 1, transaction))
+  assert(0);
+
+ error = noError;
+ return true;
+}
+
+bool
+BPlusTree::relocate(register const BPlusTree* &       newTree,
+                    register enum BPlusTreeError&     error,
+                    register const Key                key,
+                    register const uint8_t* const     location,
+                    register const unsigned int       size,
+                    register class Transaction* const transaction,
+                    register struct LeafHint* const   hint) const
+{
+ BPlusTreeBatch            batch;
+ register struct leafEntry pair;
+
+ pair.key        = key;
+ pair.payload    = location;
+ pair.size       = size;
+ pair.isLocation = true;
+
+ /* The path the batch copies is not recorded. */
+ if (hint)
+  hint->invalidate();
+
+ batch.applyPairs(newTree, this, &pair, 1, transaction);
+
+ error = noError;
+ return true;
+}
+
+bool
+BPlusTree::removeRange(register const BPlusTree* &       newTree,
+                       register enum BPlusTreeError&     error,
+                       register const Key                first,
+                       register const Key                last,
+                       register class Transaction* const transaction) const
+{
+ register enum BPlusTreeBatch::BPlusTreeBatchError batchError;
+ BPlusTreeBatch                                   batch;
+
+ if (!batch.removeRange(newTree, batchError, this, first, last, transaction))
+ {
+  assert(batchError == BPlusTreeBatch::keyOutOfOrder);
+
+  error = keyOutOfOrder;
+  return false;
+ }
+
+ error = noError;
+ return true;
+}
@@ -5,6 +5,13 @@
 bool
 BlockCacheEntry::setLBA(register VirtualBlockDevice* device,
                         register const struct LBA    lba)
+{
+ return BlockCache::getInstance().setLBA(this, device, lba);
+}
+
+bool
+BlockCacheEntry::addLocation(register VirtualBlockDevice* device,
+                             register const struct LBA    lba)
 {
  for(register unsigned int i = 0; i < maxLocations; i++)
  {
@@ -0,0 +1,169 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <Checksum.hpp>
+
+/* Reflected Castagnoli polynomial. */
+static const uint32_t
+polynomial = 0x82f63b78;
+
+/* Slicing by 8 tables for the software implementation. */
+static uint32_t
+table[8][256];
+
+static pthread_once_t
+once = PTHREAD_ONCE_INIT;
+
+static bool
+accelerated = false;
+
+Checksum::crcFunction
+Checksum::implementation = Checksum::resolve;
+
+static void
+setup(void)
+{
+ for(register unsigned int i = 0; i < 256; i++)
+ {
+  register uint32_t crc = i;
+
+  for(register unsigned int bit = 0; bit < 8; bit++)
+   crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+
+  table[0][i] = crc;
+ }
+
+ for(register unsigned int i = 0; i < 256; i++)
+  for(register unsigned int slice = 1; slice < 8; slice++)
+   table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+
+#if defined(__x86_64__) || defined(__i386__)
+ __builtin_cpu_init();
+ accelerated = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+bool
+Checksum::isAccelerated(void)
+{
+ if (pthread_once(&once, setup))
+  assert(0);
+
+ return accelerated;
+}
+
+uint32_t
+Checksum::resolve(register const uint32_t       crc,
+                  register const uint8_t* const data,
+                  register const size_t         length)
+{
+ register const crcFunction chosen = isAccelerated() ? hardware : software;
+
+ /* Threads racing here all store the same value. */
+ __atomic_store_n(&implementation, chosen, __ATOMIC_RELEASE);
+
+ return chosen(crc, data, length);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target ("sse4.2")))
+uint32_t
+Checksum::hardware(register const uint32_t       crc,
+                   register const uint8_t* const data,
+                   register const size_t         length)
+{
+ register const uint8_t* next      = data;
+ register size_t         remaining = length;
+# if defined(__x86_64__)
+ register uint64_t       value     = crc;
+
+ /* Get aligned so the wide loads do not straddle cache lines. */
+ while (remaining && (((uintptr_t) next) & 7))
+ {
+  value = __builtin_ia32_crc32qi(value, *next++);
+  remaining--;
+ }
+
+ while (remaining >= 8)
+ {
+  register uint64_t word;
+
+  memcpy(&word, next, sizeof(word));
+  value = __builtin_ia32_crc32di(value, word);
+  next      += 8;
+  remaining -= 8;
+ }
+# else
+ register uint32_t       value     = crc;
+
+ while (remaining >= 4)
+ {
+  register uint32_t word;
+
+  memcpy(&word, next, sizeof(word));
+  value = __builtin_ia32_crc32si(value, word);
+  next      += 4;
+  remaining -= 4;
+ }
+# endif
+
+ while (remaining--)
+  value = __builtin_ia32_crc32qi(value, *next++);
+
+ return value;
+}
+#else
+uint32_t
+Checksum::hardware(register const uint32_t       crc,
+                   register const uint8_t* const data,
+                   register const size_t         length)
+{
+ return software(crc, data, length);
+}
+#endif
+
+uint32_t
+Checksum::software(register const uint32_t       crc,
+                   register const uint8_t* const data,
+                   register const size_t         length)
+{
+ register const uint8_t* next      = data;
+ register size_t         remaining = length;
+ register uint32_t       value     = crc;
+
+ while (remaining >= 8)
+ {
+# if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  register uint32_t low;
+  register uint32_t high;
+
+  memcpy(&low, next, sizeof(low));
+  memcpy(&high, next + 4, sizeof(high));
+  low ^= value;
+# else
+  register const uint32_t low  = value ^ (next[0] | (next[1] << 8) | (next[2] << 16) | ((uint32_t) next[3] << 24));
+  register const uint32_t high = next[4] | (next[5] << 8) | (next[6] << 16) | ((uint32_t) next[7] << 24);
+# endif
+
+  value = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+          table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+          table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+          table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+
+  next      += 8;
+  remaining -= 8;
+ }
+
+ while (remaining--)
+  value = (value >> 8) ^ table[0][(value ^ *next++) & 0xff];
+
+ return value;
+}
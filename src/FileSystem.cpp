@@ -1,5 +1,9 @@
+#include <string.h>
+#include <time.h>
+
 #include <FileSystem.hpp>
 #include <TransactionManager.hpp>
+#include <BlockCache.hpp>
 #include <VirtualBlockDeviceBroker.hpp>
 #include <BPlusTree.hpp>
 
@@ -13,6 +17,38 @@ FileSystem::FileSystem(register const UUID theFSUUID,
  blockDevice = 0;
  currentTree = 0;
 
+ /* The superblock sector is never handed out. */
+ theLBAClock.theLBA = superBlockLBA + 1;
+
+ releasedRuns     = 0;
+ releasedCount    = 0;
+ releasedCapacity = 0;
+ freeRuns         = 0;
+ freeCount        = 0;
+ freeCapacity     = 0;
+ openTransactions = 0;
+
+ retiredTrees      = 0;
+ retiredCount      = 0;
+ retiredCapacity   = 0;
+ historyCount      = 0;
+ commitSequence    = 0;
+ forgottenSequence = 0;
+
+ commitMode          = lazyCommit;
+ requestedGeneration = 0;
+ durableGeneration   = 0;
+ groupCommitWindow   = 0;
+ superBlockWrites    = 0;
+ handedOutLBAs       = 0;
+ flushing            = false;
+
+ if (pthread_mutex_init(&commitLock, 0))
+  assert(0);
+
+ if (pthread_cond_init(&commitDone, 0))
+  assert(0);
+
  register enum VirtualBlockDeviceBroker::VirtualBlockDeviceBrokerError
  brokerError;
    
@@ -99,10 +135,495 @@ FileSystem::FileSystem(register const UUID theFSUUID,
 bool
 FileSystem::updateTree(register const class BPlusTree* const newTree)
 {
- if (currentTree)
-  delete currentTree;
+ register const class BPlusTree* const oldTree = currentTree;
+
+ /* Switch before counting the open transactions. One that opens later
+    reads the new tree then, see openTransaction. */
+ __atomic_store_n(&currentTree, newTree, __ATOMIC_SEQ_CST);
+
+ /* Other transactions may still be reading the tree, or compare theirs
+    with it. */
+ if (oldTree && (__atomic_load_n(&openTransactions, __ATOMIC_SEQ_CST) > 1))
+ {
+  if (retiredCount == retiredCapacity)
+  {
+   register const unsigned int            newCapacity = retiredCapacity ? 2 * retiredCapacity : 16;
+   register const class BPlusTree** const newTrees    = new const class BPlusTree*[newCapacity];
+
+   assert(newTrees);
+
+   if (retiredCount)
+    memcpy(newTrees, retiredTrees, retiredCount * sizeof(*retiredTrees));
+
+   delete [] retiredTrees;
+
+   retiredTrees    = newTrees;
+   retiredCapacity = newCapacity;
+  }
+
+  retiredTrees[retiredCount++] = oldTree;
+ }
+ else if (oldTree)
+  delete oldTree;
+
+ return true;
+}
+
+bool
+FileSystem::commitTree(register enum FileSystemError&        error,
+                       register const class BPlusTree* const newTree,
+                       register KeyRangeSet* const           writes,
+                       register const class BPlusTree* const base,
+                       register const uint64_t               sequence,
+                       register const KeyRangeSet* const     reads,
+                       register class BlockCacheEntry* const entries)
+{
+ register bool success = true;
+
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ /* Checked in the same critical section that switches the trees, so
+    nothing is committed in between. */
+ register const bool conflicting = reads && wasChanged(sequence, *reads);
+
+ if (conflicting || (base && (base != currentTree)))
+ {
+  if (pthread_mutex_unlock(&commitLock))
+   assert(0);
+
+  error = conflicting ? conflict : staleTree;
+  return false;
+ }
+
+ if (entries)
+  BlockCache::getInstance().adopt(entries);
+
+ if (newTree != currentTree)
+ {
+  updateTree(newTree);
+
+  __atomic_store_n(&commitSequence, commitSequence + 1, __ATOMIC_RELEASE);
+
+  /* Only transactions still open need to know what changed. */
+  if (__atomic_load_n(&openTransactions, __ATOMIC_SEQ_CST) <= 1)
+   forgetHistory();
+  else
+  {
+   if (historyCount == maxHistory)
+   {
+    forgottenSequence = history[0].sequence;
+
+    delete history[0].writes;
+
+    memmove(history, history + 1, --historyCount * sizeof(*history));
+   }
+
+   register KeyRangeSet* recorded = 0;
+
+   if (writes)
+   {
+    recorded = new KeyRangeSet;
+
+    assert(recorded);
+
+    recorded->swap(*writes);
+   }
+
+   history[historyCount].sequence = commitSequence;
+   history[historyCount].writes   = recorded;
+   historyCount++;
+  }
+ }
+
+ if (commitMode == durableCommit)
+ {
+  /* Every tree published so far is covered by any superblock written
+     from now on. */
+  register const uint64_t ticket = ++requestedGeneration;
+
+  while (durableGeneration < ticket)
+  {
+   if (flushing)
+   {
+    /* Somebody is syncing an older group. Wait and then maybe lead the
+       next one. */
+    if (pthread_cond_wait(&commitDone, &commitLock))
+     assert(0);
+
+    continue;
+   }
+
+   flushing = true;
+
+   if (groupCommitWindow)
+   {
+    register struct timespec window;
+
+    window.tv_sec  = groupCommitWindow / 1000000000ULL;
+    window.tv_nsec = groupCommitWindow % 1000000000ULL;
+
+    if (pthread_mutex_unlock(&commitLock))
+     assert(0);
+
+    while (nanosleep(&window, &window));
+
+    if (pthread_mutex_lock(&commitLock))
+     assert(0);
+   }
+
+   register const uint64_t   generation = requestedGeneration;
+   register const struct LBA rootLBA    = currentTree->rootLBA;
+   register const struct LBA nextLBA    = theLBAClock;
+
+   if (pthread_mutex_unlock(&commitLock))
+    assert(0);
+
+   success = writeSuperBlock(error, generation, rootLBA, nextLBA);
+
+   if (pthread_mutex_lock(&commitLock))
+    assert(0);
+
+   flushing = false;
+   superBlockWrites++;
+
+   if (success && (generation > durableGeneration))
+    durableGeneration = generation;
+
+   if (pthread_cond_broadcast(&commitDone))
+    assert(0);
+
+   if (!success)
+    break;
+  }
+ }
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+
+ if (success)
+  error = noError;
+
+ return success;
+}
+
+void
+FileSystem::releaseLBAs(register const struct LBARun* const runs,
+                        register const unsigned int         count)
+{
+ if (!count)
+  return;
+
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ /* A durable commit has made a superblock past the runs stable already.
+    Without one the last superblock written, if any, may still point at
+    a tree that uses them, until the next one is. */
+ register const uint64_t generation = ((commitMode == durableCommit) || !durableGeneration) ?
+                                      0 : requestedGeneration + 1;
+
+ if (releasedCount + count > releasedCapacity)
+ {
+  register const unsigned int       newCapacity = 2 * (releasedCount + count);
+  register struct releasedRun* const newRuns    = new struct releasedRun[newCapacity];
+
+  assert(newRuns);
+
+  if (releasedCount)
+   memcpy(newRuns, releasedRuns, releasedCount * sizeof(*releasedRuns));
+
+  delete [] releasedRuns;
+
+  releasedRuns     = newRuns;
+  releasedCapacity = newCapacity;
+ }
+
+ for(register unsigned int i = 0; i < count; i++)
+ {
+  releasedRuns[releasedCount].run        = runs[i];
+  releasedRuns[releasedCount].generation = generation;
+  releasedCount++;
+ }
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+}
+
+void
+FileSystem::closeTransaction(void)
+{
+ assert(__atomic_load_n(&openTransactions, __ATOMIC_ACQUIRE));
+
+ if (__atomic_sub_fetch(&openTransactions, 1, __ATOMIC_ACQ_REL))
+  return;
+
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ reclaim();
+ forgetHistory();
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+}
+
+bool
+FileSystem::changedSince(register const uint64_t     sequence,
+                         register const KeyRangeSet& reads)
+{
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ register const bool changed = wasChanged(sequence, reads);
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+
+ return changed;
+}
+
+bool
+FileSystem::wasChanged(register const uint64_t     sequence,
+                       register const KeyRangeSet& reads)
+{
+ register bool changed = false;
+
+ /* What the commits it missed changed is no longer known. */
+ if (sequence < forgottenSequence)
+  changed = true;
+
+ for(register unsigned int i = historyCount; !changed && (i > 0); i--)
+ {
+  register const struct commit& commit = history[i - 1];
+
+  if (commit.sequence <= sequence)
+   break;
+
+  if (!commit.writes || commit.writes->intersects(reads))
+   changed = true;
+ }
+
+ return changed;
+}
+
+void
+FileSystem::forgetHistory(void)
+{
+ for(register unsigned int i = 0; i < retiredCount; i++)
+  delete retiredTrees[i];
 
- currentTree = newTree;
+ for(register unsigned int i = 0; i < historyCount; i++)
+  delete history[i].writes;
+
+ retiredCount      = 0;
+ historyCount      = 0;
+ forgottenSequence = commitSequence;
+}
+
+void
+FileSystem::reclaim(void)
+{
+ register unsigned int kept = 0;
+
+ for(register unsigned int i = 0; i < releasedCount; i++)
+ {
+  register const struct LBARun run = releasedRuns[i].run;
+
+  if (releasedRuns[i].generation > durableGeneration)
+  {
+   releasedRuns[kept++] = releasedRuns[i];
+   continue;
+  }
+
+  /* What the cache holds for them is garbage now, dirty or not. */
+  for(register uint_fast64_t j = 0; j < run.count; j++)
+  {
+   register const struct LBA theLBA = { .theLBA = run.first.theLBA + j };
+
+   BlockCache::getInstance().forget(blockDevice, theLBA);
+  }
+
+  addFreeRun(run);
+ }
+
+ releasedCount = kept;
+}
+
+void
+FileSystem::freeLBAs(register const struct LBARun* const runs,
+                     register const unsigned int         count)
+{
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ for(register unsigned int i = 0; i < count; i++)
+ {
+  /* Sectors written straight to the device may still be cached. */
+  for(register uint_fast64_t j = 0; j < runs[i].count; j++)
+  {
+   register const struct LBA theLBA = { .theLBA = runs[i].first.theLBA + j };
+
+   BlockCache::getInstance().forget(blockDevice, theLBA);
+  }
+
+  addFreeRun(runs[i]);
+ }
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+}
+
+void
+FileSystem::addFreeRun(register const struct LBARun run)
+{
+ if (freeCount == freeCapacity)
+ {
+  register const unsigned int  newCapacity = freeCapacity ? 2 * freeCapacity : 64;
+  register struct LBARun* const newRuns    = new struct LBARun[newCapacity];
+
+  assert(newRuns);
+
+  if (freeCount)
+   memcpy(newRuns, freeRuns, freeCount * sizeof(*freeRuns));
+
+  delete [] freeRuns;
+
+  freeRuns     = newRuns;
+  freeCapacity = newCapacity;
+ }
+
+ freeRuns[freeCount++] = run;
+}
+
+bool
+FileSystem::setCommitMode(register enum FileSystemError& error,
+                          register const enum CommitMode mode)
+{
+ commitMode = mode;
+
+ if (mode == lazyCommit)
+ {
+  error = noError;
+  return true;
+ }
+
+ register enum BlockCache::BlockCacheError cacheError;
+
+ if (!BlockCache::getInstance().flush(cacheError))
+ {
+  error = deviceError;
+  return false;
+ }
+
+ return commitTree(error, currentTree);
+}
+
+bool
+FileSystem::remount(register enum FileSystemError& error)
+{
+ assert(!openTransactions);
+
+ register class BlockCacheEntry*           cacheEntry;
+ register enum BlockCache::BlockCacheError cacheError;
+ register const struct LBA                 theLBA = { .theLBA = superBlockLBA };
+
+ /* Read what the device holds, not what was last written through. */
+ BlockCache::getInstance().forget(blockDevice, theLBA);
+
+ if (!BlockCache::getInstance().readLookup(cacheEntry, cacheError, 0, blockDevice, theLBA))
+ {
+  error = deviceError;
+  return false;
+ }
+
+ register uint8_t*                        data       = cacheEntry->getDataPointer();
+ register const struct superBlock* const superBlock = (const struct superBlock*) data;
+ register const bool                      valid      =
+  (fromFileSystemEndian(&superBlock->magic, true) == superBlockMagic) &&
+  (superBlock->version == superBlockVersion);
+ register const uint64_t                  generation = fromFileSystemEndian(&superBlock->generation, true);
+ register const struct LBA                rootLBA    =
+  { .theLBA = fromFileSystemEndian(&superBlock->rootLBA, true) };
+
+ cacheEntry->unlock(data, cacheEntry, 0);
+
+ if (!valid || (generation != durableGeneration))
+ {
+  error = deviceError;
+  return false;
+ }
+
+ if (pthread_mutex_lock(&commitLock))
+  assert(0);
+
+ if (rootLBA.theLBA != currentTree->rootLBA.theLBA)
+ {
+  updateTree(new BPlusTree(blockDevice, rootLBA));
+
+  __atomic_store_n(&commitSequence, commitSequence + 1, __ATOMIC_RELEASE);
+
+  forgetHistory();
+ }
+
+ /* Runs released since the superblock belong to the tree now current,
+    or to trees nothing points at any more, which are lost. */
+ releasedCount = 0;
+
+ if (pthread_mutex_unlock(&commitLock))
+  assert(0);
+
+ error = noError;
+ return true;
+}
+
+bool
+FileSystem::writeSuperBlock(register enum FileSystemError& error,
+                            register const uint64_t        generation,
+                            register const struct LBA      rootLBA,
+                            register const struct LBA      nextLBA)
+{
+ register enum VirtualBlockDevice::VirtualBlockDeviceError blockError;
+
+ /* The pages of the tree must be stable before the superblock can point
+    at them. */
+ if (!blockDevice->sync(blockError))
+ {
+  error = deviceError;
+  return false;
+ }
+
+ register class BlockCacheEntry*           cacheEntry;
+ register enum BlockCache::BlockCacheError cacheError;
+ register struct LBA                       theLBA = { .theLBA = superBlockLBA };
+
+ if (!BlockCache::getInstance().readWriteLookup(cacheEntry, cacheError, 0, blockDevice, theLBA))
+  assert(0);
+
+ register uint8_t* data = cacheEntry->getDataPointer();
+
+ assert(data);
+
+ memset(data, 0, sectorSize);
+
+ register struct superBlock* const superBlock = (struct superBlock*) data;
+
+ toFileSystemEndian(&superBlock->magic, superBlockMagic, true);
+ toFileSystemEndian(&superBlock->generation, generation, true);
+ toFileSystemEndian(&superBlock->rootLBA, rootLBA.theLBA, true);
+ toFileSystemEndian(&superBlock->nextLBA, nextLBA.theLBA, true);
+ superBlock->version = superBlockVersion;
+
+ register bool success = BlockCache::getInstance().write(cacheError, &cacheEntry, 1);
+
+ cacheEntry->unlock(data, cacheEntry, 0);
+
+ if (!success || !blockDevice->sync(blockError))
+ {
+  error = deviceError;
+  return false;
+ }
 
+ error = noError;
  return true;
 }
@@ -0,0 +1,193 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+#include <KeySearch.hpp>
+
+static pthread_once_t
+once = PTHREAD_ONCE_INIT;
+
+static bool
+hasAVX2 = false;
+
+static bool
+hasSSE2 = false;
+
+KeySearch::countFunction
+KeySearch::implementation = KeySearch::resolve;
+
+static void
+setup(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+ __builtin_cpu_init();
+ hasAVX2 = __builtin_cpu_supports("avx2");
+ hasSSE2 = __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool
+KeySearch::isAccelerated(void)
+{
+ if (pthread_once(&once, setup))
+  assert(0);
+
+ return hasAVX2 || hasSSE2;
+}
+
+void
+KeySearch::resolve(register const uint32_t* const fingerprints,
+                   register const unsigned int    entries,
+                   register const uint32_t        probe,
+                   register unsigned int&         less,
+                   register unsigned int&         equal)
+{
+ isAccelerated();
+ implementation = hasAVX2 ? avx2 : (hasSSE2 ? sse2 : software);
+
+ implementation(fingerprints, entries, probe, less, equal);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The compares are signed, flipping the top bit orders unsigned values
+   the same way. */
+__attribute__ ((target ("avx2")))
+void
+KeySearch::avx2(register const uint32_t* const fingerprints,
+                register const unsigned int    entries,
+                register const uint32_t        probe,
+                register unsigned int&         less,
+                register unsigned int&         equal)
+{
+ register const __m256i bias    = _mm256_set1_epi32(INT32_MIN);
+ register const __m256i target  = _mm256_set1_epi32((int32_t) (probe ^ 0x80000000U));
+ register __m256i       belowV  = _mm256_setzero_si256();
+ register __m256i       sameV   = _mm256_setzero_si256();
+ register unsigned int  below   = 0;
+ register unsigned int  same    = 0;
+ register unsigned int  i       = 0;
+
+ /* A true compare is -1 in its lane, so subtracting counts per lane. */
+ for(; (i + 8) <= entries; i += 8)
+ {
+  register const __m256i value =
+   _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (fingerprints + i)), bias);
+
+  belowV = _mm256_sub_epi32(belowV, _mm256_cmpgt_epi32(target, value));
+  sameV  = _mm256_sub_epi32(sameV, _mm256_cmpeq_epi32(target, value));
+ }
+
+ register __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(belowV), _mm256_extracti128_si256(belowV, 1));
+
+ sum    = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+ sum    = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+ below  = _mm_cvtsi128_si32(sum);
+
+ sum    = _mm_add_epi32(_mm256_castsi256_si128(sameV), _mm256_extracti128_si256(sameV, 1));
+ sum    = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+ sum    = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+ same   = _mm_cvtsi128_si32(sum);
+
+ for(; i < entries; i++)
+ {
+  below += fingerprints[i] < probe;
+  same  += fingerprints[i] == probe;
+ }
+
+ less  = below;
+ equal = same;
+}
+
+__attribute__ ((target ("sse2")))
+void
+KeySearch::sse2(register const uint32_t* const fingerprints,
+                register const unsigned int    entries,
+                register const uint32_t        probe,
+                register unsigned int&         less,
+                register unsigned int&         equal)
+{
+ register const __m128i bias   = _mm_set1_epi32(INT32_MIN);
+ register const __m128i target = _mm_set1_epi32((int32_t) (probe ^ 0x80000000U));
+ register __m128i       belowV = _mm_setzero_si128();
+ register __m128i       sameV  = _mm_setzero_si128();
+ register unsigned int  below  = 0;
+ register unsigned int  same   = 0;
+ register unsigned int  i      = 0;
+
+ for(; (i + 4) <= entries; i += 4)
+ {
+  register const __m128i value =
+   _mm_xor_si128(_mm_loadu_si128((const __m128i*) (fingerprints + i)), bias);
+
+  belowV = _mm_sub_epi32(belowV, _mm_cmpgt_epi32(target, value));
+  sameV  = _mm_sub_epi32(sameV, _mm_cmpeq_epi32(target, value));
+ }
+
+ belowV = _mm_add_epi32(belowV, _mm_shuffle_epi32(belowV, 0x4e));
+ belowV = _mm_add_epi32(belowV, _mm_shuffle_epi32(belowV, 0xb1));
+ below  = _mm_cvtsi128_si32(belowV);
+
+ sameV  = _mm_add_epi32(sameV, _mm_shuffle_epi32(sameV, 0x4e));
+ sameV  = _mm_add_epi32(sameV, _mm_shuffle_epi32(sameV, 0xb1));
+ same   = _mm_cvtsi128_si32(sameV);
+
+ for(; i < entries; i++)
+ {
+  below += fingerprints[i] < probe;
+  same  += fingerprints[i] == probe;
+ }
+
+ less  = below;
+ equal = same;
+}
+#else
+void
+KeySearch::avx2(register const uint32_t* const fingerprints,
+                register const unsigned int    entries,
+                register const uint32_t        probe,
+                register unsigned int&         less,
+                register unsigned int&         equal)
+{
+ software(fingerprints, entries, probe, less, equal);
+}
+
+void
+KeySearch::sse2(register const uint32_t* const fingerprints,
+                register const unsigned int    entries,
+                register const uint32_t        probe,
+                register unsigned int&         less,
+                register unsigned int&         equal)
+{
+ software(fingerprints, entries, probe, less, equal);
+}
+#endif
+
+void
+KeySearch::software(register const uint32_t* const fingerprints,
+                    register const unsigned int    entries,
+                    register const uint32_t        probe,
+                    register unsigned int&         less,
+                    register unsigned int&         equal)
+{
+ register unsigned int below = 0;
+ register unsigned int same  = 0;
+
+ for(register unsigned int i = 0; i < entries; i++)
+ {
+  below += fingerprints[i] < probe;
+  same  += fingerprints[i] == probe;
+ }
+
+ less  = below;
+ equal = same;
+}
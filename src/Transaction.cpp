@@ -1,14 +1,20 @@
+#include <stdlib.h>
+
 #include <Transaction.hpp>
 
 #include <Serializable.hpp>
 
 #include <BPlusTree.hpp>
+#include <BPlusTreeCursor.hpp>
+#include <BPlusTreeBuilder.hpp>
+#include <BPlusTreeBatch.hpp>
 #include <BlockCacheEntry.hpp>
+#include <BlockCache.hpp>
 
 
 bool
 Transaction::lookup(register Serializable&          destination,
-                    register uint_fast16_t&         size,
+                    register uint_fast32_t&         size,
                     register enum TransactionError& error,
                     register const Key              key)
 {
@@ -16,7 +22,106 @@ Transaction::lookup(register Serializable&          destination,
 
  assert(currentTree);
 
- if(!currentTree->lookup(destination, size, bPlusTreeError, key, this))
+ readKeys.add(key);
+
+ if(!currentTree->lookup(destination, size, bPlusTreeError, key, this, &hint))
+ {
+  switch(bPlusTreeError)
+  {
+   case BPlusTree::keyNotFound:
+    error = keyNotFound;
+    break;
+
+   case BPlusTree::checksumError:
+    error = checksumError;
+    break;
+
+   default:  
+    assert(0);
+  }
+
+  return false;
+ }
+
+ error = noError;
+ return true; 
+}
+
+
+bool
+Transaction::multiLookup(register Serializable* const* const   destinations,
+                         register uint_fast32_t* const         sizes,
+                         register enum TransactionError* const errors,
+                         register enum TransactionError&       error,
+                         register const Key* const             keys,
+                         register const unsigned int           count)
+{
+ register enum BPlusTree::BPlusTreeError* const bPlusTreeErrors = new enum BPlusTree::BPlusTreeError[count ? count : 1];
+ register enum BPlusTree::BPlusTreeError        bPlusTreeError;
+
+ assert(currentTree);
+ assert(bPlusTreeErrors);
+
+ for(register unsigned int i = 0; i < count; i++)
+  readKeys.add(keys[i]);
+
+ if(!currentTree->multiLookup(destinations, sizes, bPlusTreeErrors, bPlusTreeError, keys, count, this))
+ {
+  assert(bPlusTreeError == BPlusTree::keyOutOfOrder);
+
+  delete [] bPlusTreeErrors;
+
+  error = keyOutOfOrder;
+  return false;
+ }
+
+ for(register unsigned int i = 0; i < count; i++)
+ {
+  switch(bPlusTreeErrors[i])
+  {
+   case BPlusTree::noError:
+    errors[i] = noError;
+    break;
+
+   case BPlusTree::keyNotFound:
+    errors[i] = keyNotFound;
+    break;
+
+   case BPlusTree::dataTooBig:
+    errors[i] = dataTooBig;
+    break;
+
+   case BPlusTree::sizeIsNotAcceptable:
+    errors[i] = sizeIsNotAcceptable;
+    break;
+
+   case BPlusTree::checksumError:
+    errors[i] = checksumError;
+    break;
+
+   default:
+    assert(0);
+  }
+ }
+
+ delete [] bPlusTreeErrors;
+
+ error = noError;
+ return true;
+}
+
+bool
+Transaction::lookupView(register class ValueView&       view,
+                        register enum TransactionError& error,
+                        register const Key              key)
+{
+ register enum BPlusTree::BPlusTreeError bPlusTreeError;
+
+ assert(currentTree);
+
+ readKeys.add(key);
+
+ if(!currentTree->lookupView(view, bPlusTreeError, key, this, &hint))
  {
   switch(bPlusTreeError)
   {
@@ -24,6 +129,51 @@ Transaction::lookup(register Serializable&          destination,
     error = keyNotFound;
     break;
 
+   case BPlusTree::checksumError:
+    error = checksumError;
+    break;
+
+   default:  
+    assert(0);
+  }
+
+  return false;
+ }
+
+ error = noError;
+ return true; 
+}
+
+
+bool
+Transaction::readPart(register uint8_t* const         destination,
+                      register const uint_fast32_t    offset,
+                      register const uint_fast32_t    length,
+                      register enum TransactionError& error,
+                      register const Key              key)
+{
+ register enum BPlusTree::BPlusTreeError bPlusTreeError;
+
+ assert(currentTree);
+
+ readKeys.add(key);
+
+ if(!currentTree->readPart(destination, offset, length, bPlusTreeError, key, this, &hint))
+ {
+  switch(bPlusTreeError)
+  {
+   case BPlusTree::keyNotFound:
+    error = keyNotFound;
+    break;
+
+   case BPlusTree::outOfRange:
+    error = outOfRange;
+    break;
+
+   case BPlusTree::checksumError:
+    error = checksumError;
+    break;
+
    default:  
     assert(0);
   }
@@ -47,10 +197,60 @@ Transaction::insert(register enum TransactionError&         error,
 
  register const BPlusTree* oldTree = currentTree;
 
- if(!oldTree->insert(currentTree, bPlusTreeError, source, key, this))
+ writtenKeys.add(key);
+
+ if(!oldTree->insert(currentTree, bPlusTreeError, source, key, this, &hint))
   assert(0);
 
- if (oldTree != originalTree)
+ /* A tree only touched in place comes back as it is. */
+ if ((oldTree != originalTree) && (oldTree != currentTree))
+  delete oldTree;
+
+ error = noError;
+ return true;
+}
+
+bool
+Transaction::writePart(register enum TransactionError& error,
+                       register const uint8_t* const   source,
+                       register const uint_fast32_t    offset,
+                       register const uint_fast32_t    length,
+                       register const Key              key)
+{
+ register enum BPlusTree::BPlusTreeError bPlusTreeError;
+
+ assert(currentTree);
+
+ register const BPlusTree* oldTree = currentTree;
+
+ /* The rest of the value stays as it was read. */
+ readKeys.add(key);
+ writtenKeys.add(key);
+
+ if(!oldTree->writePart(currentTree, bPlusTreeError, source, offset, length, key, this, &hint))
+ {
+  switch(bPlusTreeError)
+  {
+   case BPlusTree::keyNotFound:
+    error = keyNotFound;
+    break;
+
+   case BPlusTree::outOfRange:
+    error = outOfRange;
+    break;
+
+   case BPlusTree::checksumError:
+    error = checksumError;
+    break;
+
+   default:  
+    assert(0);
+  }
+
+  return false;
+ }
+
+ if ((oldTree != originalTree) && (oldTree != currentTree))
   delete oldTree;
 
  error = noError;
@@ -67,47 +267,526 @@ Transaction::remove(register enum TransactionError&         error,
 
  register const BPlusTree* oldTree = currentTree;
 
- if(!oldTree->remove(currentTree, bPlusTreeError, key, this))
+ writtenKeys.add(key);
+
+ if(!oldTree->remove(currentTree, bPlusTreeError, key, this, &hint))
   assert(0);
 
- if (oldTree != originalTree)
+ if ((oldTree != originalTree) && (oldTree != currentTree))
   delete oldTree;
 
  error = noError;
  return true;
 }
 
+bool
+Transaction::removeRange(register enum TransactionError& error,
+                         register const Key              first,
+                         register const Key              last)
+{
+ register enum BPlusTree::BPlusTreeError bPlusTreeError;
+
+ assert(currentTree);
+
+ register const BPlusTree* oldTree = currentTree;
+
+ if(!oldTree->removeRange(currentTree, bPlusTreeError, first, last, this))
+ {
+  assert(bPlusTreeError == BPlusTree::keyOutOfOrder);
+
+  error = keyOutOfOrder;
+  return false;
+ }
+
+ removedRanges.add(first, last);
+
+ hint.invalidate();
+
+ if ((oldTree != originalTree) && (oldTree != currentTree))
+  delete oldTree;
+
+ error = noError;
+ return true;
+}
+
+bool
+Transaction::bulkLoad(register enum TransactionError& error,
+                      register class BulkLoadSource&  source)
+{
+ register enum BPlusTreeBuilder::BPlusTreeBuilderError builderError;
+ register BPlusTreeBuilder* const                      builder = new BPlusTreeBuilder;
+
+ assert(currentTree);
+ assert(builder);
+
+ drain();
+
+ if (!builder->start(builderError, currentTree, this))
+  assert(0);
+
+ Key                 key;
+ const Serializable* value;
+
+ while (source.next(key, value))
+ {
+  assert(value);
+
+  writtenKeys.add(key);
+
+  if (!builder->add(builderError, key, *value))
+   assert(0);
+ }
+
+ register const BPlusTree* oldTree = currentTree;
+
+ hint.invalidate();
+
+ if (!builder->finish(builderError, currentTree))
+  assert(0);
+
+ delete builder;
+
+ if ((oldTree != originalTree) && (oldTree != currentTree))
+  delete oldTree;
+
+ error = noError;
+ return true;
+}
+
+/* Key order, and the order given for operations on the same key. */
+static int
+compareOperations(register const void* const left,
+                  register const void* const right)
+{
+ register const struct BatchOperation* const leftOperation  = *(const struct BatchOperation* const*) left;
+ register const struct BatchOperation* const rightOperation = *(const struct BatchOperation* const*) right;
+ register const int                          order          = compareKeys(leftOperation->key, rightOperation->key);
+
+ if (order)
+  return order;
+
+ return (leftOperation < rightOperation) ? -1 : (leftOperation > rightOperation);
+}
+
+bool
+Transaction::applyBatch(register enum TransactionError&             error,
+                        register const struct BatchOperation* const operations,
+                        register const unsigned int                 count)
+{
+ assert(currentTree);
+
+ if (!count)
+ {
+  error = noError;
+  return true;
+ }
+
+ register const struct BatchOperation** const sorted = new const struct BatchOperation*[count];
+
+ assert(sorted);
+
+ for(register unsigned int i = 0; i < count; i++)
+  sorted[i] = operations + i;
+
+ qsort(sorted, count, sizeof(*sorted), compareOperations);
+
+ /* Keep only the last operation on each key. */
+ register unsigned int unique = 0;
+
+ for(register unsigned int i = 0; i < count; i++)
+ {
+  if ((i + 1 < count) && !compareKeys(sorted[i]->key, sorted[i + 1]->key))
+   continue;
+
+  sorted[unique++] = sorted[i];
+  writtenKeys.add(sorted[i]->key);
+ }
+
+ register enum BPlusTreeBatch::BPlusTreeBatchError batchError;
+ BPlusTreeBatch                                   batch;
+ register const BPlusTree*                        oldTree = currentTree;
+
+ hint.invalidate();
+
+ if (!batch.apply(currentTree, batchError, oldTree, sorted, unique, this))
+  assert(0);
+
+ delete [] sorted;
+
+ /* Nodes of its own are rewritten in place, the root too. */
+ if ((oldTree != originalTree) && (oldTree != currentTree))
+  delete oldTree;
+
+ error = noError;
+ return true;
+}
+
+bool
+Transaction::seek(register class BPlusTreeCursor&  cursor,
+                  register enum TransactionError& error,
+                  register const Key              key)
+{
+ register enum BPlusTreeCursor::BPlusTreeCursorError cursorError;
+
+ assert(currentTree);
+
+ drain();
+
+ /* The cursor may go on to any key after key. */
+ readKeys.add(key, KeyRangeSet::lastKey());
+
+ if (!cursor.seek(cursorError, currentTree, this, key))
+ {
+  assert(cursorError == BPlusTreeCursor::endOfTree);
+
+  error = keyNotFound;
+  return false;
+ }
+
+ error = noError;
+ return true;
+}
+
+void
+Transaction::getStatistics(register struct TreeStatistics& statistics)
+{
+ assert(currentTree);
+
+ readKeys.add(KeyRangeSet::firstKey(), KeyRangeSet::lastKey());
+
+ currentTree->getStatistics(statistics, this);
+}
+
+bool
+Transaction::writeBack(void)
+{
+ register unsigned int count = 0;
+
+ for(register BlockCacheEntry* entry = allocatedEntries; entry; entry = entry->next)
+  count++;
+
+ if (!count)
+  return true;
+
+ register BlockCacheEntry** const entries = new BlockCacheEntry*[count];
+
+ assert(entries);
+
+ count = 0;
+
+ for(register BlockCacheEntry* entry = allocatedEntries; entry; entry = entry->next)
+  entries[count++] = entry;
+
+ register enum BlockCache::BlockCacheError cacheError;
+ register const bool                       success =
+  BlockCache::getInstance().write(cacheError, entries, count);
+
+ delete [] entries;
+
+ return success;
+}
+
+void
+Transaction::drain(void)
+{
+ register enum BPlusTreeBatch::BPlusTreeBatchError batchError;
+ BPlusTreeBatch                                   batch;
+ register const BPlusTree*                        oldTree = currentTree;
+
+ if (!batch.drain(currentTree, batchError, oldTree, this))
+  assert(0);
+
+ if (currentTree == oldTree)
+  return;
+
+ hint.invalidate();
+
+ if (oldTree != originalTree)
+  delete oldTree;
+}
+
+void
+Transaction::rebase(register const class BPlusTree* const base)
+{
+ register enum BPlusTreeBatch::BPlusTreeBatchError batchError;
+ register const BPlusTree*                        tree = base;
+
+ /* What the ranges gave back is given back again from base, if it is
+    still there. */
+ releasedCount = 0;
+
+ drain();
+
+ /* The nodes of the tree left behind that the transaction wrote itself
+    go once the changes are replayed from it. */
+ {
+  BPlusTreeBatch batch;
+
+  batch.releasePrivate(currentTree, this);
+ }
+
+ register struct LBARun* const garbage      = released;
+ register const unsigned int   garbageCount = releasedCount;
+
+ released         = 0;
+ releasedCount    = 0;
+ releasedCapacity = 0;
+
+ removedRanges.normalize();
+
+ for(register unsigned int i = 0; i < removedRanges.size(); i++)
+ {
+  BPlusTreeBatch            batch;
+  register const BPlusTree* oldTree = tree;
+
+  if (!batch.removeRange(tree, batchError, oldTree, removedRanges[i].first, removedRanges[i].last, this))
+   assert(0);
+
+  if ((oldTree != base) && (oldTree != tree))
+   delete oldTree;
+ }
+
+ /* Written keys are single keys, so normalizing only sorts them and
+    drops those written more than once. */
+ writtenKeys.normalize();
+
+ register const unsigned int count = writtenKeys.size();
+ register Key* const         keys  = new Key[count ? count : 1];
+
+ assert(keys);
+
+ for(register unsigned int i = 0; i < count; i++)
+ {
+  assert(!compareKeys(writtenKeys[i].first, writtenKeys[i].last));
+
+  keys[i] = writtenKeys[i].first;
+ }
+
+ BPlusTreeBatch            batch;
+ register const BPlusTree* oldTree = tree;
+
+ if (!batch.copyKeys(tree, batchError, oldTree, currentTree, keys, count, this))
+  assert(0);
+
+ delete [] keys;
+
+ if ((oldTree != base) && (oldTree != tree))
+  delete oldTree;
+
+ dropPages(garbage, garbageCount);
+
+ delete [] garbage;
+
+ /* So do the nodes a bulk load wrote. */
+ fileSystem->freeLBAs(written, writtenCount);
+
+ writtenCount = 0;
+
+ if (currentTree != originalTree)
+  delete currentTree;
+
+ originalTree = base;
+ currentTree  = tree;
+
+ hint.invalidate();
+}
+
+/* Order of runs, and where an LBA is among them. */
+static int
+compareRuns(register const void* const left,
+            register const void* const right)
+{
+ register const uint_fast64_t leftLBA  = ((const struct LBARun*) left)->first.theLBA;
+ register const uint_fast64_t rightLBA = ((const struct LBARun*) right)->first.theLBA;
+
+ return (leftLBA < rightLBA) ? -1 : (leftLBA > rightLBA);
+}
+
+static int
+findRun(register const void* const key,
+        register const void* const element)
+{
+ register const uint_fast64_t        theLBA = ((const struct LBA*) key)->theLBA;
+ register const struct LBARun* const run    = (const struct LBARun*) element;
+
+ if (theLBA < run->first.theLBA)
+  return -1;
+
+ return (theLBA >= run->first.theLBA + run->count) ? 1 : 0;
+}
+
+void
+Transaction::dropPages(register struct LBARun* const runs,
+                       register const unsigned int   count)
+{
+ if (!count)
+  return;
+
+ qsort(runs, count, sizeof(*runs), compareRuns);
+
+ register BlockCacheEntry** link = &allocatedEntries;
+
+ while (*link)
+ {
+  register BlockCacheEntry* const entry   = *link;
+  register bool                   dropped = false;
+
+  for(register unsigned int location = 0;
+      location < BlockCacheEntry::maxLocations;
+      location++)
+  {
+   if (entry->locations[location].valid &&
+       bsearch(&entry->locations[location].lba, runs, count, sizeof(*runs), findRun))
+    dropped = true;
+  }
+
+  if (!dropped)
+  {
+   link = &entry->next;
+   continue;
+  }
+
+  *link       = entry->next;
+  entry->next = 0;
+
+  BlockCache::getInstance().discard(entry);
+ }
+
+ fileSystem->freeLBAs(runs, count);
+}
+
 bool
 Transaction::end(void)
 {
  assert(fileSystem);
 
- if (currentTree != originalTree)
-  fileSystem->updateTree(currentTree); 
+ register bool committed = false;
+
+ /* The tree is made current only on top of the tree it was built on, so
+    whatever other threads commit first is replayed onto, see rebase,
+    until commitTree takes it. */
+ while (currentTree != originalTree)
+ {
+  register enum FileSystem::FileSystemError fileSystemError;
+  register const BPlusTree*                 base;
 
+  if (!fileSystem->getCurrentTree(base, fileSystemError))
+   assert(0);
+
+  /* Another transaction committed since, see isConflicting. */
+  if (base != originalTree)
+  {
+   rebase(base);
+
+   if (currentTree == originalTree)
+    break;
+  }
+
+  KeyRangeSet changes;
+
+  changes.add(writtenKeys);
+  changes.add(removedRanges);
+  changes.normalize();
+
+  readKeys.normalize();
+
+  /* A durable commit needs the pages on disk before the superblock can
+     point at them. */
+  if ((fileSystem->getCommitMode() == FileSystem::durableCommit) &&
+      !writeBack())
+   assert(0);
+
+  if (fileSystem->commitTree(fileSystemError, currentTree, &changes, originalTree,
+                             checkedSequence, &readKeys, allocatedEntries))
+  {
+   allocatedEntries = 0;
+   committed        = true;
+   break;
+  }
+
+  /* Left as it was, for the caller to abort. */
+  if (fileSystemError == FileSystem::conflict)
+   return false;
+
+  assert(fileSystemError == FileSystem::staleTree);
+ }
+
+ /* Pages of a tree that came to nothing. */
+ if (allocatedEntries)
+ {
+  BlockCache::getInstance().adopt(allocatedEntries);
+
+  allocatedEntries = 0;
+ }
+
+ if (committed)
+  fileSystem->releaseLBAs(released, releasedCount);
+ else
+  fileSystem->freeLBAs(written, writtenCount);
+
+ register class FileSystem* const closed = fileSystem;
+
+ releasedCount   = 0;
+ writtenCount    = 0;
  fileSystem      = 0;
  originalTree    = 0;
  currentTree     = 0;
 
- /* Loop through the entries removing their transactional status. */
- for(;
-     allocatedEntries;
-     allocatedEntries = allocatedEntries->next)
+ clearKeys();
+ hint.invalidate();
+
+ /* Its pages are ordinary sectors now, and released ones can go. */
+ closed->closeTransaction();
+   
+ return true;
+}
+
+bool
+Transaction::abort(void)
+{
+ assert(fileSystem);
+
+ if (currentTree != originalTree)
+  delete currentTree;
+
+ /* What the tree would have given back is still in use. */
+ releasedCount = 0;
+
+ /* Nobody else has seen the pages, so they are not written and their
+    LBAs can be handed out again at once. */
+ while (allocatedEntries)
  {
   register BlockCacheEntry* const tmp = allocatedEntries;
 
+  allocatedEntries = tmp->next;
+  tmp->next        = 0;
+
   for(register unsigned int location = 0;
       location < BlockCacheEntry::maxLocations;
       location++)
   {
-   tmp->locations[location].transactional = false;
-  } 
-    
-  tmp->allocated   = false;
-  tmp->transaction = 0;
+   if (tmp->locations[location].valid)
+    releaseLBA(tmp->locations[location].lba);
+  }
+
+  BlockCache::getInstance().discard(tmp);
  }
 
- allocatedEntries = 0;
-   
+ fileSystem->freeLBAs(released, releasedCount);
+ fileSystem->freeLBAs(written, writtenCount);
+
+ register class FileSystem* const closed = fileSystem;
+
+ releasedCount   = 0;
+ writtenCount    = 0;
+ fileSystem      = 0;
+ originalTree    = 0;
+ currentTree     = 0;
+
+ clearKeys();
+ hint.invalidate();
+
+ closed->closeTransaction();
+
  return true;
 }